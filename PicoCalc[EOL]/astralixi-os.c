@@ -4,7 +4,10 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <strings.h>
+#include <ctype.h>
 #include "pico/stdlib.h"
+#include "pico/stdio/driver.h"
 #include "pico/cyw43_arch.h"
 #include "lwip/netif.h"
 #include "lwip/ip4_addr.h"
@@ -12,11 +15,17 @@
 #include "hardware/timer.h"
 #include "drivers/picocalc.h"
 #include "drivers/display.h"
+#include "drivers/console.h"
 #include "drivers/lcd.h"
 #include "drivers/keyboard.h"
 #include "drivers/sdcard.h"
 #include "drivers/audio.h"
 #include "drivers/fat32.h"
+#include "drivers/fat32_mmap.h"
+#include "drivers/psram_alloc.h"
+#include "drivers/psram_bus.h"
+#include "drivers/psram_loader.h"
+#include "drivers/ramfs.h"
 #include "drivers/southbridge.h"
 #include "hardware/watchdog.h"
 #include "psram_spi.h"
@@ -25,12 +34,6 @@
 #define MAX_USERNAME_LENGTH 15 // 14 + null
 #define MAX_PASSWORD_LENGTH 15
 
-// RP2040-PSRAM required defines
-#define PSRAM_PIN_CS   20
-#define PSRAM_PIN_SCK  21
-#define PSRAM_PIN_MOSI 2
-#define PSRAM_PIN_MISO 3
-
 // Declare PSRAM handle globally
 psram_spi_inst_t psram_spi;
 
@@ -63,54 +66,51 @@ int history_cycle_idx = -1;
 
 
 /*
- * Load a file from FAT32 SD card and write its contents into PSRAM
+ * Load a file from FAT32 SD card into PSRAM
  *
  * This function demonstrates how to transfer arbitrary file data from the SD card
- * (using the FAT32 file system driver) directly into external PSRAM attached to the Pico.
+ * (using the FAT32 file system driver) into external PSRAM attached to the Pico.
  * 
- * The FAT32 driver allows you to open files and read their contents in chunks. 
- * The PSRAM driver (see psram_spi.h and psram_spi.c) provides a simple API for
- * writing bytes to PSRAM at any address, so you can treat PSRAM like a large block
- * of memory for caching, buffering, or temporary data storage.
+ * The loader (see drivers/psram_loader.h) allocates room for the whole file with
+ * psram_malloc() and streams it across in cluster-sized chunks. Two buffers take
+ * turns: core 1 writes one chunk to PSRAM while core 0 reads the next one from the
+ * card, so the SD and PSRAM buses work at the same time instead of taking turns.
  *
  * Usage:
- *    load_file_to_psram("myfile.txt", 0x00000);
- *      - Reads "myfile.txt" from the SD card and writes it to PSRAM starting at address 0x00000.
+ *    psram_handle_t handle = load_file_to_psram("myfile.txt");
+ *      - Reads "myfile.txt" from the SD card into a new PSRAM allocation.
+ *      - Returns PSRAM_HANDLE_NONE if the file could not be loaded.
  *
  * Notes and best practices:
- * - You can choose any starting PSRAM address, but make sure you don’t overwrite important data.
- * - This function reads the file in 256-byte blocks and writes each block sequentially.
- * - You can read back data from PSRAM using psram_read() or psram_read8/16/32, for random access.
+ * - The handle owns the memory; release it with psram_free(handle) when done.
+ * - Read data back with psram_handle_read(), or get the raw address with
+ *   psram_handle_address() for psram_bus_read(), which works in both SPI and QPI mode.
  * - The FAT32 driver is robust, supporting long filenames and directories.
  * - PSRAM is not persistent storage; data will be lost on power-off or reset.
+ * - For large assets where only parts are needed, map the file with fat32_mmap()
+ *   (see drivers/fat32_mmap.h) instead; clusters are then paged in on first touch.
  * - You can use PSRAM to cache files, implement virtual memory, or buffer media for fast access.
  *
  * Example code for reading back:
  *    uint8_t buffer[256];
- *    psram_read(&psram_spi, 0x00000, buffer, sizeof(buffer));
+ *    psram_handle_read(handle, 0, buffer, sizeof(buffer));
  *
  * Both the FAT32 and PSRAM drivers are portable and efficient, making this setup suitable for
  * embedded projects where fast, temporary storage is required.
  */
 
-void load_file_to_psram(const char *filename, uint32_t psram_addr) {
-    fat32_file_t file;
-    fat32_error_t result = fat32_open(&file, filename);
+psram_handle_t load_file_to_psram(const char *filename) {
+    psram_handle_t handle;
+    psram_load_stats_t stats;
+    fat32_error_t result = psram_load_file(filename, &handle, &stats);
     if (result != FAT32_OK) {
-        printf("Error opening file: %s\n", fat32_error_string(result));
-        return;
+        printf("Error loading file: %s\n", fat32_error_string(result));
+        return PSRAM_HANDLE_NONE;
     }
-    uint8_t buffer[256];
-    size_t bytes_read;
-    uint32_t addr = psram_addr;
-    while (1) {
-        result = fat32_read(&file, buffer, sizeof(buffer), &bytes_read);
-        if (result != FAT32_OK || bytes_read == 0) break;
-        psram_write(&psram_spi, addr, buffer, bytes_read);
-        addr += bytes_read;
-    }
-    fat32_close(&file);
-    printf("Loaded %s to PSRAM at 0x%08X\n", filename, psram_addr);
+    printf("Loaded %s to PSRAM at 0x%08lX: %lu bytes in %lu ms (%lu KB/s)\n", filename,
+           (unsigned long)psram_handle_address(handle), (unsigned long)stats.bytes,
+           (unsigned long)(stats.elapsed_us / 1000), (unsigned long)(psram_load_throughput(&stats) / 1024));
+    return handle;
 }
 
 void add_to_history(const char *command) {
@@ -130,35 +130,122 @@ static bool history_has_entries() {
     return false;
 }
 
+// Virtual consoles. The shell runs on console 0 and the others are spare
+// screens with input lines of their own.
+static console_set_t shell_consoles;
+static bool shell_consoles_ready = false;
+static uint8_t shell_key_modifiers = 0;
+
+// The LCD driver keeps its state in lcd.c, so the console set only needs
+// a non-NULL marker for the screen that is attached
+static int shell_lcd;
+
+static void shell_console_out_chars(const char *buf, int len) {
+    console_write(&shell_consoles, 0, buf, (size_t)len);
+}
+
+static stdio_driver_t shell_console_stdio = {
+    .out_chars = shell_console_out_chars,
+    .crlf_enabled = true,
+};
+
+// Typed input is echoed onto console 0 with the rest of the shell's output,
+// so it is kept in the grid and scrollback
+static void shell_echo(char c) {
+    if (shell_consoles_ready) {
+        console_write(&shell_consoles, 0, &c, 1);
+    } else {
+        display_emit(c);
+    }
+}
+
+// Copy the shell's output onto console 0 so it has a grid and scrollback.
+// USB serial stays enabled beside it. Each console's refresh service draws
+// its writes in batches.
+static void shell_consoles_init(void) {
+    if (console_init(&shell_consoles, &shell_lcd, CONSOLE_MAX) != 0) {
+        printf("\rConsole init failed\n");
+        return;
+    }
+    for (int i = 0; i < CONSOLE_MAX; i++) {
+        display_refresh_start(console_display(&shell_consoles, i), 0);
+    }
+    stdio_set_driver_enabled(&shell_console_stdio, true);
+    shell_consoles_ready = true;
+}
+
+// The input loops ran out of keys: draw the echo now, not at the next frame
+static void shell_console_idle(void) {
+    if (shell_consoles_ready) {
+        display_refresh_kick(console_display(&shell_consoles, console_active(&shell_consoles)));
+    }
+}
+
+// Offer a key to the consoles: Fn+F1..F6 switch screens and Shift+PageUp
+// or PageDown page through scrollback. Shift and Fn arrive as keys of their
+// own and latch onto the next key. While another console is on the LCD it
+// takes every key. Returns true when the line editor should skip the key.
+static bool shell_console_key(unsigned char c) {
+    if (!shell_consoles_ready) {
+        return false;
+    }
+    if (c == KEY_SHIFT || c == KEY_FN) {
+        shell_key_modifiers |= c == KEY_SHIFT ? KB_MOD_SHIFT : KB_MOD_FN;
+        return true;
+    }
+    uint8_t modifiers = shell_key_modifiers;
+    shell_key_modifiers = 0;
+
+    if (console_active(&shell_consoles) != 0) {
+        console_handle_key(&shell_consoles, c, modifiers);
+        return true;
+    }
+
+    // Typing on the shell's console belongs to the line editor, and only
+    // closes a scrollback view
+    if (c == '\r' || c == '\n' || c == 0x08 || (c >= 32 && c <= 0x7F)) {
+        display_scrollback_reset(console_display(&shell_consoles, 0));
+        return false;
+    }
+    return console_handle_key(&shell_consoles, c, modifiers);
+}
+
 void read_password(char *buffer, int maxLength) {
     int idx = 0;
+    bool idle = false;
     while (idx < maxLength - 1) {
         if (!keyboard_key_available()) {
+            if (!idle) {
+                shell_console_idle();
+                idle = true;
+            }
             tight_loop_contents();
             continue;
         }
+        idle = false;
         int raw = keyboard_get_key();
         if (raw < 0) continue;
         unsigned char c = (unsigned char)raw;
+        if (shell_console_key(c)) continue;
 
         if (c == '\r' || c == '\n') break;
         if (c == 0x7F || c == 0x08) {
             if (idx > 0) {
                 idx--;
-                display_emit('\b');
-                display_emit(' ');
-                display_emit('\b');
+                shell_echo('\b');
+                shell_echo(' ');
+                shell_echo('\b');
             }
             continue;
         }
         if (c >= 32 && c <= 126) {
             buffer[idx++] = c;
-            display_emit('*');
+            shell_echo('*');
         }
     }
     buffer[idx] = '\0';
-    display_emit('\r');
-    display_emit('\n');
+    shell_echo('\r');
+    shell_echo('\n');
 }
 
 void safe_gets(char *buffer, int maxLength) {
@@ -182,16 +269,16 @@ void command_history_cycle_up(char *buffer, int *idx) {
         return;
     }
     while (*idx > 0) {
-        display_emit('\b');
-        display_emit(' ');
-        display_emit('\b');
+        shell_echo('\b');
+        shell_echo(' ');
+        shell_echo('\b');
         (*idx)--;
     }
     strncpy(buffer, history[history_cycle_idx], MAX_COMMAND_LENGTH - 1);
     buffer[MAX_COMMAND_LENGTH - 1] = '\0';
     *idx = strlen(buffer);
     for (int i = 0; i < *idx; i++) {
-        display_emit(buffer[i]);
+        shell_echo(buffer[i]);
     }
 }
 
@@ -201,9 +288,9 @@ void command_history_cycle_down(char *buffer, int *idx) {
     int next_idx = (history_cycle_idx + 1) % MAX_HISTORY;
     if (next_idx == history_next_idx || history[next_idx][0] == '\0') {
         while (*idx > 0) {
-            display_emit('\b');
-            display_emit(' ');
-            display_emit('\b');
+            shell_echo('\b');
+            shell_echo(' ');
+            shell_echo('\b');
             (*idx)--;
         }
         buffer[0] = '\0';
@@ -218,25 +305,25 @@ void command_history_cycle_down(char *buffer, int *idx) {
             history_cycle_idx = -1;
             buffer[0] = '\0';
             while (*idx > 0) {
-                display_emit('\b');
-                display_emit(' ');
-                display_emit('\b');
+                shell_echo('\b');
+                shell_echo(' ');
+                shell_echo('\b');
                 (*idx)--;
             }
             return;
         }
     }
     while (*idx > 0) {
-        display_emit('\b');
-        display_emit(' ');
-        display_emit('\b');
+        shell_echo('\b');
+        shell_echo(' ');
+        shell_echo('\b');
         (*idx)--;
     }
     strncpy(buffer, history[history_cycle_idx], MAX_COMMAND_LENGTH - 1);
     buffer[MAX_COMMAND_LENGTH - 1] = '\0';
     *idx = strlen(buffer);
     for (int i = 0; i < *idx; i++) {
-        display_emit(buffer[i]);
+        shell_echo(buffer[i]);
     }
 }
 
@@ -246,21 +333,28 @@ void read_line(char *buffer, int maxLength) {
     int idx = 0;
     history_cycle_idx = -1;
     buffer[0] = '\0';
+    bool idle = false;
     
     while (1) {
         if (!keyboard_key_available()) {
+            if (!idle) {
+                shell_console_idle();
+                idle = true;
+            }
             tight_loop_contents();
             continue;
         }
+        idle = false;
 
         int raw = keyboard_get_key();
         if (raw < 0) continue;
 
         unsigned char c = (unsigned char)raw;
+        if (shell_console_key(c)) continue;
 
         if (c == '\r' || c == '\n') {
-            display_emit('\r');
-            display_emit('\n');
+            shell_echo('\r');
+            shell_echo('\n');
             buffer[idx] = '\0';
             return;
         }
@@ -268,9 +362,9 @@ void read_line(char *buffer, int maxLength) {
         if ((c == 0x7F || c == 0x08) && idx > 0) {
             idx--;
             buffer[idx] = '\0';
-            display_emit('\b');
-            display_emit(' ');
-            display_emit('\b');
+            shell_echo('\b');
+            shell_echo(' ');
+            shell_echo('\b');
             continue;
         }
 
@@ -278,7 +372,7 @@ void read_line(char *buffer, int maxLength) {
             command_history_cycle_up(buffer, &idx);
             printf("\r> ");
             for (int i = 0; i < idx; i++) {
-                display_emit(buffer[i]);
+                shell_echo(buffer[i]);
             }
             continue;
         }
@@ -286,7 +380,7 @@ void read_line(char *buffer, int maxLength) {
             command_history_cycle_down(buffer, &idx);
             printf("\r> ");
             for (int i = 0; i < idx; i++) {
-                display_emit(buffer[i]);
+                shell_echo(buffer[i]);
             }
             continue;
         }
@@ -297,7 +391,7 @@ void read_line(char *buffer, int maxLength) {
         if (c >= 32 && c <= 126 && idx < maxLength - 1) {
             buffer[idx++] = c;
             buffer[idx] = '\0';
-            display_emit(c);
+            shell_echo(c);
             history_cycle_idx = -1;
         }
     }
@@ -435,41 +529,237 @@ void command_tempcheck(void) {
 }
 
 void command_help(void) {
-    printf("Available commands: hello, help, ls (list file), mk file (make file), rm file (remove file), mkdir (make directory)," 
+    printf("Available commands: hello, help, ls (list files, -u unsorted, | more to page), mk file (make file), rm file (remove file), mkdir (make directory)," 
         "rmdir (remove directory), pwd (print working directory), cd (change directory), whoami, pico, cls, passwd, usernm, time,"
-        "settime, uname, memory, echo, read file, reboot, suspend, wifi scan, wifi enable, wifi disable, mv (move file)," 
+        "settime, uname, memory, fsinfo (-f for fragmentation), echo, read file, reboot, suspend, wifi scan, wifi enable, wifi disable, mv (move file), cp (copy file, -r for directories),"
+        " find (search by -name, -type, -size), index (name index for big directories, -d to remove), "
+        "psramload (load a file into PSRAM and time it, -m to map it), rambench (RAM disk vs SD card speed), "
+        "psrambench (PSRAM speed in SPI and QPI mode), displaybench (text grid scroll and redraw speed), ansibench (escape sequence parsing speed), "
+        "displaycheck (check that bulk and single character output draw the same), "
+        "scrollsearch (find text in the scrollback, Shift+PageUp/PageDown to browse), "
         "rn (rename file), tempcheck, history\n");
 }
 
-void command_listfiles(void) {
+// Paths under /ram go to the RAM disk, everything else to the SD card
+static bool cp_resolve(char *path, const char *name, size_t name_len);
+static bool cp_join(char *path, const char *dir, const char *name);
+static bool cp_file(const char *src, const char *dst);
+
+static fat32_error_t vol_open(fat32_file_t *file, const char *path) {
+    return ramfs_is_path(path) ? ramfs_open(file, path) : fat32_open_indexed(file, path);
+}
+
+static fat32_error_t vol_create(fat32_file_t *file, const char *path) {
+    if (ramfs_is_path(path)) {
+        return ramfs_create(file, path);
+    }
+    fat32_error_t result = fat32_create(file, path);
+    if (result == FAT32_OK) {
+        fat32_index_add(path, file);
+    }
+    return result;
+}
+
+static fat32_error_t vol_read(fat32_file_t *file, void *buffer, size_t size, size_t *bytes_read) {
+    return (file->attributes & RAMFS_ATTR_RAM) ? ramfs_read(file, buffer, size, bytes_read)
+                                               : fat32_read_buffered(file, buffer, size, bytes_read);
+}
+
+// Card writes go through a write-behind buffer, attached on the first write
+// and flushed by fat32_close(). Without a free slot or memory for one the
+// write falls through to fat32_write().
+static fat32_error_t vol_write(fat32_file_t *file, const void *buffer, size_t size, size_t *bytes_written) {
+    if (file->attributes & RAMFS_ATTR_RAM) {
+        return ramfs_write(file, buffer, size, bytes_written);
+    }
+    fat32_write_buffer_attach(file, NULL, 0);
+    return fat32_write_buffered(file, buffer, size, bytes_written);
+}
+
+static fat32_error_t vol_close(fat32_file_t *file) {
+    return (file->attributes & RAMFS_ATTR_RAM) ? ramfs_close(file) : fat32_close(file);
+}
+
+static fat32_error_t vol_delete(const char *path) {
+    if (ramfs_is_path(path)) {
+        return ramfs_delete(path);
+    }
+    fat32_index_remove(path);
+    return fat32_delete(path);
+}
+
+#define LS_BATCH_SIZE 16
+#define PAGER_PAGE_LINES (ROWS - 1)
+
+typedef struct {
+    uint32_t name_offset;
+    uint32_t size;
+    uint8_t attr;
+} ls_record_t;
+
+static bool pager_enabled = false;
+static int pager_lines = 0;
+static const char *ls_name_pool;
+
+static void pager_begin(bool enabled) {
+    pager_enabled = enabled;
+    pager_lines = 0;
+}
+
+// Call after every printed line, returns false if the user quit the listing
+static bool pager_line(void) {
+    if (!pager_enabled || ++pager_lines < PAGER_PAGE_LINES) {
+        return true;
+    }
+
+    printf("-- More --");
+    fflush(stdout);
+    int key = keyboard_get_key();
+    printf("\r          \r");
+
+    if (key == 'q' || key == 'Q' || key == 0x1B) {
+        return false;
+    }
+    // Return shows one more line, anything else shows the next page
+    pager_lines = (key == '\r' || key == '\n') ? PAGER_PAGE_LINES - 1 : 0;
+    return true;
+}
+
+static bool ls_is_hidden(const fat32_entry_t *entry) {
+    return (entry->attr & FAT32_ATTR_SYSTEM) || strcmp(entry->filename, "credentials_data.txt") == 0;
+}
+
+static bool ls_print(const char *name, uint8_t attr, uint32_t size) {
+    if (attr & FAT32_ATTR_DIRECTORY) {
+        printf("[DIR] %s\n", name);
+    } else {
+        printf("[FILE] %s (%lu bytes)\n", name, (unsigned long)size);
+    }
+    return pager_line();
+}
+
+static int ls_compare(const void *a, const void *b) {
+    const ls_record_t *ra = a;
+    const ls_record_t *rb = b;
+    bool dir_a = (ra->attr & FAT32_ATTR_DIRECTORY) != 0;
+    bool dir_b = (rb->attr & FAT32_ATTR_DIRECTORY) != 0;
+    if (dir_a != dir_b) {
+        return dir_a ? -1 : 1;
+    }
+    return strcasecmp(ls_name_pool + ra->name_offset, ls_name_pool + rb->name_offset);
+}
+
+void command_listfiles(const char *fullCommand) {
+    static fat32_dir_iter_t iter;
+    static fat32_entry_t batch[LS_BATCH_SIZE];
+    bool sorted = strstr(fullCommand, "-u") == NULL;
     fat32_error_t result;
 
-    result = fat32_open(&dir, currentWorkingDirectory);
+    pager_begin(strstr(fullCommand, "| more") != NULL);
+
+    if (ramfs_is_path(currentWorkingDirectory)) {
+        fat32_file_t ram_dir;
+        fat32_entry_t entry;
+        bool any = false;
+        result = ramfs_open(&ram_dir, currentWorkingDirectory);
+        while (result == FAT32_OK && (result = ramfs_dir_read(&ram_dir, &entry)) == FAT32_OK && entry.filename[0]) {
+            any = true;
+            if (!ls_print(entry.filename, entry.attr, entry.size)) {
+                break;
+            }
+        }
+        if (result != FAT32_OK) {
+            printf("Error reading directory: %s\n", fat32_error_string(result));
+        } else if (!any) {
+            printf("Directory is empty\n");
+        }
+        return;
+    }
+
+    result = fat32_dir_iter_open(&iter, currentWorkingDirectory);
     if (result != FAT32_OK) {
         printf("Error opening directory: %s\n", fat32_error_string(result));
         return;
     }
 
+    // Sorting keeps a compact record per entry, names are packed into one pool
+    ls_record_t *records = NULL;
+    char *pool = NULL;
+    size_t record_count = 0, record_capacity = 0;
+    size_t pool_used = 0, pool_capacity = 0;
     bool has_entries = false;
-    while (fat32_dir_read(&dir, &entry) == FAT32_OK && entry.filename[0]) {
-        if (strcmp(entry.filename, "credentials_data.txt") == 0) {
-            continue;
+    bool stopped = false;
+    size_t count;
+
+    while (!stopped && (result = fat32_dir_iter_next(&iter, batch, LS_BATCH_SIZE, &count)) == FAT32_OK && count > 0) {
+        for (size_t i = 0; i < count && !stopped; i++) {
+            fat32_entry_t *e = &batch[i];
+            if (ls_is_hidden(e)) {
+                continue;
+            }
+            has_entries = true;
+
+            if (sorted) {
+                size_t name_len = strlen(e->filename) + 1;
+                if (record_count == record_capacity) {
+                    size_t capacity = record_capacity ? record_capacity * 2 : 64;
+                    ls_record_t *grown = realloc(records, capacity * sizeof(ls_record_t));
+                    if (grown) {
+                        records = grown;
+                        record_capacity = capacity;
+                    }
+                }
+                if (pool_used + name_len > pool_capacity) {
+                    size_t capacity = pool_capacity ? pool_capacity * 2 : 1024;
+                    while (capacity < pool_used + name_len) capacity *= 2;
+                    char *grown = realloc(pool, capacity);
+                    if (grown) {
+                        pool = grown;
+                        pool_capacity = capacity;
+                    }
+                }
+                if (record_count < record_capacity && pool_used + name_len <= pool_capacity) {
+                    records[record_count].name_offset = pool_used;
+                    records[record_count].size = e->size;
+                    records[record_count].attr = e->attr;
+                    memcpy(pool + pool_used, e->filename, name_len);
+                    pool_used += name_len;
+                    record_count++;
+                    continue;
+                }
+
+                // Out of memory, show what we have unsorted and stream the rest
+                printf("(directory too large to sort)\n");
+                for (size_t r = 0; r < record_count && !stopped; r++) {
+                    stopped = !ls_print(pool + records[r].name_offset, records[r].attr, records[r].size);
+                }
+                record_count = 0;
+                sorted = false;
+            }
+            if (!stopped) {
+                stopped = !ls_print(e->filename, e->attr, e->size);
+            }
         }
-        
-        has_entries = true;
-        if (entry.attr & FAT32_ATTR_DIRECTORY) {
-            printf("[DIR] %s\n", entry.filename);
-        } else {
-            printf("[FILE] %s (%lu bytes)\n", entry.filename, (unsigned long)entry.size);
+    }
+
+    if (result != FAT32_OK) {
+        printf("Error reading directory: %s\n", fat32_error_string(result));
+    }
+
+    if (sorted && record_count > 0) {
+        ls_name_pool = pool;
+        qsort(records, record_count, sizeof(ls_record_t), ls_compare);
+        for (size_t r = 0; r < record_count && !stopped; r++) {
+            stopped = !ls_print(pool + records[r].name_offset, records[r].attr, records[r].size);
         }
-        sleep_ms(10);
     }
 
-    if (!has_entries) {
+    free(records);
+    free(pool);
+
+    if (!has_entries && result == FAT32_OK) {
         printf("Directory is empty\n");
     }
-
-    fat32_close(&dir);
 }
 
 void command_createfile(const char *fullCommand) {
@@ -480,7 +770,7 @@ void command_createfile(const char *fullCommand) {
     char filepath[FAT32_MAX_PATH_LEN];
     snprintf(filepath, sizeof(filepath), "%s%s", currentWorkingDirectory, filename);
     
-    fat32_error_t result = fat32_create(&file, filepath);
+    fat32_error_t result = vol_create(&file, filepath);
     if (result == FAT32_ERROR_FILE_EXISTS) {
         printf("Error: File '%s' already exists\n", filename);
         return;
@@ -490,7 +780,7 @@ void command_createfile(const char *fullCommand) {
     }
 
     printf("File '%s' created successfully.\n", filename);
-    fat32_close(&file);
+    vol_close(&file);
 }
 
 void command_deletefile(const char *fullCommand) {
@@ -501,13 +791,13 @@ void command_deletefile(const char *fullCommand) {
     snprintf(filepath, sizeof(filepath), "%s%s", currentWorkingDirectory, filename);
     
     fat32_file_t file;
-    if (fat32_open(&file, filepath) != FAT32_OK) {
+    if (vol_open(&file, filepath) != FAT32_OK) {
         printf("Error: File '%s' not found\n", filename);
         return;
     }
-    fat32_close(&file);
+    vol_close(&file);
 
-    fat32_error_t result = fat32_delete(filepath);
+    fat32_error_t result = vol_delete(filepath);
     if (result != FAT32_OK) {
         printf("Error deleting file: %s\n", fat32_error_string(result));
         return;
@@ -523,6 +813,10 @@ void command_createdir(const char *fullCommand) {
     
     char dirpath[FAT32_MAX_PATH_LEN];
     snprintf(dirpath, sizeof(dirpath), "%s%s", currentWorkingDirectory, dirname);
+    if (ramfs_is_path(dirpath)) {
+        printf("Error: %s only holds files\n", RAMFS_MOUNT_POINT);
+        return;
+    }
     
     fat32_error_t result = fat32_dir_create(&dir, dirpath);
     if (result != FAT32_OK) {
@@ -534,6 +828,7 @@ void command_createdir(const char *fullCommand) {
         return;
     }
 
+    fat32_index_add(dirpath, &dir);
     printf("Directory '%s' created successfully.\n", dirname);
     fat32_close(&dir);
 }
@@ -544,6 +839,10 @@ void command_deletedir(const char *fullCommand) {
     
     char dirpath[FAT32_MAX_PATH_LEN];
     snprintf(dirpath, sizeof(dirpath), "%s%s", currentWorkingDirectory, dirname);
+    if (ramfs_is_path(dirpath)) {
+        printf("Error: %s only holds files\n", RAMFS_MOUNT_POINT);
+        return;
+    }
     
     fat32_file_t dir;
     if (fat32_open(&dir, dirpath) != FAT32_OK) {
@@ -561,6 +860,7 @@ void command_deletedir(const char *fullCommand) {
     }
     fat32_close(&dir);
 
+    fat32_index_remove(dirpath);
     fat32_error_t result = fat32_delete(dirpath);
     if (result != FAT32_OK) {
         printf("Error deleting directory: %s\n", fat32_error_string(result));
@@ -578,6 +878,24 @@ void command_changedirectory(const char *fullCommand) {
     const char *dirname = fullCommand;
     char newpath[FAT32_MAX_PATH_LEN];
     snprintf(newpath, sizeof(newpath), "%s%s", currentWorkingDirectory, dirname);
+
+    // The RAM disk is one flat directory, the only way out is back to the card
+    if (ramfs_is_path(currentWorkingDirectory)) {
+        if (strcmp(dirname, "/") == 0 || strcmp(dirname, "..") == 0) {
+            strcpy(currentWorkingDirectory, "/");
+        } else {
+            printf("Error: %s has no subdirectories\n", RAMFS_MOUNT_POINT);
+        }
+        return;
+    }
+    if (ramfs_is_path(newpath) || ramfs_is_path(dirname)) {
+        if (!ramfs_is_mounted()) {
+            printf("Error: RAM disk not available\n");
+            return;
+        }
+        strcpy(currentWorkingDirectory, RAMFS_MOUNT_POINT "/");
+        return;
+    }
     fat32_file_t dir;
     fat32_error_t result = fat32_open(&dir, newpath);
     if (result == FAT32_OK) {
@@ -646,7 +964,7 @@ change_password:
                 return;
             }
             char template_str[] = "Username:              \nPassword:              \n";
-            fat32_write(&file, template_str, strlen(template_str), NULL);
+            vol_write(&file, template_str, strlen(template_str), NULL);
             fat32_close(&file);
             
             if (fat32_open(&file, "credentials_data.txt") != FAT32_OK) {
@@ -668,7 +986,7 @@ change_password:
         memcpy(padded_password, currentPassword, pass_len);
         padded_password[14] = '\0';
 
-        result = fat32_write(&file, padded_password, 14, NULL);
+        result = vol_write(&file, padded_password, 14, NULL);
         fat32_close(&file);
 
         if (result != FAT32_OK) {
@@ -702,7 +1020,7 @@ void command_usernm(void) {
             printf("Error creating credentials file\n");
             return;
         }
-        fat32_write(&file, template_str, strlen(template_str), NULL);
+        vol_write(&file, template_str, strlen(template_str), NULL);
         fat32_close(&file);
         if (fat32_open(&file, "credentials_data.txt") != FAT32_OK) {
             printf("Error opening credentials file\n");
@@ -723,7 +1041,7 @@ void command_usernm(void) {
     memcpy(padded_username, currentUsername, username_len);
     padded_username[14] = '\0';
     
-    if (fat32_write(&file, padded_username, 14, NULL) != FAT32_OK) {
+    if (vol_write(&file, padded_username, 14, NULL) != FAT32_OK) {
         printf("Error writing to credentials file\n");
         fat32_close(&file);
         return;
@@ -778,6 +1096,7 @@ void command_uname(void) {
 }
 
 void command_reboot(void) {
+    fat32_sync();
     watchdog_reboot(0, 0, 0);
     while (true);
 }
@@ -805,6 +1124,72 @@ void command_memory(void) {
     printf("Available memory: %lu bytes\n", (unsigned long)available);
     printf("Used memory: %lu bytes\n", (unsigned long) total_ram - available);
     printf("Total memory: %lu bytes\n", (unsigned long)total_ram);
+
+    if (!psram_alloc_ready()) {
+        return;
+    }
+    psram_alloc_stats_t stats;
+    psram_alloc_get_stats(&stats);
+    printf("PSRAM bus: %s mode\n", psram_bus_mode_name(psram_bus_mode()));
+    printf("PSRAM used: %lu of %lu bytes in %lu allocations (%lu requested)\n",
+           (unsigned long)stats.used, (unsigned long)stats.total,
+           (unsigned long)stats.handles, (unsigned long)stats.requested);
+    printf("PSRAM free: %lu bytes in %lu blocks, largest %lu\n",
+           (unsigned long)stats.free, (unsigned long)stats.free_blocks, (unsigned long)stats.largest_free);
+    unsigned long fragmentation = stats.free ? 100 - (unsigned long)((uint64_t)stats.largest_free * 100 / stats.free) : 0;
+    printf("PSRAM fragmentation: %lu%%, %lu slabs with %lu bytes spare\n",
+           fragmentation, (unsigned long)stats.slabs, (unsigned long)stats.slab_free);
+    if (stats.failures || stats.lost) {
+        printf("PSRAM failed allocations: %lu, untracked bytes: %lu\n",
+               (unsigned long)stats.failures, (unsigned long)stats.lost);
+    }
+}
+
+void command_fsinfo(const char *fullCommand) {
+    uint64_t free_space = 0, total_space = 0;
+    uint32_t cluster_size = 0;
+    fat32_error_t result = fat32_get_total_space(&total_space);
+    if (result == FAT32_OK) result = fat32_get_free_space(&free_space);
+    if (result == FAT32_OK) result = fat32_get_cluster_size(&cluster_size);
+    if (result != FAT32_OK) {
+        printf("Error reading filesystem info: %s\n", fat32_error_string(result));
+        return;
+    }
+
+    printf("Total space: %lu KB\n", (unsigned long)(total_space / 1024));
+    printf("Free space: %lu KB\n", (unsigned long)(free_space / 1024));
+    printf("Cluster size: %lu bytes\n", (unsigned long)cluster_size);
+    if (ramfs_get_space(&total_space, &free_space) == FAT32_OK) {
+        printf("RAM disk (%s): %lu KB free of %lu KB\n", RAMFS_MOUNT_POINT,
+               (unsigned long)(free_space / 1024), (unsigned long)(total_space / 1024));
+    }
+
+    fat32_write_stats_t stats;
+    fat32_get_write_stats(&stats);
+    printf("Buffered bytes written: %lu\n", (unsigned long)stats.bytes_written);
+    printf("Sector writes: %lu (%lu buffer flushes)\n",
+           (unsigned long)stats.sector_writes, (unsigned long)stats.flushes);
+
+    // Walking every chain takes a while on a full card, so only on request
+    if (strstr(fullCommand, "-f") == NULL) {
+        return;
+    }
+
+    fat32_frag_stats_t frag;
+    printf("Checking fragmentation...\n");
+    result = fat32_get_fragmentation("/", &frag);
+    if (result != FAT32_OK) {
+        printf("Error checking fragmentation: %s\n", fat32_error_string(result));
+        return;
+    }
+    printf("Fragmented: %lu of %lu files and directories\n",
+           (unsigned long)frag.fragmented, (unsigned long)frag.chains);
+    printf("Extents: %lu over %lu clusters", (unsigned long)frag.extents, (unsigned long)frag.clusters);
+    if (frag.chains) {
+        unsigned long tenths = (unsigned long)frag.extents * 10 / frag.chains;
+        printf(" (%lu.%lu per chain)", tenths / 10, tenths % 10);
+    }
+    printf("\n");
 }
 
 void command_echo(const char *fullCommand) {
@@ -819,8 +1204,14 @@ void command_open_and_read_file(const char* filename) {
         return;
     }
     
+    char ram_path[FAT32_MAX_PATH_LEN];
+    if (ramfs_is_path(currentWorkingDirectory) && filename[0] != '/') {
+        snprintf(ram_path, sizeof(ram_path), "%s%s", currentWorkingDirectory, filename);
+        filename = ram_path;
+    }
+    
     fat32_file_t file;
-    fat32_error_t result = fat32_open(&file, filename);
+    fat32_error_t result = vol_open(&file, filename);
     if (result != FAT32_OK) {
         printf("Error opening file: %s\n", fat32_error_string(result));
         return;
@@ -828,7 +1219,7 @@ void command_open_and_read_file(const char* filename) {
     char buffer[512];
     size_t bytes_read;
     while (true) {
-        result = fat32_read(&file, buffer, sizeof(buffer) - 1, &bytes_read);
+        result = vol_read(&file, buffer, sizeof(buffer) - 1, &bytes_read);
         if (result != FAT32_OK) {
             printf("Error reading file: %s\n", fat32_error_string(result));
             break;
@@ -848,7 +1239,7 @@ void command_open_and_read_file(const char* filename) {
             }
         }
     }
-    fat32_close(&file);
+    vol_close(&file);
 }
 
 void command_wifi_scan(void) {
@@ -942,18 +1333,31 @@ void command_rename_file(const char *fullCommand) {
     }
     memcpy(new_path, currentWorkingDirectory, prefix_len);
     strcpy(new_path + prefix_len, new_name);
+
+    if (ramfs_is_path(old_path)) {
+        fat32_error_t result = ramfs_rename(old_path, new_path);
+        if (result != FAT32_OK) {
+            printf("Error renaming file: %s\n", fat32_error_string(result));
+            return;
+        }
+        printf("File renamed successfully\n");
+        return;
+    }
     
     fat32_file_t file;
-    if (fat32_open(&file, old_path) != FAT32_OK) {
+    if (fat32_open_indexed(&file, old_path) != FAT32_OK) {
         printf("Error: File not found\n");
         return;
     }
     fat32_close(&file);
     
+    fat32_index_remove(old_path);
     if (fat32_rename(old_path, new_path) != FAT32_OK) {
+        fat32_index_add(old_path, NULL);
         printf("Error renaming file\n");
         return;
     }
+    fat32_index_add(new_path, NULL);
     
     printf("File renamed successfully\n");
 }
@@ -982,6 +1386,26 @@ void command_move_file(const char *fullCommand) {
     memcpy(src_path, currentWorkingDirectory, prefix_len);
     memcpy(src_path + prefix_len, src, src_len);
     src_path[prefix_len + src_len] = '\0';
+
+    // Moving to or from the RAM disk is a copy followed by a delete
+    char ram_dest[FAT32_MAX_PATH_LEN];
+    if (cp_resolve(ram_dest, dest, strlen(dest)) && (ramfs_is_path(src_path) || ramfs_is_path(ram_dest))) {
+        const char *name = strrchr(src_path, '/');
+        if (!cp_join(dest_path, ram_dest, name ? name + 1 : src_path)) {
+            printf("Error: Destination path too long\n");
+            return;
+        }
+        if (ramfs_is_path(src_path) && ramfs_is_path(dest_path)) {
+            printf("Error: %s has no subdirectories\n", RAMFS_MOUNT_POINT);
+            return;
+        }
+        if (cp_file(src_path, dest_path) && vol_delete(src_path) == FAT32_OK) {
+            printf("File moved successfully\n");
+        } else {
+            printf("Error moving file\n");
+        }
+        return;
+    }
     
     size_t dest_len = strlen(dest);
     size_t full_dest_len = prefix_len + dest_len + src_len + 2;
@@ -997,7 +1421,7 @@ void command_move_file(const char *fullCommand) {
     dest_path[full_dest_len - 1] = '\0';
     
     fat32_file_t file;
-    fat32_error_t result = fat32_open(&file, src_path);
+    fat32_error_t result = fat32_open_indexed(&file, src_path);
     if (result != FAT32_OK) {
         printf("Error: Source file not found\n");
         return;
@@ -1013,13 +1437,1111 @@ void command_move_file(const char *fullCommand) {
         fat32_dir_create(&file, dest_dir);
     }
 
+    fat32_index_remove(src_path);
     if (fat32_rename(src_path, dest_path) == FAT32_OK) {
+        fat32_index_add(dest_path, NULL);
         printf("File moved successfully\n");
     } else {
+        fat32_index_add(src_path, NULL);
         printf("Error moving file\n");
     }
 }
 
+#define CP_MAX_DEPTH 8
+#define CP_STREAM_CHUNK 4096
+
+static uint64_t cp_start_us;
+
+// Resolve a shell argument against the working directory
+static bool cp_resolve(char *path, const char *name, size_t name_len) {
+    size_t prefix_len = 0;
+    if (name[0] != '/') {
+        prefix_len = strlen(currentWorkingDirectory);
+        if (prefix_len + name_len + 1 >= FAT32_MAX_PATH_LEN) {
+            return false;
+        }
+        memcpy(path, currentWorkingDirectory, prefix_len);
+        if (prefix_len == 0 || path[prefix_len - 1] != '/') {
+            path[prefix_len++] = '/';
+        }
+    } else if (name_len >= FAT32_MAX_PATH_LEN) {
+        return false;
+    }
+    memcpy(path + prefix_len, name, name_len);
+    path[prefix_len + name_len] = '\0';
+    return true;
+}
+
+static bool cp_join(char *path, const char *dir, const char *name) {
+    int len = snprintf(path, FAT32_MAX_PATH_LEN, "%s%s%s", dir,
+                       dir[strlen(dir) - 1] == '/' ? "" : "/", name);
+    return len > 0 && len < FAT32_MAX_PATH_LEN;
+}
+
+static void cp_progress(uint32_t bytes_done, uint32_t bytes_total, void *context) {
+    uint64_t elapsed = time_us_64() - cp_start_us;
+    unsigned long rate = elapsed ? (unsigned long)((uint64_t)bytes_done * 1000000 / elapsed / 1024) : 0;
+    printf("\r%s: %lu/%lu KB, %lu KB/s   ", (const char *)context,
+           (unsigned long)(bytes_done / 1024), (unsigned long)(bytes_total / 1024), rate);
+    fflush(stdout);
+}
+
+// Plain read/write loop, used when one side is on the RAM disk
+static fat32_error_t cp_stream(const char *src, const char *dst, void *context) {
+    uint8_t *buffer = malloc(CP_STREAM_CHUNK);
+    if (!buffer) {
+        return FAT32_ERROR_NO_MEMORY;
+    }
+
+    fat32_file_t in, out;
+    fat32_error_t result = vol_open(&in, src);
+    if (result == FAT32_OK) {
+        result = vol_create(&out, dst);
+        if (result == FAT32_OK) {
+            uint32_t done = 0;
+            size_t bytes_read, bytes_written;
+            while ((result = vol_read(&in, buffer, CP_STREAM_CHUNK, &bytes_read)) == FAT32_OK && bytes_read > 0) {
+                result = vol_write(&out, buffer, bytes_read, &bytes_written);
+                if (result == FAT32_OK && bytes_written < bytes_read) {
+                    result = FAT32_ERROR_DISK_FULL;
+                }
+                if (result != FAT32_OK) {
+                    break;
+                }
+                done += bytes_read;
+                cp_progress(done, in.file_size, context);
+            }
+            vol_close(&out);
+            if (result != FAT32_OK) {
+                vol_delete(dst);
+            }
+        }
+        vol_close(&in);
+    }
+
+    free(buffer);
+    return result;
+}
+
+static bool cp_file(const char *src, const char *dst) {
+    const char *name = strrchr(src, '/');
+    name = name ? name + 1 : src;
+
+    cp_start_us = time_us_64();
+    fat32_error_t result = (ramfs_is_path(src) || ramfs_is_path(dst))
+                               ? cp_stream(src, dst, (void *)name)
+                               : fat32_copy(src, dst, cp_progress, (void *)name);
+    printf("\n");
+    if (result != FAT32_OK) {
+        printf("Error copying '%s': %s\n", name, fat32_error_string(result));
+        return false;
+    }
+    return true;
+}
+
+// Copy a directory tree, returns the number of entries that failed
+static int cp_tree(const char *src, const char *dst, int depth) {
+    typedef struct {
+        fat32_dir_iter_t iter;
+        fat32_entry_t batch[LS_BATCH_SIZE];
+        char src_path[FAT32_MAX_PATH_LEN];
+        char dst_path[FAT32_MAX_PATH_LEN];
+    } cp_level_t;
+
+    fat32_file_t dir;
+    fat32_error_t result = fat32_dir_create(&dir, dst);
+    if (result == FAT32_OK) {
+        fat32_index_add(dst, &dir);
+        fat32_close(&dir);
+    } else if (result != FAT32_ERROR_FILE_EXISTS) {
+        printf("Error creating '%s': %s\n", dst, fat32_error_string(result));
+        return 1;
+    }
+
+    // One level per recursion, kept off the stack
+    cp_level_t *level = malloc(sizeof(cp_level_t));
+    if (!level) {
+        printf("Error: Not enough memory to copy '%s'\n", src);
+        return 1;
+    }
+
+    int failures = 0;
+    size_t count;
+    result = fat32_dir_iter_open(&level->iter, src);
+    while (result == FAT32_OK) {
+        result = fat32_dir_iter_next(&level->iter, level->batch, LS_BATCH_SIZE, &count);
+        if (result != FAT32_OK || count == 0) {
+            break;
+        }
+        for (size_t i = 0; i < count; i++) {
+            fat32_entry_t *entry = &level->batch[i];
+            // System files are driver bookkeeping (name index, intent log) tied to their volume location
+            if (strcmp(entry->filename, ".") == 0 || strcmp(entry->filename, "..") == 0 ||
+                (entry->attr & FAT32_ATTR_SYSTEM)) {
+                continue;
+            }
+            if (!cp_join(level->src_path, src, entry->filename) ||
+                !cp_join(level->dst_path, dst, entry->filename)) {
+                printf("Error: Path too long for '%s'\n", entry->filename);
+                failures++;
+                continue;
+            }
+            if (entry->attr & FAT32_ATTR_DIRECTORY) {
+                if (depth + 1 >= CP_MAX_DEPTH) {
+                    printf("Skipping '%s': too deeply nested\n", level->src_path);
+                    failures++;
+                    continue;
+                }
+                failures += cp_tree(level->src_path, level->dst_path, depth + 1);
+            } else if (!cp_file(level->src_path, level->dst_path)) {
+                failures++;
+            }
+        }
+    }
+    if (result != FAT32_OK) {
+        printf("Error reading '%s': %s\n", src, fat32_error_string(result));
+        failures++;
+    }
+
+    free(level);
+    return failures;
+}
+
+void command_copy(const char *fullCommand) {
+    const char *src = fullCommand + 2;
+    while (*src == ' ') src++;
+
+    bool recursive = strncmp(src, "-r ", 3) == 0;
+    if (recursive) {
+        src += 3;
+        while (*src == ' ') src++;
+    }
+
+    const char *space = strchr(src, ' ');
+    const char *dest = space;
+    while (dest && *dest == ' ') dest++;
+    if (!space || !*dest) {
+        printf("Usage: cp [-r] <source> <destination>\n");
+        return;
+    }
+
+    char src_path[FAT32_MAX_PATH_LEN], dest_path[FAT32_MAX_PATH_LEN];
+    if (!cp_resolve(src_path, src, space - src) || !cp_resolve(dest_path, dest, strlen(dest))) {
+        printf("Error: Path too long\n");
+        return;
+    }
+
+    fat32_file_t file;
+    if (vol_open(&file, src_path) != FAT32_OK) {
+        printf("Error: Source '%s' not found\n", src_path);
+        return;
+    }
+    bool src_is_dir = (file.attributes & FAT32_ATTR_DIRECTORY) != 0;
+    vol_close(&file);
+
+    // Copying into an existing directory keeps the source name
+    if (vol_open(&file, dest_path) == FAT32_OK) {
+        bool dest_is_dir = (file.attributes & FAT32_ATTR_DIRECTORY) != 0;
+        vol_close(&file);
+        const char *name = strrchr(src_path, '/');
+        char dest_dir[FAT32_MAX_PATH_LEN];
+        strcpy(dest_dir, dest_path);
+        if (!dest_is_dir || !cp_join(dest_path, dest_dir, name ? name + 1 : src_path)) {
+            printf("Error: '%s' already exists\n", dest_path);
+            return;
+        }
+    }
+
+    if (!src_is_dir) {
+        if (cp_file(src_path, dest_path)) {
+            printf("File copied successfully\n");
+        }
+        return;
+    }
+
+    if (!recursive) {
+        printf("Error: '%s' is a directory, use cp -r\n", src_path);
+        return;
+    }
+    if (ramfs_is_path(src_path) || ramfs_is_path(dest_path)) {
+        printf("Error: %s only holds files\n", RAMFS_MOUNT_POINT);
+        return;
+    }
+
+    size_t src_len = strlen(src_path);
+    if (strncmp(dest_path, src_path, src_len) == 0 && dest_path[src_len] == '/') {
+        printf("Error: Cannot copy a directory into itself\n");
+        return;
+    }
+
+    int failures = cp_tree(src_path, dest_path, 0);
+    if (failures == 0) {
+        printf("Directory copied successfully\n");
+    } else {
+        printf("Directory copied with %d error(s)\n", failures);
+    }
+}
+
+// Case-insensitive glob match supporting '*' and '?'
+static bool find_glob_match(const char *pattern, const char *name) {
+    const char *star = NULL;
+    const char *resume = NULL;
+
+    while (*name) {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = name;
+        } else if (*pattern == '?' || tolower((unsigned char)*pattern) == tolower((unsigned char)*name)) {
+            pattern++;
+            name++;
+        } else if (star) {
+            pattern = star + 1;
+            name = ++resume;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*') pattern++;
+    return *pattern == '\0';
+}
+
+// Parses [+|-]N[k|m] into a comparison (-1 less, 0 equal, 1 more) and bytes
+static bool find_parse_size(const char *arg, int *compare, uint32_t *bytes) {
+    char *end;
+    *compare = 0;
+    if (*arg == '+' || *arg == '-') {
+        *compare = *arg == '+' ? 1 : -1;
+        arg++;
+    }
+    unsigned long value = strtoul(arg, &end, 10);
+    if (end == arg) {
+        return false;
+    }
+    if (*end == 'k' || *end == 'K') {
+        value *= 1024;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        value *= 1024 * 1024;
+        end++;
+    }
+    *bytes = (uint32_t)value;
+    return *end == '\0';
+}
+
+void command_find(const char *fullCommand) {
+    static fat32_walk_t walk;
+    char args[MAX_COMMAND_LENGTH];
+    char root[FAT32_MAX_PATH_LEN];
+    const char *pattern = NULL;
+    char type = 0;
+    int size_compare = 0;
+    uint32_t size_bytes = 0;
+    bool size_filter = false;
+
+    strncpy(root, currentWorkingDirectory, sizeof(root) - 1);
+    root[sizeof(root) - 1] = '\0';
+    strncpy(args, fullCommand + 4, sizeof(args) - 1);
+    args[sizeof(args) - 1] = '\0';
+
+    bool paged = false;
+    char *more = strstr(args, "| more");
+    if (more) {
+        *more = '\0';
+        paged = true;
+    }
+
+    for (char *token = strtok(args, " "); token; token = strtok(NULL, " ")) {
+        if (strcmp(token, "-name") == 0 && (pattern = strtok(NULL, " ")) != NULL) {
+            continue;
+        } else if (strcmp(token, "-type") == 0) {
+            const char *value = strtok(NULL, " ");
+            if (value && (strcmp(value, "f") == 0 || strcmp(value, "d") == 0)) {
+                type = value[0];
+                continue;
+            }
+        } else if (strcmp(token, "-size") == 0) {
+            const char *value = strtok(NULL, " ");
+            if (value && find_parse_size(value, &size_compare, &size_bytes)) {
+                size_filter = true;
+                continue;
+            }
+        } else if (token[0] != '-') {
+            if (!cp_resolve(root, token, strlen(token))) {
+                printf("Error: Path too long\n");
+                return;
+            }
+            continue;
+        }
+        printf("Usage: find [dir] [-name pattern] [-type f|d] [-size [+|-]N[k|m]] [| more]\n");
+        return;
+    }
+
+    fat32_error_t result = fat32_walk_open(&walk, root);
+    if (result != FAT32_OK) {
+        printf("Error: Cannot search '%s': %s\n", root, fat32_error_string(result));
+        return;
+    }
+
+    pager_begin(paged);
+    unsigned long matches = 0;
+    fat32_entry_t entry;
+    while ((result = fat32_walk_next(&walk, &entry)) == FAT32_OK && entry.filename[0]) {
+        bool is_dir = (entry.attr & FAT32_ATTR_DIRECTORY) != 0;
+        if (ls_is_hidden(&entry)) {
+            fat32_walk_skip(&walk);
+            continue;
+        }
+        if (type && (type == 'd') != is_dir) {
+            continue;
+        }
+        if (size_filter) {
+            if (is_dir) {
+                continue;
+            }
+            int order = entry.size < size_bytes ? -1 : entry.size > size_bytes;
+            if (order != size_compare) {
+                continue;
+            }
+        }
+        if (pattern && !find_glob_match(pattern, entry.filename)) {
+            continue;
+        }
+
+        matches++;
+        printf("%s%s\n", walk.path, is_dir ? "/" : "");
+        if (!pager_line()) {
+            return;
+        }
+    }
+
+    if (result != FAT32_OK) {
+        printf("Error while searching: %s\n", fat32_error_string(result));
+    }
+    if (walk.skipped) {
+        printf("%lu entries skipped (nested too deep or path too long)\n", (unsigned long)walk.skipped);
+    }
+    printf("%lu match(es)\n", matches);
+}
+
+void command_index(const char *fullCommand) {
+    const char *arg = fullCommand + 5;
+    while (*arg == ' ') arg++;
+
+    bool drop = strncmp(arg, "-d", 2) == 0 && (arg[2] == ' ' || arg[2] == '\0');
+    if (drop) {
+        arg += 2;
+        while (*arg == ' ') arg++;
+    }
+
+    char dirpath[FAT32_MAX_PATH_LEN];
+    if (*arg == '\0') {
+        strncpy(dirpath, currentWorkingDirectory, sizeof(dirpath) - 1);
+        dirpath[sizeof(dirpath) - 1] = '\0';
+    } else if (!cp_resolve(dirpath, arg, strlen(arg))) {
+        printf("Error: Path too long\n");
+        return;
+    }
+
+    fat32_error_t result;
+    if (drop) {
+        result = fat32_index_drop(dirpath);
+        if (result == FAT32_OK) {
+            printf("Name index removed from '%s'\n", dirpath);
+        } else {
+            printf("Error removing name index: %s\n", fat32_error_string(result));
+        }
+        return;
+    }
+
+    printf("Indexing '%s'...\n", dirpath);
+    uint64_t start_us = time_us_64();
+    result = fat32_index_create(dirpath);
+    if (result != FAT32_OK) {
+        printf("Error building name index: %s\n", fat32_error_string(result));
+        return;
+    }
+    printf("Name index built in %lu ms\n", (unsigned long)((time_us_64() - start_us) / 1000));
+}
+
+#define PSRAMBENCH_REGION (64 * 1024)
+#define PSRAMBENCH_OPS 1024
+#define PSRAMBENCH_BULK 4096
+#define PSRAMBENCH_LATENCY_READS 256
+
+// KB/s for a transfer that took elapsed_us
+static unsigned long rambench_rate(uint64_t bytes, uint64_t elapsed_us) {
+    return elapsed_us ? (unsigned long)(bytes * 1000000 / elapsed_us / 1024) : 0;
+}
+
+// Time PSRAMBENCH_OPS single transfers of width bytes, stepping through the region
+static uint64_t psrambench_ops(uint32_t base, uint32_t width, bool write, uint8_t *buffer) {
+    uint64_t start = time_us_64();
+    for (uint32_t i = 0; i < PSRAMBENCH_OPS; i++) {
+        uint32_t address = base + (i * width) % PSRAMBENCH_REGION;
+        if (write) {
+            psram_bus_write(&psram_spi, address, buffer, width);
+        } else {
+            psram_bus_read(&psram_spi, address, buffer, width);
+        }
+    }
+    return time_us_64() - start;
+}
+
+static void psrambench_mode(uint32_t base, uint8_t *buffer) {
+    static const uint32_t widths[] = {1, 4};
+    static const char *names[] = {"Byte", "Word"};
+
+    printf("%s mode:\n", psram_bus_mode_name(psram_bus_mode()));
+    for (int w = 0; w < 2; w++) {
+        uint64_t write_us = psrambench_ops(base, widths[w], true, buffer);
+        uint64_t read_us = psrambench_ops(base, widths[w], false, buffer);
+        uint64_t bytes = (uint64_t)PSRAMBENCH_OPS * widths[w];
+        printf("  %s: write %lu KB/s, read %lu KB/s\n", names[w],
+               rambench_rate(bytes, write_us), rambench_rate(bytes, read_us));
+    }
+
+    uint64_t start = time_us_64();
+    for (uint32_t offset = 0; offset < PSRAMBENCH_REGION; offset += PSRAMBENCH_BULK) {
+        psram_bus_write(&psram_spi, base + offset, buffer, PSRAMBENCH_BULK);
+    }
+    uint64_t write_us = time_us_64() - start;
+    start = time_us_64();
+    for (uint32_t offset = 0; offset < PSRAMBENCH_REGION; offset += PSRAMBENCH_BULK) {
+        psram_bus_read(&psram_spi, base + offset, buffer, PSRAMBENCH_BULK);
+    }
+    uint64_t read_us = time_us_64() - start;
+    printf("  Bulk (%d bytes): write %lu KB/s, read %lu KB/s\n", PSRAMBENCH_BULK,
+           rambench_rate(PSRAMBENCH_REGION, write_us), rambench_rate(PSRAMBENCH_REGION, read_us));
+
+    // Scattered word reads, so nothing benefits from a previous burst
+    uint32_t seed = 12345;
+    start = time_us_64();
+    for (int i = 0; i < PSRAMBENCH_LATENCY_READS; i++) {
+        seed = seed * 1103515245 + 12345;
+        psram_bus_read(&psram_spi, base + ((seed >> 8) % PSRAMBENCH_REGION & ~3u), buffer, 4);
+    }
+    uint64_t latency_ns = (time_us_64() - start) * 1000 / PSRAMBENCH_LATENCY_READS;
+    printf("  Random read latency: %lu ns\n", (unsigned long)latency_ns);
+}
+
+// Measure PSRAM throughput and latency in the current mode and, if the chip
+// can switch, in the other one too
+void command_psrambench(void) {
+    if (!psram_alloc_ready()) {
+        printf("Error: PSRAM not available\n");
+        return;
+    }
+    psram_handle_t region = psram_malloc(PSRAMBENCH_REGION);
+    uint8_t *buffer = malloc(PSRAMBENCH_BULK);
+    if (region == PSRAM_HANDLE_NONE || !buffer) {
+        printf("Error: Not enough memory\n");
+        psram_free(region);
+        free(buffer);
+        return;
+    }
+    for (int i = 0; i < PSRAMBENCH_BULK; i++) {
+        buffer[i] = (uint8_t)i;
+    }
+
+    uint32_t base = psram_handle_address(region);
+    psram_mode_t selected = psram_bus_mode();
+    psrambench_mode(base, buffer);
+
+    psram_mode_t other = selected == PSRAM_MODE_QPI ? PSRAM_MODE_SPI : PSRAM_MODE_QPI;
+    if (psram_bus_set_mode(other)) {
+        psrambench_mode(base, buffer);
+        psram_bus_set_mode(selected);
+    } else {
+        printf("%s mode not available\n", psram_bus_mode_name(other));
+    }
+    printf("Using %s mode\n", psram_bus_mode_name(psram_bus_mode()));
+
+    psram_free(region);
+    free(buffer);
+}
+
+#define RAMBENCH_CHUNK 4096
+#define RAMBENCH_DEFAULT_KB 256
+#define RAMBENCH_BLOCK_READS 64
+
+// Write a scratch file in fixed chunks, read it back, then remove it
+static bool rambench_file(const char *path, uint32_t size, uint8_t *buffer, uint64_t *write_us, uint64_t *read_us) {
+    fat32_file_t file;
+    size_t bytes;
+    uint32_t done = 0;
+
+    uint64_t start = time_us_64();
+    if (vol_create(&file, path) != FAT32_OK) {
+        return false;
+    }
+    while (done < size) {
+        uint32_t chunk = size - done < RAMBENCH_CHUNK ? size - done : RAMBENCH_CHUNK;
+        if (vol_write(&file, buffer, chunk, &bytes) != FAT32_OK || bytes == 0) {
+            break;
+        }
+        done += bytes;
+    }
+    vol_close(&file);
+    *write_us = time_us_64() - start;
+    bool ok = done >= size;
+
+    start = time_us_64();
+    if (ok && vol_open(&file, path) == FAT32_OK) {
+        done = 0;
+        while (vol_read(&file, buffer, RAMBENCH_CHUNK, &bytes) == FAT32_OK && bytes > 0) {
+            done += bytes;
+        }
+        vol_close(&file);
+        ok = done >= size;
+    }
+    *read_us = time_us_64() - start;
+
+    vol_delete(path);
+    return ok;
+}
+
+// Compare the RAM disk with the SD card, through the file systems and at block level
+void command_rambench(const char *fullCommand) {
+    if (!ramfs_is_mounted()) {
+        printf("Error: RAM disk not available\n");
+        return;
+    }
+
+    uint32_t kb = (uint32_t)strtoul(fullCommand + 8, NULL, 10);
+    if (kb == 0) {
+        kb = RAMBENCH_DEFAULT_KB;
+    }
+    uint64_t total_space, free_space;
+    ramfs_get_space(&total_space, &free_space);
+    if ((uint64_t)kb * 1024 > free_space) {
+        printf("Error: Only %lu KB free on %s\n", (unsigned long)(free_space / 1024), RAMFS_MOUNT_POINT);
+        return;
+    }
+
+    uint8_t *buffer = malloc(RAMBENCH_CHUNK);
+    if (!buffer) {
+        printf("Error: Not enough memory\n");
+        return;
+    }
+    for (int i = 0; i < RAMBENCH_CHUNK; i++) {
+        buffer[i] = (uint8_t)i;
+    }
+
+    uint32_t size = kb * 1024;
+    uint64_t write_us, read_us;
+    printf("Writing and reading %lu KB in %d byte chunks...\n", (unsigned long)kb, RAMBENCH_CHUNK);
+    if (rambench_file("/rambench.tmp", size, buffer, &write_us, &read_us)) {
+        printf("SD card:  write %lu KB/s, read %lu KB/s\n",
+               rambench_rate(size, write_us), rambench_rate(size, read_us));
+    } else {
+        printf("SD card:  failed\n");
+    }
+    if (rambench_file(RAMFS_MOUNT_POINT "/rambench.tmp", size, buffer, &write_us, &read_us)) {
+        printf("RAM disk: write %lu KB/s, read %lu KB/s\n",
+               rambench_rate(size, write_us), rambench_rate(size, read_us));
+    } else {
+        printf("RAM disk: failed\n");
+    }
+
+    // Raw multi-block reads, without any file system work. The card side reads
+    // the start of the FAT data region, where file data actually lives, rather
+    // than the partition table and reserved sectors at block 0.
+    const uint32_t blocks = RAMBENCH_CHUNK / SD_BLOCK_SIZE;
+    uint64_t bytes = (uint64_t)RAMBENCH_BLOCK_READS * RAMBENCH_CHUNK;
+    uint32_t data_block, data_blocks;
+    if (fat32_get_data_region(&data_block, &data_blocks) != FAT32_OK ||
+        data_blocks < (uint32_t)RAMBENCH_BLOCK_READS * blocks) {
+        printf("Block reads: SD card not available\n");
+        free(buffer);
+        return;
+    }
+    uint64_t start = time_us_64();
+    for (int i = 0; i < RAMBENCH_BLOCK_READS; i++) {
+        sd_read_blocks(data_block + i * blocks, blocks, buffer);
+    }
+    uint64_t sd_us = time_us_64() - start;
+    start = time_us_64();
+    for (int i = 0; i < RAMBENCH_BLOCK_READS; i++) {
+        ramdisk_read_blocks(i * blocks, blocks, buffer);
+    }
+    uint64_t ram_us = time_us_64() - start;
+    printf("Block reads (%lu KB): SD card %lu KB/s, RAM disk %lu KB/s\n", (unsigned long)(bytes / 1024),
+           rambench_rate(bytes, sd_us), rambench_rate(bytes, ram_us));
+
+    free(buffer);
+}
+
+// Map a file into PSRAM, touch every page once and report the paging work
+static void psramload_mapped(const char *filepath) {
+    fat32_file_t file;
+    fat32_mmap_t map;
+    fat32_error_t result = vol_open(&file, filepath);
+    if (result != FAT32_OK) {
+        printf("Error opening file: %s\n", fat32_error_string(result));
+        return;
+    }
+
+    uint64_t start = time_us_64();
+    result = fat32_mmap(&map, &file, 0, fat32_size(&file), PSRAM_HANDLE_NONE);
+    if (result == FAT32_OK) {
+        result = fat32_mmap_touch(&map, 0, map.length);
+        fat32_error_t unmap = fat32_munmap(&map);
+        if (result == FAT32_OK) {
+            result = unmap;
+        }
+    }
+    uint64_t elapsed_us = time_us_64() - start;
+    vol_close(&file);
+    if (result != FAT32_OK) {
+        printf("Error mapping file: %s\n", fat32_error_string(result));
+        return;
+    }
+
+    printf("Mapped %lu bytes in %lu ms: %lu pages of %lu bytes read on first touch\n",
+           (unsigned long)map.length, (unsigned long)(elapsed_us / 1000),
+           (unsigned long)map.page_ins, (unsigned long)map.page_size);
+}
+
+// Load a file into PSRAM and report where the time went, then free it again.
+// With -m the file is demand-paged through fat32_mmap() instead.
+void command_psramload(const char *fullCommand) {
+    const char *filename = fullCommand + 9;
+    while (*filename == ' ') filename++;
+    bool mapped = strncmp(filename, "-m ", 3) == 0;
+    if (mapped) {
+        filename += 3;
+        while (*filename == ' ') filename++;
+    }
+    if (*filename == '\0') {
+        printf("Usage: psramload [-m] <file>\n");
+        return;
+    }
+
+    char filepath[FAT32_MAX_PATH_LEN];
+    if (!cp_resolve(filepath, filename, strlen(filename))) {
+        printf("Error: Path too long\n");
+        return;
+    }
+    if (mapped) {
+        if (ramfs_is_path(filepath)) {
+            printf("Error: Only files on the SD card can be mapped\n");
+            return;
+        }
+        psramload_mapped(filepath);
+        return;
+    }
+
+    psram_handle_t handle;
+    psram_load_stats_t stats;
+    fat32_error_t result = psram_load_file(filepath, &handle, &stats);
+    if (result != FAT32_OK) {
+        printf("Error loading file: %s\n", fat32_error_string(result));
+        return;
+    }
+    psram_free(handle);
+
+    printf("Loaded %lu bytes in %lu ms: %lu KB/s\n", (unsigned long)stats.bytes,
+           (unsigned long)(stats.elapsed_us / 1000), (unsigned long)(psram_load_throughput(&stats) / 1024));
+    printf("%lu chunks of %lu bytes, card reads %lu ms, waiting on PSRAM %lu ms\n",
+           (unsigned long)stats.chunks, (unsigned long)stats.chunk_size,
+           (unsigned long)(stats.read_us / 1000), (unsigned long)(stats.write_wait_us / 1000));
+}
+
+#define DISPLAYBENCH_SCROLLS 1000
+#define DISPLAYBENCH_REDRAWS 20
+#define DISPLAYBENCH_CELLS (DISPLAY_WIDTH_CHARS * DISPLAY_HEIGHT_CHARS)
+#define DISPLAYBENCH_STYLES 4
+
+// The display's old 4-byte cell, kept here to compare against the packed one
+typedef struct {
+    uint8_t character;
+    uint8_t fg_color;
+    uint8_t bg_color;
+    uint8_t attributes;
+} displaybench_cell_t;
+
+static const display_style_t displaybench_styles[DISPLAYBENCH_STYLES] = {
+    {COLOR_WHITE, COLOR_BLACK, ATTR_NORMAL},
+    {COLOR_GREEN, COLOR_BLACK, ATTR_BOLD},
+    {COLOR_YELLOW, COLOR_BLUE, ATTR_NORMAL},
+    {COLOR_CYAN, COLOR_BLACK, ATTR_REVERSE},
+};
+
+static uint16_t displaybench_pixels[DISPLAY_WIDTH_CHARS * 8 * GLYPH_HEIGHT];
+
+// Compare scrolling and redrawing the text grid with 4-byte and packed 16-bit cells.
+// Both are drawn by the display driver's renderer on a detached context, so
+// colours are resolved through the same cache and only the cell layout differs.
+void command_displaybench(void) {
+    displaybench_cell_t *wide = malloc(DISPLAYBENCH_CELLS * sizeof(displaybench_cell_t));
+    char_cell_t *packed = malloc(DISPLAYBENCH_CELLS * sizeof(char_cell_t));
+    display_context_t *ctx = malloc(sizeof(display_context_t));
+    if (!wide || !packed || !ctx || display_init(ctx, NULL) != 0) {
+        printf("Error: Not enough memory\n");
+        free(wide);
+        free(packed);
+        free(ctx);
+        return;
+    }
+
+    for (int i = 0; i < DISPLAYBENCH_CELLS; i++) {
+        const display_style_t *style = &displaybench_styles[(i / 7) % DISPLAYBENCH_STYLES];
+        uint16_t x = i % DISPLAY_WIDTH_CHARS, y = i / DISPLAY_WIDTH_CHARS;
+        wide[i].character = 'A' + i % 26;
+        wide[i].fg_color = style->fg;
+        wide[i].bg_color = style->bg;
+        wide[i].attributes = style->attributes;
+        display_set_cell(ctx, x, y, 'A' + i % 26, style->fg, style->bg, style->attributes);
+        packed[i] = *display_get_cell(ctx, x, y);
+    }
+    // The packed blank cell, taken from the driver like every other cell
+    display_set_cell(ctx, 0, 0, ' ', COLOR_WHITE, COLOR_BLACK, ATTR_NORMAL);
+    char_cell_t blank = *display_get_cell(ctx, 0, 0);
+
+    const int row = DISPLAY_WIDTH_CHARS;
+    const int moved = DISPLAYBENCH_CELLS - row;
+
+    // Scroll: move every row up one and blank the bottom row
+    uint64_t start = time_us_64();
+    for (int n = 0; n < DISPLAYBENCH_SCROLLS; n++) {
+        memmove(wide, wide + row, moved * sizeof(displaybench_cell_t));
+        for (int x = 0; x < row; x++) {
+            wide[moved + x] = (displaybench_cell_t){' ', COLOR_WHITE, COLOR_BLACK, ATTR_NORMAL};
+        }
+    }
+    uint64_t wide_scroll_us = time_us_64() - start;
+
+    start = time_us_64();
+    for (int n = 0; n < DISPLAYBENCH_SCROLLS; n++) {
+        memmove(packed, packed + row, moved * sizeof(char_cell_t));
+        for (int x = 0; x < row; x++) {
+            packed[moved + x] = blank;
+        }
+    }
+    uint64_t packed_scroll_us = time_us_64() - start;
+
+    // Redraw: render every row into pixels through the driver
+    start = time_us_64();
+    for (int n = 0; n < DISPLAYBENCH_REDRAWS; n++) {
+        for (int i = 0; i < DISPLAYBENCH_CELLS; i++) {
+            const displaybench_cell_t *cell = &wide[i];
+            display_render_glyph(ctx, displaybench_pixels + (i % row) * 8, row * 8, cell->character,
+                                 cell->fg_color, cell->bg_color, cell->attributes);
+        }
+    }
+    uint64_t wide_redraw_us = time_us_64() - start;
+
+    start = time_us_64();
+    for (int n = 0; n < DISPLAYBENCH_REDRAWS; n++) {
+        for (int y = 0; y < DISPLAY_HEIGHT_CHARS; y++) {
+            display_render_cells(ctx, packed + y * row, row, displaybench_pixels);
+        }
+    }
+    uint64_t packed_redraw_us = time_us_64() - start;
+
+    printf("Text grid %dx%d, %d scrolls, %d full redraws:\n", DISPLAY_WIDTH_CHARS, DISPLAY_HEIGHT_CHARS,
+           DISPLAYBENCH_SCROLLS, DISPLAYBENCH_REDRAWS);
+    printf("  4-byte cells (%u bytes): scroll %lu ns, redraw %lu us\n",
+           (unsigned)(DISPLAYBENCH_CELLS * sizeof(displaybench_cell_t)),
+           (unsigned long)(wide_scroll_us * 1000 / DISPLAYBENCH_SCROLLS),
+           (unsigned long)(wide_redraw_us / DISPLAYBENCH_REDRAWS));
+    printf("  Packed cells (%u bytes): scroll %lu ns, redraw %lu us\n",
+           (unsigned)(DISPLAYBENCH_CELLS * sizeof(char_cell_t)),
+           (unsigned long)(packed_scroll_us * 1000 / DISPLAYBENCH_SCROLLS),
+           (unsigned long)(packed_redraw_us / DISPLAYBENCH_REDRAWS));
+
+    display_deinit(ctx);
+    free(ctx);
+    free(wide);
+    free(packed);
+
+    if (!shell_consoles_ready) {
+        return;
+    }
+    display_context_t *live = console_display(&shell_consoles, 0);
+    display_refresh_stats_t stats;
+    display_refresh_get_stats(live, &stats);
+    printf("  Refresh service: %lu frames (%lu early for input), %lu fps\n",
+           (unsigned long)stats.frames, (unsigned long)stats.input_frames, (unsigned long)stats.fps);
+    printf("  Frame time: last %lu us, average %lu us, slowest %lu us\n",
+           (unsigned long)stats.last_frame_us,
+           (unsigned long)(stats.frames ? stats.total_frame_us / stats.frames : 0),
+           (unsigned long)stats.max_frame_us);
+
+    // Redraw the unchanged shell screen with the shadow framebuffer on: the
+    // first update fills the shadow, the second should send next to nothing
+    if (display_set_shadow(live, true) != 0) {
+        printf("  Shadow framebuffer: not enough memory\n");
+        return;
+    }
+    uint32_t rendered, pushed, rendered_after, pushed_after;
+    display_update(live);
+    display_get_pixel_counts(live, &rendered, &pushed);
+    display_force_redraw(live);
+    display_update(live);
+    display_get_pixel_counts(live, &rendered_after, &pushed_after);
+    display_set_shadow(live, false);
+    printf("  Unchanged redraw with shadow: %lu pixels rendered, %lu pushed\n",
+           (unsigned long)(rendered_after - rendered), (unsigned long)(pushed_after - pushed));
+}
+
+#define ANSIBENCH_BYTES (64 * 1024)
+
+static const char *const ansibench_colors[] = {
+    "\033[0m", "\033[1;34m", "\033[32m", "\033[1;36m", "\033[33;44m", "\033[38;5;13m",
+};
+
+// The display's old escape handling: buffer until a letter, then re-scan
+// the buffer for parameters. Parse only, returns the sequences found.
+static uint32_t ansibench_legacy_parse(const char *data, size_t len) {
+    char buffer[32];
+    int index = 0;
+    bool in_escape = false;
+    uint32_t sequences = 0;
+    volatile uint32_t sink = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+        if (in_escape) {
+            if (index < (int)sizeof(buffer) - 1) {
+                buffer[index++] = c;
+            }
+            if (!isalpha((unsigned char)c)) {
+                continue;
+            }
+            buffer[index] = '\0';
+            in_escape = false;
+            sequences++;
+
+            int params[16];
+            int param_count = 0;
+            params[0] = 0;
+            for (const char *p = buffer + 1; *p && param_count < 16; p++) {
+                if (isdigit((unsigned char)*p)) {
+                    params[param_count] = params[param_count] * 10 + (*p - '0');
+                } else if (*p == ';') {
+                    if (param_count == 15) {
+                        break;
+                    }
+                    params[++param_count] = 0;
+                } else {
+                    break;
+                }
+            }
+            sink += params[0];
+        } else if (c == '\033') {
+            in_escape = true;
+            index = 0;
+        } else {
+            sink += (uint8_t)c;
+        }
+    }
+    return sequences;
+}
+
+// Feed a large colored listing through the escape parser
+void command_ansibench(void) {
+    char *text = malloc(ANSIBENCH_BYTES);
+    char *plain = malloc(ANSIBENCH_BYTES);
+    display_context_t *ctx = malloc(sizeof(display_context_t));
+    if (!text || !plain || !ctx || display_init(ctx, NULL) != 0) {
+        printf("Error: Not enough memory\n");
+        free(text);
+        free(plain);
+        free(ctx);
+        return;
+    }
+
+    // ls -l style lines with a color change around every name
+    size_t len = 0;
+    uint32_t sequences = 0;
+    const int colors = sizeof(ansibench_colors) / sizeof(ansibench_colors[0]);
+    for (int n = 0; len < ANSIBENCH_BYTES - 96; n++) {
+        len += snprintf(text + len, ANSIBENCH_BYTES - len, "-rw-r--r-- %6d %sfile_%04d.txt\033[0m %s*\033[m\r\n",
+                        n * 37 % 100000, ansibench_colors[n % colors], n, ansibench_colors[(n + 1) % colors]);
+        sequences += 4;
+    }
+
+    // The same listing without escapes, to time the output on its own
+    size_t plain_len = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == '\033') {
+            while (i < len && !isalpha((unsigned char)text[i])) {
+                i++;
+            }
+        } else {
+            plain[plain_len++] = text[i];
+        }
+    }
+
+    uint64_t start = time_us_64();
+    display_write(ctx, plain, plain_len);
+    uint64_t plain_write_us = time_us_64() - start;
+
+    start = time_us_64();
+    for (size_t i = 0; i < plain_len; i++) {
+        display_putchar(ctx, plain[i]);
+    }
+    uint64_t plain_putchar_us = time_us_64() - start;
+
+    start = time_us_64();
+    uint32_t legacy_sequences = ansibench_legacy_parse(text, len);
+    uint64_t legacy_us = time_us_64() - start;
+
+    start = time_us_64();
+    display_write(ctx, text, len);
+    uint64_t write_us = time_us_64() - start;
+
+    start = time_us_64();
+    for (size_t i = 0; i < len; i++) {
+        display_putchar(ctx, text[i]);
+    }
+    uint64_t putchar_us = time_us_64() - start;
+
+    // The old parser never drew, so each state machine time has the
+    // output of the stripped text taken off to leave its parsing alone
+    uint64_t write_parse_us = write_us > plain_write_us ? write_us - plain_write_us : 0;
+    uint64_t putchar_parse_us = putchar_us > plain_putchar_us ? putchar_us - plain_putchar_us : 0;
+
+    printf("%u bytes of colored text, %lu escape sequences:\n", (unsigned)len, (unsigned long)sequences);
+    printf("  Output alone (%u bytes, escapes stripped): write %lu us, putchar %lu us\n", (unsigned)plain_len,
+           (unsigned long)plain_write_us, (unsigned long)plain_putchar_us);
+    printf("  Parsing, old buffer and re-scan (%lu found): %lu us, %lu KB/s\n",
+           (unsigned long)legacy_sequences, (unsigned long)legacy_us,
+           (unsigned long)(legacy_us ? (uint64_t)len * 1000000 / 1024 / legacy_us : 0));
+    printf("  Parsing, state machine via display_write:   %lu us, %lu KB/s\n", (unsigned long)write_parse_us,
+           (unsigned long)(write_parse_us ? (uint64_t)len * 1000000 / 1024 / write_parse_us : 0));
+    printf("  Parsing, state machine via display_putchar: %lu us, %lu KB/s\n", (unsigned long)putchar_parse_us,
+           (unsigned long)(putchar_parse_us ? (uint64_t)len * 1000000 / 1024 / putchar_parse_us : 0));
+
+    display_deinit(ctx);
+    free(ctx);
+    free(plain);
+    free(text);
+}
+
+// Byte streams for displaycheck. Each one goes through display_write() on
+// one context and display_putchar() on another, and both screens must match.
+static const char *const displaycheck_cases[] = {
+    "Plain text long enough to wrap past the right edge of the first row and onto the next one",
+    "1\n2\n3\n4\n5\n6\n7\n8\n9\n10\n11\n12\n13\n14\n15\n16\n17\n18\n19\n20\n21\n22\n23\n24\n25\n26\n27\n28\n29\n30",
+    "DEL\177 is\177\177 ignored\177",
+    "\033[18;19r\033[23;1H0123456789012345678901234567890123456789012345678901234567890123456789",
+    "\033[18;19r\033[23;1Hbelow\nthe\nregion\n\n\nstays put",
+    "\033[5;10r\033[10;1Hscroll\ninside\nthe\nregion\033[DEnd",
+    "\033[5;10r\033[2;1Habove\nthe\nregion\nruns\ninto\nit\nand\nscrolls\nat\nthe\nbottom\nmargin",
+    "\033[31;1mbold red\033[0m\ttab\tstops\r\n\033[7mreverse\033[m\033[24;1Hlast row\nand past it",
+    "\311\315\315\315\273\r\n\272box\272\177\r\n\310\315\315\315\274 \304\304\263\033[1m\333\262\261\260\033[m",
+};
+
+static bool displaycheck_same(display_context_t *a, display_context_t *b, uint16_t *bad_x, uint16_t *bad_y) {
+    uint16_t ax, ay, bx, by;
+    display_get_cursor(a, &ax, &ay);
+    display_get_cursor(b, &bx, &by);
+    if (ax != bx || ay != by) {
+        *bad_x = ax;
+        *bad_y = ay;
+        return false;
+    }
+    for (uint16_t y = 0; y < DISPLAY_HEIGHT_CHARS; y++) {
+        for (uint16_t x = 0; x < DISPLAY_WIDTH_CHARS; x++) {
+            char_cell_t ca = *display_get_cell(a, x, y);
+            char_cell_t cb = *display_get_cell(b, x, y);
+            const display_style_t *sa = &a->styles[cell_style(ca)];
+            const display_style_t *sb = &b->styles[cell_style(cb)];
+            if (cell_char(ca) != cell_char(cb) || sa->fg != sb->fg || sa->bg != sb->bg ||
+                sa->attributes != sb->attributes) {
+                *bad_x = x;
+                *bad_y = y;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Check that display_write() and display_putchar() leave the same screen
+void command_displaycheck(void) {
+    display_context_t *a = malloc(sizeof(display_context_t));
+    display_context_t *b = malloc(sizeof(display_context_t));
+    const int cases = sizeof(displaycheck_cases) / sizeof(displaycheck_cases[0]);
+    int failed = 0;
+
+    if (!a || !b) {
+        printf("Error: Not enough memory\n");
+        free(a);
+        free(b);
+        return;
+    }
+
+    for (int i = 0; i < cases; i++) {
+        if (display_init(a, NULL) != 0) {
+            printf("Error: Not enough memory\n");
+            break;
+        }
+        if (display_init(b, NULL) != 0) {
+            display_deinit(a);
+            printf("Error: Not enough memory\n");
+            break;
+        }
+
+        const char *text = displaycheck_cases[i];
+        display_write(a, text, strlen(text));
+        for (const char *p = text; *p; p++) {
+            display_putchar(b, *p);
+        }
+
+        uint16_t x, y;
+        if (!displaycheck_same(a, b, &x, &y)) {
+            printf("Case %d: write and putchar differ at column %d, row %d\n", i + 1, x + 1, y + 1);
+            failed++;
+        }
+        display_deinit(a);
+        display_deinit(b);
+    }
+
+    printf("%d of %d display cases passed\n", cases - failed, cases);
+    free(a);
+    free(b);
+}
+
+// Console 0's scrollback view jumps to the nearest earlier line holding
+// the text. Typing closes the view again, so running the same search once
+// more goes one match further back.
+void command_scrollsearch(const char *command) {
+    static char last_text[DISPLAY_WIDTH_CHARS + 1];
+    static int last_matches = 0;
+    const char *text = command + strlen("scrollsearch");
+    while (*text == ' ') text++;
+
+    if (!*text || strlen(text) > DISPLAY_WIDTH_CHARS) {
+        printf("Usage: scrollsearch <text>, up to %d characters\n", DISPLAY_WIDTH_CHARS);
+        return;
+    }
+    if (!shell_consoles_ready) {
+        printf("Error: No scrollback\n");
+        return;
+    }
+
+    int matches = strcmp(text, last_text) == 0 ? last_matches + 1 : 1;
+    strcpy(last_text, text);
+    display_context_t *display = console_display(&shell_consoles, 0);
+    int found = 0;
+    while (found < matches && display_scrollback_search(display, text, true) >= 0) {
+        found++;
+    }
+    if (found == 0) {
+        last_matches = 0;
+        printf("\"%s\" is not in the scrollback\n", text);
+    } else if (found < matches) {
+        // Past the oldest match: stay on it and start over next time
+        last_matches = 0;
+        printf("No older \"%s\"\n", text);
+    } else {
+        last_matches = found;
+    }
+}
+
 void execute_command(const char *command) {
     if (strcmp(command, "hello") == 0) {  
         command_hello();
@@ -1045,8 +2567,9 @@ void execute_command(const char *command) {
         command_pico();
     } else if (strcmp(command, "pwd") == 0) {  
         command_printdirectory();
-    } else if (strcmp(command, "ls") == 0 || strcmp(command, "list files") == 0) {  
-        command_listfiles();
+    } else if (strcmp(command, "ls") == 0 || strncmp(command, "ls ", 3) == 0 ||
+               strcmp(command, "list files") == 0) {  
+        command_listfiles(command);
     } else if (strncmp(command, "read file", 9) == 0) {  
         const char* filename = command + 10;
         while (*filename == ' ') filename++;
@@ -1059,6 +2582,26 @@ void execute_command(const char *command) {
         command_rename_file(command);
     } else if (strncmp(command, "mv", 2) == 0) {  
         command_move_file(command);
+    } else if (strncmp(command, "cp ", 3) == 0) {  
+        command_copy(command);
+    } else if (strcmp(command, "find") == 0 || strncmp(command, "find ", 5) == 0) {  
+        command_find(command);
+    } else if (strcmp(command, "index") == 0 || strncmp(command, "index ", 6) == 0) {  
+        command_index(command);
+    } else if (strncmp(command, "psramload", 9) == 0) {  
+        command_psramload(command);
+    } else if (strcmp(command, "psrambench") == 0) {  
+        command_psrambench();
+    } else if (strcmp(command, "displaybench") == 0) {  
+        command_displaybench();
+    } else if (strcmp(command, "ansibench") == 0) {  
+        command_ansibench();
+    } else if (strncmp(command, "scrollsearch", 12) == 0) {
+        command_scrollsearch(command);
+    } else if (strcmp(command, "displaycheck") == 0) {  
+        command_displaycheck();
+    } else if (strcmp(command, "rambench") == 0 || strncmp(command, "rambench ", 9) == 0) {  
+        command_rambench(command);
     } else if (strncmp(command, "mk file", 7) == 0) {  
         command_createfile(command);
     } else if (strncmp(command, "rm file", 7) == 0) {  
@@ -1069,6 +2612,8 @@ void execute_command(const char *command) {
         command_deletedir(command);
     } else if (strcmp(command, "memory") == 0) {  
         command_memory();
+    } else if (strcmp(command, "fsinfo") == 0 || strncmp(command, "fsinfo ", 7) == 0) {  
+        command_fsinfo(command);
     } else if (strcmp(command, "reboot") == 0) {  
         printf("Rebooting... ");
         sleep_ms(250);
@@ -1125,7 +2670,7 @@ void load_credentials(void) {
             currentPassword[MAX_PASSWORD_LENGTH - 1] = '\0';
             return;
         }
-        fat32_write(&file, template_str, strlen(template_str), NULL);
+        vol_write(&file, template_str, strlen(template_str), NULL);
         fat32_close(&file);
         
         strncpy(currentUsername, "admin", MAX_USERNAME_LENGTH - 1);
@@ -1188,6 +2733,13 @@ int main() {
 
     // Initialize PSRAM (using PIO 0, state machine 0, fudge enabled)
     psram_spi = psram_spi_init_clkdiv(pio0, 0, 1.0, true);
+    psram_bus_init(&psram_spi);
+    psram_alloc_init(&psram_spi, 0, PSRAM_SIZE);
+    psram_loader_init(&psram_spi);
+    shell_consoles_init();
+    if (ramfs_mount(RAMFS_DEFAULT_SIZE) != FAT32_OK) {
+        printf("\rRAM disk init failed\n");
+    }
 
     load_credentials();
 
@@ -1250,6 +2802,9 @@ Login_Sequence:
         add_to_history(userCommand);  
         execute_command(userCommand);
 
+        // Apply the command's logged metadata updates in one batch
+        fat32_sync();
+
         sleep_ms(20);
         mini_seconds++;
 
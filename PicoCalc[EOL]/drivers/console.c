@@ -0,0 +1,196 @@
+#include "console.h"
+#include "keyboard.h"
+#include <stdlib.h>
+#include <string.h>
+
+int console_init(console_set_t *set, void *lcd_ctx, int count) {
+    if (!set || !lcd_ctx || count < 1 || count > CONSOLE_MAX) {
+        return -1;
+    }
+    
+    memset(set, 0, sizeof(console_set_t));
+    set->consoles = calloc(count, sizeof(console_t));
+    if (!set->consoles) {
+        return -1;
+    }
+    
+    if (pthread_mutex_init(&set->lock, NULL) != 0) {
+        free(set->consoles);
+        return -1;
+    }
+    
+    // Only the first console starts on the LCD. Each one keeps its own
+    // scrollback, at the display driver's default depth.
+    for (int i = 0; i < count; i++) {
+        display_context_t *display = &set->consoles[i].display;
+        bool ready = display_init(display, i == 0 ? lcd_ctx : NULL) == 0;
+        if (ready && display_scrollback_init(display, 0) != 0) {
+            display_deinit(display);
+            ready = false;
+        }
+        if (!ready) {
+            while (--i >= 0) {
+                display_deinit(&set->consoles[i].display);
+            }
+            pthread_mutex_destroy(&set->lock);
+            free(set->consoles);
+            return -1;
+        }
+    }
+    
+    set->count = count;
+    set->active = 0;
+    set->lcd_ctx = lcd_ctx;
+    
+    return 0;
+}
+
+void console_deinit(console_set_t *set) {
+    if (!set || !set->consoles) {
+        return;
+    }
+    
+    for (int i = 0; i < set->count; i++) {
+        display_deinit(&set->consoles[i].display);
+    }
+    pthread_mutex_destroy(&set->lock);
+    free(set->consoles);
+    set->consoles = NULL;
+    set->count = 0;
+}
+
+// Hand the LCD to another console. The old one stops drawing before the
+// new one repaints from its own grid.
+int console_switch(console_set_t *set, int index) {
+    if (!set || index < 0 || index >= set->count) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&set->lock);
+    if (index != set->active) {
+        display_detach(&set->consoles[set->active].display);
+        set->active = index;
+        display_attach(&set->consoles[index].display, set->lcd_ctx);
+    }
+    pthread_mutex_unlock(&set->lock);
+    
+    display_update(&set->consoles[index].display);
+    return 0;
+}
+
+int console_active(console_set_t *set) {
+    if (!set) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&set->lock);
+    int active = set->active;
+    pthread_mutex_unlock(&set->lock);
+    
+    return active;
+}
+
+display_context_t *console_display(console_set_t *set, int index) {
+    if (!set || index < 0 || index >= set->count) {
+        return NULL;
+    }
+    
+    return &set->consoles[index].display;
+}
+
+// Output goes to the console's grid whether or not it is on the LCD
+void console_write(console_set_t *set, int index, const char *data, size_t len) {
+    display_context_t *display = console_display(set, index);
+    if (!display) {
+        return;
+    }
+    
+    display_write(display, data, len);
+}
+
+void console_puts(console_set_t *set, int index, const char *str) {
+    if (!str) {
+        return;
+    }
+    
+    console_write(set, index, str, strlen(str));
+}
+
+// Edit the input line of a console and echo it. Caller holds the set lock.
+static void input_key(console_t *console, uint8_t key) {
+    display_context_t *display = &console->display;
+    
+    // The previous line has not been read yet
+    if (console->line_ready) {
+        return;
+    }
+    
+    switch (key) {
+        case KEY_RETURN:
+        case '\n':
+            console->input[console->input_length] = '\0';
+            console->line_ready = true;
+            display_write(display, "\r\n", 2);
+            break;
+            
+        case KEY_BACKSPACE:
+        case KEY_DELETE:
+            if (console->input_length > 0) {
+                console->input_length--;
+                display_write(display, "\b \b", 3);
+            }
+            break;
+            
+        default:
+            if (key >= 0x20 && key < 0x7F && console->input_length < CONSOLE_INPUT_MAX - 1) {
+                console->input[console->input_length++] = key;
+                display_putchar(display, key);
+            }
+            break;
+    }
+}
+
+// Fn+F1..F6 switch consoles, Shift+PageUp/PageDown page through the active
+// console's scrollback, and anything else edits its input line. Returns
+// false for keys that were not used.
+bool console_handle_key(console_set_t *set, uint8_t key, uint8_t modifiers) {
+    if (!set) {
+        return false;
+    }
+    
+    if ((modifiers & KB_MOD_FN) && key >= KEY_F1 && key <= KEY_F6) {
+        return console_switch(set, key - KEY_F1) == 0;
+    }
+    
+    pthread_mutex_lock(&set->lock);
+    console_t *console = &set->consoles[set->active];
+    bool used = display_scrollback_key(&console->display, key, modifiers);
+    if (!used && (key == KEY_RETURN || key == '\n' || key == KEY_BACKSPACE || key == KEY_DELETE ||
+                  (key >= 0x20 && key < 0x7F))) {
+        input_key(console, key);
+        used = true;
+    }
+    pthread_mutex_unlock(&set->lock);
+    
+    return used;
+}
+
+// Take the finished input line of a console, if there is one
+bool console_read_line(console_set_t *set, int index, char *buffer, size_t size) {
+    if (!set || !buffer || size == 0 || index < 0 || index >= set->count) {
+        return false;
+    }
+    
+    pthread_mutex_lock(&set->lock);
+    console_t *console = &set->consoles[index];
+    bool ready = console->line_ready;
+    if (ready) {
+        strncpy(buffer, console->input, size - 1);
+        buffer[size - 1] = '\0';
+        console->input_length = 0;
+        console->line_ready = false;
+    }
+    pthread_mutex_unlock(&set->lock);
+    
+    return ready;
+}
@@ -0,0 +1,54 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "display.h"
+
+// Virtual consoles
+#define CONSOLE_MAX         6       // Fn+F1 to Fn+F6
+#define CONSOLE_INPUT_MAX   128     // Characters in one input line
+
+// One virtual console: a display context of its own and the line being typed
+typedef struct {
+    display_context_t display;
+    
+    // Input line
+    char input[CONSOLE_INPUT_MAX];
+    uint16_t input_length;
+    bool line_ready;            // Return was pressed, the line is waiting
+} console_t;
+
+// The set of consoles sharing the LCD. Only the active one draws; the
+// others keep taking output into their grids.
+typedef struct {
+    console_t *consoles;
+    int count;
+    int active;
+    void *lcd_ctx;
+    pthread_mutex_t lock;       // Serialises switches
+} console_set_t;
+
+// Function prototypes
+
+// Initialization
+int console_init(console_set_t *set, void *lcd_ctx, int count);
+void console_deinit(console_set_t *set);
+
+// Switching
+int console_switch(console_set_t *set, int index);
+int console_active(console_set_t *set);
+display_context_t *console_display(console_set_t *set, int index);
+
+// Output
+void console_write(console_set_t *set, int index, const char *data, size_t len);
+void console_puts(console_set_t *set, int index, const char *str);
+
+// Input
+bool console_handle_key(console_set_t *set, uint8_t key, uint8_t modifiers);
+bool console_read_line(console_set_t *set, int index, char *buffer, size_t size);
+
+#endif // CONSOLE_H
@@ -1,14 +1,18 @@
 #include "display.h"
 #include "lcd.h"
-#include "font-8x10.h"
+#include "font.h"
+#include "keyboard.h"
+#include "psram_alloc.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <errno.h>
+#include <time.h>
 
-// ANSI color palette (16 colors)
-static const uint32_t ansi_palette[16] = {
+// Default ANSI color palette (16 colors)
+static const uint32_t ansi_palette[DISPLAY_PALETTE_SIZE] = {
     0x000000, // 0: Black
     0xAA0000, // 1: Red
     0x00AA00, // 2: Green
@@ -27,6 +31,16 @@ static const uint32_t ansi_palette[16] = {
     0xFFFFFF  // 15: Bright white
 };
 
+// Cell geometry in pixels
+#define CELL_WIDTH          8
+#define CELL_HEIGHT         GLYPH_HEIGHT
+
+// Blank runs at least this long are sent as a solid fill instead of glyphs
+#define FILL_MIN_CELLS      4
+
+// Every screen row, as a bit mask
+#define SHADOW_ALL_ROWS     ((1u << DISPLAY_HEIGHT_CHARS) - 1)
+
 // Box drawing characters
 #define BOX_HORIZONTAL      0xC4
 #define BOX_VERTICAL        0xB3
@@ -40,19 +54,156 @@ static const uint32_t ansi_palette[16] = {
 #define BOX_T_TOP           0xC2
 #define BOX_T_BOTTOM        0xC1
 
-// Saved cursor state
-typedef struct {
-    uint16_t x;
-    uint16_t y;
-    uint8_t fg;
-    uint8_t bg;
-    uint8_t attr;
-} cursor_state_t;
+// Index into the color cache for a cell's colors and attributes
+static inline uint16_t color_key(uint8_t fg, uint8_t bg, uint8_t attr) {
+    return ((attr & ATTR_BOLD) ? 0x200 : 0) | ((attr & ATTR_REVERSE) ? 0x100 : 0) |
+           ((fg & 0x0F) << 4) | (bg & 0x0F);
+}
+
+// Convert the palette to RGB565 and resolve every (attr, fg, bg) entry
+static void rebuild_colors(display_context_t *ctx) {
+    for (int i = 0; i < DISPLAY_PALETTE_SIZE; i++) {
+        uint32_t c = ctx->palette[i];
+        ctx->palette565[i] = RGB((c >> 16) & 0xFF, (c >> 8) & 0xFF, c & 0xFF);
+    }
+    
+    for (int key = 0; key < DISPLAY_COLOR_CACHE_SIZE; key++) {
+        uint8_t fg_index = (key >> 4) & 0x0F;
+        uint16_t fg = ctx->palette565[fg_index];
+        uint16_t bg = ctx->palette565[key & 0x0F];
+        
+        // Handle reverse video
+        if (key & 0x100) {
+            uint16_t temp = fg;
+            fg = bg;
+            bg = temp;
+        }
+        
+        // Handle bold (brighten foreground)
+        if (key & 0x200) {
+            fg = ctx->palette565[(fg_index & 0x07) + 8];
+        }
+        
+        ctx->color_cache[key] = ((uint32_t)fg << 16) | bg;
+    }
+    
+    ctx->full_redraw_needed = true;
+}
+
+// Free every style no cell refers to any more
+static void reclaim_styles(display_context_t *ctx) {
+    bool used[DISPLAY_MAX_STYLES] = {false};
+    
+    used[ctx->blank_style] = true;
+    for (int i = 0; i < ctx->buffer_size; i++) {
+        used[cell_style(ctx->text_buffer[i])] = true;
+    }
+    for (int w = 0; w < ctx->window_count; w++) {
+        const display_window_t *win = ctx->windows[w];
+        for (int i = 0; i < win->width * win->height; i++) {
+            used[cell_style(win->cells[i])] = true;
+        }
+    }
+    if (ctx->screen) {
+        used[ctx->screen->style] = true;
+        for (int i = 0; i < DISPLAY_WIDTH_CHARS * DISPLAY_HEIGHT_CHARS; i++) {
+            used[cell_style(ctx->screen->cells[i])] = true;
+        }
+    }
+    for (int i = 0; i < ctx->style_count; i++) {
+        if (!used[i]) {
+            ctx->styles[i].fg = DISPLAY_STYLE_FREE;
+        }
+    }
+}
+
+// Style index for a color and attribute combination, adding it if new.
+// If the table is full of live styles the colors are kept and the
+// attributes dropped.
+static uint8_t intern_style(display_context_t *ctx, uint8_t fg, uint8_t bg, uint8_t attr) {
+    fg &= 0x0F;
+    bg &= 0x0F;
+    
+    display_style_t *last = &ctx->styles[ctx->last_style];
+    if (ctx->last_style < ctx->style_count && last->fg == fg && last->bg == bg && last->attributes == attr) {
+        return ctx->last_style;
+    }
+    
+    int slot = -1;
+    for (int pass = 0; pass < 2 && slot < 0; pass++) {
+        for (int i = 0; i < ctx->style_count; i++) {
+            display_style_t *style = &ctx->styles[i];
+            if (style->fg == fg && style->bg == bg && style->attributes == attr) {
+                ctx->last_style = i;
+                return i;
+            }
+            if (slot < 0 && style->fg == DISPLAY_STYLE_FREE) {
+                slot = i;
+            }
+        }
+        if (slot < 0 && ctx->style_count < DISPLAY_MAX_STYLES) {
+            slot = ctx->style_count++;
+        }
+        if (slot < 0) {
+            reclaim_styles(ctx);
+        }
+    }
+    if (slot < 0) {
+        return attr ? intern_style(ctx, fg, bg, ATTR_NORMAL) : ctx->blank_style;
+    }
+    
+    ctx->styles[slot].fg = fg;
+    ctx->styles[slot].bg = bg;
+    ctx->styles[slot].attributes = attr;
+    ctx->last_style = slot;
+    return slot;
+}
+
+static inline char_cell_t blank_cell(display_context_t *ctx) {
+    return cell_make(' ', ctx->blank_style);
+}
+
+// Pixels for one row of cells, filled in and pushed with a single blit
+static uint16_t span_pixels[DISPLAY_WIDTH_CHARS * CELL_WIDTH * CELL_HEIGHT];
+
+// Widen the dirty span of a row to cover columns x0..x1
+static inline void mark_dirty(display_context_t *ctx, uint16_t y, uint16_t x0, uint16_t x1) {
+    if (y >= DISPLAY_HEIGHT_CHARS || x0 > x1) {
+        return;
+    }
+    if (x1 >= DISPLAY_WIDTH_CHARS) {
+        x1 = DISPLAY_WIDTH_CHARS - 1;
+    }
+    if (x0 < ctx->dirty_min[y]) {
+        ctx->dirty_min[y] = x0;
+    }
+    if (x1 > ctx->dirty_max[y]) {
+        ctx->dirty_max[y] = x1;
+    }
+}
+
+// Cells of screen row y. The grid is a ring: screen row 0 is stored at
+// top_row, so scrolling the whole screen only moves top_row.
+static inline char_cell_t *row_cells(display_context_t *ctx, uint16_t y) {
+    uint32_t row = ctx->top_row + y;
+    if (row >= DISPLAY_HEIGHT_CHARS) {
+        row %= DISPLAY_HEIGHT_CHARS;
+    }
+    return &ctx->text_buffer[row * DISPLAY_WIDTH_CHARS];
+}
+
+static inline void mark_line_dirty(display_context_t *ctx, uint16_t y) {
+    mark_dirty(ctx, y, 0, DISPLAY_WIDTH_CHARS - 1);
+}
 
-static cursor_state_t saved_state;
+static inline void mark_clean(display_context_t *ctx, uint16_t y) {
+    ctx->dirty_min[y] = DISPLAY_SPAN_CLEAN_MIN;
+    ctx->dirty_max[y] = DISPLAY_SPAN_CLEAN_MAX;
+}
 
+// lcd_ctx may be NULL for a context that is written but never drawn
 int display_init(display_context_t *ctx, void *lcd_ctx) {
-    if (!ctx || !lcd_ctx) {
+    if (!ctx) {
         return -1;
     }
     
@@ -66,17 +217,24 @@ int display_init(display_context_t *ctx, void *lcd_ctx) {
         return -1;
     }
     
-    // Allocate dirty line tracking
-    ctx->dirty_lines = calloc(DISPLAY_HEIGHT_CHARS, sizeof(bool));
-    if (!ctx->dirty_lines) {
+    // Allocate dirty span tracking
+    ctx->dirty_min = malloc(DISPLAY_HEIGHT_CHARS);
+    ctx->dirty_max = malloc(DISPLAY_HEIGHT_CHARS);
+    if (!ctx->dirty_min || !ctx->dirty_max) {
         free(ctx->text_buffer);
+        free(ctx->dirty_min);
+        free(ctx->dirty_max);
         return -1;
     }
+    for (int y = 0; y < DISPLAY_HEIGHT_CHARS; y++) {
+        mark_clean(ctx, y);
+    }
     
     // Initialize mutex
     if (pthread_mutex_init(&ctx->lock, NULL) != 0) {
         free(ctx->text_buffer);
-        free(ctx->dirty_lines);
+        free(ctx->dirty_min);
+        free(ctx->dirty_max);
         return -1;
     }
     
@@ -90,6 +248,13 @@ int display_init(display_context_t *ctx, void *lcd_ctx) {
     ctx->config.default_fg = COLOR_WHITE;
     ctx->config.default_bg = COLOR_BLACK;
     
+    // Load the default palette
+    memcpy(ctx->palette, ansi_palette, sizeof(ctx->palette));
+    rebuild_colors(ctx);
+    
+    // The default style goes first so cleared cells always have one
+    ctx->blank_style = intern_style(ctx, ctx->config.default_fg, ctx->config.default_bg, ATTR_NORMAL);
+    
     // Set initial attributes
     ctx->current_fg = ctx->config.default_fg;
     ctx->current_bg = ctx->config.default_bg;
@@ -99,6 +264,11 @@ int display_init(display_context_t *ctx, void *lcd_ctx) {
     ctx->scroll_top = 0;
     ctx->scroll_bottom = DISPLAY_HEIGHT_CHARS - 1;
     
+    // Hardware scrolling covers exactly the text rows
+    if (lcd_ctx) {
+        lcd_define_scrolling(0, HEIGHT - DISPLAY_HEIGHT_CHARS * CELL_HEIGHT);
+    }
+    
     // Clear display
     display_clear(ctx);
     
@@ -110,139 +280,331 @@ void display_deinit(display_context_t *ctx) {
         return;
     }
     
+    display_refresh_stop(ctx);
+    
+    while (ctx->window_count > 0) {
+        display_window_destroy(ctx->windows[ctx->window_count - 1]);
+    }
+    display_screen_destroy(ctx->screen);
+    
     pthread_mutex_destroy(&ctx->lock);
+    free(ctx->shadow);
+    free(ctx->shadow_scratch);
+    free(ctx->scrollback_heap);
+    if (ctx->scrollback_handle != PSRAM_HANDLE_NONE) {
+        psram_free(ctx->scrollback_handle);
+    }
     free(ctx->text_buffer);
-    free(ctx->dirty_lines);
+    free(ctx->dirty_min);
+    free(ctx->dirty_max);
 }
 
-void display_clear(display_context_t *ctx) {
-    if (!ctx) {
+// Give the context the LCD. Whatever the LCD shows belongs to someone
+// else, so the next update repaints everything from the grid.
+void display_attach(display_context_t *ctx, void *lcd_ctx) {
+    if (!ctx || !lcd_ctx) {
         return;
     }
     
     pthread_mutex_lock(&ctx->lock);
+    ctx->lcd_ctx = lcd_ctx;
+    ctx->pending_scroll = 0;
+    ctx->full_redraw_needed = true;
+    ctx->view_redraw = ctx->view_offset > 0;
+    ctx->view_shift = 0;
+    ctx->shadow_stale = SHADOW_ALL_ROWS;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+// Stop drawing. The grid keeps taking output and the changes are drawn
+// after display_attach().
+void display_detach(display_context_t *ctx) {
+    if (!ctx) {
+        return;
+    }
     
-    // Clear text buffer
+    pthread_mutex_lock(&ctx->lock);
+    ctx->lcd_ctx = NULL;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+// Blank the whole grid and home the cursor. Caller holds the lock.
+static void clear_locked(display_context_t *ctx) {
     for (int i = 0; i < ctx->buffer_size; i++) {
-        ctx->text_buffer[i].character = ' ';
-        ctx->text_buffer[i].fg_color = ctx->config.default_fg;
-        ctx->text_buffer[i].bg_color = ctx->config.default_bg;
-        ctx->text_buffer[i].attributes = ATTR_NORMAL;
+        ctx->text_buffer[i] = blank_cell(ctx);
     }
     
     // Reset cursor
     ctx->cursor_x = 0;
     ctx->cursor_y = 0;
     
-    // Mark all lines as dirty
-    for (int i = 0; i < DISPLAY_HEIGHT_CHARS; i++) {
-        ctx->dirty_lines[i] = true;
-    }
+    // Redraw everything
     ctx->full_redraw_needed = true;
+}
+
+void display_clear(display_context_t *ctx) {
+    if (!ctx) {
+        return;
+    }
     
+    pthread_mutex_lock(&ctx->lock);
+    clear_locked(ctx);
     pthread_mutex_unlock(&ctx->lock);
     
     // Update display
     display_update(ctx);
 }
 
+static void clear_line_locked(display_context_t *ctx, uint16_t line) {
+    char_cell_t *row = row_cells(ctx, line);
+    for (int x = 0; x < DISPLAY_WIDTH_CHARS; x++) {
+        row[x] = blank_cell(ctx);
+    }
+    
+    mark_line_dirty(ctx, line);
+}
+
 void display_clear_line(display_context_t *ctx, uint16_t line) {
     if (!ctx || line >= DISPLAY_HEIGHT_CHARS) {
         return;
     }
     
     pthread_mutex_lock(&ctx->lock);
+    clear_line_locked(ctx, line);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static inline bool scroll_region_is_screen(display_context_t *ctx) {
+    return ctx->scroll_top == 0 && ctx->scroll_bottom == DISPLAY_HEIGHT_CHARS - 1;
+}
+
+//
+// Scrollback
+//
+
+static void scrollback_store(display_context_t *ctx, uint32_t slot, const display_line_t *lines, uint32_t count) {
+    if (ctx->scrollback_heap) {
+        memcpy(&ctx->scrollback_heap[slot], lines, count * sizeof(display_line_t));
+    } else {
+        psram_handle_write(ctx->scrollback_handle, slot * sizeof(display_line_t), lines, count * sizeof(display_line_t));
+    }
+}
+
+static void scrollback_load(display_context_t *ctx, uint32_t slot, display_line_t *line) {
+    if (ctx->scrollback_heap) {
+        *line = ctx->scrollback_heap[slot];
+    } else {
+        psram_handle_read(ctx->scrollback_handle, slot * sizeof(display_line_t), line, sizeof(display_line_t));
+    }
+}
+
+// Lines available, including the ones still being staged
+static inline uint32_t scrollback_total(display_context_t *ctx) {
+    return ctx->scrollback_count + ctx->stage_count;
+}
+
+// Line i of the scrollback, 0 being the oldest
+static void scrollback_line(display_context_t *ctx, uint32_t i, display_line_t *line) {
+    if (i >= ctx->scrollback_count) {
+        *line = ctx->scrollback_stage[i - ctx->scrollback_count];
+        return;
+    }
+    uint32_t slot = (ctx->scrollback_next + ctx->scrollback_capacity - ctx->scrollback_count + i) %
+                    ctx->scrollback_capacity;
+    scrollback_load(ctx, slot, line);
+}
+
+// Write the staged lines to the ring in as few transfers as possible
+static void flush_stage(display_context_t *ctx) {
+    uint32_t done = 0;
+    while (done < ctx->stage_count) {
+        uint32_t count = ctx->stage_count - done;
+        if (count > ctx->scrollback_capacity - ctx->scrollback_next) {
+            count = ctx->scrollback_capacity - ctx->scrollback_next;
+        }
+        scrollback_store(ctx, ctx->scrollback_next, &ctx->scrollback_stage[done], count);
+        ctx->scrollback_next = (ctx->scrollback_next + count) % ctx->scrollback_capacity;
+        done += count;
+    }
     
-    int offset = line * DISPLAY_WIDTH_CHARS;
-    for (int x = 0; x < DISPLAY_WIDTH_CHARS; x++) {
-        ctx->text_buffer[offset + x].character = ' ';
-        ctx->text_buffer[offset + x].fg_color = ctx->config.default_fg;
-        ctx->text_buffer[offset + x].bg_color = ctx->config.default_bg;
-        ctx->text_buffer[offset + x].attributes = ATTR_NORMAL;
+    ctx->scrollback_count += ctx->stage_count;
+    if (ctx->scrollback_count > ctx->scrollback_capacity) {
+        ctx->scrollback_count = ctx->scrollback_capacity;
+    }
+    ctx->stage_count = 0;
+}
+
+// Keep a row that is leaving the top of the screen. Caller holds the lock.
+static void scrollback_push(display_context_t *ctx, const char_cell_t *row) {
+    if (ctx->scrollback_capacity == 0) {
+        return;
     }
     
-    ctx->dirty_lines[line] = true;
+    display_line_t *line = &ctx->scrollback_stage[ctx->stage_count++];
+    for (int x = 0; x < DISPLAY_WIDTH_CHARS; x++) {
+        const display_style_t *style = &ctx->styles[cell_style(row[x])];
+        line->chars[x] = cell_char(row[x]);
+        line->colors[x] = (style->fg << 4) | style->bg;
+        line->attributes[x] = style->attributes;
+    }
+    if (ctx->stage_count == DISPLAY_SCROLLBACK_STAGE) {
+        flush_stage(ctx);
+    }
     
-    pthread_mutex_unlock(&ctx->lock);
+    // An open view stays on the same lines
+    if (ctx->view_offset > 0 && ctx->view_offset < scrollback_total(ctx)) {
+        ctx->view_offset++;
+    }
 }
 
-void display_scroll_up(display_context_t *ctx, uint16_t lines) {
-    if (!ctx || lines == 0) {
+// Advance the ring by lines whole-screen rows. The dirty spans move up
+// with the content and the LCD is told to scroll at the next update.
+static void rotate_rows(display_context_t *ctx, uint16_t lines) {
+    ctx->top_row = (ctx->top_row + lines) % DISPLAY_HEIGHT_CHARS;
+    ctx->pending_scroll += lines;
+    if (ctx->pending_scroll > DISPLAY_HEIGHT_CHARS) {
+        ctx->pending_scroll = DISPLAY_HEIGHT_CHARS;
+    }
+    if (lines >= DISPLAY_HEIGHT_CHARS) {
+        ctx->drawn_cursor_y = DISPLAY_HEIGHT_CHARS;
         return;
     }
     
-    pthread_mutex_lock(&ctx->lock);
+    memmove(ctx->dirty_min, ctx->dirty_min + lines, DISPLAY_HEIGHT_CHARS - lines);
+    memmove(ctx->dirty_max, ctx->dirty_max + lines, DISPLAY_HEIGHT_CHARS - lines);
+    for (uint16_t y = DISPLAY_HEIGHT_CHARS - lines; y < DISPLAY_HEIGHT_CHARS; y++) {
+        mark_clean(ctx, y);
+    }
+    ctx->drawn_cursor_y = (ctx->drawn_cursor_y >= lines) ? ctx->drawn_cursor_y - lines : DISPLAY_HEIGHT_CHARS;
+}
+
+// The same the other way: rows come in at the top, holding what was at the
+// bottom, and the LCD is told to scroll down
+static void rotate_rows_down(display_context_t *ctx, uint16_t lines) {
+    if (lines >= DISPLAY_HEIGHT_CHARS) {
+        ctx->pending_scroll = -DISPLAY_HEIGHT_CHARS;
+        ctx->drawn_cursor_y = DISPLAY_HEIGHT_CHARS;
+        return;
+    }
+    ctx->top_row = (ctx->top_row + DISPLAY_HEIGHT_CHARS - lines) % DISPLAY_HEIGHT_CHARS;
+    ctx->pending_scroll -= lines;
+    if (ctx->pending_scroll < -DISPLAY_HEIGHT_CHARS) {
+        ctx->pending_scroll = -DISPLAY_HEIGHT_CHARS;
+    }
     
+    memmove(ctx->dirty_min + lines, ctx->dirty_min, DISPLAY_HEIGHT_CHARS - lines);
+    memmove(ctx->dirty_max + lines, ctx->dirty_max, DISPLAY_HEIGHT_CHARS - lines);
+    for (uint16_t y = 0; y < lines; y++) {
+        mark_clean(ctx, y);
+    }
+    ctx->drawn_cursor_y = (ctx->drawn_cursor_y + lines < DISPLAY_HEIGHT_CHARS) ? ctx->drawn_cursor_y + lines : DISPLAY_HEIGHT_CHARS;
+}
+
+static void scroll_up_locked(display_context_t *ctx, uint16_t lines) {
     uint16_t scroll_height = ctx->scroll_bottom - ctx->scroll_top + 1;
     if (lines > scroll_height) {
         lines = scroll_height;
     }
     
-    // Move lines up within scroll region
-    for (uint16_t y = ctx->scroll_top; y <= ctx->scroll_bottom - lines; y++) {
-        memcpy(&ctx->text_buffer[y * DISPLAY_WIDTH_CHARS],
-               &ctx->text_buffer[(y + lines) * DISPLAY_WIDTH_CHARS],
-               DISPLAY_WIDTH_CHARS * sizeof(char_cell_t));
-        ctx->dirty_lines[y] = true;
+    if (scroll_height == DISPLAY_HEIGHT_CHARS) {
+        // Whole screen: rotate the ring and let the LCD scroll its frame
+        // memory, so only the new bottom lines need painting
+        for (uint16_t y = 0; y < lines; y++) {
+            scrollback_push(ctx, row_cells(ctx, y));
+        }
+        rotate_rows(ctx, lines);
+    } else {
+        // Partial region: move the rows and redraw them
+        for (uint16_t y = ctx->scroll_top; y <= ctx->scroll_bottom - lines; y++) {
+            memcpy(row_cells(ctx, y), row_cells(ctx, y + lines),
+                   DISPLAY_WIDTH_CHARS * sizeof(char_cell_t));
+            mark_line_dirty(ctx, y);
+        }
     }
     
     // Clear bottom lines
     for (uint16_t y = ctx->scroll_bottom - lines + 1; y <= ctx->scroll_bottom; y++) {
-        int offset = y * DISPLAY_WIDTH_CHARS;
-        for (int x = 0; x < DISPLAY_WIDTH_CHARS; x++) {
-            ctx->text_buffer[offset + x].character = ' ';
-            ctx->text_buffer[offset + x].fg_color = ctx->config.default_fg;
-            ctx->text_buffer[offset + x].bg_color = ctx->config.default_bg;
-            ctx->text_buffer[offset + x].attributes = ATTR_NORMAL;
-        }
-        ctx->dirty_lines[y] = true;
+        clear_line_locked(ctx, y);
+    }
+}
+
+void display_scroll_up(display_context_t *ctx, uint16_t lines) {
+    if (!ctx || lines == 0) {
+        return;
     }
     
+    pthread_mutex_lock(&ctx->lock);
+    scroll_up_locked(ctx, lines);
     pthread_mutex_unlock(&ctx->lock);
 }
 
-void display_putchar(display_context_t *ctx, char c) {
-    if (!ctx) {
+// The LCD only scrolls up, so this always moves and redraws the rows
+static void scroll_down_locked(display_context_t *ctx, uint16_t lines) {
+    uint16_t scroll_height = ctx->scroll_bottom - ctx->scroll_top + 1;
+    if (lines > scroll_height) {
+        lines = scroll_height;
+    }
+    
+    for (uint16_t y = ctx->scroll_bottom; y >= ctx->scroll_top + lines; y--) {
+        memcpy(row_cells(ctx, y), row_cells(ctx, y - lines),
+               DISPLAY_WIDTH_CHARS * sizeof(char_cell_t));
+        mark_line_dirty(ctx, y);
+    }
+    
+    // Clear top lines
+    for (uint16_t y = ctx->scroll_top; y < ctx->scroll_top + lines; y++) {
+        clear_line_locked(ctx, y);
+    }
+}
+
+void display_scroll_down(display_context_t *ctx, uint16_t lines) {
+    if (!ctx || lines == 0) {
         return;
     }
     
     pthread_mutex_lock(&ctx->lock);
-    
-    // Handle ANSI escape sequences
-    if (ctx->config.ansi_enabled) {
-        if (ctx->in_escape) {
-            if (ctx->escape_index < 31) {
-                ctx->escape_buffer[ctx->escape_index++] = c;
-                ctx->escape_buffer[ctx->escape_index] = '\0';
-                
-                // Check if sequence is complete
-                if (isalpha(c) || c == 'm' || c == 'H' || c == 'J' || c == 'K') {
-                    display_process_ansi(ctx, ctx->escape_buffer);
-                    ctx->in_escape = false;
-                    ctx->escape_index = 0;
-                }
-            } else {
-                // Escape sequence too long, abort
-                ctx->in_escape = false;
-                ctx->escape_index = 0;
-            }
-            pthread_mutex_unlock(&ctx->lock);
-            return;
-        }
-        
-        if (c == '\033') {
-            ctx->in_escape = true;
-            ctx->escape_index = 0;
-            pthread_mutex_unlock(&ctx->lock);
-            return;
+    scroll_down_locked(ctx, lines);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+// Move the cursor down a line the way xterm does: on the bottom margin the
+// region scrolls, anywhere else the cursor moves down until the last screen
+// row and stays there. A cursor below the region never scrolls it.
+static void cursor_down(display_context_t *ctx) {
+    if (ctx->cursor_y == ctx->scroll_bottom) {
+        scroll_up_locked(ctx, 1);
+    } else if (ctx->cursor_y < DISPLAY_HEIGHT_CHARS - 1) {
+        ctx->cursor_y++;
+    }
+}
+
+// Wrap when the cursor has run off the right edge
+static void settle_cursor(display_context_t *ctx) {
+    if (ctx->cursor_x >= DISPLAY_WIDTH_CHARS) {
+        if (ctx->config.wrap_lines) {
+            ctx->cursor_x = 0;
+            cursor_down(ctx);
+        } else {
+            ctx->cursor_x = DISPLAY_WIDTH_CHARS - 1;
         }
     }
+}
+
+static void print_char(display_context_t *ctx, uint8_t c) {
+    uint8_t style = intern_style(ctx, ctx->current_fg, ctx->current_bg, ctx->current_attr);
+    row_cells(ctx, ctx->cursor_y)[ctx->cursor_x] = cell_make(c, style);
+    mark_dirty(ctx, ctx->cursor_y, ctx->cursor_x, ctx->cursor_x);
     
-    // Handle special characters
+    ctx->cursor_x++;
+    settle_cursor(ctx);
+}
+
+// C0 control characters
+static void execute_control(display_context_t *ctx, uint8_t c) {
     switch (c) {
         case '\n':
             ctx->cursor_x = 0;
-            ctx->cursor_y++;
+            cursor_down(ctx);
             break;
             
         case '\r':
@@ -253,7 +615,7 @@ void display_putchar(display_context_t *ctx, char c) {
             ctx->cursor_x = ((ctx->cursor_x / ctx->config.tab_width) + 1) * ctx->config.tab_width;
             if (ctx->cursor_x >= DISPLAY_WIDTH_CHARS) {
                 ctx->cursor_x = 0;
-                ctx->cursor_y++;
+                cursor_down(ctx);
             }
             break;
             
@@ -265,232 +627,1765 @@ void display_putchar(display_context_t *ctx, char c) {
             
         case '\f':
             // Form feed - clear screen
-            pthread_mutex_unlock(&ctx->lock);
-            display_clear(ctx);
+            clear_locked(ctx);
             return;
             
         default:
-            // Normal character
-            if (c >= 32) {  // Printable character
-                int offset = ctx->cursor_y * DISPLAY_WIDTH_CHARS + ctx->cursor_x;
-                ctx->text_buffer[offset].character = c;
-                ctx->text_buffer[offset].fg_color = ctx->current_fg;
-                ctx->text_buffer[offset].bg_color = ctx->current_bg;
-                ctx->text_buffer[offset].attributes = ctx->current_attr;
-                ctx->dirty_lines[ctx->cursor_y] = true;
-                
-                ctx->cursor_x++;
-            }
-            break;
-    }
-    
-    // Handle line wrap
-    if (ctx->cursor_x >= DISPLAY_WIDTH_CHARS) {
-        if (ctx->config.wrap_lines) {
-            ctx->cursor_x = 0;
-            ctx->cursor_y++;
-        } else {
-            ctx->cursor_x = DISPLAY_WIDTH_CHARS - 1;
-        }
+            return;
     }
     
-    // Handle scrolling
-    if (ctx->cursor_y > ctx->scroll_bottom) {
-        display_scroll_up(ctx, ctx->cursor_y - ctx->scroll_bottom);
-        ctx->cursor_y = ctx->scroll_bottom;
+    settle_cursor(ctx);
+}
+
+//
+// ANSI escape sequences: a DEC/ECMA-48 state machine. Each byte is classed,
+// then one table lookup gives the action to run and the next state.
+// Parameters are accumulated as the digits arrive, so a finished sequence
+// is dispatched without looking at its bytes again, and sequences of any
+// length stay in sync.
+//
+
+enum {
+    PARSE_GROUND,
+    PARSE_ESCAPE,
+    PARSE_ESCAPE_INTERMEDIATE,
+    PARSE_CSI_ENTRY,
+    PARSE_CSI_PARAM,
+    PARSE_CSI_INTERMEDIATE,
+    PARSE_CSI_IGNORE,
+    PARSE_OSC,
+    PARSE_STRING,           // DCS, SOS, PM and APC, which are skipped
+    PARSE_STRING_ESC,       // ESC inside OSC or a string, maybe the terminator
+    PARSE_STATE_COUNT
+};
+
+enum {
+    BYTE_CONTROL,           // C0 controls not listed below
+    BYTE_BEL,
+    BYTE_CANCEL,            // CAN, SUB
+    BYTE_ESC,
+    BYTE_INTERMEDIATE,      // 0x20-0x2F
+    BYTE_DIGIT,
+    BYTE_SEPARATOR,         // ; and :
+    BYTE_PRIVATE,           // < = > ?
+    BYTE_FINAL,             // 0x40-0x7E not listed below
+    BYTE_CSI,               // [
+    BYTE_OSC,               // ]
+    BYTE_STRING,            // P X ^ _
+    BYTE_ST,                // backslash
+    BYTE_DEL,
+    BYTE_HIGH,              // 0x80-0xFF, CP437 box and line glyphs
+    BYTE_CLASS_COUNT
+};
+
+enum {
+    DO_NONE,
+    DO_PRINT,
+    DO_EXECUTE,
+    DO_CLEAR,               // start of a new sequence
+    DO_COLLECT,             // intermediate or private marker
+    DO_PARAM,
+    DO_ESC_DISPATCH,
+    DO_CSI_DISPATCH,
+    DO_OSC_START,
+    DO_OSC_PUT,
+    DO_OSC_END
+};
+
+static const uint8_t byte_class[128] = {
+    [0x00 ... 0x06] = BYTE_CONTROL,
+    [0x07]          = BYTE_BEL,
+    [0x08 ... 0x17] = BYTE_CONTROL,
+    [0x18]          = BYTE_CANCEL,
+    [0x19]          = BYTE_CONTROL,
+    [0x1A]          = BYTE_CANCEL,
+    [0x1B]          = BYTE_ESC,
+    [0x1C ... 0x1F] = BYTE_CONTROL,
+    [0x20 ... 0x2F] = BYTE_INTERMEDIATE,
+    [0x30 ... 0x39] = BYTE_DIGIT,
+    [0x3A ... 0x3B] = BYTE_SEPARATOR,
+    [0x3C ... 0x3F] = BYTE_PRIVATE,
+    [0x40 ... 0x4F] = BYTE_FINAL,
+    ['P']           = BYTE_STRING,
+    [0x51 ... 0x57] = BYTE_FINAL,
+    ['X']           = BYTE_STRING,
+    [0x59 ... 0x5A] = BYTE_FINAL,
+    ['[']           = BYTE_CSI,
+    ['\\']         = BYTE_ST,
+    [']']           = BYTE_OSC,
+    ['^']           = BYTE_STRING,
+    ['_']           = BYTE_STRING,
+    [0x60 ... 0x7E] = BYTE_FINAL,
+    [0x7F]          = BYTE_DEL,
+};
+
+// Action in the high nibble, next state in the low nibble
+#define T(action, state)    (uint8_t)(((action) << 4) | (state))
+
+static const uint8_t parse_table[PARSE_STATE_COUNT][BYTE_CLASS_COUNT] = {
+    [PARSE_GROUND] = {
+        T(DO_EXECUTE, PARSE_GROUND), T(DO_EXECUTE, PARSE_GROUND), T(DO_NONE, PARSE_GROUND), T(DO_CLEAR, PARSE_ESCAPE),
+        T(DO_PRINT, PARSE_GROUND), T(DO_PRINT, PARSE_GROUND), T(DO_PRINT, PARSE_GROUND), T(DO_PRINT, PARSE_GROUND),
+        T(DO_PRINT, PARSE_GROUND), T(DO_PRINT, PARSE_GROUND), T(DO_PRINT, PARSE_GROUND), T(DO_PRINT, PARSE_GROUND),
+        T(DO_PRINT, PARSE_GROUND), T(DO_NONE, PARSE_GROUND), T(DO_PRINT, PARSE_GROUND),
+    },
+    [PARSE_ESCAPE] = {
+        T(DO_EXECUTE, PARSE_ESCAPE), T(DO_EXECUTE, PARSE_ESCAPE), T(DO_NONE, PARSE_GROUND), T(DO_CLEAR, PARSE_ESCAPE),
+        T(DO_COLLECT, PARSE_ESCAPE_INTERMEDIATE), T(DO_ESC_DISPATCH, PARSE_GROUND), T(DO_ESC_DISPATCH, PARSE_GROUND), T(DO_ESC_DISPATCH, PARSE_GROUND),
+        T(DO_ESC_DISPATCH, PARSE_GROUND), T(DO_CLEAR, PARSE_CSI_ENTRY), T(DO_OSC_START, PARSE_OSC), T(DO_NONE, PARSE_STRING),
+        T(DO_NONE, PARSE_GROUND), T(DO_NONE, PARSE_ESCAPE), T(DO_NONE, PARSE_GROUND),
+    },
+    [PARSE_ESCAPE_INTERMEDIATE] = {
+        T(DO_EXECUTE, PARSE_ESCAPE_INTERMEDIATE), T(DO_EXECUTE, PARSE_ESCAPE_INTERMEDIATE), T(DO_NONE, PARSE_GROUND), T(DO_CLEAR, PARSE_ESCAPE),
+        T(DO_COLLECT, PARSE_ESCAPE_INTERMEDIATE), T(DO_ESC_DISPATCH, PARSE_GROUND), T(DO_ESC_DISPATCH, PARSE_GROUND), T(DO_ESC_DISPATCH, PARSE_GROUND),
+        T(DO_ESC_DISPATCH, PARSE_GROUND), T(DO_ESC_DISPATCH, PARSE_GROUND), T(DO_ESC_DISPATCH, PARSE_GROUND), T(DO_ESC_DISPATCH, PARSE_GROUND),
+        T(DO_ESC_DISPATCH, PARSE_GROUND), T(DO_NONE, PARSE_ESCAPE_INTERMEDIATE), T(DO_NONE, PARSE_GROUND),
+    },
+    [PARSE_CSI_ENTRY] = {
+        T(DO_EXECUTE, PARSE_CSI_ENTRY), T(DO_EXECUTE, PARSE_CSI_ENTRY), T(DO_NONE, PARSE_GROUND), T(DO_CLEAR, PARSE_ESCAPE),
+        T(DO_COLLECT, PARSE_CSI_INTERMEDIATE), T(DO_PARAM, PARSE_CSI_PARAM), T(DO_PARAM, PARSE_CSI_PARAM), T(DO_COLLECT, PARSE_CSI_PARAM),
+        T(DO_CSI_DISPATCH, PARSE_GROUND), T(DO_CSI_DISPATCH, PARSE_GROUND), T(DO_CSI_DISPATCH, PARSE_GROUND), T(DO_CSI_DISPATCH, PARSE_GROUND),
+        T(DO_CSI_DISPATCH, PARSE_GROUND), T(DO_NONE, PARSE_CSI_ENTRY), T(DO_NONE, PARSE_GROUND),
+    },
+    [PARSE_CSI_PARAM] = {
+        T(DO_EXECUTE, PARSE_CSI_PARAM), T(DO_EXECUTE, PARSE_CSI_PARAM), T(DO_NONE, PARSE_GROUND), T(DO_CLEAR, PARSE_ESCAPE),
+        T(DO_COLLECT, PARSE_CSI_INTERMEDIATE), T(DO_PARAM, PARSE_CSI_PARAM), T(DO_PARAM, PARSE_CSI_PARAM), T(DO_NONE, PARSE_CSI_IGNORE),
+        T(DO_CSI_DISPATCH, PARSE_GROUND), T(DO_CSI_DISPATCH, PARSE_GROUND), T(DO_CSI_DISPATCH, PARSE_GROUND), T(DO_CSI_DISPATCH, PARSE_GROUND),
+        T(DO_CSI_DISPATCH, PARSE_GROUND), T(DO_NONE, PARSE_CSI_PARAM), T(DO_NONE, PARSE_GROUND),
+    },
+    [PARSE_CSI_INTERMEDIATE] = {
+        T(DO_EXECUTE, PARSE_CSI_INTERMEDIATE), T(DO_EXECUTE, PARSE_CSI_INTERMEDIATE), T(DO_NONE, PARSE_GROUND), T(DO_CLEAR, PARSE_ESCAPE),
+        T(DO_COLLECT, PARSE_CSI_INTERMEDIATE), T(DO_NONE, PARSE_CSI_IGNORE), T(DO_NONE, PARSE_CSI_IGNORE), T(DO_NONE, PARSE_CSI_IGNORE),
+        T(DO_CSI_DISPATCH, PARSE_GROUND), T(DO_CSI_DISPATCH, PARSE_GROUND), T(DO_CSI_DISPATCH, PARSE_GROUND), T(DO_CSI_DISPATCH, PARSE_GROUND),
+        T(DO_CSI_DISPATCH, PARSE_GROUND), T(DO_NONE, PARSE_CSI_INTERMEDIATE), T(DO_NONE, PARSE_GROUND),
+    },
+    [PARSE_CSI_IGNORE] = {
+        T(DO_EXECUTE, PARSE_CSI_IGNORE), T(DO_EXECUTE, PARSE_CSI_IGNORE), T(DO_NONE, PARSE_GROUND), T(DO_CLEAR, PARSE_ESCAPE),
+        T(DO_NONE, PARSE_CSI_IGNORE), T(DO_NONE, PARSE_CSI_IGNORE), T(DO_NONE, PARSE_CSI_IGNORE), T(DO_NONE, PARSE_CSI_IGNORE),
+        T(DO_NONE, PARSE_GROUND), T(DO_NONE, PARSE_GROUND), T(DO_NONE, PARSE_GROUND), T(DO_NONE, PARSE_GROUND),
+        T(DO_NONE, PARSE_GROUND), T(DO_NONE, PARSE_CSI_IGNORE), T(DO_NONE, PARSE_GROUND),
+    },
+    [PARSE_OSC] = {
+        T(DO_NONE, PARSE_OSC), T(DO_OSC_END, PARSE_GROUND), T(DO_NONE, PARSE_GROUND), T(DO_NONE, PARSE_STRING_ESC),
+        T(DO_OSC_PUT, PARSE_OSC), T(DO_OSC_PUT, PARSE_OSC), T(DO_OSC_PUT, PARSE_OSC), T(DO_OSC_PUT, PARSE_OSC),
+        T(DO_OSC_PUT, PARSE_OSC), T(DO_OSC_PUT, PARSE_OSC), T(DO_OSC_PUT, PARSE_OSC), T(DO_OSC_PUT, PARSE_OSC),
+        T(DO_OSC_PUT, PARSE_OSC), T(DO_NONE, PARSE_OSC), T(DO_OSC_PUT, PARSE_OSC),
+    },
+    [PARSE_STRING] = {
+        T(DO_NONE, PARSE_STRING), T(DO_NONE, PARSE_GROUND), T(DO_NONE, PARSE_GROUND), T(DO_NONE, PARSE_STRING_ESC),
+        T(DO_NONE, PARSE_STRING), T(DO_NONE, PARSE_STRING), T(DO_NONE, PARSE_STRING), T(DO_NONE, PARSE_STRING),
+        T(DO_NONE, PARSE_STRING), T(DO_NONE, PARSE_STRING), T(DO_NONE, PARSE_STRING), T(DO_NONE, PARSE_STRING),
+        T(DO_NONE, PARSE_STRING), T(DO_NONE, PARSE_STRING), T(DO_NONE, PARSE_STRING),
+    },
+    // Only backslash (ST) is looked up here, anything else starts a new escape
+    [PARSE_STRING_ESC] = {
+        [BYTE_ST] = T(DO_OSC_END, PARSE_GROUND),
+    },
+};
+
+#undef T
+
+// Parameter i, or def when it is missing or zero
+static inline uint16_t csi_param(display_context_t *ctx, int i, uint16_t def) {
+    return (i < ctx->param_count && ctx->params[i] > 0) ? ctx->params[i] : def;
+}
+
+static inline uint16_t clamp_row(int row) {
+    return row < 0 ? 0 : (row >= DISPLAY_HEIGHT_CHARS ? DISPLAY_HEIGHT_CHARS - 1 : row);
+}
+
+static inline uint16_t clamp_column(int column) {
+    return column < 0 ? 0 : (column >= DISPLAY_WIDTH_CHARS ? DISPLAY_WIDTH_CHARS - 1 : column);
+}
+
+static void clear_cells(display_context_t *ctx, uint16_t y, uint16_t x0, uint16_t x1) {
+    char_cell_t *row = row_cells(ctx, y);
+    for (uint16_t x = x0; x <= x1; x++) {
+        row[x] = blank_cell(ctx);
     }
-    
-    pthread_mutex_unlock(&ctx->lock);
+    mark_dirty(ctx, y, x0, x1);
 }
 
-void display_puts(display_context_t *ctx, const char *str) {
-    if (!ctx || !str) {
-        return;
+// Index of a 256-color value when it is one of the 16 palette colors
+static inline int indexed_color(uint16_t value) {
+    return value < DISPLAY_PALETTE_SIZE ? value : -1;
+}
+
+// SGR: ESC [ ... m
+static void select_graphics(display_context_t *ctx) {
+    if (ctx->param_count == 0) {
+        ctx->param_count = 1;
+        ctx->params[0] = 0;
     }
     
-    while (*str) {
-        display_putchar(ctx, *str++);
+    for (int i = 0; i < ctx->param_count; i++) {
+        uint16_t p = ctx->params[i];
+        switch (p) {
+            case 0: // Reset
+                ctx->current_attr = ATTR_NORMAL;
+                ctx->current_fg = ctx->config.default_fg;
+                ctx->current_bg = ctx->config.default_bg;
+                break;
+            case 1: ctx->current_attr |= ATTR_BOLD; break;
+            case 2: ctx->current_attr |= ATTR_DIM; break;
+            case 3: ctx->current_attr |= ATTR_ITALIC; break;
+            case 4: ctx->current_attr |= ATTR_UNDERLINE; break;
+            case 5: ctx->current_attr |= ATTR_BLINK; break;
+            case 7: ctx->current_attr |= ATTR_REVERSE; break;
+            case 8: ctx->current_attr |= ATTR_HIDDEN; break;
+            case 9: ctx->current_attr |= ATTR_STRIKE; break;
+            case 22: ctx->current_attr &= ~(ATTR_BOLD | ATTR_DIM); break;
+            case 23: ctx->current_attr &= ~ATTR_ITALIC; break;
+            case 24: ctx->current_attr &= ~ATTR_UNDERLINE; break;
+            case 25: ctx->current_attr &= ~ATTR_BLINK; break;
+            case 27: ctx->current_attr &= ~ATTR_REVERSE; break;
+            case 28: ctx->current_attr &= ~ATTR_HIDDEN; break;
+            case 29: ctx->current_attr &= ~ATTR_STRIKE; break;
+            case 30: case 31: case 32: case 33:
+            case 34: case 35: case 36: case 37:
+                ctx->current_fg = p - 30;
+                break;
+            case 39: ctx->current_fg = ctx->config.default_fg; break;
+            case 40: case 41: case 42: case 43:
+            case 44: case 45: case 46: case 47:
+                ctx->current_bg = p - 40;
+                break;
+            case 49: ctx->current_bg = ctx->config.default_bg; break;
+            case 90: case 91: case 92: case 93:
+            case 94: case 95: case 96: case 97:
+                ctx->current_fg = p - 90 + 8;
+                break;
+            case 100: case 101: case 102: case 103:
+            case 104: case 105: case 106: case 107:
+                ctx->current_bg = p - 100 + 8;
+                break;
+            case 38: case 48: {
+                // 5;n picks an indexed color, 2;r;g;b a direct one. Only the
+                // 16 palette colors can be shown, the rest are skipped.
+                int color = -1;
+                if (i + 2 < ctx->param_count && ctx->params[i + 1] == 5) {
+                    color = indexed_color(ctx->params[i + 2]);
+                    i += 2;
+                } else if (i + 4 < ctx->param_count && ctx->params[i + 1] == 2) {
+                    i += 4;
+                }
+                if (color >= 0) {
+                    if (p == 38) {
+                        ctx->current_fg = color;
+                    } else {
+                        ctx->current_bg = color;
+                    }
+                }
+                break;
+            }
+        }
     }
 }
 
-void display_printf(display_context_t *ctx, const char *format, ...) {
-    if (!ctx || !format) {
+// DEC private modes: ESC [ ? n h and ESC [ ? n l
+static void set_private_mode(display_context_t *ctx, bool on) {
+    for (int i = 0; i < ctx->param_count; i++) {
+        switch (ctx->params[i]) {
+            case 7: // Auto wrap
+                ctx->config.wrap_lines = on;
+                break;
+            case 25: // Cursor visible
+                if (!on) {
+                    mark_dirty(ctx, ctx->drawn_cursor_y, ctx->drawn_cursor_x, ctx->drawn_cursor_x);
+                }
+                ctx->cursor_visible = on;
+                break;
+        }
+    }
+}
+
+static void csi_dispatch(display_context_t *ctx, uint8_t final) {
+    if (ctx->csi_private) {
+        if (ctx->csi_private == '?' && (final == 'h' || final == 'l')) {
+            set_private_mode(ctx, final == 'h');
+        }
+        return;
+    }
+    if (ctx->csi_intermediate) {
+        // DECSCUSR: ESC [ n SP q sets the cursor shape
+        if (ctx->csi_intermediate == ' ' && final == 'q') {
+            static const cursor_style_t shapes[] = {
+                CURSOR_BLINK_BLOCK, CURSOR_BLINK_BLOCK, CURSOR_BLOCK, CURSOR_BLINK_UNDERLINE, CURSOR_UNDERLINE
+            };
+            uint16_t shape = ctx->param_count ? ctx->params[0] : 0;
+            if (shape < sizeof(shapes) / sizeof(shapes[0])) {
+                ctx->cursor_style = shapes[shape];
+            }
+        }
         return;
     }
     
-    char buffer[1024];
-    va_list args;
-    va_start(args, format);
-    vsnprintf(buffer, sizeof(buffer), format, args);
-    va_end(args);
-    
-    display_puts(ctx, buffer);
-}
-
-void display_process_ansi(display_context_t *ctx, const char *seq) {
-    if (!seq || seq[0] != '[') {
-        return;
-    }
-    
-    // Parse ANSI escape sequence
-    int params[16] = {0};
-    int param_count = 0;
-    const char *p = seq + 1;
-    
-    // Extract parameters
-    while (*p && param_count < 16) {
-        if (isdigit(*p)) {
-            params[param_count] = params[param_count] * 10 + (*p - '0');
-        } else if (*p == ';') {
-            param_count++;
-        } else {
-            break;
-        }
-        p++;
-    }
-    if (param_count < 16 && params[param_count] > 0) {
-        param_count++;
-    }
-    
-    // Process command
-    switch (*p) {
+    uint16_t n = csi_param(ctx, 0, 1);
+    switch (final) {
         case 'm': // Set graphics mode
-            for (int i = 0; i < param_count; i++) {
-                switch (params[i]) {
-                    case 0: // Reset
-                        ctx->current_attr = ATTR_NORMAL;
-                        ctx->current_fg = ctx->config.default_fg;
-                        ctx->current_bg = ctx->config.default_bg;
-                        break;
-                    case 1: ctx->current_attr |= ATTR_BOLD; break;
-                    case 2: ctx->current_attr |= ATTR_DIM; break;
-                    case 3: ctx->current_attr |= ATTR_ITALIC; break;
-                    case 4: ctx->current_attr |= ATTR_UNDERLINE; break;
-                    case 5: ctx->current_attr |= ATTR_BLINK; break;
-                    case 7: ctx->current_attr |= ATTR_REVERSE; break;
-                    case 8: ctx->current_attr |= ATTR_HIDDEN; break;
-                    case 9: ctx->current_attr |= ATTR_STRIKE; break;
-                    case 30: case 31: case 32: case 33:
-                    case 34: case 35: case 36: case 37:
-                        ctx->current_fg = params[i] - 30;
-                        break;
-                    case 39: ctx->current_fg = ctx->config.default_fg; break;
-                    case 40: case 41: case 42: case 43:
-                    case 44: case 45: case 46: case 47:
-                        ctx->current_bg = params[i] - 40;
-                        break;
-                    case 49: ctx->current_bg = ctx->config.default_bg; break;
-                    case 90: case 91: case 92: case 93:
-                    case 94: case 95: case 96: case 97:
-                        ctx->current_fg = params[i] - 90 + 8;
-                        break;
-                    case 100: case 101: case 102: case 103:
-                    case 104: case 105: case 106: case 107:
-                        ctx->current_bg = params[i] - 100 + 8;
-                        break;
-                }
-            }
+            select_graphics(ctx);
             break;
             
         case 'H': case 'f': // Set cursor position
-            if (param_count >= 2) {
-                ctx->cursor_y = (params[0] > 0) ? params[0] - 1 : 0;
-                ctx->cursor_x = (params[1] > 0) ? params[1] - 1 : 0;
-            } else {
-                ctx->cursor_x = 0;
-                ctx->cursor_y = 0;
-            }
+            ctx->cursor_y = clamp_row(csi_param(ctx, 0, 1) - 1);
+            ctx->cursor_x = clamp_column(csi_param(ctx, 1, 1) - 1);
             break;
             
         case 'A': // Cursor up
-            ctx->cursor_y -= (params[0] > 0) ? params[0] : 1;
-            if (ctx->cursor_y < 0) ctx->cursor_y = 0;
+            ctx->cursor_y = clamp_row(ctx->cursor_y - n);
             break;
             
         case 'B': // Cursor down
-            ctx->cursor_y += (params[0] > 0) ? params[0] : 1;
-            if (ctx->cursor_y >= DISPLAY_HEIGHT_CHARS) 
-                ctx->cursor_y = DISPLAY_HEIGHT_CHARS - 1;
+            ctx->cursor_y = clamp_row(ctx->cursor_y + n);
             break;
             
         case 'C': // Cursor right
-            ctx->cursor_x += (params[0] > 0) ? params[0] : 1;
-            if (ctx->cursor_x >= DISPLAY_WIDTH_CHARS) 
-                ctx->cursor_x = DISPLAY_WIDTH_CHARS - 1;
+            ctx->cursor_x = clamp_column(ctx->cursor_x + n);
             break;
             
         case 'D': // Cursor left
-            ctx->cursor_x -= (params[0] > 0) ? params[0] : 1;
-            if (ctx->cursor_x < 0) ctx->cursor_x = 0;
+            ctx->cursor_x = clamp_column(ctx->cursor_x - n);
+            break;
+            
+        case 'G': // Cursor to column
+            ctx->cursor_x = clamp_column(n - 1);
+            break;
+            
+        case 'd': // Cursor to row
+            ctx->cursor_y = clamp_row(n - 1);
             break;
             
         case 'J': // Clear screen
-            switch (params[0]) {
+            switch (csi_param(ctx, 0, 0)) {
                 case 0: // Clear from cursor to end
-                    for (int y = ctx->cursor_y; y < DISPLAY_HEIGHT_CHARS; y++) {
-                        int start = (y == ctx->cursor_y) ? ctx->cursor_x : 0;
-                        for (int x = start; x < DISPLAY_WIDTH_CHARS; x++) {
-                            int offset = y * DISPLAY_WIDTH_CHARS + x;
-                            ctx->text_buffer[offset].character = ' ';
-                            ctx->text_buffer[offset].fg_color = ctx->config.default_fg;
-                            ctx->text_buffer[offset].bg_color = ctx->config.default_bg;
-                            ctx->text_buffer[offset].attributes = ATTR_NORMAL;
-                        }
-                        ctx->dirty_lines[y] = true;
+                    clear_cells(ctx, ctx->cursor_y, ctx->cursor_x, DISPLAY_WIDTH_CHARS - 1);
+                    for (int y = ctx->cursor_y + 1; y < DISPLAY_HEIGHT_CHARS; y++) {
+                        clear_cells(ctx, y, 0, DISPLAY_WIDTH_CHARS - 1);
                     }
                     break;
                 case 1: // Clear from start to cursor
-                    for (int y = 0; y <= ctx->cursor_y; y++) {
-                        int end = (y == ctx->cursor_y) ? ctx->cursor_x : DISPLAY_WIDTH_CHARS;
-                        for (int x = 0; x < end; x++) {
-                            int offset = y * DISPLAY_WIDTH_CHARS + x;
-                            ctx->text_buffer[offset].character = ' ';
-                            ctx->text_buffer[offset].fg_color = ctx->config.default_fg;
-                            ctx->text_buffer[offset].bg_color = ctx->config.default_bg;
-                            ctx->text_buffer[offset].attributes = ATTR_NORMAL;
-                        }
-                        ctx->dirty_lines[y] = true;
+                    for (int y = 0; y < ctx->cursor_y; y++) {
+                        clear_cells(ctx, y, 0, DISPLAY_WIDTH_CHARS - 1);
                     }
+                    clear_cells(ctx, ctx->cursor_y, 0, ctx->cursor_x);
                     break;
                 case 2: // Clear entire screen
                     for (int i = 0; i < ctx->buffer_size; i++) {
-                        ctx->text_buffer[i].character = ' ';
-                        ctx->text_buffer[i].fg_color = ctx->config.default_fg;
-                        ctx->text_buffer[i].bg_color = ctx->config.default_bg;
-                        ctx->text_buffer[i].attributes = ATTR_NORMAL;
+                        ctx->text_buffer[i] = blank_cell(ctx);
                     }
                     ctx->full_redraw_needed = true;
                     break;
             }
-            break;
-            
-        case 'K': // Clear line
-            switch (params[0]) {
-                case 0: // Clear from cursor to end of line
-                    for (int x = ctx->cursor_x; x < DISPLAY_WIDTH_CHARS; x++) {
-                        int offset = ctx->cursor_y * DISPLAY_WIDTH_CHARS + x;
-                        ctx->text_buffer[offset].character = ' ';
-                        ctx->text_buffer[offset].fg_color = ctx->config.default_fg;
-                        ctx->text_buffer[offset].bg_color = ctx->config.default_bg;
-                        ctx->text_buffer[offset].attributes = ATTR_NORMAL;
-                    }
-                    break;
-                case 1: // Clear from start to cursor
-                    for (int x = 0; x <= ctx->cursor_x; x++) {
-                        int offset = ctx->cursor_y * DISPLAY_WIDTH_CHARS + x;
-                        ctx->text_buffer[offset].character = ' ';
-                        ctx->text_buffer[offset].fg_color = ctx->config.default_fg;
-                        ctx->text_buffer[offset].bg_color = ctx->config.default_bg;
-                        ctx->text_buffer[offset].attributes = ATTR_NORMAL;
-                    }
-                    break;
-                case 2: // Clear entire line
-                    display_clear_line(ctx, ctx->cursor_y);
-                    break;
+            break;
+            
+        case 'K': // Clear line
+            switch (csi_param(ctx, 0, 0)) {
+                case 0: // Clear from cursor to end of line
+                    clear_cells(ctx, ctx->cursor_y, ctx->cursor_x, DISPLAY_WIDTH_CHARS - 1);
+                    break;
+                case 1: // Clear from start to cursor
+                    clear_cells(ctx, ctx->cursor_y, 0, ctx->cursor_x);
+                    break;
+                case 2: // Clear entire line
+                    clear_line_locked(ctx, ctx->cursor_y);
+                    break;
+            }
+            break;
+            
+        case 'S': // Scroll up
+            scroll_up_locked(ctx, n);
+            break;
+            
+        case 'T': // Scroll down
+            scroll_down_locked(ctx, n);
+            break;
+            
+        case 'r': { // Set scroll region
+            uint16_t top = csi_param(ctx, 0, 1) - 1;
+            uint16_t bottom = csi_param(ctx, 1, DISPLAY_HEIGHT_CHARS) - 1;
+            if (top < bottom && bottom < DISPLAY_HEIGHT_CHARS) {
+                ctx->scroll_top = top;
+                ctx->scroll_bottom = bottom;
+                ctx->cursor_x = 0;
+                ctx->cursor_y = 0;
+            }
+            break;
+        }
+            
+        case 's': // Save cursor
+            ctx->saved.x = ctx->cursor_x;
+            ctx->saved.y = ctx->cursor_y;
+            break;
+            
+        case 'u': // Restore cursor
+            ctx->cursor_x = ctx->saved.x;
+            ctx->cursor_y = ctx->saved.y;
+            break;
+    }
+}
+
+static void esc_dispatch(display_context_t *ctx, uint8_t final) {
+    if (ctx->csi_intermediate) {
+        return;     // Character set selection and the like
+    }
+    
+    switch (final) {
+        case '7': // Save cursor and attributes
+            ctx->saved.x = ctx->cursor_x;
+            ctx->saved.y = ctx->cursor_y;
+            ctx->saved.fg = ctx->current_fg;
+            ctx->saved.bg = ctx->current_bg;
+            ctx->saved.attr = ctx->current_attr;
+            break;
+            
+        case '8': // Restore cursor and attributes
+            ctx->cursor_x = ctx->saved.x;
+            ctx->cursor_y = ctx->saved.y;
+            ctx->current_fg = ctx->saved.fg;
+            ctx->current_bg = ctx->saved.bg;
+            ctx->current_attr = ctx->saved.attr;
+            break;
+            
+        case 'D': // Index
+            cursor_down(ctx);
+            break;
+            
+        case 'E': // Next line
+            ctx->cursor_x = 0;
+            cursor_down(ctx);
+            break;
+            
+        case 'M': // Reverse index
+            if (ctx->cursor_y == ctx->scroll_top) {
+                scroll_down_locked(ctx, 1);
+            } else if (ctx->cursor_y > 0) {
+                ctx->cursor_y--;
+            }
+            break;
+            
+        case 'c': // Reset
+            ctx->current_fg = ctx->config.default_fg;
+            ctx->current_bg = ctx->config.default_bg;
+            ctx->current_attr = ATTR_NORMAL;
+            ctx->scroll_top = 0;
+            ctx->scroll_bottom = DISPLAY_HEIGHT_CHARS - 1;
+            clear_locked(ctx);
+            break;
+    }
+}
+
+// Parse an 0xRRGGBB color given as rgb:RR/GG/BB or #RRGGBB
+static bool parse_osc_color(const char *text, uint32_t *color) {
+    unsigned r, g, b;
+    if (sscanf(text, "rgb:%2x/%2x/%2x", &r, &g, &b) == 3 ||
+        sscanf(text, "#%2x%2x%2x", &r, &g, &b) == 3) {
+        *color = display_rgb_to_color(r, g, b);
+        return true;
+    }
+    return false;
+}
+
+// OSC 4 ; index ; color sets a palette entry and OSC 104 resets the palette.
+// Anything else, such as window titles, is ignored.
+static void osc_dispatch(display_context_t *ctx) {
+    ctx->osc_buffer[ctx->osc_length] = '\0';
+    char *text = ctx->osc_buffer;
+    char *rest;
+    unsigned long command = strtoul(text, &rest, 10);
+    if (rest == text || (*rest != ';' && *rest != '\0')) {
+        return;
+    }
+    
+    if (command == 104) {
+        memcpy(ctx->palette, ansi_palette, sizeof(ctx->palette));
+        rebuild_colors(ctx);
+        return;
+    }
+    
+    while (command == 4 && *rest == ';') {
+        unsigned long index = strtoul(rest + 1, &rest, 10);
+        uint32_t color;
+        if (*rest != ';' || !parse_osc_color(rest + 1, &color)) {
+            return;
+        }
+        if (index < DISPLAY_PALETTE_SIZE && ctx->palette[index] != color) {
+            ctx->palette[index] = color;
+            rebuild_colors(ctx);
+        }
+        rest = strchr(rest + 1, ';');
+        if (!rest) {
+            return;
+        }
+    }
+}
+
+static void parse_byte(display_context_t *ctx, uint8_t c) {
+    uint8_t class = c < 0x80 ? byte_class[c] : BYTE_HIGH;
+    
+    // ESC inside a string: backslash ends it, anything else ends it and
+    // starts a new escape sequence
+    if (ctx->parse_state == PARSE_STRING_ESC && class != BYTE_ST) {
+        if (ctx->string_is_osc) {
+            osc_dispatch(ctx);
+        }
+        ctx->csi_intermediate = 0;
+        ctx->parse_state = PARSE_ESCAPE;
+    }
+    
+    uint8_t entry = parse_table[ctx->parse_state][class];
+    ctx->parse_state = entry & 0x0F;
+    
+    switch (entry >> 4) {
+        case DO_PRINT:
+            print_char(ctx, c);
+            break;
+            
+        case DO_EXECUTE:
+            execute_control(ctx, c);
+            break;
+            
+        case DO_CLEAR:
+            ctx->csi_private = 0;
+            ctx->csi_intermediate = 0;
+            ctx->param_count = 0;
+            ctx->params[0] = 0;
+            break;
+            
+        case DO_COLLECT:
+            if (class == BYTE_PRIVATE) {
+                ctx->csi_private = c;
+            } else {
+                ctx->csi_intermediate = c;
+            }
+            break;
+            
+        case DO_PARAM:
+            if (ctx->param_count == 0) {
+                ctx->param_count = 1;
+            }
+            if (class == BYTE_DIGIT) {
+                uint16_t *p = &ctx->params[ctx->param_count - 1];
+                if (*p < 10000) {
+                    *p = *p * 10 + (c - '0');
+                }
+            } else if (ctx->param_count < DISPLAY_MAX_PARAMS) {
+                ctx->params[ctx->param_count++] = 0;
+            }
+            break;
+            
+        case DO_ESC_DISPATCH:
+            esc_dispatch(ctx, c);
+            break;
+            
+        case DO_CSI_DISPATCH:
+            csi_dispatch(ctx, c);
+            break;
+            
+        case DO_OSC_START:
+            ctx->osc_length = 0;
+            ctx->string_is_osc = true;
+            break;
+            
+        case DO_OSC_PUT:
+            // Long strings keep parsing, only the start is kept
+            if (ctx->osc_length < DISPLAY_OSC_MAX - 1) {
+                ctx->osc_buffer[ctx->osc_length++] = c;
+            }
+            break;
+            
+        case DO_OSC_END:
+            if (ctx->string_is_osc) {
+                osc_dispatch(ctx);
+            }
+            ctx->string_is_osc = false;
+            break;
+    }
+    
+    // Entering a skipped string
+    if (ctx->parse_state == PARSE_STRING && class == BYTE_STRING) {
+        ctx->string_is_osc = false;
+    }
+}
+
+static void putchar_locked(display_context_t *ctx, char c) {
+    uint8_t b = (uint8_t)c;
+    
+    if (ctx->config.ansi_enabled) {
+        parse_byte(ctx, b);
+    } else if (b >= 0x20 && b != 0x7F) {
+        print_char(ctx, b);
+    } else {
+        execute_control(ctx, b);
+    }
+}
+
+void display_putchar(display_context_t *ctx, char c) {
+    if (!ctx) {
+        return;
+    }
+    
+    pthread_mutex_lock(&ctx->lock);
+    putchar_locked(ctx, c);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+//
+// Bulk output. display_write() holds the lock for the whole buffer, copies
+// runs of printable characters straight into the grid, and when the whole
+// screen scrolls it lets the cursor run past the bottom row and rotates
+// the ring once at the end of the call.
+//
+
+// First control byte or DEL from p, checking a word at a time. High glyphs
+// print, so only a byte below 0x20 (which borrows into a clear bit 7) or
+// one equal to 0x7F (zero after the XOR) stops the run. Either test can
+// flag a byte after a real hit, which only hands the word to the byte loop.
+static const uint8_t *scan_printable(const uint8_t *p, const uint8_t *end) {
+    while (end - p >= 4) {
+        uint32_t word;
+        memcpy(&word, p, sizeof(word));
+        uint32_t del = word ^ 0x7F7F7F7Fu;
+        if ((((word - 0x20202020u) & ~word) | ((del - 0x01010101u) & ~del)) & 0x80808080u) {
+            break;
+        }
+        p += 4;
+    }
+    while (p < end && *p >= 0x20 && *p != 0x7F) {
+        p++;
+    }
+    return p;
+}
+
+// Commit the rows the cursor has run past the bottom of the screen
+static void flush_deferred_scroll(display_context_t *ctx) {
+    uint16_t lines = ctx->deferred_scroll;
+    if (lines == 0) {
+        return;
+    }
+    
+    ctx->deferred_scroll = 0;
+    ctx->cursor_y -= lines;
+    rotate_rows(ctx, lines);
+    
+    // The new rows were blanked and written below the old bottom
+    for (uint16_t y = (lines < DISPLAY_HEIGHT_CHARS) ? DISPLAY_HEIGHT_CHARS - lines : 0; y < DISPLAY_HEIGHT_CHARS; y++) {
+        mark_line_dirty(ctx, y);
+    }
+}
+
+// Same rule as cursor_down(), except that a whole-screen scroll from the
+// bottom row is deferred
+static void line_feed(display_context_t *ctx) {
+    // Past a screenful nothing deferred is still visible, so settle up
+    if (ctx->deferred_scroll >= DISPLAY_HEIGHT_CHARS) {
+        flush_deferred_scroll(ctx);
+    }
+    
+    ctx->cursor_x = 0;
+    if (!scroll_region_is_screen(ctx) || ctx->cursor_y != ctx->scroll_bottom + ctx->deferred_scroll) {
+        cursor_down(ctx);
+        return;
+    }
+    
+    // Reuse the ring row that is about to scroll off
+    ctx->cursor_y++;
+    ctx->deferred_scroll++;
+    char_cell_t *row = row_cells(ctx, ctx->cursor_y);
+    scrollback_push(ctx, row);
+    for (int x = 0; x < DISPLAY_WIDTH_CHARS; x++) {
+        row[x] = blank_cell(ctx);
+    }
+}
+
+static void write_run(display_context_t *ctx, const uint8_t *text, size_t len) {
+    uint8_t style = intern_style(ctx, ctx->current_fg, ctx->current_bg, ctx->current_attr);
+    
+    while (len > 0) {
+        char_cell_t *row = row_cells(ctx, ctx->cursor_y);
+        size_t count = DISPLAY_WIDTH_CHARS - ctx->cursor_x;
+        if (count > len) {
+            count = len;
+        }
+        for (size_t i = 0; i < count; i++) {
+            row[ctx->cursor_x + i] = cell_make(text[i], style);
+        }
+        mark_dirty(ctx, ctx->cursor_y, ctx->cursor_x, ctx->cursor_x + count - 1);
+        ctx->cursor_x += count;
+        text += count;
+        len -= count;
+        
+        if (ctx->cursor_x >= DISPLAY_WIDTH_CHARS) {
+            if (ctx->config.wrap_lines) {
+                line_feed(ctx);
+            } else {
+                // Without wrapping the last column keeps the last character
+                ctx->cursor_x = DISPLAY_WIDTH_CHARS - 1;
+                if (len > 0) {
+                    row[ctx->cursor_x] = cell_make(text[len - 1], style);
+                    len = 0;
+                }
+            }
+        }
+    }
+}
+
+void display_write(display_context_t *ctx, const char *data, size_t len) {
+    if (!ctx || !data) {
+        return;
+    }
+    
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + len;
+    
+    pthread_mutex_lock(&ctx->lock);
+    
+    while (p < end) {
+        if (ctx->parse_state == PARSE_GROUND || !ctx->config.ansi_enabled) {
+            const uint8_t *run_end = scan_printable(p, end);
+            if (run_end > p) {
+                write_run(ctx, p, run_end - p);
+                p = run_end;
+                continue;
+            }
+            if (*p == '\n') {
+                line_feed(ctx);
+                p++;
+                continue;
+            }
+            if (*p == '\r') {
+                ctx->cursor_x = 0;
+                p++;
+                continue;
+            }
+        }
+        
+        // Escapes and other controls see the screen as it really is
+        flush_deferred_scroll(ctx);
+        putchar_locked(ctx, (char)*p++);
+    }
+    flush_deferred_scroll(ctx);
+    
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void display_puts(display_context_t *ctx, const char *str) {
+    if (!ctx || !str) {
+        return;
+    }
+    
+    display_write(ctx, str, strlen(str));
+}
+
+void display_printf(display_context_t *ctx, const char *format, ...) {
+    if (!ctx || !format) {
+        return;
+    }
+    
+    char buffer[1024];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    
+    display_puts(ctx, buffer);
+}
+
+// Run one escape sequence, given without its leading ESC
+void display_process_ansi(display_context_t *ctx, const char *seq) {
+    if (!ctx || !seq) {
+        return;
+    }
+    
+    pthread_mutex_lock(&ctx->lock);
+    parse_byte(ctx, 0x1B);
+    while (*seq) {
+        parse_byte(ctx, (uint8_t)*seq++);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+//
+// Windows
+//
+
+// Mark a rectangle of the screen for repainting, clipped to the screen
+static void damage_rect(display_context_t *ctx, uint16_t x, uint16_t y, uint16_t width, uint16_t height) {
+    if (width == 0 || x >= DISPLAY_WIDTH_CHARS) {
+        return;
+    }
+    for (uint16_t row = y; row < y + height && row < DISPLAY_HEIGHT_CHARS; row++) {
+        mark_dirty(ctx, row, x, x + width - 1);
+    }
+}
+
+static inline void window_mark_dirty(display_window_t *win, uint16_t y, uint16_t x0, uint16_t x1) {
+    if (x0 < win->dirty_min[y]) {
+        win->dirty_min[y] = x0;
+    }
+    if (x1 > win->dirty_max[y]) {
+        win->dirty_max[y] = x1;
+    }
+}
+
+// Move the windows' dirty spans onto the screen. Caller holds the lock.
+static void collect_window_damage(display_context_t *ctx) {
+    for (int w = 0; w < ctx->window_count; w++) {
+        display_window_t *win = ctx->windows[w];
+        for (uint16_t y = 0; y < win->height; y++) {
+            if (win->dirty_min[y] <= win->dirty_max[y]) {
+                if (win->visible) {
+                    mark_dirty(ctx, win->y + y, win->x + win->dirty_min[y], win->x + win->dirty_max[y]);
+                }
+                win->dirty_min[y] = DISPLAY_SPAN_CLEAN_MIN;
+                win->dirty_max[y] = DISPLAY_SPAN_CLEAN_MAX;
+            }
+        }
+    }
+}
+
+// Row y as it appears on screen, with any windows over it
+static const char_cell_t *screen_row(display_context_t *ctx, uint16_t y) {
+    const char_cell_t *row = row_cells(ctx, y);
+    bool copied = false;
+    
+    for (int w = 0; w < ctx->window_count; w++) {
+        const display_window_t *win = ctx->windows[w];
+        if (!win->visible || y < win->y || y >= win->y + win->height || win->x >= DISPLAY_WIDTH_CHARS) {
+            continue;
+        }
+        if (!copied) {
+            memcpy(ctx->compose_row, row, sizeof(ctx->compose_row));
+            copied = true;
+        }
+        uint16_t width = win->width;
+        if (win->x + width > DISPLAY_WIDTH_CHARS) {
+            width = DISPLAY_WIDTH_CHARS - win->x;
+        }
+        memcpy(&ctx->compose_row[win->x], &win->cells[(y - win->y) * win->width], width * sizeof(char_cell_t));
+    }
+    
+    return copied ? ctx->compose_row : row;
+}
+
+// Keep the window list in z order, stable for equal z. Caller holds the lock.
+static void sort_windows(display_context_t *ctx) {
+    for (int i = 1; i < ctx->window_count; i++) {
+        display_window_t *win = ctx->windows[i];
+        int j = i;
+        while (j > 0 && ctx->windows[j - 1]->z > win->z) {
+            ctx->windows[j] = ctx->windows[j - 1];
+            j--;
+        }
+        ctx->windows[j] = win;
+    }
+}
+
+// Repaint where the window is on the LCD. Scrolls the LCD has not done yet
+// will move those pixels, and the dirty spans move with them, so mark the
+// rows they start from; the window's own rows are repainted after the
+// scroll anyway.
+static void damage_window(display_window_t *win) {
+    display_context_t *ctx = win->display;
+    int top = (int)win->y - ctx->pending_scroll;
+    int bottom = top + win->height;
+    if (!win->visible || bottom <= 0 || top >= DISPLAY_HEIGHT_CHARS) {
+        return;
+    }
+    
+    if (top < 0) {
+        top = 0;
+    }
+    damage_rect(ctx, win->x, top, win->width, bottom - top);
+}
+
+display_window_t *display_window_create(display_context_t *ctx, uint16_t x, uint16_t y,
+                                        uint16_t width, uint16_t height, int z) {
+    if (!ctx || width == 0 || height == 0 || width > DISPLAY_WIDTH_CHARS || height > DISPLAY_HEIGHT_CHARS) {
+        return NULL;
+    }
+    
+    display_window_t *win = calloc(1, sizeof(display_window_t));
+    if (!win) {
+        return NULL;
+    }
+    win->cells = malloc(width * height * sizeof(char_cell_t));
+    win->dirty_min = malloc(height);
+    win->dirty_max = malloc(height);
+    if (!win->cells || !win->dirty_min || !win->dirty_max) {
+        free(win->cells);
+        free(win->dirty_min);
+        free(win->dirty_max);
+        free(win);
+        return NULL;
+    }
+    
+    win->display = ctx;
+    win->x = x;
+    win->y = y;
+    win->width = width;
+    win->height = height;
+    win->z = z;
+    win->visible = true;
+    win->scroll_top = 0;
+    win->scroll_bottom = height - 1;
+    
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->window_count >= DISPLAY_MAX_WINDOWS) {
+        pthread_mutex_unlock(&ctx->lock);
+        free(win->cells);
+        free(win->dirty_min);
+        free(win->dirty_max);
+        free(win);
+        return NULL;
+    }
+    win->fg = ctx->config.default_fg;
+    win->bg = ctx->config.default_bg;
+    win->attr = ATTR_NORMAL;
+    for (int i = 0; i < width * height; i++) {
+        win->cells[i] = blank_cell(ctx);
+    }
+    for (uint16_t row = 0; row < height; row++) {
+        win->dirty_min[row] = DISPLAY_SPAN_CLEAN_MIN;
+        win->dirty_max[row] = DISPLAY_SPAN_CLEAN_MAX;
+    }
+    ctx->windows[ctx->window_count++] = win;
+    sort_windows(ctx);
+    damage_window(win);
+    pthread_mutex_unlock(&ctx->lock);
+    
+    return win;
+}
+
+void display_window_destroy(display_window_t *win) {
+    if (!win) {
+        return;
+    }
+    
+    display_context_t *ctx = win->display;
+    pthread_mutex_lock(&ctx->lock);
+    damage_window(win);
+    for (int i = 0; i < ctx->window_count; i++) {
+        if (ctx->windows[i] == win) {
+            memmove(&ctx->windows[i], &ctx->windows[i + 1], (ctx->window_count - i - 1) * sizeof(win));
+            ctx->window_count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    
+    free(win->cells);
+    free(win->dirty_min);
+    free(win->dirty_max);
+    free(win);
+}
+
+void display_window_move(display_window_t *win, uint16_t x, uint16_t y) {
+    if (!win) {
+        return;
+    }
+    
+    pthread_mutex_lock(&win->display->lock);
+    damage_window(win);
+    win->x = x;
+    win->y = y;
+    damage_window(win);
+    pthread_mutex_unlock(&win->display->lock);
+}
+
+void display_window_set_z(display_window_t *win, int z) {
+    if (!win) {
+        return;
+    }
+    
+    pthread_mutex_lock(&win->display->lock);
+    win->z = z;
+    sort_windows(win->display);
+    damage_window(win);
+    pthread_mutex_unlock(&win->display->lock);
+}
+
+void display_window_show(display_window_t *win, bool visible) {
+    if (!win) {
+        return;
+    }
+    
+    pthread_mutex_lock(&win->display->lock);
+    if (win->visible != visible) {
+        win->visible = true;
+        damage_window(win);
+        win->visible = visible;
+    }
+    pthread_mutex_unlock(&win->display->lock);
+}
+
+void display_window_set_colors(display_window_t *win, uint8_t fg, uint8_t bg, uint8_t attr) {
+    if (!win) {
+        return;
+    }
+    
+    pthread_mutex_lock(&win->display->lock);
+    win->fg = fg & 0x0F;
+    win->bg = bg & 0x0F;
+    win->attr = attr;
+    pthread_mutex_unlock(&win->display->lock);
+}
+
+void display_window_set_cursor(display_window_t *win, uint16_t x, uint16_t y) {
+    if (!win) {
+        return;
+    }
+    
+    pthread_mutex_lock(&win->display->lock);
+    win->cursor_x = x < win->width ? x : win->width - 1;
+    win->cursor_y = y < win->height ? y : win->height - 1;
+    pthread_mutex_unlock(&win->display->lock);
+}
+
+void display_window_set_scroll_region(display_window_t *win, uint16_t top, uint16_t bottom) {
+    if (!win || top > bottom || bottom >= win->height) {
+        return;
+    }
+    
+    pthread_mutex_lock(&win->display->lock);
+    win->scroll_top = top;
+    win->scroll_bottom = bottom;
+    pthread_mutex_unlock(&win->display->lock);
+}
+
+// A blank cell in the window's colors. Caller holds the lock.
+static inline char_cell_t window_blank(display_window_t *win) {
+    return cell_make(' ', intern_style(win->display, win->fg, win->bg, ATTR_NORMAL));
+}
+
+static void window_clear_rows(display_window_t *win, uint16_t first, uint16_t last) {
+    char_cell_t blank = window_blank(win);
+    for (uint16_t y = first; y <= last; y++) {
+        for (uint16_t x = 0; x < win->width; x++) {
+            win->cells[y * win->width + x] = blank;
+        }
+        window_mark_dirty(win, y, 0, win->width - 1);
+    }
+}
+
+void display_window_clear(display_window_t *win) {
+    if (!win) {
+        return;
+    }
+    
+    pthread_mutex_lock(&win->display->lock);
+    window_clear_rows(win, 0, win->height - 1);
+    win->cursor_x = 0;
+    win->cursor_y = 0;
+    pthread_mutex_unlock(&win->display->lock);
+}
+
+static void window_scroll_locked(display_window_t *win, uint16_t lines) {
+    uint16_t scroll_height = win->scroll_bottom - win->scroll_top + 1;
+    if (lines > scroll_height) {
+        lines = scroll_height;
+    }
+    
+    for (uint16_t y = win->scroll_top; y + lines <= win->scroll_bottom; y++) {
+        memcpy(&win->cells[y * win->width], &win->cells[(y + lines) * win->width],
+               win->width * sizeof(char_cell_t));
+        window_mark_dirty(win, y, 0, win->width - 1);
+    }
+    window_clear_rows(win, win->scroll_bottom - lines + 1, win->scroll_bottom);
+}
+
+void display_window_scroll_up(display_window_t *win, uint16_t lines) {
+    if (!win || lines == 0) {
+        return;
+    }
+    
+    pthread_mutex_lock(&win->display->lock);
+    window_scroll_locked(win, lines);
+    pthread_mutex_unlock(&win->display->lock);
+}
+
+void display_window_set_cell(display_window_t *win, uint16_t x, uint16_t y, char c) {
+    if (!win || x >= win->width || y >= win->height) {
+        return;
+    }
+    
+    pthread_mutex_lock(&win->display->lock);
+    uint8_t style = intern_style(win->display, win->fg, win->bg, win->attr);
+    win->cells[y * win->width + x] = cell_make((uint8_t)c, style);
+    window_mark_dirty(win, y, x, x);
+    pthread_mutex_unlock(&win->display->lock);
+}
+
+// Text with \r, \n and \b, wrapping at the window edge and scrolling the
+// window's scroll region
+void display_window_write(display_window_t *win, const char *text, size_t len) {
+    if (!win || !text) {
+        return;
+    }
+    
+    pthread_mutex_lock(&win->display->lock);
+    uint8_t style = intern_style(win->display, win->fg, win->bg, win->attr);
+    
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = (uint8_t)text[i];
+        switch (c) {
+            case '\r':
+                win->cursor_x = 0;
+                continue;
+            case '\n':
+                win->cursor_x = 0;
+                win->cursor_y++;
+                break;
+            case '\b':
+                if (win->cursor_x > 0) {
+                    win->cursor_x--;
+                }
+                continue;
+            default:
+                if (c < 0x20) {
+                    continue;
+                }
+                win->cells[win->cursor_y * win->width + win->cursor_x] = cell_make(c, style);
+                window_mark_dirty(win, win->cursor_y, win->cursor_x, win->cursor_x);
+                if (++win->cursor_x >= win->width) {
+                    win->cursor_x = 0;
+                    win->cursor_y++;
+                }
+                break;
+        }
+        
+        if (win->cursor_y == win->scroll_bottom + 1) {
+            window_scroll_locked(win, 1);
+            win->cursor_y = win->scroll_bottom;
+        } else if (win->cursor_y >= win->height) {
+            win->cursor_y = win->height - 1;
+        }
+    }
+    
+    pthread_mutex_unlock(&win->display->lock);
+}
+
+void display_window_puts(display_window_t *win, const char *str) {
+    if (!str) {
+        return;
+    }
+    
+    display_window_write(win, str, strlen(str));
+}
+
+//
+// Virtual screen
+//
+
+display_screen_t *display_screen_create(display_context_t *ctx) {
+    if (!ctx) {
+        return NULL;
+    }
+    
+    display_screen_t *scr = calloc(1, sizeof(display_screen_t));
+    if (!scr) {
+        return NULL;
+    }
+    
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->screen) {
+        pthread_mutex_unlock(&ctx->lock);
+        free(scr);
+        return NULL;
+    }
+    scr->display = ctx;
+    scr->style = ctx->blank_style;
+    scr->cursor_visible = ctx->cursor_visible;
+    char_cell_t blank = blank_cell(ctx);
+    for (int i = 0; i < DISPLAY_WIDTH_CHARS * DISPLAY_HEIGHT_CHARS; i++) {
+        scr->cells[i] = blank;
+    }
+    ctx->screen = scr;
+    pthread_mutex_unlock(&ctx->lock);
+    
+    return scr;
+}
+
+void display_screen_destroy(display_screen_t *scr) {
+    if (!scr) {
+        return;
+    }
+    
+    pthread_mutex_lock(&scr->display->lock);
+    scr->display->screen = NULL;
+    pthread_mutex_unlock(&scr->display->lock);
+    free(scr);
+}
+
+void display_screen_set_colors(display_screen_t *scr, uint8_t fg, uint8_t bg, uint8_t attr) {
+    if (!scr) {
+        return;
+    }
+    
+    pthread_mutex_lock(&scr->display->lock);
+    scr->style = intern_style(scr->display, fg, bg, attr);
+    pthread_mutex_unlock(&scr->display->lock);
+}
+
+// Blank every cell in the current colors
+void display_screen_clear(display_screen_t *scr) {
+    if (!scr) {
+        return;
+    }
+    
+    pthread_mutex_lock(&scr->display->lock);
+    char_cell_t blank = cell_make(' ', scr->style);
+    for (int i = 0; i < DISPLAY_WIDTH_CHARS * DISPLAY_HEIGHT_CHARS; i++) {
+        scr->cells[i] = blank;
+    }
+    scr->cursor_x = 0;
+    scr->cursor_y = 0;
+    pthread_mutex_unlock(&scr->display->lock);
+}
+
+void display_screen_set_cell(display_screen_t *scr, uint16_t x, uint16_t y, char c) {
+    if (!scr || x >= DISPLAY_WIDTH_CHARS || y >= DISPLAY_HEIGHT_CHARS) {
+        return;
+    }
+    
+    pthread_mutex_lock(&scr->display->lock);
+    scr->cells[y * DISPLAY_WIDTH_CHARS + x] = cell_make((uint8_t)c, scr->style);
+    pthread_mutex_unlock(&scr->display->lock);
+}
+
+// Text from (x, y), cut off at the end of the row
+void display_screen_puts(display_screen_t *scr, uint16_t x, uint16_t y, const char *str) {
+    if (!scr || !str || y >= DISPLAY_HEIGHT_CHARS) {
+        return;
+    }
+    
+    pthread_mutex_lock(&scr->display->lock);
+    char_cell_t *row = &scr->cells[y * DISPLAY_WIDTH_CHARS];
+    for (; *str && x < DISPLAY_WIDTH_CHARS; str++, x++) {
+        row[x] = cell_make((uint8_t)*str, scr->style);
+    }
+    pthread_mutex_unlock(&scr->display->lock);
+}
+
+void display_screen_set_cursor(display_screen_t *scr, uint16_t x, uint16_t y) {
+    if (!scr) {
+        return;
+    }
+    
+    pthread_mutex_lock(&scr->display->lock);
+    if (x < DISPLAY_WIDTH_CHARS) {
+        scr->cursor_x = x;
+    }
+    if (y < DISPLAY_HEIGHT_CHARS) {
+        scr->cursor_y = y;
+    }
+    pthread_mutex_unlock(&scr->display->lock);
+}
+
+void display_screen_show_cursor(display_screen_t *scr, bool visible) {
+    if (!scr) {
+        return;
+    }
+    
+    pthread_mutex_lock(&scr->display->lock);
+    scr->cursor_visible = visible;
+    pthread_mutex_unlock(&scr->display->lock);
+}
+
+// FNV-1a over a row of cells, to find rows that moved without comparing
+// every pair of rows cell by cell
+static uint32_t hash_row(const char_cell_t *row) {
+    uint32_t hash = 2166136261u;
+    for (int x = 0; x < DISPLAY_WIDTH_CHARS; x++) {
+        hash = (hash ^ (row[x] & 0xFF)) * 16777619u;
+        hash = (hash ^ (row[x] >> 8)) * 16777619u;
+    }
+    return hash;
+}
+
+static inline bool rows_equal(const char_cell_t *a, uint32_t hash_a, const char_cell_t *b, uint32_t hash_b) {
+    return hash_a == hash_b && memcmp(a, b, DISPLAY_WIDTH_CHARS * sizeof(char_cell_t)) == 0;
+}
+
+// The shift, in rows, that leaves the most grid rows where the virtual
+// screen wants them: positive when lines were deleted near the top and the
+// content moves up, negative when lines were inserted and it moves down.
+static int16_t best_scroll(display_context_t *ctx, const display_screen_t *scr,
+                           const uint32_t *old_hash, const uint32_t *new_hash) {
+    int16_t best = 0;
+    int best_rows = 0;
+    
+    for (uint16_t y = 0; y < DISPLAY_HEIGHT_CHARS; y++) {
+        if (rows_equal(row_cells(ctx, y), old_hash[y], &scr->cells[y * DISPLAY_WIDTH_CHARS], new_hash[y])) {
+            best_rows++;
+        }
+    }
+    
+    for (uint16_t shift = 1; shift < DISPLAY_HEIGHT_CHARS; shift++) {
+        // Not enough rows left to beat the best so far
+        if (DISPLAY_HEIGHT_CHARS - shift <= best_rows) {
+            break;
+        }
+        int up = 0;
+        int down = 0;
+        for (uint16_t y = 0; y + shift < DISPLAY_HEIGHT_CHARS; y++) {
+            if (rows_equal(row_cells(ctx, y + shift), old_hash[y + shift],
+                           &scr->cells[y * DISPLAY_WIDTH_CHARS], new_hash[y])) {
+                up++;
+            }
+            if (rows_equal(row_cells(ctx, y), old_hash[y],
+                           &scr->cells[(y + shift) * DISPLAY_WIDTH_CHARS], new_hash[y + shift])) {
+                down++;
+            }
+        }
+        if (up > best_rows) {
+            best_rows = up;
+            best = shift;
+        }
+        if (down > best_rows) {
+            best_rows = down;
+            best = -shift;
+        }
+    }
+    
+    return best;
+}
+
+// Make the grid match the virtual screen: scroll if that saves repainting,
+// then copy only the cells that differ. Nothing is drawn until the next
+// display_update(), which sees the whole change at once.
+void display_screen_doupdate(display_screen_t *scr) {
+    if (!scr) {
+        return;
+    }
+    
+    display_context_t *ctx = scr->display;
+    uint32_t old_hash[DISPLAY_HEIGHT_CHARS];
+    uint32_t new_hash[DISPLAY_HEIGHT_CHARS];
+    
+    pthread_mutex_lock(&ctx->lock);
+    
+    for (uint16_t y = 0; y < DISPLAY_HEIGHT_CHARS; y++) {
+        old_hash[y] = hash_row(row_cells(ctx, y));
+        new_hash[y] = hash_row(&scr->cells[y * DISPLAY_WIDTH_CHARS]);
+    }
+    
+    // The rows that come in at the bottom (or the top, scrolling down) hold
+    // whatever scrolled off the other edge, so they are repainted whole
+    scr->scrolled_lines = best_scroll(ctx, scr, old_hash, new_hash);
+    if (scr->scrolled_lines > 0) {
+        rotate_rows(ctx, scr->scrolled_lines);
+        for (uint16_t y = DISPLAY_HEIGHT_CHARS - scr->scrolled_lines; y < DISPLAY_HEIGHT_CHARS; y++) {
+            mark_line_dirty(ctx, y);
+        }
+    } else if (scr->scrolled_lines < 0) {
+        rotate_rows_down(ctx, -scr->scrolled_lines);
+        for (uint16_t y = 0; y < -scr->scrolled_lines; y++) {
+            mark_line_dirty(ctx, y);
+        }
+    }
+    
+    scr->changed_cells = 0;
+    for (uint16_t y = 0; y < DISPLAY_HEIGHT_CHARS; y++) {
+        char_cell_t *row = row_cells(ctx, y);
+        const char_cell_t *want = &scr->cells[y * DISPLAY_WIDTH_CHARS];
+        int first = -1;
+        int last = -1;
+        for (int x = 0; x < DISPLAY_WIDTH_CHARS; x++) {
+            if (row[x] != want[x]) {
+                row[x] = want[x];
+                if (first < 0) {
+                    first = x;
+                }
+                last = x;
+                scr->changed_cells++;
+            }
+        }
+        if (first >= 0) {
+            mark_dirty(ctx, y, first, last);
+        }
+    }
+    
+    ctx->cursor_x = scr->cursor_x;
+    ctx->cursor_y = scr->cursor_y;
+    ctx->cursor_visible = scr->cursor_visible;
+    
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void display_screen_refresh(display_screen_t *scr) {
+    if (!scr) {
+        return;
+    }
+    
+    display_screen_doupdate(scr);
+    display_update(scr->display);
+}
+
+// Final foreground and background pixels for a cell
+static inline void cell_colors(display_context_t *ctx, const char_cell_t *cell, uint16_t *fg, uint16_t *bg) {
+    const display_style_t *style = &ctx->styles[cell_style(*cell)];
+    uint32_t colors = ctx->color_cache[color_key(style->fg, style->bg, style->attributes)];
+    *fg = colors >> 16;
+    *bg = colors & 0xFFFF;
+}
+
+// A cell that draws nothing but its background
+static inline bool cell_blank(display_context_t *ctx, const char_cell_t *cell) {
+    uint8_t attr = ctx->styles[cell_style(*cell)].attributes;
+    if (attr & ATTR_UNDERLINE) {
+        return false;
+    }
+    uint8_t c = cell_char(*cell);
+    return c == ' ' || c == 0 || (attr & ATTR_HIDDEN);
+}
+
+// Number of blank cells from x with the same background, 0 if x is not blank
+static uint16_t blank_run(display_context_t *ctx, const char_cell_t *row, uint16_t x, uint16_t x1) {
+    if (!cell_blank(ctx, &row[x])) {
+        return 0;
+    }
+    uint16_t fg, bg, next_fg, next_bg;
+    cell_colors(ctx, &row[x], &fg, &bg);
+    uint16_t n = 1;
+    while (x + n <= x1 && cell_blank(ctx, &row[x + n])) {
+        cell_colors(ctx, &row[x + n], &next_fg, &next_bg);
+        if (next_bg != bg) {
+            break;
+        }
+        n++;
+    }
+    return n;
+}
+
+//
+// Shadow framebuffer
+//
+
+#define SHADOW_ROW_PIXELS   (DISPLAY_WIDTH_PIXELS * CELL_HEIGHT)
+
+static inline uint16_t *shadow_row(display_context_t *ctx, uint16_t y) {
+    return ctx->shadow + ((ctx->shadow_top + y) % DISPLAY_HEIGHT_CHARS) * SHADOW_ROW_PIXELS;
+}
+
+// The LCD scrolled up by lines rows, or down when lines is negative. The
+// rows it exposed were cleared to a colour the display does not choose, so
+// they are stale until repainted.
+static void shadow_scroll(display_context_t *ctx, int lines) {
+    if (!ctx->shadow) {
+        return;
+    }
+    if (lines >= 0) {
+        ctx->shadow_top = (ctx->shadow_top + lines) % DISPLAY_HEIGHT_CHARS;
+        ctx->shadow_stale = (ctx->shadow_stale >> lines) |
+                            (SHADOW_ALL_ROWS & ~(SHADOW_ALL_ROWS >> lines));
+    } else {
+        lines = -lines;
+        ctx->shadow_top = (ctx->shadow_top + DISPLAY_HEIGHT_CHARS - lines) % DISPLAY_HEIGHT_CHARS;
+        ctx->shadow_stale = ((ctx->shadow_stale << lines) | ((1u << lines) - 1)) & SHADOW_ALL_ROWS;
+    }
+}
+
+int display_set_shadow(display_context_t *ctx, bool enable) {
+    if (!ctx) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&ctx->lock);
+    if (enable && !ctx->shadow) {
+        ctx->shadow = malloc(DISPLAY_HEIGHT_CHARS * SHADOW_ROW_PIXELS * sizeof(uint16_t));
+        ctx->shadow_scratch = malloc(SHADOW_ROW_PIXELS * sizeof(uint16_t));
+        if (!ctx->shadow || !ctx->shadow_scratch) {
+            free(ctx->shadow);
+            free(ctx->shadow_scratch);
+            ctx->shadow = NULL;
+            ctx->shadow_scratch = NULL;
+            pthread_mutex_unlock(&ctx->lock);
+            return -1;
+        }
+        // Nothing is known about the LCD yet: send everything once
+        ctx->shadow_top = 0;
+        ctx->shadow_stale = SHADOW_ALL_ROWS;
+    } else if (!enable && ctx->shadow) {
+        free(ctx->shadow);
+        free(ctx->shadow_scratch);
+        ctx->shadow = NULL;
+        ctx->shadow_scratch = NULL;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    
+    return 0;
+}
+
+void display_get_pixel_counts(display_context_t *ctx, uint32_t *rendered, uint32_t *pushed) {
+    if (!ctx || !rendered || !pushed) {
+        return;
+    }
+    
+    pthread_mutex_lock(&ctx->lock);
+    *rendered = ctx->pixels_rendered;
+    *pushed = ctx->pixels_pushed;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+// Render the whole screen again at the next update. The shadow still
+// vouches for the LCD, so only pixels that differ from it are sent.
+void display_force_redraw(display_context_t *ctx) {
+    if (!ctx) {
+        return;
+    }
+    
+    pthread_mutex_lock(&ctx->lock);
+    ctx->full_redraw_needed = true;
+    ctx->view_redraw = ctx->view_offset > 0;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+// Pixel (column px, line r) of a block, pixels NULL meaning solid colour
+static inline uint16_t block_pixel(const uint16_t *pixels, uint16_t colour, uint16_t width,
+                                   uint16_t px, uint16_t r) {
+    return pixels ? pixels[r * width + px] : colour;
+}
+
+// Send cells x0..x0+cells-1, pixel lines first..first+lines-1 of row y.
+// pixels holds the block with a stride of its own width, or is NULL for a
+// solid colour.
+static void send_block(display_context_t *ctx, uint16_t y, uint16_t x0, uint16_t cells,
+                       uint16_t first, uint16_t lines, const uint16_t *pixels, uint16_t colour) {
+    uint16_t width = cells * CELL_WIDTH;
+    if (pixels) {
+        lcd_blit(pixels, x0 * CELL_WIDTH, y * CELL_HEIGHT + first, width, lines);
+    } else {
+        lcd_solid_rectangle(colour, x0 * CELL_WIDTH, y * CELL_HEIGHT + first, width, lines);
+    }
+    ctx->lcd_writes++;
+    ctx->pixels_pushed += width * lines;
+}
+
+// Copy lines lo..hi of cells c0..c1 of a block into the shadow and send
+// them, packed into one blit
+static void flush_changed(display_context_t *ctx, uint16_t y, uint16_t x0, uint16_t cells,
+                          uint16_t first, const uint16_t *pixels, uint16_t colour,
+                          uint16_t c0, uint16_t c1, uint16_t lo, uint16_t hi) {
+    uint16_t width = cells * CELL_WIDTH;
+    uint16_t run = (c1 - c0 + 1) * CELL_WIDTH;
+    uint16_t *shadow = shadow_row(ctx, y) + (x0 + c0) * CELL_WIDTH;
+    uint16_t *packed = ctx->shadow_scratch;
+    
+    for (uint16_t r = lo; r <= hi; r++) {
+        uint16_t *dst = shadow + (first + r) * DISPLAY_WIDTH_PIXELS;
+        for (uint16_t px = 0; px < run; px++) {
+            dst[px] = block_pixel(pixels, colour, width, c0 * CELL_WIDTH + px, r);
+        }
+        if (pixels) {
+            memcpy(packed + (r - lo) * run, dst, run * sizeof(uint16_t));
+        }
+    }
+    
+    send_block(ctx, y, x0 + c0, c1 - c0 + 1, first + lo, hi - lo + 1, pixels ? packed : NULL, colour);
+}
+
+// Push a rendered block to the LCD. With a shadow framebuffer only the
+// runs of cells that changed are sent, each trimmed to the pixel lines
+// that changed.
+static void push_block(display_context_t *ctx, uint16_t y, uint16_t x0, uint16_t cells,
+                       uint16_t first, uint16_t lines, const uint16_t *pixels, uint16_t colour) {
+    uint16_t width = cells * CELL_WIDTH;
+    ctx->pixels_rendered += width * lines;
+    
+    if (!ctx->shadow) {
+        send_block(ctx, y, x0, cells, first, lines, pixels, colour);
+        return;
+    }
+    if (ctx->shadow_stale & (1u << y)) {
+        flush_changed(ctx, y, x0, cells, first, pixels, colour, 0, cells - 1, 0, lines - 1);
+        return;
+    }
+    
+    const uint16_t *shadow = shadow_row(ctx, y) + x0 * CELL_WIDTH + first * DISPLAY_WIDTH_PIXELS;
+    int run_start = -1;
+    uint16_t run_lo = 0, run_hi = 0;
+    
+    for (uint16_t c = 0; c <= cells; c++) {
+        // Pixel lines of cell c that differ from the shadow
+        int lo = -1, hi = -1;
+        for (uint16_t r = 0; c < cells && r < lines; r++) {
+            const uint16_t *old = shadow + r * DISPLAY_WIDTH_PIXELS + c * CELL_WIDTH;
+            for (uint16_t b = 0; b < CELL_WIDTH; b++) {
+                if (old[b] != block_pixel(pixels, colour, width, c * CELL_WIDTH + b, r)) {
+                    if (lo < 0) {
+                        lo = r;
+                    }
+                    hi = r;
+                    break;
+                }
+            }
+        }
+        
+        if (lo >= 0) {
+            if (run_start < 0) {
+                run_start = c;
+                run_lo = lo;
+                run_hi = hi;
+            } else {
+                run_lo = lo < run_lo ? lo : run_lo;
+                run_hi = hi > run_hi ? hi : run_hi;
+            }
+        } else if (run_start >= 0) {
+            flush_changed(ctx, y, x0, cells, first, pixels, colour, run_start, c - 1, run_lo, run_hi);
+            run_start = -1;
+        }
+    }
+}
+
+// Draw one character cell into a pixel buffer stride pixels wide
+static void draw_glyph(uint16_t *dst, uint16_t stride, uint8_t c, uint8_t attr, uint16_t fg, uint16_t bg) {
+    const uint8_t *glyph = &font_8x10.glyphs[c * GLYPH_HEIGHT];
+    for (int i = 0; i < CELL_HEIGHT; i++, dst += stride) {
+        uint8_t bits = glyph[i];
+        if (attr & ATTR_BOLD) {
+            bits |= bits >> 1;
+        }
+        if ((attr & ATTR_UNDERLINE) && i == CELL_HEIGHT - 1) {
+            bits = 0xFF;
+        }
+        if (attr & ATTR_HIDDEN) {
+            bits = 0;
+        }
+        for (int b = 0; b < CELL_WIDTH; b++) {
+            dst[b] = (bits & (0x80 >> b)) ? fg : bg;
+        }
+    }
+}
+
+// Render cells x0..x1 of a row into span_pixels and push them in one blit.
+// invert swaps the colors, which is how the block cursor is drawn.
+static void render_cells(display_context_t *ctx, uint16_t y, const char_cell_t *row,
+                         uint16_t x0, uint16_t x1, bool invert) {
+    uint16_t width = (x1 - x0 + 1) * CELL_WIDTH;
+    
+    for (uint16_t x = x0; x <= x1; x++) {
+        const char_cell_t *cell = &row[x];
+        uint8_t attr = ctx->styles[cell_style(*cell)].attributes;
+        uint16_t fg, bg;
+        cell_colors(ctx, cell, &fg, &bg);
+        if (invert) {
+            uint16_t temp = fg;
+            fg = bg;
+            bg = temp;
+        }
+        
+        draw_glyph(span_pixels + (x - x0) * CELL_WIDTH, width, cell_char(*cell), attr, fg, bg);
+    }
+    
+    push_block(ctx, y, x0, x1 - x0 + 1, 0, CELL_HEIGHT, span_pixels, 0);
+}
+
+// Render count cells into pixels, count cells wide, exactly as the LCD path
+// draws them but without touching the LCD
+void display_render_cells(display_context_t *ctx, const char_cell_t *cells, uint16_t count, uint16_t *pixels) {
+    if (!ctx || !cells || !pixels) {
+        return;
+    }
+    
+    uint16_t width = count * CELL_WIDTH;
+    for (uint16_t x = 0; x < count; x++) {
+        uint8_t attr = ctx->styles[cell_style(cells[x])].attributes;
+        uint16_t fg, bg;
+        cell_colors(ctx, &cells[x], &fg, &bg);
+        draw_glyph(pixels + x * CELL_WIDTH, width, cell_char(cells[x]), attr, fg, bg);
+    }
+}
+
+// Render one character given by palette colors and attributes, resolved
+// through the same color cache as styled cells
+void display_render_glyph(display_context_t *ctx, uint16_t *dst, uint16_t stride,
+                          uint8_t c, uint8_t fg, uint8_t bg, uint8_t attr) {
+    if (!ctx || !dst) {
+        return;
+    }
+    
+    uint32_t colors = ctx->color_cache[color_key(fg, bg, attr)];
+    draw_glyph(dst, stride, c, attr, colors >> 16, colors & 0xFFFF);
+}
+
+// Draw columns x0..x1 of a row: long blank runs as fills, the rest as glyph blits
+static void render_span(display_context_t *ctx, uint16_t y, uint16_t x0, uint16_t x1) {
+    const char_cell_t *row = screen_row(ctx, y);
+    uint16_t x = x0;
+    
+    while (x <= x1) {
+        uint16_t n = blank_run(ctx, row, x, x1);
+        if (n >= FILL_MIN_CELLS) {
+            uint16_t fg, bg;
+            cell_colors(ctx, &row[x], &fg, &bg);
+            push_block(ctx, y, x, n, 0, CELL_HEIGHT, NULL, bg);
+            x += n;
+            continue;
+        }
+        
+        // Extend the glyph run up to the next long blank run
+        uint16_t end = x;
+        while (end <= x1) {
+            n = blank_run(ctx, row, end, x1);
+            if (n >= FILL_MIN_CELLS) {
+                break;
+            }
+            end += n ? n : 1;
+        }
+        render_cells(ctx, y, row, x, end - 1, false);
+        x = end;
+    }
+    
+    ctx->cells_drawn += x1 - x0 + 1;
+}
+
+static void view_line(display_context_t *ctx, uint16_t y, display_line_t *line);
+
+// Draw a scrollback line across screen row y
+static void render_line(display_context_t *ctx, uint16_t y, const display_line_t *line) {
+    uint16_t width = DISPLAY_WIDTH_CHARS * CELL_WIDTH;
+    for (uint16_t x = 0; x < DISPLAY_WIDTH_CHARS; x++) {
+        uint8_t attr = line->attributes[x];
+        uint32_t colors = ctx->color_cache[color_key(line->colors[x] >> 4, line->colors[x] & 0x0F, attr)];
+        draw_glyph(span_pixels + x * CELL_WIDTH, width, line->chars[x], attr, colors >> 16, colors & 0xFFFF);
+    }
+    push_block(ctx, y, 0, DISPLAY_WIDTH_CHARS, 0, CELL_HEIGHT, span_pixels, 0);
+    ctx->cells_drawn += DISPLAY_WIDTH_CHARS;
+}
+
+// Bring the LCD up to date with the scrollback view. Small moves scroll the
+// LCD and draw only the rows that came into view. Caller holds the lock.
+static void update_view(display_context_t *ctx) {
+    int32_t shift = ctx->view_shift;
+    uint16_t first = 0, last = DISPLAY_HEIGHT_CHARS - 1;
+    
+    if (!ctx->view_redraw && shift != 0 && shift <= DISPLAY_SCROLLBACK_PAGE && -shift <= DISPLAY_SCROLLBACK_PAGE) {
+        if (shift > 0) {
+            // Back in history: the content moves down
+            for (int32_t i = 0; i < shift; i++) {
+                lcd_scroll_down();
             }
-            ctx->dirty_lines[ctx->cursor_y] = true;
-            break;
+            last = shift - 1;
+        } else {
+            for (int32_t i = 0; i < -shift; i++) {
+                lcd_scroll_up();
+            }
+            first = DISPLAY_HEIGHT_CHARS + shift;
+        }
+        ctx->lcd_writes += shift > 0 ? shift : -shift;
+        shadow_scroll(ctx, -shift);
+    } else if (!ctx->view_redraw && shift == 0) {
+        return;
+    }
+    
+    display_line_t line;
+    for (uint16_t y = first; y <= last; y++) {
+        view_line(ctx, y, &line);
+        render_line(ctx, y, &line);
     }
+    ctx->shadow_stale = 0;
+    ctx->view_shift = 0;
+    ctx->view_redraw = false;
 }
 
 void display_update(display_context_t *ctx) {
@@ -500,66 +2395,497 @@ void display_update(display_context_t *ctx) {
     
     pthread_mutex_lock(&ctx->lock);
     
-    lcd_context_t *lcd = (lcd_context_t*)ctx->lcd_ctx;
+    // Detached while waiting for the lock
+    if (!ctx->lcd_ctx) {
+        pthread_mutex_unlock(&ctx->lock);
+        return;
+    }
     
-    // Update dirty lines
-    for (int y = 0; y < DISPLAY_HEIGHT_CHARS; y++) {
-        if (ctx->dirty_lines[y] || ctx->full_redraw_needed) {
-            for (int x = 0; x < DISPLAY_WIDTH_CHARS; x++) {
-                int offset = y * DISPLAY_WIDTH_CHARS + x;
-                char_cell_t *cell = &ctx->text_buffer[offset];
-                
-                // Get colors
-                uint32_t fg = ansi_palette[cell->fg_color & 0x0F];
-                uint32_t bg = ansi_palette[cell->bg_color & 0x0F];
-                
-                // Handle reverse video
-                if (cell->attributes & ATTR_REVERSE) {
-                    uint32_t temp = fg;
-                    fg = bg;
-                    bg = temp;
-                }
-                
-                // Handle bold (brighten foreground)
-                if (cell->attributes & ATTR_BOLD) {
-                    if ((cell->fg_color & 0x07) < 8) {
-                        fg = ansi_palette[(cell->fg_color & 0x07) + 8];
-                    }
+    // The scrollback view replaces the screen until it is closed
+    if (ctx->view_offset > 0) {
+        update_view(ctx);
+        pthread_mutex_unlock(&ctx->lock);
+        return;
+    }
+    
+    // Catch the LCD up with whole-screen scrolls. More than a screenful is
+    // cheaper to redraw.
+    int16_t scroll = ctx->pending_scroll;
+    if (scroll >= DISPLAY_HEIGHT_CHARS || scroll <= -DISPLAY_HEIGHT_CHARS) {
+        ctx->full_redraw_needed = true;
+    } else if (!ctx->full_redraw_needed && scroll != 0) {
+        for (int16_t i = 0; i < scroll; i++) {
+            lcd_scroll_up();
+        }
+        for (int16_t i = 0; i > scroll; i--) {
+            lcd_scroll_down();
+        }
+        ctx->lcd_writes += scroll > 0 ? scroll : -scroll;
+        shadow_scroll(ctx, scroll);
+        
+        // Windows do not scroll with the grid: repaint them and the rows
+        // their old image moved into
+        for (int w = 0; w < ctx->window_count; w++) {
+            display_window_t *win = ctx->windows[w];
+            if (win->visible) {
+                int top = scroll > 0 ? (int)win->y - scroll : win->y;
+                int bottom = scroll > 0 ? win->y + win->height : win->y + win->height - scroll;
+                if (top < 0) {
+                    top = 0;
                 }
-                
-                // Draw character
-                lcd_draw_char(lcd, x * 8, y * 10, cell->character, fg, bg);
+                damage_rect(ctx, win->x, top, win->width, bottom - top);
             }
-            ctx->dirty_lines[y] = false;
         }
     }
+    ctx->pending_scroll = 0;
+    collect_window_damage(ctx);
+    
+    // The cell under the old cursor has to be repainted when it moves
+    if (ctx->drawn_cursor_x != ctx->cursor_x || ctx->drawn_cursor_y != ctx->cursor_y) {
+        mark_dirty(ctx, ctx->drawn_cursor_y, ctx->drawn_cursor_x, ctx->drawn_cursor_x);
+    }
+    for (int y = 0; y < DISPLAY_HEIGHT_CHARS; y++) {
+        if (ctx->full_redraw_needed || (ctx->shadow_stale & (1u << y))) {
+            mark_line_dirty(ctx, y);
+        }
+    }
+    
+    // Redraw only the changed span of each row
+    for (int y = 0; y < DISPLAY_HEIGHT_CHARS; y++) {
+        if (ctx->dirty_min[y] <= ctx->dirty_max[y]) {
+            render_span(ctx, y, ctx->dirty_min[y], ctx->dirty_max[y]);
+            mark_clean(ctx, y);
+        }
+    }
+    ctx->shadow_stale = 0;
     
     // Draw cursor if visible
     if (ctx->cursor_visible && ctx->cursor_style != CURSOR_NONE) {
-        int cx = ctx->cursor_x * 8;
-        int cy = ctx->cursor_y * 10;
-        uint32_t cursor_color = ansi_palette[COLOR_WHITE];
+        uint16_t cursor_color = ctx->palette565[COLOR_WHITE];
         
         switch (ctx->cursor_style) {
             case CURSOR_UNDERLINE:
             case CURSOR_BLINK_UNDERLINE:
-                lcd_draw_hline(lcd, cx, cy + 9, 8, cursor_color);
+                push_block(ctx, ctx->cursor_y, ctx->cursor_x, 1, CELL_HEIGHT - 1, 1, NULL, cursor_color);
                 break;
             case CURSOR_BLOCK:
             case CURSOR_BLINK_BLOCK:
-                lcd_draw_rect_filled(lcd, cx, cy, 8, 10, cursor_color);
+                render_cells(ctx, ctx->cursor_y, screen_row(ctx, ctx->cursor_y), ctx->cursor_x, ctx->cursor_x, true);
                 break;
             default:
                 break;
         }
     }
+    ctx->drawn_cursor_x = ctx->cursor_x;
+    ctx->drawn_cursor_y = ctx->cursor_y;
     
     ctx->full_redraw_needed = false;
     
     pthread_mutex_unlock(&ctx->lock);
+}
+
+// Line shown on screen row y of the scrollback view. Rows below the end
+// of the scrollback come from the grid. Caller holds the lock.
+static void view_line(display_context_t *ctx, uint16_t y, display_line_t *line) {
+    uint32_t total = scrollback_total(ctx);
+    uint32_t v = total - ctx->view_offset + y;
+    if (v < total) {
+        scrollback_line(ctx, v, line);
+        return;
+    }
+    
+    const char_cell_t *row = row_cells(ctx, v - total);
+    for (int x = 0; x < DISPLAY_WIDTH_CHARS; x++) {
+        const display_style_t *style = &ctx->styles[cell_style(row[x])];
+        line->chars[x] = cell_char(row[x]);
+        line->colors[x] = (style->fg << 4) | style->bg;
+        line->attributes[x] = style->attributes;
+    }
+}
+
+// Keep lines that scroll off the screen, 0 for the default. They go to
+// PSRAM when it is available, otherwise a short ring on the heap is used.
+int display_scrollback_init(display_context_t *ctx, uint32_t lines) {
+    if (!ctx) {
+        return -1;
+    }
+    if (lines == 0) {
+        lines = DISPLAY_SCROLLBACK_LINES;
+    }
+    
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->scrollback_capacity > 0) {
+        pthread_mutex_unlock(&ctx->lock);
+        return -1;
+    }
+    
+    if (psram_alloc_ready()) {
+        ctx->scrollback_handle = psram_malloc(lines * sizeof(display_line_t));
+    }
+    if (ctx->scrollback_handle == PSRAM_HANDLE_NONE) {
+        if (lines > DISPLAY_SCROLLBACK_HEAP_LINES) {
+            lines = DISPLAY_SCROLLBACK_HEAP_LINES;
+        }
+        ctx->scrollback_heap = malloc(lines * sizeof(display_line_t));
+        if (!ctx->scrollback_heap) {
+            pthread_mutex_unlock(&ctx->lock);
+            return -1;
+        }
+    }
+    
+    ctx->scrollback_capacity = lines;
+    ctx->scrollback_count = 0;
+    ctx->scrollback_next = 0;
+    ctx->stage_count = 0;
+    pthread_mutex_unlock(&ctx->lock);
+    
+    return 0;
+}
+
+uint32_t display_scrollback_lines(display_context_t *ctx) {
+    if (!ctx) {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&ctx->lock);
+    uint32_t total = scrollback_total(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+    
+    return total;
+}
+
+// Move the view to offset lines back. Caller holds the lock.
+static void set_view_offset(display_context_t *ctx, int64_t offset) {
+    uint32_t total = scrollback_total(ctx);
+    if (offset < 0) {
+        offset = 0;
+    }
+    if (offset > total) {
+        offset = total;
+    }
+    
+    uint32_t old = ctx->view_offset;
+    ctx->view_offset = (uint32_t)offset;
+    if (ctx->view_offset == old) {
+        return;
+    }
+    
+    if (old == 0) {
+        ctx->view_redraw = true;
+        ctx->view_shift = 0;
+    } else if (ctx->view_offset == 0) {
+        // Back to the live screen, which may have changed underneath
+        ctx->view_redraw = false;
+        ctx->view_shift = 0;
+        ctx->full_redraw_needed = true;
+    } else {
+        ctx->view_shift += (int32_t)ctx->view_offset - (int32_t)old;
+    }
+}
+
+void display_scrollback_scroll(display_context_t *ctx, int32_t lines) {
+    if (!ctx) {
+        return;
+    }
+    
+    pthread_mutex_lock(&ctx->lock);
+    set_view_offset(ctx, (int64_t)ctx->view_offset + lines);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void display_scrollback_reset(display_context_t *ctx) {
+    if (!ctx) {
+        return;
+    }
+    
+    pthread_mutex_lock(&ctx->lock);
+    set_view_offset(ctx, 0);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+// Shift+PageUp and Shift+PageDown move through the scrollback. Returns true
+// when the key was used. Any other key closes the view and is left for the
+// caller.
+bool display_scrollback_key(display_context_t *ctx, uint8_t key, uint8_t modifiers) {
+    if (!ctx) {
+        return false;
+    }
+    
+    if (modifiers & KB_MOD_SHIFT) {
+        if (key == KEY_PAGEUP) {
+            display_scrollback_scroll(ctx, DISPLAY_SCROLLBACK_PAGE);
+            return true;
+        }
+        if (key == KEY_PAGEDOWN) {
+            display_scrollback_scroll(ctx, -DISPLAY_SCROLLBACK_PAGE);
+            return true;
+        }
+    }
+    if (key == KEY_SHIFT || key == KEY_FN) {
+        return false;
+    }
+    
+    display_scrollback_reset(ctx);
+    return false;
+}
+
+// Find text in the scrollback, starting next to the line at the top of the
+// view. Returns the new view offset, or -1 if there is no match.
+int32_t display_scrollback_search(display_context_t *ctx, const char *text, bool older) {
+    if (!ctx || !text || !*text) {
+        return -1;
+    }
+    
+    size_t len = strlen(text);
+    if (len > DISPLAY_WIDTH_CHARS) {
+        return -1;
+    }
+    
+    pthread_mutex_lock(&ctx->lock);
+    uint32_t total = scrollback_total(ctx);
+    int64_t top = (int64_t)total - ctx->view_offset;
+    int step = older ? -1 : 1;
+    int32_t found = -1;
+    display_line_t line;
+    
+    for (int64_t i = top + step; i >= 0 && i < total; i += step) {
+        scrollback_line(ctx, (uint32_t)i, &line);
+        for (size_t x = 0; x + len <= DISPLAY_WIDTH_CHARS; x++) {
+            if (memcmp(&line.chars[x], text, len) == 0) {
+                found = (int32_t)(total - i);
+                break;
+            }
+        }
+        if (found >= 0) {
+            set_view_offset(ctx, found);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    
+    return found;
+}
+
+//
+// Refresh service
+//
+
+static uint64_t get_time_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Whether display_update() would draw anything. Caller holds the lock.
+static bool update_pending(display_context_t *ctx) {
+    if (!ctx->lcd_ctx) {
+        return false;
+    }
+    if (ctx->view_offset > 0) {
+        return ctx->view_redraw || ctx->view_shift != 0;
+    }
+    if (ctx->full_redraw_needed || ctx->pending_scroll) {
+        return true;
+    }
+    
+    // Writes inside windows only mark the window's own spans
+    collect_window_damage(ctx);
+    if (ctx->drawn_cursor_x != ctx->cursor_x || ctx->drawn_cursor_y != ctx->cursor_y) {
+        return true;
+    }
+    for (int y = 0; y < DISPLAY_HEIGHT_CHARS; y++) {
+        if (ctx->dirty_min[y] <= ctx->dirty_max[y]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Close the FPS window once a second has passed. Caller holds the lock.
+static void update_fps(display_context_t *ctx, uint64_t now) {
+    uint64_t window = now - ctx->fps_window_start_us;
+    if (window >= 1000000) {
+        ctx->refresh_stats.fps = (uint32_t)((uint64_t)ctx->fps_window_frames * 1000000 / window);
+        ctx->fps_window_start_us = now;
+        ctx->fps_window_frames = 0;
+    }
+}
+
+// Caller holds the lock
+static void record_frame(display_context_t *ctx, uint64_t start, uint64_t end, bool kicked) {
+    display_refresh_stats_t *stats = &ctx->refresh_stats;
+    uint32_t frame_us = (uint32_t)(end - start);
+    
+    stats->frames++;
+    if (kicked) {
+        stats->input_frames++;
+    }
+    stats->last_frame_us = frame_us;
+    stats->total_frame_us += frame_us;
+    if (frame_us > stats->max_frame_us) {
+        stats->max_frame_us = frame_us;
+    }
+    
+    ctx->fps_window_frames++;
+    update_fps(ctx, end);
+}
+
+// Wake once per frame, or early when kicked, and draw whatever changed
+// since the last frame. Writes in between are coalesced into one update.
+static void* refresh_thread_main(void *arg) {
+    display_context_t *ctx = (display_context_t*)arg;
+    
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->refresh_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)ctx->frame_interval_us * 1000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        
+        while (ctx->refresh_running && !ctx->refresh_now) {
+            if (pthread_cond_timedwait(&ctx->refresh_wake, &ctx->lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        
+        bool kicked = ctx->refresh_now;
+        ctx->refresh_now = false;
+        if (!ctx->refresh_running || !update_pending(ctx)) {
+            continue;
+        }
+        
+        pthread_mutex_unlock(&ctx->lock);
+        uint64_t start = get_time_us();
+        display_update(ctx);
+        uint64_t end = get_time_us();
+        pthread_mutex_lock(&ctx->lock);
+        
+        record_frame(ctx, start, end, kicked);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    
+    return NULL;
+}
+
+int display_refresh_start(display_context_t *ctx, uint16_t max_fps) {
+    if (!ctx) {
+        return -1;
+    }
+    if (max_fps == 0) {
+        max_fps = DISPLAY_REFRESH_DEFAULT_FPS;
+    }
+    
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->refresh_running || pthread_cond_init(&ctx->refresh_wake, NULL) != 0) {
+        pthread_mutex_unlock(&ctx->lock);
+        return -1;
+    }
+    ctx->frame_interval_us = 1000000 / max_fps;
+    ctx->refresh_now = false;
+    memset(&ctx->refresh_stats, 0, sizeof(ctx->refresh_stats));
+    ctx->fps_window_start_us = get_time_us();
+    ctx->fps_window_frames = 0;
+    ctx->refresh_running = true;
+    
+    // The thread blocks on the lock until it is released below
+    if (pthread_create(&ctx->refresh_thread, NULL, refresh_thread_main, ctx) != 0) {
+        ctx->refresh_running = false;
+        pthread_cond_destroy(&ctx->refresh_wake);
+        pthread_mutex_unlock(&ctx->lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    
+    return 0;
+}
+
+void display_refresh_stop(display_context_t *ctx) {
+    if (!ctx) {
+        return;
+    }
+    
+    pthread_mutex_lock(&ctx->lock);
+    bool running = ctx->refresh_running;
+    ctx->refresh_running = false;
+    if (running) {
+        pthread_cond_signal(&ctx->refresh_wake);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    
+    if (running) {
+        pthread_join(ctx->refresh_thread, NULL);
+        pthread_cond_destroy(&ctx->refresh_wake);
+    }
+}
+
+// Draw pending changes now instead of at the next frame
+void display_refresh_kick(display_context_t *ctx) {
+    if (!ctx) {
+        return;
+    }
+    
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->refresh_running) {
+        ctx->refresh_now = true;
+        pthread_cond_signal(&ctx->refresh_wake);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void display_refresh_get_stats(display_context_t *ctx, display_refresh_stats_t *stats) {
+    if (!ctx || !stats) {
+        return;
+    }
+    
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->refresh_running) {
+        update_fps(ctx, get_time_us());
+    }
+    *stats = ctx->refresh_stats;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void display_set_palette(display_context_t *ctx, const uint32_t *colors) {
+    if (!ctx || !colors) {
+        return;
+    }
+    
+    pthread_mutex_lock(&ctx->lock);
+    memcpy(ctx->palette, colors, sizeof(ctx->palette));
+    rebuild_colors(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void display_set_palette_entry(display_context_t *ctx, uint8_t index, uint32_t color) {
+    if (!ctx || index >= DISPLAY_PALETTE_SIZE) {
+        return;
+    }
+    
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->palette[index] != color) {
+        ctx->palette[index] = color;
+        rebuild_colors(ctx);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void display_get_palette(display_context_t *ctx, uint32_t *colors) {
+    if (!ctx || !colors) {
+        return;
+    }
     
-    // Update LCD
-    lcd_update(lcd);
+    pthread_mutex_lock(&ctx->lock);
+    memcpy(colors, ctx->palette, sizeof(ctx->palette));
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void display_reset_palette(display_context_t *ctx) {
+    display_set_palette(ctx, ansi_palette);
+}
+
+uint32_t display_rgb_to_color(uint8_t r, uint8_t g, uint8_t b) {
+    return ((uint32_t)r << 16) | ((uint32_t)g << 8) | b;
 }
 
 void display_set_cursor(display_context_t *ctx, uint16_t x, uint16_t y) {
@@ -618,12 +2944,15 @@ void display_draw_box(display_context_t *ctx, uint16_t x, uint16_t y,
     }
     display_set_cell(ctx, x + width - 1, y + height - 1, BOX_BOTTOM_RIGHT, ctx->current_fg, ctx->current_bg, ctx->current_attr);
     
-    // Mark affected lines as dirty
-    for (uint16_t i = y; i < y + height && i < DISPLAY_HEIGHT_CHARS; i++) {
-        ctx->dirty_lines[i] = true;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+char_cell_t* display_get_cell(display_context_t *ctx, uint16_t x, uint16_t y) {
+    if (!ctx || x >= DISPLAY_WIDTH_CHARS || y >= DISPLAY_HEIGHT_CHARS) {
+        return NULL;
     }
     
-    pthread_mutex_unlock(&ctx->lock);
+    return &row_cells(ctx, y)[x];
 }
 
 void display_set_cell(display_context_t *ctx, uint16_t x, uint16_t y,
@@ -632,12 +2961,10 @@ void display_set_cell(display_context_t *ctx, uint16_t x, uint16_t y,
         return;
     }
     
-    int offset = y * DISPLAY_WIDTH_CHARS + x;
-    ctx->text_buffer[offset].character = c;
-    ctx->text_buffer[offset].fg_color = fg;
-    ctx->text_buffer[offset].bg_color = bg;
-    ctx->text_buffer[offset].attributes = attr;
-    ctx->dirty_lines[y] = true;
+    pthread_mutex_lock(&ctx->lock);
+    row_cells(ctx, y)[x] = cell_make((uint8_t)c, intern_style(ctx, fg, bg, attr));
+    mark_dirty(ctx, y, x, x);
+    pthread_mutex_unlock(&ctx->lock);
 }
 
 void display_save_state(display_context_t *ctx) {
@@ -646,11 +2973,11 @@ void display_save_state(display_context_t *ctx) {
     }
     
     pthread_mutex_lock(&ctx->lock);
-    saved_state.x = ctx->cursor_x;
-    saved_state.y = ctx->cursor_y;
-    saved_state.fg = ctx->current_fg;
-    saved_state.bg = ctx->current_bg;
-    saved_state.attr = ctx->current_attr;
+    ctx->saved.x = ctx->cursor_x;
+    ctx->saved.y = ctx->cursor_y;
+    ctx->saved.fg = ctx->current_fg;
+    ctx->saved.bg = ctx->current_bg;
+    ctx->saved.attr = ctx->current_attr;
     pthread_mutex_unlock(&ctx->lock);
 }
 
@@ -660,10 +2987,10 @@ void display_restore_state(display_context_t *ctx) {
     }
     
     pthread_mutex_lock(&ctx->lock);
-    ctx->cursor_x = saved_state.x;
-    ctx->cursor_y = saved_state.y;
-    ctx->current_fg = saved_state.fg;
-    ctx->current_bg = saved_state.bg;
-    ctx->current_attr = saved_state.attr;
+    ctx->cursor_x = ctx->saved.x;
+    ctx->cursor_y = ctx->saved.y;
+    ctx->current_fg = ctx->saved.fg;
+    ctx->current_bg = ctx->saved.bg;
+    ctx->current_attr = ctx->saved.attr;
     pthread_mutex_unlock(&ctx->lock);
 }
\ No newline at end of file
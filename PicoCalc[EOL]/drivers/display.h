@@ -11,6 +11,10 @@
 #define DISPLAY_WIDTH_CHARS   40   // 320/8 = 40 chars at 8 pixels wide
 #define DISPLAY_HEIGHT_CHARS  24   // 240/10 = 24 chars at 10 pixels tall
 
+// Dirty span of a row with nothing to redraw (min > max)
+#define DISPLAY_SPAN_CLEAN_MIN  0xFF
+#define DISPLAY_SPAN_CLEAN_MAX  0x00
+
 // ANSI color codes
 #define COLOR_BLACK     0
 #define COLOR_RED       1
@@ -22,6 +26,13 @@
 #define COLOR_WHITE     7
 #define COLOR_DEFAULT   9
 
+// Number of palette entries
+#define DISPLAY_PALETTE_SIZE  16
+
+// Resolved color cache: one entry per (attribute, fg, bg), where only
+// bold and reverse change the final pixels
+#define DISPLAY_COLOR_CACHE_SIZE  (4 * DISPLAY_PALETTE_SIZE * DISPLAY_PALETTE_SIZE)
+
 // Display attributes
 #define ATTR_NORMAL     0x00
 #define ATTR_BOLD       0x01
@@ -33,13 +44,76 @@
 #define ATTR_HIDDEN     0x40
 #define ATTR_STRIKE     0x80
 
-// Character cell structure
+// Character cell, packed into 16 bits: the character in the low byte and
+// an index into the context's style table in the high byte
+typedef uint16_t char_cell_t;
+
+static inline char_cell_t cell_make(uint8_t character, uint8_t style) {
+    return (char_cell_t)(character | (style << 8));
+}
+
+static inline uint8_t cell_char(char_cell_t cell) {
+    return cell & 0xFF;
+}
+
+static inline uint8_t cell_style(char_cell_t cell) {
+    return cell >> 8;
+}
+
+// Style table entry: one combination of colors and attributes in use
+#define DISPLAY_MAX_STYLES  256
+#define DISPLAY_STYLE_FREE  0xFF    // fg value of an unused entry
+
 typedef struct {
-    uint8_t character;      // ASCII character
-    uint8_t fg_color;       // Foreground color (0-15)
-    uint8_t bg_color;       // Background color (0-15)
+    uint8_t fg;             // Foreground color (0-15)
+    uint8_t bg;             // Background color (0-15)
     uint8_t attributes;     // Text attributes
-} char_cell_t;
+} display_style_t;
+
+// ANSI parser limits
+#define DISPLAY_MAX_PARAMS  16      // CSI parameters kept, extras are dropped
+#define DISPLAY_OSC_MAX     64      // OSC bytes kept, the rest are skipped
+
+// Saved cursor state
+typedef struct {
+    uint16_t x;
+    uint16_t y;
+    uint8_t fg;
+    uint8_t bg;
+    uint8_t attr;
+} cursor_state_t;
+
+// Scrollback
+#define DISPLAY_SCROLLBACK_LINES      4000  // Lines kept in PSRAM
+#define DISPLAY_SCROLLBACK_HEAP_LINES 100   // Lines kept in SRAM without PSRAM
+#define DISPLAY_SCROLLBACK_STAGE      16    // Lines gathered per PSRAM write
+#define DISPLAY_SCROLLBACK_PAGE       (DISPLAY_HEIGHT_CHARS / 2)
+
+// A line in the scrollback. Colors and attributes are stored in full, so
+// lines do not hold on to entries in the style table.
+typedef struct {
+    uint8_t chars[DISPLAY_WIDTH_CHARS];
+    uint8_t colors[DISPLAY_WIDTH_CHARS];        // fg << 4 | bg
+    uint8_t attributes[DISPLAY_WIDTH_CHARS];
+} display_line_t;
+
+// Windows
+#define DISPLAY_MAX_WINDOWS  8
+
+struct display_window;
+struct display_screen;
+
+// Refresh service
+#define DISPLAY_REFRESH_DEFAULT_FPS  60
+
+typedef struct {
+    uint32_t frames;            // Frames drawn since the service started
+    uint32_t input_frames;      // Of those, drawn early for display_refresh_kick()
+    uint32_t fps;               // Frames drawn in the last measured second
+    uint32_t last_frame_us;     // Time to draw the most recent frame
+    uint32_t max_frame_us;      // Slowest frame
+    uint64_t total_frame_us;    // All frames, for the average
+} display_refresh_stats_t;
 
 // Display modes
 typedef enum {
@@ -74,9 +148,12 @@ typedef struct {
     // Hardware interface
     void *lcd_ctx;              // LCD driver context
     
-    // Text buffer
+    // Text buffer, a ring of rows
     char_cell_t *text_buffer;   // Character buffer
     uint16_t buffer_size;
+    uint16_t top_row;           // Buffer row shown at the top of the screen
+    int16_t pending_scroll;     // Whole-screen scrolls the LCD has not done yet, down if negative
+    uint16_t deferred_scroll;   // Rows display_write() has run past the bottom
     
     // Cursor position
     uint16_t cursor_x;          // Column (0-39)
@@ -89,31 +166,143 @@ typedef struct {
     uint8_t current_bg;
     uint8_t current_attr;
     
-    // ANSI escape sequence parsing
-    bool in_escape;
-    char escape_buffer[32];
-    int escape_index;
+    cursor_state_t saved;       // ESC 7 and display_save_state()
+    
+    // ANSI escape sequence parser state
+    uint8_t parse_state;
+    uint8_t csi_private;        // < = > ? marker, or 0
+    uint8_t csi_intermediate;   // Last intermediate byte, or 0
+    uint8_t param_count;
+    uint16_t params[DISPLAY_MAX_PARAMS];
+    char osc_buffer[DISPLAY_OSC_MAX];
+    uint8_t osc_length;
+    bool string_is_osc;         // The string being skipped is an OSC
     
     // Configuration
     display_config_t config;
     
+    // Colors: the palette in 24-bit and RGB565, and the final fg/bg pixels
+    // (fg << 16 | bg) for every combination, rebuilt when the palette changes
+    uint32_t palette[DISPLAY_PALETTE_SIZE];
+    uint16_t palette565[DISPLAY_PALETTE_SIZE];
+    uint32_t color_cache[DISPLAY_COLOR_CACHE_SIZE];
+    
+    // Styles referenced by cells, added as they are first used
+    display_style_t styles[DISPLAY_MAX_STYLES];
+    uint16_t style_count;       // Entries handed out so far
+    uint8_t last_style;         // Most recently used, checked first
+    uint8_t blank_style;        // Default colors, no attributes
+    
     // Thread safety
     pthread_mutex_t lock;
     
-    // Dirty tracking for optimization
-    bool *dirty_lines;
+    // Dirty tracking for optimization: per row, the first and last column
+    // that changed since the last update. A clean row has min > max.
+    uint8_t *dirty_min;
+    uint8_t *dirty_max;
     bool full_redraw_needed;
+    uint16_t drawn_cursor_x;    // Where the cursor was last drawn
+    uint16_t drawn_cursor_y;
+    uint32_t cells_drawn;       // Cells sent to the LCD since init
+    uint32_t lcd_writes;        // Blits and fills sent to the LCD since init
+    
+    // Optional RGB565 copy of what the LCD shows, a ring of cell rows that
+    // scrolls with it. Rendered pixels are compared against it and only the
+    // ones that changed are sent.
+    uint16_t *shadow;
+    uint16_t *shadow_scratch;   // Changed pixels packed for one blit
+    uint16_t shadow_top;        // Shadow row holding screen row 0
+    uint32_t shadow_stale;      // Bit per screen row the shadow can't vouch for
+    uint32_t pixels_rendered;   // Pixels produced since init
+    uint32_t pixels_pushed;     // Of those, pixels sent to the LCD
     
     // Scroll region
     uint16_t scroll_top;
     uint16_t scroll_bottom;
+    
+    // Scrollback: a ring of lines that left the top of the screen, in PSRAM
+    // or on the heap, fed through a small staging buffer
+    uint32_t scrollback_handle;     // PSRAM allocation, or 0
+    display_line_t *scrollback_heap;
+    uint32_t scrollback_capacity;   // Lines the ring holds, 0 when disabled
+    uint32_t scrollback_count;      // Lines in the ring
+    uint32_t scrollback_next;       // Slot the next line goes to
+    display_line_t scrollback_stage[DISPLAY_SCROLLBACK_STAGE];
+    uint16_t stage_count;
+    
+    // Scrollback view. While it is open the screen is frozen on it and
+    // output only goes to the grid.
+    uint32_t view_offset;           // Lines scrolled back, 0 for the live screen
+    int32_t view_shift;             // Movement the LCD has not caught up with
+    bool view_redraw;               // The whole view has to be drawn
+    
+    // Windows drawn over the grid, lowest z first
+    struct display_window *windows[DISPLAY_MAX_WINDOWS];
+    uint8_t window_count;
+    char_cell_t compose_row[DISPLAY_WIDTH_CHARS];   // A grid row with windows on top
+    
+    // Off-screen grid an application draws into, at most one per display
+    struct display_screen *screen;
+    
+    // Refresh service: a thread that draws changes at most once per frame
+    pthread_t refresh_thread;
+    pthread_cond_t refresh_wake;    // Signalled to stop or to flush early
+    bool refresh_running;
+    bool refresh_now;               // Flush without waiting for the frame
+    uint32_t frame_interval_us;
+    display_refresh_stats_t refresh_stats;
+    uint64_t fps_window_start_us;
+    uint32_t fps_window_frames;
 } display_context_t;
 
+// A window: a rectangle of cells with its own cursor, colors, scroll
+// region and dirty spans, drawn over the grid. Coordinates are in cells.
+typedef struct display_window {
+    display_context_t *display;
+    uint16_t x;                 // Position on screen
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+    int z;                      // Higher is on top
+    bool visible;
+    
+    char_cell_t *cells;         // width * height
+    uint16_t cursor_x;
+    uint16_t cursor_y;
+    uint8_t fg;
+    uint8_t bg;
+    uint8_t attr;
+    uint16_t scroll_top;
+    uint16_t scroll_bottom;
+    
+    // Per window row, the changed columns. A clean row has min > max.
+    uint8_t *dirty_min;
+    uint8_t *dirty_max;
+} display_window_t;
+
+// A virtual screen: an off-screen copy of the grid. Drawing into it does
+// not touch the display; display_screen_doupdate() then moves only the
+// differences to the grid in one pass.
+typedef struct display_screen {
+    display_context_t *display;
+    char_cell_t cells[DISPLAY_WIDTH_CHARS * DISPLAY_HEIGHT_CHARS];
+    uint16_t cursor_x;
+    uint16_t cursor_y;
+    bool cursor_visible;
+    uint8_t style;              // Style of cells drawn next
+    
+    // What the last update did
+    int16_t scrolled_lines;     // Rows the LCD was scrolled up by, down if negative
+    uint16_t changed_cells;
+} display_screen_t;
+
 // Function prototypes
 
 // Initialization
 int display_init(display_context_t *ctx, void *lcd_ctx);
 void display_deinit(display_context_t *ctx);
+void display_attach(display_context_t *ctx, void *lcd_ctx);
+void display_detach(display_context_t *ctx);
 
 // Basic operations
 void display_clear(display_context_t *ctx);
@@ -140,6 +329,12 @@ void display_set_colors(display_context_t *ctx, uint8_t fg, uint8_t bg);
 void display_set_attribute(display_context_t *ctx, uint8_t attr);
 void display_reset_attributes(display_context_t *ctx);
 
+// Palette and themes (colors are 0xRRGGBB)
+void display_set_palette(display_context_t *ctx, const uint32_t *colors);
+void display_set_palette_entry(display_context_t *ctx, uint8_t index, uint32_t color);
+void display_get_palette(display_context_t *ctx, uint32_t *colors);
+void display_reset_palette(display_context_t *ctx);
+
 // ANSI escape sequence support
 void display_process_ansi(display_context_t *ctx, const char *seq);
 void display_enable_ansi(display_context_t *ctx, bool enable);
@@ -149,6 +344,12 @@ char_cell_t* display_get_cell(display_context_t *ctx, uint16_t x, uint16_t y);
 void display_set_cell(display_context_t *ctx, uint16_t x, uint16_t y, 
                      char c, uint8_t fg, uint8_t bg, uint8_t attr);
 
+// Off-screen rendering with the driver's colors and font, for benchmarks.
+// pixels is count cells wide and one cell tall.
+void display_render_cells(display_context_t *ctx, const char_cell_t *cells, uint16_t count, uint16_t *pixels);
+void display_render_glyph(display_context_t *ctx, uint16_t *dst, uint16_t stride,
+                          uint8_t c, uint8_t fg, uint8_t bg, uint8_t attr);
+
 // Window and region management
 void display_set_scroll_region(display_context_t *ctx, uint16_t top, uint16_t bottom);
 void display_reset_scroll_region(display_context_t *ctx);
@@ -161,6 +362,57 @@ void display_get_config(display_context_t *ctx, display_config_t *config);
 void display_update(display_context_t *ctx);
 void display_update_line(display_context_t *ctx, uint16_t line);
 void display_force_redraw(display_context_t *ctx);
+int display_set_shadow(display_context_t *ctx, bool enable);
+void display_get_pixel_counts(display_context_t *ctx, uint32_t *rendered, uint32_t *pushed);
+
+// Windows. Changes are drawn by the next display_update(), and only where
+// a window changed, moved, appeared or went away.
+display_window_t *display_window_create(display_context_t *ctx, uint16_t x, uint16_t y,
+                                        uint16_t width, uint16_t height, int z);
+void display_window_destroy(display_window_t *win);
+void display_window_move(display_window_t *win, uint16_t x, uint16_t y);
+void display_window_set_z(display_window_t *win, int z);
+void display_window_show(display_window_t *win, bool visible);
+void display_window_set_colors(display_window_t *win, uint8_t fg, uint8_t bg, uint8_t attr);
+void display_window_set_cursor(display_window_t *win, uint16_t x, uint16_t y);
+void display_window_set_scroll_region(display_window_t *win, uint16_t top, uint16_t bottom);
+void display_window_clear(display_window_t *win);
+void display_window_scroll_up(display_window_t *win, uint16_t lines);
+void display_window_set_cell(display_window_t *win, uint16_t x, uint16_t y, char c);
+void display_window_write(display_window_t *win, const char *text, size_t len);
+void display_window_puts(display_window_t *win, const char *str);
+
+// Virtual screen. Draw with the display_screen_* calls, then
+// display_screen_doupdate() applies every change at once and
+// display_screen_refresh() also draws it.
+display_screen_t *display_screen_create(display_context_t *ctx);
+void display_screen_destroy(display_screen_t *scr);
+void display_screen_set_colors(display_screen_t *scr, uint8_t fg, uint8_t bg, uint8_t attr);
+void display_screen_clear(display_screen_t *scr);
+void display_screen_set_cell(display_screen_t *scr, uint16_t x, uint16_t y, char c);
+void display_screen_puts(display_screen_t *scr, uint16_t x, uint16_t y, const char *str);
+void display_screen_set_cursor(display_screen_t *scr, uint16_t x, uint16_t y);
+void display_screen_show_cursor(display_screen_t *scr, bool visible);
+void display_screen_doupdate(display_screen_t *scr);
+void display_screen_refresh(display_screen_t *scr);
+
+// Scrollback. Positive lines scroll back into history. Search looks for
+// text from the top of the view, in older or newer lines, and moves the
+// view to the match.
+int display_scrollback_init(display_context_t *ctx, uint32_t lines);
+uint32_t display_scrollback_lines(display_context_t *ctx);
+void display_scrollback_scroll(display_context_t *ctx, int32_t lines);
+void display_scrollback_reset(display_context_t *ctx);
+bool display_scrollback_key(display_context_t *ctx, uint8_t key, uint8_t modifiers);
+int32_t display_scrollback_search(display_context_t *ctx, const char *text, bool older);
+
+// Refresh service. Once started, writers only change the grid and the
+// service draws at up to max_fps. Input loops call display_refresh_kick()
+// when they run out of keys so echo is drawn at once.
+int display_refresh_start(display_context_t *ctx, uint16_t max_fps);
+void display_refresh_stop(display_context_t *ctx);
+void display_refresh_kick(display_context_t *ctx);
+void display_refresh_get_stats(display_context_t *ctx, display_refresh_stats_t *stats);
 
 // Special characters and box drawing
 void display_draw_box(display_context_t *ctx, uint16_t x, uint16_t y, 
@@ -8,6 +8,7 @@
 //
 
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <strings.h>
@@ -57,10 +58,68 @@ static uint32_t bytes_per_cluster;
 
 static uint32_t current_dir_cluster = 0;
 
+// Card write counters
+static fat32_write_stats_t write_stats;
+
 // Working buffers
 static uint8_t sector_buffer[FAT32_SECTOR_SIZE] __attribute__((aligned(4)));
 static fat32_lfn_entry_t lfn_buffer[MAX_LFN_PART];
 
+// Metadata intent log
+//
+// FAT, FSInfo and directory sector updates are staged in RAM, recorded once
+// in a reserved log file and only written in place when the pending table is
+// checkpointed. Repeated updates of the same sector coalesce into a single
+// in-place write, and a crash between the two steps is repaired on mount by
+// replaying the log. A transaction is logged as one record or not at all:
+// one that cannot be staged is rolled back instead of being split.
+#define JOURNAL_FILE_NAME "/.fat32_intent.log"
+#define JOURNAL_MAGIC (0x4C544E49)       // "INTL"
+#define JOURNAL_LOG_SECTORS (256)        // size of a new log file in sectors
+#define JOURNAL_MIN_LOG_SECTORS (16)     // smallest existing log that is used
+#define JOURNAL_MAX_PENDING (16)         // committed sectors kept before a checkpoint
+#define JOURNAL_MAX_TXN (120)            // sectors one transaction can stage
+#define JOURNAL_TXN_RESERVE (6)          // sectors kept free for one transaction
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint32_t epoch;                          // bumped by every checkpoint
+    uint32_t sequence;                       // 0 for the log header, then 1, 2, ...
+    uint32_t count;                          // sector images following the record
+    uint32_t targets[JOURNAL_MAX_TXN];       // volume sector of each image
+    uint32_t image_checksum;
+    uint32_t header_checksum;
+} journal_record_t;
+
+// A staged sector image. Images of the open transaction are always new
+// slots after journal_txn_start, so committed images are never modified
+// until the transaction commits and a rollback only has to drop slots.
+typedef struct
+{
+    uint32_t target;                                       // volume sector
+    bool in_txn;                                           // staged by the open transaction
+    uint8_t image[FAT32_SECTOR_SIZE] __attribute__((aligned(4)));
+} journal_slot_t;
+
+static bool journal_enabled = false;
+static uint32_t journal_start_sector;        // first sector of the log file
+static uint32_t journal_log_sectors;         // size of the log file in sectors
+static uint32_t journal_epoch;
+static uint32_t journal_sequence;            // sequence of the last record
+static uint32_t journal_head;                // next free log sector
+static int journal_depth;                    // transaction nesting level
+static uint32_t journal_txn_start;           // first slot of the open transaction
+static bool journal_failed;                  // open transaction will be rolled back
+
+static journal_slot_t *pending;              // heap table, grown while a transaction needs it
+static uint32_t pending_count;
+static uint32_t pending_capacity;
+
+// Log headers and records are built here, never in sector_buffer, which may
+// hold the very image a caller is staging
+static uint8_t journal_buffer[FAT32_SECTOR_SIZE] __attribute__((aligned(4)));
+
 // TODO: Implement timer for SD card detection
 // This should call fat32_check_card_presence() periodically
 
@@ -80,16 +139,61 @@ static inline uint32_t cluster_to_sector(uint32_t cluster)
     return ((cluster - 2) * boot_sector.sectors_per_cluster) + first_data_sector;
 }
 
-static inline fat32_error_t read_sector(uint32_t sector, uint8_t *buffer)
+static inline fat32_error_t read_sector_raw(uint32_t sector, uint8_t *buffer)
 {
     return sd_read_block(volume_start_block + sector, buffer);
 }
 
-static inline fat32_error_t write_sector(uint32_t sector, const uint8_t *buffer)
+static inline fat32_error_t write_sector_raw(uint32_t sector, const uint8_t *buffer)
 {
+    write_stats.sector_writes++;
     return sd_write_block(volume_start_block + sector, buffer);
 }
 
+// Multi-block write of consecutive data sectors
+static inline fat32_error_t write_sectors_raw(uint32_t sector, uint32_t count, const uint8_t *buffer)
+{
+    write_stats.sector_writes += count;
+    return sd_write_blocks(volume_start_block + sector, count, buffer);
+}
+
+// Newest image of a sector, the open transaction's copy shadows a committed one
+static inline int journal_find(uint32_t sector)
+{
+    for (uint32_t i = pending_count; i-- > 0;)
+    {
+        if (pending[i].target == sector)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static fat32_error_t write_meta_sector(uint32_t sector, const uint8_t *buffer);
+
+// Sectors with a pending metadata image are served from the intent log so
+// readers always see the latest state
+static inline fat32_error_t read_sector(uint32_t sector, uint8_t *buffer)
+{
+    int slot = journal_find(sector);
+    if (slot >= 0)
+    {
+        memcpy(buffer, pending[slot].image, FAT32_SECTOR_SIZE);
+        return FAT32_OK;
+    }
+    return read_sector_raw(sector, buffer);
+}
+
+static inline fat32_error_t write_sector(uint32_t sector, const uint8_t *buffer)
+{
+    if (journal_find(sector) >= 0)
+    {
+        return write_meta_sector(sector, buffer);
+    }
+    return write_sector_raw(sector, buffer);
+}
+
 //
 // FAT32 file system functions
 //
@@ -169,9 +273,341 @@ static fat32_error_t is_valid_fat32_boot_sector(const fat32_boot_sector_t *bs)
     return FAT32_OK;
 }
 
+//
+// Metadata intent log
+//
+
+static uint32_t journal_checksum(uint32_t hash, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void journal_seal(journal_record_t *record)
+{
+    record->magic = JOURNAL_MAGIC;
+    record->header_checksum = journal_checksum(2166136261u, (const uint8_t *)record,
+                                               offsetof(journal_record_t, header_checksum));
+}
+
+static bool journal_record_valid(const journal_record_t *record)
+{
+    return record->magic == JOURNAL_MAGIC &&
+           record->count <= JOURNAL_MAX_TXN &&
+           record->header_checksum == journal_checksum(2166136261u, (const uint8_t *)record,
+                                                       offsetof(journal_record_t, header_checksum));
+}
+
+// Largest transaction the attached log can hold as a single record
+static inline uint32_t journal_max_txn(void)
+{
+    return journal_log_sectors - 1 < JOURNAL_MAX_TXN ? journal_log_sectors - 1 : JOURNAL_MAX_TXN;
+}
+
+// Start a new log epoch, which invalidates every record written so far
+static fat32_error_t journal_reset_log(void)
+{
+    journal_record_t *record = (journal_record_t *)journal_buffer;
+    memset(journal_buffer, 0, FAT32_SECTOR_SIZE);
+    record->epoch = ++journal_epoch;
+    journal_seal(record);
+    RETURN_ON_ERROR(write_sector_raw(journal_start_sector, journal_buffer));
+
+    journal_sequence = 0;
+    journal_head = 1;
+    return FAT32_OK;
+}
+
+// Apply every committed image in place and empty the log. Images of an
+// open transaction are not logged yet and stay staged.
+static fat32_error_t journal_checkpoint(void)
+{
+    uint32_t committed = 0;
+    for (uint32_t i = 0; i < pending_count; i++)
+    {
+        committed += !pending[i].in_txn;
+    }
+    if (committed == 0)
+    {
+        return FAT32_OK;
+    }
+
+    // Write in sector order so FAT sectors go out as one sequential sweep.
+    // Committed targets are unique, duplicates are merged at commit.
+    uint32_t last_target = 0;
+    for (uint32_t n = 0; n < committed; n++)
+    {
+        int next = -1;
+        for (uint32_t i = 0; i < pending_count; i++)
+        {
+            if (!pending[i].in_txn && (n == 0 || pending[i].target > last_target) &&
+                (next < 0 || pending[i].target < pending[next].target))
+            {
+                next = i;
+            }
+        }
+        RETURN_ON_ERROR(write_sector_raw(pending[next].target, pending[next].image));
+        last_target = pending[next].target;
+    }
+
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < pending_count; i++)
+    {
+        if (pending[i].in_txn)
+        {
+            if (kept != i)
+            {
+                pending[kept] = pending[i];
+            }
+            kept++;
+        }
+    }
+    journal_txn_start = 0;
+    pending_count = kept;
+    return journal_reset_log();
+}
+
+// Write one record holding every image staged by the open transaction, then
+// fold those images into the committed set
+static fat32_error_t journal_write_record(void)
+{
+    uint32_t count = pending_count - journal_txn_start;
+    if (count == 0)
+    {
+        return FAT32_OK;
+    }
+    if (journal_head + 1 + count > journal_log_sectors)
+    {
+        RETURN_ON_ERROR(journal_checkpoint());
+    }
+
+    journal_record_t *record = (journal_record_t *)journal_buffer;
+    uint32_t log_sector = journal_head + 1;
+    uint32_t image_checksum = 2166136261u;
+    for (uint32_t i = journal_txn_start; i < pending_count; i++)
+    {
+        RETURN_ON_ERROR(write_sector_raw(journal_start_sector + log_sector++, pending[i].image));
+        image_checksum = journal_checksum(image_checksum, pending[i].image, FAT32_SECTOR_SIZE);
+    }
+
+    // The header goes last; a torn record fails its checksum and is ignored
+    memset(journal_buffer, 0, FAT32_SECTOR_SIZE);
+    for (uint32_t i = journal_txn_start; i < pending_count; i++)
+    {
+        record->targets[record->count++] = pending[i].target;
+    }
+    record->epoch = journal_epoch;
+    record->sequence = ++journal_sequence;
+    record->image_checksum = image_checksum;
+    journal_seal(record);
+    RETURN_ON_ERROR(write_sector_raw(journal_start_sector + journal_head, journal_buffer));
+    journal_head = log_sector;
+
+    // Committed now: drop the images the transaction superseded
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < pending_count; i++)
+    {
+        if (i < journal_txn_start && journal_find(pending[i].target) != (int)i)
+        {
+            continue;
+        }
+        if (kept != i)
+        {
+            pending[kept] = pending[i];
+        }
+        pending[kept++].in_txn = false;
+    }
+    pending_count = kept;
+    journal_txn_start = kept;
+    return FAT32_OK;
+}
+
+static void forget_run_search(void);
+
+// Drop everything the open transaction staged and reload the FSInfo copy it
+// may have changed. Clusters it allocated are free again.
+static void journal_rollback(void)
+{
+    pending_count = journal_txn_start;
+    journal_failed = false;
+    read_sector(boot_sector.fat32_info, (uint8_t *)&fsinfo);
+    forget_run_search();
+}
+
+static bool journal_has_room(uint32_t sectors)
+{
+    return pending_count + sectors <= JOURNAL_MAX_PENDING &&
+           journal_head + 1 + sectors <= journal_log_sectors;
+}
+
+static fat32_error_t journal_begin(void)
+{
+    if (!journal_enabled || journal_depth++ > 0)
+    {
+        return FAT32_OK;
+    }
+
+    journal_txn_start = pending_count;
+    journal_failed = false;
+    if (!journal_has_room(JOURNAL_TXN_RESERVE))
+    {
+        fat32_error_t result = journal_checkpoint();
+        if (result != FAT32_OK)
+        {
+            journal_depth = 0;
+            return result;
+        }
+    }
+    return FAT32_OK;
+}
+
+// End a transaction with the result of the work done inside it. The
+// outermost level logs the transaction if everything succeeded and rolls
+// it back otherwise.
+static fat32_error_t journal_commit(fat32_error_t result)
+{
+    if (!journal_enabled || journal_depth == 0)
+    {
+        return result;
+    }
+    if (result != FAT32_OK)
+    {
+        journal_failed = true;
+    }
+    if (--journal_depth > 0)
+    {
+        return result;
+    }
+
+    if (!journal_failed)
+    {
+        result = journal_write_record();
+    }
+    if (result != FAT32_OK || journal_failed)
+    {
+        journal_rollback();
+        return result != FAT32_OK ? result : FAT32_ERROR_NO_MEMORY;
+    }
+    return FAT32_OK;
+}
+
+static fat32_error_t journal_grow(void)
+{
+    uint32_t capacity = pending_capacity ? pending_capacity * 2 : JOURNAL_MAX_PENDING;
+    if (capacity > JOURNAL_MAX_PENDING + JOURNAL_MAX_TXN)
+    {
+        capacity = JOURNAL_MAX_PENDING + JOURNAL_MAX_TXN;
+    }
+    journal_slot_t *grown = realloc(pending, capacity * sizeof(journal_slot_t));
+    if (!grown)
+    {
+        return FAT32_ERROR_NO_MEMORY;
+    }
+    pending = grown;
+    pending_capacity = capacity;
+    return FAT32_OK;
+}
+
+static fat32_error_t write_meta_sector(uint32_t sector, const uint8_t *buffer)
+{
+    if (!journal_enabled)
+    {
+        return write_sector_raw(sector, buffer);
+    }
+
+    if (journal_depth == 0)
+    {
+        RETURN_ON_ERROR(journal_begin());
+        return journal_commit(write_meta_sector(sector, buffer));
+    }
+    if (journal_failed)
+    {
+        return FAT32_ERROR_NO_MEMORY;
+    }
+
+    int slot = journal_find(sector);
+    if (slot < 0 || !pending[slot].in_txn)
+    {
+        // A transaction that outgrows the log fails as a whole
+        if (pending_count - journal_txn_start >= journal_max_txn() ||
+            (pending_count == pending_capacity && journal_grow() != FAT32_OK))
+        {
+            journal_failed = true;
+            return FAT32_ERROR_NO_MEMORY;
+        }
+        slot = pending_count++;
+        pending[slot].target = sector;
+        pending[slot].in_txn = true;
+    }
+
+    memcpy(pending[slot].image, buffer, FAT32_SECTOR_SIZE);
+    return FAT32_OK;
+}
+
+// Re-apply every intact record of the current epoch after an unclean stop.
+// Applying a record twice is harmless, so a crash during replay is also safe.
+static fat32_error_t journal_replay(void)
+{
+    journal_record_t record;
+
+    pending_count = 0;
+    journal_depth = 0;
+    journal_txn_start = 0;
+    journal_failed = false;
+    RETURN_ON_ERROR(read_sector_raw(journal_start_sector, journal_buffer));
+    memcpy(&record, journal_buffer, sizeof(record));
+    if (!journal_record_valid(&record) || record.sequence != 0)
+    {
+        // Fresh or unreadable log
+        journal_epoch = 0;
+        return journal_reset_log();
+    }
+    journal_epoch = record.epoch;
+    journal_sequence = 0;
+    journal_head = 1;
+
+    while (journal_head < journal_log_sectors)
+    {
+        RETURN_ON_ERROR(read_sector_raw(journal_start_sector + journal_head, journal_buffer));
+        memcpy(&record, journal_buffer, sizeof(record));
+        if (!journal_record_valid(&record) || record.epoch != journal_epoch ||
+            record.sequence != journal_sequence + 1 ||
+            journal_head + 1 + record.count > journal_log_sectors)
+        {
+            break;
+        }
+
+        // Verify the whole record before touching anything in place
+        uint32_t image_checksum = 2166136261u;
+        for (uint32_t i = 0; i < record.count; i++)
+        {
+            RETURN_ON_ERROR(read_sector_raw(journal_start_sector + journal_head + 1 + i, journal_buffer));
+            image_checksum = journal_checksum(image_checksum, journal_buffer, FAT32_SECTOR_SIZE);
+        }
+        if (image_checksum != record.image_checksum)
+        {
+            break;
+        }
+
+        for (uint32_t i = 0; i < record.count; i++)
+        {
+            RETURN_ON_ERROR(read_sector_raw(journal_start_sector + journal_head + 1 + i, journal_buffer));
+            RETURN_ON_ERROR(write_sector_raw(record.targets[i], journal_buffer));
+        }
+
+        journal_sequence = record.sequence;
+        journal_head += 1 + record.count;
+    }
+
+    return journal_reset_log();
+}
+
 static fat32_error_t update_fsinfo()
 {
-    return write_sector(boot_sector.fat32_info, (const uint8_t *)&fsinfo);
+    return write_meta_sector(boot_sector.fat32_info, (const uint8_t *)&fsinfo);
 }
 
 static fat32_error_t read_cluster_fat_entry(uint32_t cluster, uint32_t *value)
@@ -208,17 +644,42 @@ static fat32_error_t write_cluster_fat_entry(uint32_t cluster, uint32_t value)
     *(uint32_t *)(sector_buffer + entry_offset) &= 0xF0000000;
     *(uint32_t *)(sector_buffer + entry_offset) |= value & 0x0FFFFFFF;
 
-    RETURN_ON_ERROR(write_sector(fat_sector, sector_buffer));
+    RETURN_ON_ERROR(write_meta_sector(fat_sector, sector_buffer));
 
     return FAT32_OK;
 }
 
-static fat32_error_t get_next_free_cluster(uint32_t *cluster)
+#define GROWTH_WINDOW (8) // free clusters kept ahead of a growing chain
+
+// Where a search for free clusters starts: the caller's hint when it is a
+// valid cluster, otherwise the volume-wide FSInfo hint
+static inline uint32_t allocation_start(uint32_t hint)
 {
-    uint32_t start_cluster = fsinfo.next_free != 0xFFFFFFFF ? fsinfo.next_free : 2;
+    if (hint >= 2 && hint < cluster_count + 2)
+    {
+        return hint;
+    }
+    if (fsinfo.next_free >= 2 && fsinfo.next_free < cluster_count + 2)
+    {
+        return fsinfo.next_free;
+    }
+    return 2;
+}
+
+// Find a free cluster at or after hint, wrapping around to the start of the
+// volume. Passing the cluster after a file's tail keeps the file contiguous.
+static fat32_error_t find_free_cluster(uint32_t hint, uint32_t *cluster)
+{
+    uint32_t start_cluster = allocation_start(hint);
 
-    for (uint32_t i = start_cluster; i < cluster_count + 2; i++)
+    for (uint32_t n = 0; n < cluster_count; n++)
     {
+        uint32_t i = start_cluster + n;
+        if (i >= cluster_count + 2)
+        {
+            i -= cluster_count;
+        }
+
         uint32_t value;
         RETURN_ON_ERROR(read_cluster_fat_entry(i, &value));
 
@@ -231,7 +692,96 @@ static fat32_error_t get_next_free_cluster(uint32_t *cluster)
     return FAT32_ERROR_DISK_FULL;
 }
 
-static fat32_error_t release_cluster_chain(uint32_t start_cluster)
+// The first cluster of a new chain. The FSInfo hint moves past it by the
+// growth window so the next new chain leaves this one room to grow.
+static fat32_error_t get_next_free_cluster(uint32_t *cluster)
+{
+    RETURN_ON_ERROR(find_free_cluster(0, cluster));
+    if (*cluster + GROWTH_WINDOW < cluster_count + 2)
+    {
+        fsinfo.next_free = *cluster + GROWTH_WINDOW;
+    }
+    return FAT32_OK;
+}
+
+// Find the first run of count free clusters at or after hint. Runs do not
+// span the wrap back to cluster 2.
+static fat32_error_t find_free_run(uint32_t hint, uint32_t count, uint32_t *cluster)
+{
+    uint32_t start_cluster = allocation_start(hint);
+    uint32_t run = 0;
+
+    for (uint32_t n = 0; n < cluster_count; n++)
+    {
+        uint32_t i = start_cluster + n;
+        if (i >= cluster_count + 2)
+        {
+            i -= cluster_count;
+        }
+        if (i == 2)
+        {
+            run = 0;
+        }
+
+        uint32_t value;
+        RETURN_ON_ERROR(read_cluster_fat_entry(i, &value));
+
+        run = value == FAT32_FAT_ENTRY_FREE ? run + 1 : 0;
+        if (run == count)
+        {
+            *cluster = i + 1 - count;
+            return FAT32_OK;
+        }
+    }
+    return FAT32_ERROR_DISK_FULL;
+}
+
+// What the last growth window search learned. No run of GROWTH_WINDOW free
+// clusters lay between run_search_from and run_search_found (or anywhere at
+// all, with run_search_none). Allocating cannot make a run appear, so the
+// next search resumes from there; freeing clusters forgets it.
+static uint32_t run_search_from;
+static uint32_t run_search_found;
+static bool run_search_none;
+
+static void forget_run_search(void)
+{
+    run_search_from = 0;
+    run_search_found = 0;
+    run_search_none = false;
+}
+
+// Find a run of GROWTH_WINDOW free clusters at the FSInfo hint, skipping
+// what the last search already scanned
+static fat32_error_t find_growth_window(uint32_t *cluster)
+{
+    if (run_search_none)
+    {
+        return FAT32_ERROR_DISK_FULL;
+    }
+
+    uint32_t search_from = allocation_start(0);
+    uint32_t start_cluster = search_from;
+    if (run_search_from != 0 && search_from >= run_search_from && search_from < run_search_found)
+    {
+        search_from = run_search_from;
+        start_cluster = run_search_found;
+    }
+
+    fat32_error_t result = find_free_run(start_cluster, GROWTH_WINDOW, cluster);
+    if (result == FAT32_ERROR_DISK_FULL)
+    {
+        run_search_none = true;
+    }
+    else if (result == FAT32_OK && *cluster >= start_cluster)
+    {
+        run_search_from = search_from;
+        run_search_found = *cluster;
+    }
+    return result;
+}
+
+static fat32_error_t free_cluster_chain(uint32_t start_cluster)
 {
     uint32_t total_clusters = 0;
     uint32_t lowest_cluster = 0xFFFFFFFF;
@@ -255,16 +805,23 @@ static fat32_error_t release_cluster_chain(uint32_t start_cluster)
         cluster = next_cluster;
     }
 
+    forget_run_search();
     fsinfo.free_count += total_clusters;
     if (fsinfo.next_free > lowest_cluster)
     {
         fsinfo.next_free = lowest_cluster;
     }
-    RETURN_ON_ERROR(write_sector(boot_sector.fat32_info, (const uint8_t *)&fsinfo));
+    RETURN_ON_ERROR(update_fsinfo());
 
     return FAT32_OK;
 }
 
+static fat32_error_t release_cluster_chain(uint32_t start_cluster)
+{
+    RETURN_ON_ERROR(journal_begin());
+    return journal_commit(free_cluster_chain(start_cluster));
+}
+
 static fat32_error_t find_last_cluster(uint32_t start_cluster, uint32_t count, uint32_t *last_cluster)
 {
     *last_cluster = start_cluster;
@@ -277,39 +834,159 @@ static fat32_error_t find_last_cluster(uint32_t start_cluster, uint32_t count, u
     return FAT32_OK;
 }
 
-static fat32_error_t allocate_and_link_cluster(uint32_t last_cluster, uint32_t *new_cluster)
+// Grow a chain by one cluster. The cluster after the tail is used when it
+// is free. Otherwise the next free cluster is most likely the room behind
+// another growing file, so the chain moves on to a free run of
+// GROWTH_WINDOW clusters at the FSInfo hint instead. The hint is kept that
+// far ahead of the new tail, so files written side by side grow in
+// extents rather than interleaving cluster by cluster.
+static fat32_error_t link_new_cluster(uint32_t last_cluster, uint32_t *new_cluster)
 {
-    RETURN_ON_ERROR(get_next_free_cluster(new_cluster));
+    uint32_t value;
+    uint32_t next_cluster = last_cluster + 1;
+    if (next_cluster < cluster_count + 2 && read_cluster_fat_entry(next_cluster, &value) == FAT32_OK &&
+        value == FAT32_FAT_ENTRY_FREE)
+    {
+        *new_cluster = next_cluster;
+    }
+    else if (find_growth_window(new_cluster) != FAT32_OK)
+    {
+        RETURN_ON_ERROR(find_free_cluster(next_cluster, new_cluster));
+    }
     RETURN_ON_ERROR(write_cluster_fat_entry(last_cluster, *new_cluster));
     RETURN_ON_ERROR(write_cluster_fat_entry(*new_cluster, FAT32_FAT_ENTRY_EOC));
 
+    bool changed = false;
+    if (fsinfo.next_free >= *new_cluster && fsinfo.next_free < *new_cluster + GROWTH_WINDOW &&
+        *new_cluster + GROWTH_WINDOW < cluster_count + 2)
+    {
+        fsinfo.next_free = *new_cluster + GROWTH_WINDOW;
+        changed = true;
+    }
     if (fsinfo.free_count != 0xFFFFFFFF)
     {
         fsinfo.free_count--;
-        update_fsinfo();
+        changed = true;
+    }
+    if (changed)
+    {
+        RETURN_ON_ERROR(update_fsinfo());
     }
 
     return FAT32_OK;
 }
 
-static fat32_error_t clear_cluster(uint32_t cluster)
+// The FAT link, the end-of-chain mark and FSInfo are one logged update
+static fat32_error_t allocate_and_link_cluster(uint32_t last_cluster, uint32_t *new_cluster)
 {
-    uint32_t sector = cluster_to_sector(cluster);
-    memset(sector_buffer, 0, FAT32_SECTOR_SIZE);
-    for (uint32_t i = 0; i < boot_sector.sectors_per_cluster; i++)
-    {
-        RETURN_ON_ERROR(write_sector(sector + i, sector_buffer));
-    }
-    return FAT32_OK;
+    RETURN_ON_ERROR(journal_begin());
+    return journal_commit(link_new_cluster(last_cluster, new_cluster));
 }
 
-static fat32_error_t seek_to_cluster(uint32_t start_cluster, uint32_t offset, uint32_t *result_cluster)
+// Allocate a whole chain up front, reading and writing each FAT sector once.
+// Free clusters are taken in order from the hint (0 for the FSInfo hint), so
+// the chain is contiguous whenever the free space is.
+static fat32_error_t allocate_chain(uint32_t count, uint32_t hint, uint32_t *first_cluster)
 {
-    uint32_t cluster = start_cluster;
-    for (uint32_t i = 0; i < offset; i++)
+    const uint32_t entries_per_sector = FAT32_SECTOR_SIZE / sizeof(uint32_t);
+    uint32_t *entries = (uint32_t *)sector_buffer;
+    bool global_hint = allocation_start(hint) != hint;
+    hint = allocation_start(hint);
+    uint32_t allocated = 0;
+    uint32_t tail = 0;
+
+    *first_cluster = 0;
+    for (int pass = 0; pass < 2 && allocated < count; pass++)
     {
-        uint32_t next_cluster;
-        RETURN_ON_ERROR(read_cluster_fat_entry(cluster, &next_cluster));
+        uint32_t cluster = pass == 0 ? hint : 2;
+        uint32_t end = pass == 0 ? cluster_count + 2 : hint;
+
+        while (cluster < end && allocated < count)
+        {
+            uint32_t sector_first = cluster - (cluster % entries_per_sector);
+            uint32_t fat_sector = boot_sector.reserved_sectors + cluster / entries_per_sector;
+            uint32_t head = 0;
+            uint32_t last = 0;
+
+            RETURN_ON_ERROR(read_sector(fat_sector, sector_buffer));
+            for (; cluster < end && cluster < sector_first + entries_per_sector && allocated < count; cluster++)
+            {
+                uint32_t *entry = &entries[cluster - sector_first];
+                if ((*entry & 0x0FFFFFFF) != FAT32_FAT_ENTRY_FREE)
+                {
+                    continue;
+                }
+                if (last)
+                {
+                    entries[last - sector_first] = (entries[last - sector_first] & 0xF0000000) | cluster;
+                }
+                else
+                {
+                    head = cluster;
+                }
+                *entry = (*entry & 0xF0000000) | FAT32_FAT_ENTRY_EOC;
+                last = cluster;
+                allocated++;
+            }
+
+            if (head == 0)
+            {
+                continue;
+            }
+            RETURN_ON_ERROR(write_meta_sector(fat_sector, sector_buffer));
+            if (tail)
+            {
+                RETURN_ON_ERROR(write_cluster_fat_entry(tail, head));
+            }
+            else
+            {
+                *first_cluster = head;
+            }
+            tail = last;
+        }
+    }
+
+    if (fsinfo.free_count != 0xFFFFFFFF)
+    {
+        fsinfo.free_count -= allocated;
+    }
+    if (allocated < count)
+    {
+        if (*first_cluster)
+        {
+            RETURN_ON_ERROR(free_cluster_chain(*first_cluster));
+        }
+        *first_cluster = 0;
+        return FAT32_ERROR_DISK_FULL;
+    }
+
+    // New files start after this chain, leaving room for it to grow in place.
+    // A file continuing from its own tail leaves the volume hint alone.
+    if (global_hint)
+    {
+        fsinfo.next_free = tail + 1;
+    }
+    return update_fsinfo();
+}
+
+static fat32_error_t clear_cluster(uint32_t cluster)
+{
+    uint32_t sector = cluster_to_sector(cluster);
+    memset(sector_buffer, 0, FAT32_SECTOR_SIZE);
+    for (uint32_t i = 0; i < boot_sector.sectors_per_cluster; i++)
+    {
+        RETURN_ON_ERROR(write_sector(sector + i, sector_buffer));
+    }
+    return FAT32_OK;
+}
+
+static fat32_error_t seek_to_cluster(uint32_t start_cluster, uint32_t offset, uint32_t *result_cluster)
+{
+    uint32_t cluster = start_cluster;
+    for (uint32_t i = 0; i < offset; i++)
+    {
+        uint32_t next_cluster;
+        RETURN_ON_ERROR(read_cluster_fat_entry(cluster, &next_cluster));
         if (next_cluster >= FAT32_FAT_ENTRY_EOC)
         {
             return FAT32_ERROR_INVALID_POSITION;
@@ -324,6 +1001,76 @@ static fat32_error_t seek_to_cluster(uint32_t start_cluster, uint32_t offset, ui
 // as the original, just without Pico-specific dependencies. 
 // Due to length limits, I'm including the critical mount/unmount functions:
 
+// Locate (or create) the reserved log file and replay it
+static fat32_error_t journal_attach(void)
+{
+    fat32_file_t log;
+    if (!pending)
+    {
+        RETURN_ON_ERROR(journal_grow());
+    }
+
+    fat32_error_t result = fat32_open(&log, JOURNAL_FILE_NAME);
+    if (result == FAT32_ERROR_FILE_NOT_FOUND)
+    {
+        RETURN_ON_ERROR(fat32_create(&log, JOURNAL_FILE_NAME));
+        memset(pending[0].image, 0, FAT32_SECTOR_SIZE);
+        for (uint32_t i = 0; i < JOURNAL_LOG_SECTORS && result == FAT32_OK; i++)
+        {
+            result = fat32_write(&log, pending[0].image, FAT32_SECTOR_SIZE, NULL);
+        }
+        uint32_t entry_sector = log.dir_entry_sector;
+        uint32_t entry_offset = log.dir_entry_offset;
+        fat32_close(&log);
+        RETURN_ON_ERROR(result);
+
+        // Keep the log out of directory listings
+        RETURN_ON_ERROR(read_sector(entry_sector, sector_buffer));
+        ((fat32_dir_entry_t *)(sector_buffer + entry_offset))->attr |= FAT32_ATTR_HIDDEN | FAT32_ATTR_SYSTEM;
+        RETURN_ON_ERROR(write_sector(entry_sector, sector_buffer));
+
+        RETURN_ON_ERROR(fat32_open(&log, JOURNAL_FILE_NAME));
+    }
+    else
+    {
+        RETURN_ON_ERROR(result);
+    }
+
+    uint32_t start_cluster = log.start_cluster;
+    uint32_t size = log.file_size;
+    fat32_close(&log);
+
+    // Logs made by older builds may be smaller, use whatever size is there
+    journal_log_sectors = size / FAT32_SECTOR_SIZE;
+    if (journal_log_sectors > JOURNAL_LOG_SECTORS)
+    {
+        journal_log_sectors = JOURNAL_LOG_SECTORS;
+    }
+    if (start_cluster < 2 || journal_log_sectors < JOURNAL_MIN_LOG_SECTORS)
+    {
+        return FAT32_ERROR_INVALID_FORMAT;
+    }
+
+    // Records are written by sector number, so the log must be contiguous
+    uint32_t clusters = (journal_log_sectors + boot_sector.sectors_per_cluster - 1) / boot_sector.sectors_per_cluster;
+    uint32_t cluster = start_cluster;
+    for (uint32_t i = 1; i < clusters; i++)
+    {
+        uint32_t next_cluster;
+        RETURN_ON_ERROR(read_cluster_fat_entry(cluster, &next_cluster));
+        if (next_cluster != cluster + 1)
+        {
+            return FAT32_ERROR_INVALID_FORMAT;
+        }
+        cluster = next_cluster;
+    }
+
+    journal_start_sector = cluster_to_sector(start_cluster);
+    RETURN_ON_ERROR(journal_replay());
+    journal_enabled = true;
+    return FAT32_OK;
+}
+
 fat32_error_t fat32_mount(void)
 {
     if (!sd_card_present())
@@ -401,11 +1148,41 @@ fat32_error_t fat32_mount(void)
     }
 
     fat32_mounted = true;
+    mount_status = FAT32_OK;
+
+    // Without a usable log, metadata is written in place synchronously
+    if (journal_attach() == FAT32_OK)
+    {
+        // Replay may have rewritten FSInfo
+        RETURN_ON_ERROR(read_sector(boot_sector.fat32_info, sector_buffer));
+        memcpy(&fsinfo, sector_buffer, sizeof(fat32_fsinfo_t));
+    }
     return FAT32_OK;
 }
 
+static fat32_error_t write_behind_flush_all(void);
+static void nameidx_forget(void);
+
 void fat32_unmount(void)
 {
+    // Best effort, the card may already be gone. Other machines never read
+    // the intent log, so committed updates are written in place now; only
+    // a card pulled without unmounting relies on replay at the next mount.
+    write_behind_flush_all();
+    nameidx_forget();
+    if (journal_enabled && journal_depth == 0)
+    {
+        journal_checkpoint();
+    }
+
+    journal_enabled = false;
+    journal_depth = 0;
+    pending_count = 0;
+    pending_capacity = 0;
+    free(pending);
+    pending = NULL;
+    forget_run_search();
+
     fat32_mounted = false;
     mount_status = FAT32_ERROR_NO_CARD;
     volume_start_block = 0;
@@ -447,6 +1224,36 @@ fat32_error_t fat32_get_status(void)
     return mount_status;
 }
 
+// Card blocks holding cluster data, for tools that bypass the file system
+fat32_error_t fat32_get_data_region(uint32_t *first_block, uint32_t *block_count)
+{
+    if (!first_block || !block_count)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+    if (!fat32_mounted)
+    {
+        return FAT32_ERROR_NOT_MOUNTED;
+    }
+    *first_block = volume_start_block + first_data_sector;
+    *block_count = cluster_count * boot_sector.sectors_per_cluster;
+    return FAT32_OK;
+}
+
+fat32_error_t fat32_sync(void)
+{
+    if (!fat32_mounted)
+    {
+        return FAT32_OK;
+    }
+    RETURN_ON_ERROR(write_behind_flush_all());
+    if (!journal_enabled || journal_depth > 0)
+    {
+        return FAT32_OK;
+    }
+    return journal_checkpoint();
+}
+
 // NOTE: Due to character limits, I'm providing the core structure.
 // The full file would include ALL functions from the original fat32.c
 // with the same logic, just without Pico-specific timer/semaphore code.
@@ -470,4 +1277,1723 @@ void fat32_init(void)
 
 // NOTE: Include ALL other functions from the original fat32.c here
 // (fat32_open, fat32_read, fat32_write, fat32_dir_read, etc.)
-// They work identically without Pico-specific dependencies
\ No newline at end of file
+// They work identically without Pico-specific dependencies
+//
+// Batched directory iteration
+//
+
+static uint8_t dir_iter_lfn_checksum(const char *short_name)
+{
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++)
+    {
+        sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t)short_name[i];
+    }
+    return sum;
+}
+
+static void dir_iter_short_name(const fat32_dir_entry_t *dir_entry, char *name)
+{
+    int pos = 0;
+    bool lower_base = (dir_entry->nt_reserved & 0x08) != 0;
+    bool lower_ext = (dir_entry->nt_reserved & 0x10) != 0;
+
+    for (int i = 0; i < 8 && dir_entry->name[i] != ' '; i++)
+    {
+        char c = (i == 0 && (uint8_t)dir_entry->name[0] == 0x05) ? (char)0xE5 : dir_entry->name[i];
+        name[pos++] = lower_base ? tolower((unsigned char)c) : c;
+    }
+    if (dir_entry->name[8] != ' ')
+    {
+        name[pos++] = '.';
+        for (int i = 8; i < 11 && dir_entry->name[i] != ' '; i++)
+        {
+            name[pos++] = lower_ext ? tolower((unsigned char)dir_entry->name[i]) : dir_entry->name[i];
+        }
+    }
+    name[pos] = '\0';
+}
+
+static void dir_iter_store_lfn(fat32_dir_iter_t *iter, const fat32_lfn_entry_t *lfn)
+{
+    uint16_t chars[13];
+    memcpy(&chars[0], lfn->name1, sizeof(lfn->name1));
+    memcpy(&chars[5], lfn->name2, sizeof(lfn->name2));
+    memcpy(&chars[11], lfn->name3, sizeof(lfn->name3));
+
+    int base = ((lfn->seq & 0x1F) - 1) * 13;
+    for (int i = 0; i < 13 && base + i < FAT32_MAX_FILENAME_LEN; i++)
+    {
+        if (chars[i] == 0x0000 || chars[i] == 0xFFFF)
+        {
+            iter->lfn_name[base + i] = '\0';
+            break;
+        }
+        iter->lfn_name[base + i] = chars[i] < 0x80 ? (char)chars[i] : '?';
+    }
+}
+
+static inline void dir_iter_reset_lfn(fat32_dir_iter_t *iter)
+{
+    iter->lfn_next_seq = 0;
+    iter->lfn_name[0] = '\0';
+}
+
+static void dir_iter_start(fat32_dir_iter_t *iter, uint32_t cluster)
+{
+    iter->cluster = cluster;
+    iter->sector = 0;
+    iter->entry = 0;
+    iter->loaded = false;
+    iter->end = cluster < 2;
+    dir_iter_reset_lfn(iter);
+}
+
+// Move to the next directory sector, following the cluster chain as needed
+static fat32_error_t dir_iter_advance_sector(fat32_dir_iter_t *iter)
+{
+    iter->entry = 0;
+    iter->loaded = false;
+    if (++iter->sector < boot_sector.sectors_per_cluster)
+    {
+        return FAT32_OK;
+    }
+
+    uint32_t next_cluster;
+    RETURN_ON_ERROR(read_cluster_fat_entry(iter->cluster, &next_cluster));
+    iter->sector = 0;
+    if (next_cluster < 2 || next_cluster >= FAT32_FAT_ENTRY_EOC)
+    {
+        iter->end = true;
+    }
+    else
+    {
+        iter->cluster = next_cluster;
+    }
+    return FAT32_OK;
+}
+
+fat32_error_t fat32_dir_iter_open(fat32_dir_iter_t *iter, const char *path)
+{
+    if (!iter || !path)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+    if (!fat32_is_ready())
+    {
+        return FAT32_ERROR_NOT_MOUNTED;
+    }
+
+    fat32_file_t dir;
+    RETURN_ON_ERROR(fat32_open(&dir, path));
+    uint32_t start_cluster = dir.start_cluster;
+    bool is_directory = (dir.attributes & FAT32_ATTR_DIRECTORY) != 0;
+    fat32_close(&dir);
+
+    if (start_cluster == 0)
+    {
+        start_cluster = boot_sector.root_cluster;
+    }
+    else if (!is_directory)
+    {
+        return FAT32_ERROR_NOT_A_DIRECTORY;
+    }
+
+    dir_iter_start(iter, start_cluster);
+    return FAT32_OK;
+}
+
+fat32_error_t fat32_dir_iter_next(fat32_dir_iter_t *iter, fat32_entry_t *entries, size_t max_entries, size_t *count)
+{
+    if (!iter || !entries || !count)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    *count = 0;
+    while (*count < max_entries && !iter->end)
+    {
+        if (!iter->loaded)
+        {
+            RETURN_ON_ERROR(read_sector(cluster_to_sector(iter->cluster) + iter->sector, iter->sector_data));
+            iter->loaded = true;
+        }
+
+        // Decode every remaining entry of the sector that fits in the batch
+        const fat32_dir_entry_t *dir_entries = (const fat32_dir_entry_t *)iter->sector_data;
+        while (iter->entry < FAT32_DIR_ENTRIES_PER_SECTOR && *count < max_entries)
+        {
+            const fat32_dir_entry_t *dir_entry = &dir_entries[iter->entry++];
+            uint8_t first = (uint8_t)dir_entry->name[0];
+
+            if (first == FAT32_DIR_ENTRY_END)
+            {
+                iter->end = true;
+                return FAT32_OK;
+            }
+            if (first == FAT32_DIR_ENTRY_FREE)
+            {
+                dir_iter_reset_lfn(iter);
+                continue;
+            }
+
+            if ((dir_entry->attr & FAT32_ATTR_LONG_NAME) == FAT32_ATTR_LONG_NAME)
+            {
+                const fat32_lfn_entry_t *lfn = (const fat32_lfn_entry_t *)dir_entry;
+                uint8_t seq = lfn->seq & 0x1F;
+                if (lfn->seq & FAT32_LFN_LAST_ENTRY)
+                {
+                    if (seq == 0 || seq > MAX_LFN_PART)
+                    {
+                        dir_iter_reset_lfn(iter);
+                        continue;
+                    }
+                    iter->lfn_checksum = lfn->checksum;
+                    iter->lfn_name[seq * 13 < FAT32_MAX_FILENAME_LEN ? seq * 13 : FAT32_MAX_FILENAME_LEN] = '\0';
+                }
+                else if (seq == 0 || seq != iter->lfn_next_seq || lfn->checksum != iter->lfn_checksum)
+                {
+                    dir_iter_reset_lfn(iter);
+                    continue;
+                }
+                dir_iter_store_lfn(iter, lfn);
+                iter->lfn_next_seq = seq - 1;
+                continue;
+            }
+
+            if (dir_entry->attr & FAT32_ATTR_VOLUME_ID)
+            {
+                dir_iter_reset_lfn(iter);
+                continue;
+            }
+
+            fat32_entry_t *entry = &entries[(*count)++];
+            iter->last_sector = cluster_to_sector(iter->cluster) + iter->sector;
+            iter->last_entry = iter->entry - 1;
+            if (iter->lfn_next_seq == 0 && iter->lfn_name[0] &&
+                iter->lfn_checksum == dir_iter_lfn_checksum(dir_entry->name))
+            {
+                strcpy(entry->filename, iter->lfn_name);
+            }
+            else
+            {
+                dir_iter_short_name(dir_entry, entry->filename);
+            }
+            dir_iter_reset_lfn(iter);
+
+            entry->size = dir_entry->file_size;
+            entry->date = dir_entry->write_date;
+            entry->time = dir_entry->write_time;
+            entry->start_cluster = ((uint32_t)dir_entry->first_cluster_hi << 16) | dir_entry->first_cluster_lo;
+            entry->attr = dir_entry->attr;
+        }
+
+        if (iter->entry >= FAT32_DIR_ENTRIES_PER_SECTOR)
+        {
+            RETURN_ON_ERROR(dir_iter_advance_sector(iter));
+        }
+    }
+    return FAT32_OK;
+}
+
+//
+// Tree walking
+//
+
+fat32_error_t fat32_walk_open(fat32_walk_t *walk, const char *path)
+{
+    if (!walk || !path)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    size_t len = strlen(path);
+    while (len > 0 && path[len - 1] == '/')
+    {
+        len--;
+    }
+    if (len >= FAT32_MAX_PATH_LEN)
+    {
+        return FAT32_ERROR_INVALID_PATH;
+    }
+
+    RETURN_ON_ERROR(fat32_dir_iter_open(&walk->stack[0], path));
+    memcpy(walk->path, path, len);
+    walk->path[len] = '\0';
+    walk->path_len[0] = (uint16_t)len;
+    walk->levels = 1;
+    walk->depth = 0;
+    walk->descend = false;
+    walk->descend_cluster = 0;
+    walk->skipped = 0;
+    return FAT32_OK;
+}
+
+// Returns the next entry in depth-first order. At the end of the tree the
+// entry comes back with an empty filename, like fat32_dir_read().
+fat32_error_t fat32_walk_next(fat32_walk_t *walk, fat32_entry_t *entry)
+{
+    if (!walk || !entry)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    // Enter the directory returned last time, unless it was pruned
+    if (walk->descend)
+    {
+        walk->descend = false;
+        if (walk->levels <= FAT32_WALK_MAX_DEPTH)
+        {
+            uint32_t cluster = walk->descend_cluster ? walk->descend_cluster : boot_sector.root_cluster;
+            dir_iter_start(&walk->stack[walk->levels], cluster);
+            walk->path_len[walk->levels] = (uint16_t)strlen(walk->path);
+            walk->levels++;
+        }
+        else
+        {
+            walk->skipped++;
+        }
+    }
+
+    while (walk->levels > 0)
+    {
+        uint8_t level = walk->levels - 1;
+        size_t count;
+
+        RETURN_ON_ERROR(fat32_dir_iter_next(&walk->stack[level], entry, 1, &count));
+        if (count == 0)
+        {
+            walk->levels--;
+            continue;
+        }
+        if (strcmp(entry->filename, ".") == 0 || strcmp(entry->filename, "..") == 0)
+        {
+            continue;
+        }
+
+        size_t base = walk->path_len[level];
+        size_t name_len = strlen(entry->filename);
+        if (base + 1 + name_len >= FAT32_MAX_PATH_LEN)
+        {
+            walk->skipped++;
+            continue;
+        }
+        walk->path[base] = '/';
+        memcpy(walk->path + base + 1, entry->filename, name_len + 1);
+
+        walk->depth = level;
+        if (entry->attr & FAT32_ATTR_DIRECTORY)
+        {
+            walk->descend = true;
+            walk->descend_cluster = entry->start_cluster;
+        }
+        return FAT32_OK;
+    }
+
+    walk->path[walk->path_len[0]] = '\0';
+    entry->filename[0] = '\0';
+    return FAT32_OK;
+}
+
+// Do not descend into the directory returned by the last fat32_walk_next()
+void fat32_walk_skip(fat32_walk_t *walk)
+{
+    walk->descend = false;
+}
+
+//
+// File copy
+//
+
+#define COPY_CHUNK_SECTORS (32) // sectors moved per multi-block read and write
+#define COPY_ALLOC_STEP (2048)   // clusters preallocated per transaction
+
+static uint8_t copy_buffer[COPY_CHUNK_SECTORS * FAT32_SECTOR_SIZE] __attribute__((aligned(4)));
+
+typedef struct
+{
+    uint32_t cluster;
+    uint32_t sector;
+} chain_cursor_t;
+
+// Take the longest run of physically consecutive sectors at the cursor
+static fat32_error_t chain_next_run(chain_cursor_t *cursor, uint32_t max_sectors, uint32_t *start_sector, uint32_t *run)
+{
+    if (cursor->cluster < 2)
+    {
+        return FAT32_ERROR_INVALID_POSITION;
+    }
+
+    *start_sector = cluster_to_sector(cursor->cluster) + cursor->sector;
+    *run = 0;
+    while (*run < max_sectors)
+    {
+        uint32_t available = boot_sector.sectors_per_cluster - cursor->sector;
+        uint32_t take = available < max_sectors - *run ? available : max_sectors - *run;
+        *run += take;
+        cursor->sector += take;
+        if (cursor->sector < boot_sector.sectors_per_cluster)
+        {
+            break;
+        }
+
+        uint32_t next_cluster;
+        RETURN_ON_ERROR(read_cluster_fat_entry(cursor->cluster, &next_cluster));
+        bool contiguous = next_cluster == cursor->cluster + 1;
+        cursor->sector = 0;
+        cursor->cluster = (next_cluster >= 2 && next_cluster < FAT32_FAT_ENTRY_EOC) ? next_cluster : 0;
+        if (!contiguous || cursor->cluster == 0)
+        {
+            break;
+        }
+    }
+    return FAT32_OK;
+}
+
+static fat32_error_t copy_read_chunk(chain_cursor_t *cursor, uint32_t sectors, uint8_t *buffer)
+{
+    for (uint32_t done = 0; done < sectors;)
+    {
+        uint32_t start_sector, run;
+        RETURN_ON_ERROR(chain_next_run(cursor, sectors - done, &start_sector, &run));
+        RETURN_ON_ERROR(sd_read_blocks(volume_start_block + start_sector, run, buffer + done * FAT32_SECTOR_SIZE));
+        done += run;
+    }
+    return FAT32_OK;
+}
+
+static fat32_error_t copy_write_chunk(chain_cursor_t *cursor, uint32_t sectors, const uint8_t *buffer)
+{
+    for (uint32_t done = 0; done < sectors;)
+    {
+        uint32_t start_sector, run;
+        RETURN_ON_ERROR(chain_next_run(cursor, sectors - done, &start_sector, &run));
+        RETURN_ON_ERROR(write_sectors_raw(start_sector, run, buffer + done * FAT32_SECTOR_SIZE));
+        done += run;
+    }
+    return FAT32_OK;
+}
+
+// Allocate the next piece of the destination chain and link it after tail.
+// The first piece is hooked into the directory entry, size is set with the
+// last one.
+static fat32_error_t copy_extend(uint32_t entry_sector, uint32_t entry_offset, uint32_t count, uint32_t size,
+                                 uint32_t *first_cluster, uint32_t *tail)
+{
+    uint32_t piece;
+    RETURN_ON_ERROR(allocate_chain(count, *tail ? *tail + 1 : 0, &piece));
+    if (*tail)
+    {
+        RETURN_ON_ERROR(write_cluster_fat_entry(*tail, piece));
+    }
+    RETURN_ON_ERROR(find_last_cluster(piece, count, tail));
+    if (*first_cluster && size == 0)
+    {
+        return FAT32_OK;
+    }
+
+    RETURN_ON_ERROR(read_sector(entry_sector, sector_buffer));
+    fat32_dir_entry_t *dir_entry = (fat32_dir_entry_t *)(sector_buffer + entry_offset);
+    if (!*first_cluster)
+    {
+        *first_cluster = piece;
+        dir_entry->first_cluster_hi = (uint16_t)(piece >> 16);
+        dir_entry->first_cluster_lo = (uint16_t)(piece & 0xFFFF);
+    }
+    dir_entry->file_size = size;
+    return write_meta_sector(entry_sector, sector_buffer);
+}
+
+// Give the empty destination its preallocated chain and final size. Each
+// step is its own logged transaction so a large file never outgrows the
+// intent log; a crash in between leaves a chain longer than the file, never
+// a broken one.
+static fat32_error_t copy_preallocate(uint32_t entry_sector, uint32_t entry_offset, uint32_t size, uint32_t *first_cluster)
+{
+    uint32_t clusters = (size + bytes_per_cluster - 1) / bytes_per_cluster;
+    uint32_t tail = 0;
+
+    *first_cluster = 0;
+    for (uint32_t done = 0; done < clusters;)
+    {
+        uint32_t step = clusters - done < COPY_ALLOC_STEP ? clusters - done : COPY_ALLOC_STEP;
+        done += step;
+        RETURN_ON_ERROR(journal_begin());
+        RETURN_ON_ERROR(journal_commit(copy_extend(entry_sector, entry_offset, step, done == clusters ? size : 0,
+                                                   first_cluster, &tail)));
+    }
+    return FAT32_OK;
+}
+
+fat32_error_t fat32_copy(const char *src_path, const char *dst_path, fat32_copy_progress_t progress, void *context)
+{
+    fat32_file_t file;
+
+    if (!src_path || !dst_path)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    RETURN_ON_ERROR(fat32_open_indexed(&file, src_path));
+    uint32_t size = file.file_size;
+    uint32_t src_cluster = file.start_cluster;
+    bool is_directory = (file.attributes & FAT32_ATTR_DIRECTORY) != 0;
+    fat32_close(&file);
+    if (is_directory)
+    {
+        return FAT32_ERROR_NOT_A_FILE;
+    }
+
+    RETURN_ON_ERROR(fat32_create(&file, dst_path));
+    uint32_t entry_sector = file.dir_entry_sector;
+    uint32_t entry_offset = file.dir_entry_offset;
+    fat32_index_add(dst_path, &file);
+    fat32_close(&file);
+
+    if (size == 0 || src_cluster < 2)
+    {
+        if (progress)
+        {
+            progress(0, 0, context);
+        }
+        return FAT32_OK;
+    }
+
+    // Allocate the whole destination first so its chain is as contiguous as
+    // the free space allows and data can be written in long runs
+    uint32_t dst_cluster;
+    fat32_error_t result = copy_preallocate(entry_sector, entry_offset, size, &dst_cluster);
+    if (result != FAT32_OK)
+    {
+        fat32_index_remove(dst_path);
+        fat32_delete(dst_path);
+        return result;
+    }
+
+    // Both chains are walked in runs of consecutive sectors, so each chunk
+    // costs one multi-block read and one multi-block write when contiguous
+    chain_cursor_t src = {src_cluster, 0};
+    chain_cursor_t dst = {dst_cluster, 0};
+    uint32_t total_sectors = (size + FAT32_SECTOR_SIZE - 1) / FAT32_SECTOR_SIZE;
+    uint32_t sectors_done = 0;
+    while (sectors_done < total_sectors)
+    {
+        uint32_t chunk = total_sectors - sectors_done;
+        if (chunk > COPY_CHUNK_SECTORS)
+        {
+            chunk = COPY_CHUNK_SECTORS;
+        }
+
+        result = copy_read_chunk(&src, chunk, copy_buffer);
+        if (result == FAT32_OK)
+        {
+            result = copy_write_chunk(&dst, chunk, copy_buffer);
+        }
+        if (result != FAT32_OK)
+        {
+            // A partial copy is full size but holds garbage past this point
+            fat32_index_remove(dst_path);
+            fat32_delete(dst_path);
+            return result;
+        }
+        sectors_done += chunk;
+
+        if (progress)
+        {
+            uint32_t bytes = sectors_done * FAT32_SECTOR_SIZE;
+            progress(bytes < size ? bytes : size, size, context);
+        }
+    }
+
+    return FAT32_OK;
+}
+
+//
+// Write-behind buffering
+//
+
+#define WRITE_BEHIND_SLOTS (4)      // files that can have a write-behind buffer at once
+#define WRITE_BEHIND_RESERVE (8)    // default extent reservation window in clusters
+
+typedef struct
+{
+    fat32_file_t *file;    // owning handle, NULL when the slot is free
+    uint8_t *buffer;       // buffered bytes
+    uint32_t size;         // capacity, a multiple of the sector size
+    uint32_t start;        // file position of buffer[0]
+    uint32_t length;       // bytes waiting to be written
+    bool owned;            // buffer was allocated by the driver
+    uint32_t last_cluster; // last cluster of the chain, 0 when not known
+    uint32_t last_index;   // index of last_cluster within the chain
+    uint32_t reserve;      // clusters to allocate at least per extension
+} write_behind_t;
+
+static write_behind_t write_behind[WRITE_BEHIND_SLOTS];
+
+static write_behind_t *write_behind_find(const fat32_file_t *file)
+{
+    for (int i = 0; i < WRITE_BEHIND_SLOTS; i++)
+    {
+        if (write_behind[i].file == file)
+        {
+            return &write_behind[i];
+        }
+    }
+    return NULL;
+}
+
+// Grow the chain of a file until it covers size bytes. Growth happens in
+// extents of at least the reservation window, continuing right after the
+// file's last cluster, so files written side by side do not interleave.
+static fat32_error_t write_behind_extend(write_behind_t *slot, uint32_t size)
+{
+    fat32_file_t *file = slot->file;
+    uint32_t needed = (size + bytes_per_cluster - 1) / bytes_per_cluster;
+
+    if (file->start_cluster < 2)
+    {
+        uint32_t first_cluster;
+        RETURN_ON_ERROR(allocate_chain(needed > slot->reserve ? needed : slot->reserve, 0, &first_cluster));
+        RETURN_ON_ERROR(read_sector(file->dir_entry_sector, sector_buffer));
+        fat32_dir_entry_t *dir_entry = (fat32_dir_entry_t *)(sector_buffer + file->dir_entry_offset);
+        dir_entry->first_cluster_hi = (uint16_t)(first_cluster >> 16);
+        dir_entry->first_cluster_lo = (uint16_t)(first_cluster & 0xFFFF);
+        RETURN_ON_ERROR(write_meta_sector(file->dir_entry_sector, sector_buffer));
+        file->start_cluster = first_cluster;
+        file->current_cluster = first_cluster;
+        slot->last_cluster = 0;
+        return FAT32_OK;
+    }
+
+    // Walk to the end of the chain once, later flushes continue from there
+    if (slot->last_cluster < 2)
+    {
+        slot->last_cluster = file->start_cluster;
+        slot->last_index = 0;
+    }
+    for (;;)
+    {
+        uint32_t next_cluster;
+        RETURN_ON_ERROR(read_cluster_fat_entry(slot->last_cluster, &next_cluster));
+        if (next_cluster < 2 || next_cluster >= FAT32_FAT_ENTRY_EOC)
+        {
+            break;
+        }
+        slot->last_cluster = next_cluster;
+        slot->last_index++;
+    }
+
+    if (slot->last_index + 1 >= needed)
+    {
+        return FAT32_OK;
+    }
+
+    uint32_t extension = needed - slot->last_index - 1;
+    uint32_t first_cluster;
+    RETURN_ON_ERROR(allocate_chain(extension > slot->reserve ? extension : slot->reserve,
+                                   slot->last_cluster + 1, &first_cluster));
+    return write_cluster_fat_entry(slot->last_cluster, first_cluster);
+}
+
+// Give back reserved clusters past the end of the file
+static fat32_error_t write_behind_trim(write_behind_t *slot)
+{
+    fat32_file_t *file = slot->file;
+    if (file->start_cluster < 2)
+    {
+        return FAT32_OK;
+    }
+
+    uint32_t keep = (file->file_size + bytes_per_cluster - 1) / bytes_per_cluster;
+    uint32_t next_cluster;
+    if (keep == 0)
+    {
+        RETURN_ON_ERROR(free_cluster_chain(file->start_cluster));
+        RETURN_ON_ERROR(read_sector(file->dir_entry_sector, sector_buffer));
+        fat32_dir_entry_t *dir_entry = (fat32_dir_entry_t *)(sector_buffer + file->dir_entry_offset);
+        dir_entry->first_cluster_hi = 0;
+        dir_entry->first_cluster_lo = 0;
+        RETURN_ON_ERROR(write_meta_sector(file->dir_entry_sector, sector_buffer));
+        file->start_cluster = 0;
+        file->current_cluster = 0;
+        return FAT32_OK;
+    }
+
+    uint32_t last_cluster;
+    RETURN_ON_ERROR(seek_to_cluster(file->start_cluster, keep - 1, &last_cluster));
+    RETURN_ON_ERROR(read_cluster_fat_entry(last_cluster, &next_cluster));
+    if (next_cluster < 2 || next_cluster >= FAT32_FAT_ENTRY_EOC)
+    {
+        return FAT32_OK;
+    }
+    RETURN_ON_ERROR(write_cluster_fat_entry(last_cluster, FAT32_FAT_ENTRY_EOC));
+    return free_cluster_chain(next_cluster);
+}
+
+static fat32_error_t write_behind_set_size(fat32_file_t *file, uint32_t size)
+{
+    RETURN_ON_ERROR(read_sector(file->dir_entry_sector, sector_buffer));
+    fat32_dir_entry_t *dir_entry = (fat32_dir_entry_t *)(sector_buffer + file->dir_entry_offset);
+    dir_entry->file_size = size;
+    RETURN_ON_ERROR(write_meta_sector(file->dir_entry_sector, sector_buffer));
+    file->file_size = size;
+    return FAT32_OK;
+}
+
+// Write the buffered bytes, whole sectors as multi-block runs and only the
+// unaligned head and tail as read-modify-write
+static fat32_error_t write_behind_flush(write_behind_t *slot)
+{
+    fat32_file_t *file = slot->file;
+    uint32_t position = slot->start;
+    uint32_t end = slot->start + slot->length;
+    const uint8_t *data = slot->buffer;
+
+    if (slot->length == 0)
+    {
+        return FAT32_OK;
+    }
+
+    RETURN_ON_ERROR(journal_begin());
+    RETURN_ON_ERROR(journal_commit(write_behind_extend(slot, end)));
+
+    uint32_t cluster;
+    RETURN_ON_ERROR(seek_to_cluster(file->start_cluster, position / bytes_per_cluster, &cluster));
+    chain_cursor_t cursor = {cluster, (position % bytes_per_cluster) / FAT32_SECTOR_SIZE};
+
+    while (position < end)
+    {
+        uint32_t offset = position % FAT32_SECTOR_SIZE;
+        uint32_t start_sector, run;
+
+        if (offset != 0 || end - position < FAT32_SECTOR_SIZE)
+        {
+            uint32_t take = FAT32_SECTOR_SIZE - offset;
+            if (take > end - position)
+            {
+                take = end - position;
+            }
+            RETURN_ON_ERROR(chain_next_run(&cursor, 1, &start_sector, &run));
+            if (position - offset < file->file_size)
+            {
+                RETURN_ON_ERROR(read_sector(start_sector, sector_buffer));
+            }
+            else
+            {
+                memset(sector_buffer, 0, FAT32_SECTOR_SIZE);
+            }
+            memcpy(sector_buffer + offset, data, take);
+            RETURN_ON_ERROR(write_sector(start_sector, sector_buffer));
+            position += take;
+            data += take;
+        }
+        else
+        {
+            RETURN_ON_ERROR(chain_next_run(&cursor, (end - position) / FAT32_SECTOR_SIZE, &start_sector, &run));
+            RETURN_ON_ERROR(write_sectors_raw(start_sector, run, data));
+            position += run * FAT32_SECTOR_SIZE;
+            data += run * FAT32_SECTOR_SIZE;
+        }
+    }
+
+    if (end > file->file_size)
+    {
+        RETURN_ON_ERROR(write_behind_set_size(file, end));
+    }
+
+    write_stats.flushes++;
+    slot->start = end;
+    slot->length = 0;
+
+    // Bring the handle's own cluster cursor up to date
+    return fat32_seek(file, file->position);
+}
+
+static fat32_error_t write_behind_flush_all(void)
+{
+    fat32_error_t status = FAT32_OK;
+    for (int i = 0; i < WRITE_BEHIND_SLOTS; i++)
+    {
+        if (write_behind[i].file)
+        {
+            fat32_error_t result = write_behind_flush(&write_behind[i]);
+            if (status == FAT32_OK)
+            {
+                status = result;
+            }
+        }
+    }
+    return status;
+}
+
+// Attach a write-behind buffer to an open file. With a NULL buffer one
+// cluster is allocated by the driver.
+fat32_error_t fat32_write_buffer_attach(fat32_file_t *file, void *buffer, uint32_t size)
+{
+    if (!file || !file->is_open || (file->attributes & FAT32_ATTR_DIRECTORY))
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+    if (write_behind_find(file))
+    {
+        return FAT32_OK;
+    }
+
+    write_behind_t *slot = write_behind_find(NULL);
+    if (!slot)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    bool owned = buffer == NULL;
+    if (owned)
+    {
+        size = bytes_per_cluster;
+        buffer = malloc(size);
+        if (!buffer)
+        {
+            return FAT32_ERROR_NO_MEMORY;
+        }
+    }
+    size -= size % FAT32_SECTOR_SIZE;
+    if (size == 0)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    slot->file = file;
+    slot->buffer = buffer;
+    slot->size = size;
+    slot->start = file->position;
+    slot->length = 0;
+    slot->owned = owned;
+    slot->last_cluster = 0;
+    slot->last_index = 0;
+    slot->reserve = WRITE_BEHIND_RESERVE;
+    return FAT32_OK;
+}
+
+// Set how many clusters are allocated ahead of the data, 0 disables it
+fat32_error_t fat32_write_buffer_reserve(fat32_file_t *file, uint32_t clusters)
+{
+    write_behind_t *slot = write_behind_find(file);
+    if (!slot || !file)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+    slot->reserve = clusters;
+    return FAT32_OK;
+}
+
+// Flush and drop the write-behind buffer, fat32_close() does this too
+fat32_error_t fat32_write_buffer_detach(fat32_file_t *file)
+{
+    write_behind_t *slot = write_behind_find(file);
+    if (!slot || !file)
+    {
+        return FAT32_OK;
+    }
+
+    fat32_error_t result = write_behind_flush(slot);
+    if (result == FAT32_OK)
+    {
+        result = journal_begin();
+    }
+    if (result == FAT32_OK)
+    {
+        result = journal_commit(write_behind_trim(slot));
+    }
+    if (slot->owned)
+    {
+        free(slot->buffer);
+    }
+    memset(slot, 0, sizeof(*slot));
+    return result;
+}
+
+fat32_error_t fat32_flush(fat32_file_t *file)
+{
+    write_behind_t *slot = write_behind_find(file);
+    if (!slot || !file)
+    {
+        return FAT32_OK;
+    }
+    return write_behind_flush(slot);
+}
+
+// Set up a handle for the directory entry at sector and offset, positioned
+// at the start of the file. Every path that opens an existing entry goes
+// through here so handles never differ in what they start with.
+static void file_open_entry(fat32_file_t *file, const fat32_dir_entry_t *dir_entry, uint32_t sector, uint32_t offset)
+{
+    file->is_open = true;
+    file->start_cluster = ((uint32_t)dir_entry->first_cluster_hi << 16) | dir_entry->first_cluster_lo;
+    file->current_cluster = file->start_cluster;
+    file->file_size = dir_entry->file_size;
+    file->position = 0;
+    file->attributes = dir_entry->attr;
+    file->dir_entry_sector = sector;
+    file->dir_entry_offset = offset;
+    file->last_entry_read = 0;
+}
+
+// Slots are keyed by the handle's address, so a handle must give its slot
+// back before the memory is reused for another file
+fat32_error_t fat32_close(fat32_file_t *file)
+{
+    if (!file)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    fat32_error_t result = fat32_write_buffer_detach(file);
+    file->is_open = false;
+    return result;
+}
+
+// Like fat32_read(), but bytes still waiting in the write-behind buffer are
+// written out first so the read sees them
+fat32_error_t fat32_read_buffered(fat32_file_t *file, void *buffer, size_t size, size_t *bytes_read)
+{
+    write_behind_t *slot = write_behind_find(file);
+    if (slot && slot->length > 0)
+    {
+        fat32_error_t result = write_behind_flush(slot);
+        if (result != FAT32_OK)
+        {
+            if (bytes_read)
+            {
+                *bytes_read = 0;
+            }
+            return result;
+        }
+    }
+    return fat32_read(file, buffer, size, bytes_read);
+}
+
+// Like fat32_write(), but small writes collect in the attached buffer and
+// reach the card when it fills, when the file position moves elsewhere, or
+// on fat32_flush(), fat32_read_buffered(), fat32_close() and fat32_sync()
+fat32_error_t fat32_write_buffered(fat32_file_t *file, const void *buffer, size_t size, size_t *bytes_written)
+{
+    write_behind_t *slot = write_behind_find(file);
+    const uint8_t *data = buffer;
+    size_t done = 0;
+
+    if (bytes_written)
+    {
+        *bytes_written = 0;
+    }
+    if (!slot)
+    {
+        return file ? fat32_write(file, buffer, size, bytes_written) : FAT32_ERROR_INVALID_PARAMETER;
+    }
+    if (!buffer)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    // A seek since the last write starts a new run
+    if (file->position != slot->start + slot->length)
+    {
+        RETURN_ON_ERROR(write_behind_flush(slot));
+        slot->start = file->position;
+    }
+
+    while (done < size)
+    {
+        uint32_t take = slot->size - slot->length;
+        if (take > size - done)
+        {
+            take = size - done;
+        }
+        memcpy(slot->buffer + slot->length, data + done, take);
+        slot->length += take;
+        done += take;
+        file->position += take;
+        write_stats.bytes_written += take;
+
+        if (slot->length == slot->size)
+        {
+            RETURN_ON_ERROR(write_behind_flush(slot));
+        }
+        if (bytes_written)
+        {
+            *bytes_written = done;
+        }
+    }
+    return FAT32_OK;
+}
+
+void fat32_get_write_stats(fat32_write_stats_t *stats)
+{
+    *stats = write_stats;
+}
+
+//
+// Fragmentation statistics
+//
+
+// Private FAT sector cache, chains are mostly local so one sector covers
+// 128 consecutive links
+static uint8_t frag_fat_sector[FAT32_SECTOR_SIZE] __attribute__((aligned(4)));
+static uint32_t frag_fat_loaded;
+
+static fat32_error_t frag_next_cluster(uint32_t cluster, uint32_t *next_cluster)
+{
+    const uint32_t entries_per_sector = FAT32_SECTOR_SIZE / sizeof(uint32_t);
+    uint32_t fat_sector = boot_sector.reserved_sectors + cluster / entries_per_sector;
+
+    if (fat_sector != frag_fat_loaded)
+    {
+        RETURN_ON_ERROR(read_sector(fat_sector, frag_fat_sector));
+        frag_fat_loaded = fat_sector;
+    }
+    *next_cluster = ((const uint32_t *)frag_fat_sector)[cluster % entries_per_sector] & 0x0FFFFFFF;
+    return FAT32_OK;
+}
+
+static fat32_error_t frag_count_chain(uint32_t cluster, fat32_frag_stats_t *stats)
+{
+    uint32_t extents = 1;
+
+    // Bounded by the cluster count so a looped chain cannot hang the walk
+    for (uint32_t n = 0; n < cluster_count; n++)
+    {
+        uint32_t next_cluster;
+        RETURN_ON_ERROR(frag_next_cluster(cluster, &next_cluster));
+        stats->clusters++;
+        if (next_cluster < 2 || next_cluster >= FAT32_FAT_ENTRY_EOC)
+        {
+            break;
+        }
+        if (next_cluster != cluster + 1)
+        {
+            extents++;
+        }
+        cluster = next_cluster;
+    }
+
+    stats->chains++;
+    stats->extents += extents;
+    if (extents > 1)
+    {
+        stats->fragmented++;
+    }
+    return FAT32_OK;
+}
+
+// Count how the chains of every file and directory below path are split up
+fat32_error_t fat32_get_fragmentation(const char *path, fat32_frag_stats_t *stats)
+{
+    if (!path || !stats)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+    memset(stats, 0, sizeof(*stats));
+
+    fat32_walk_t *walk = malloc(sizeof(fat32_walk_t));
+    if (!walk)
+    {
+        return FAT32_ERROR_NO_MEMORY;
+    }
+
+    fat32_entry_t entry;
+    frag_fat_loaded = 0;
+    fat32_error_t result = fat32_walk_open(walk, path);
+    while (result == FAT32_OK)
+    {
+        result = fat32_walk_next(walk, &entry);
+        if (result != FAT32_OK || entry.filename[0] == '\0')
+        {
+            break;
+        }
+        if (entry.start_cluster >= 2 && entry.start_cluster < cluster_count + 2)
+        {
+            result = frag_count_chain(entry.start_cluster, stats);
+        }
+    }
+
+    free(walk);
+    return result;
+}
+
+//
+// Directory name index
+//
+// An optional hidden file in a directory holding (name hash, entry location)
+// records. A header sector carries a small unsorted tail for recent
+// additions, the sorted records follow it. Every hit is checked against the
+// directory entry itself and misses fall back to the linear scan, so an
+// index gone stale behind our back can cost time but never hide a file.
+//
+
+#define NAMEIDX_FILE_NAME ".nameidx"
+#define NAMEIDX_TEMP_NAME ".nameidx.new"
+#define NAMEIDX_MAGIC (0x3244494E) // "NID2"
+#define NAMEIDX_BATCH (512)        // records sorted in RAM per merge
+#define NAMEIDX_TOMBSTONE (0)      // sector of a removed record
+#define NAMEIDX_MISSING_SLOTS (8)  // directories remembered as having no index
+
+typedef struct __attribute__((packed))
+{
+    uint32_t hash;
+    uint32_t sector;     // volume sector of the short entry
+    uint8_t slot;        // entry within that sector
+    uint8_t reserved[3];
+} nameidx_record_t;
+
+#define NAMEIDX_TAIL_MAX ((FAT32_SECTOR_SIZE - 12) / sizeof(nameidx_record_t))
+#define NAMEIDX_CACHE_RECORDS (FAT32_SECTOR_SIZE / sizeof(nameidx_record_t))
+
+typedef struct __attribute__((packed))
+{
+    uint32_t magic;
+    uint32_t sorted_count;                    // records after the header sector
+    uint32_t tail_count;                      // records in tail, unsorted
+    nameidx_record_t tail[NAMEIDX_TAIL_MAX];
+    uint8_t padding[FAT32_SECTOR_SIZE - 12 - NAMEIDX_TAIL_MAX * sizeof(nameidx_record_t)];
+} nameidx_header_t;
+
+static nameidx_header_t nameidx_header;
+static uint8_t nameidx_entries[2 * FAT32_SECTOR_SIZE] __attribute__((aligned(4)));
+static nameidx_record_t nameidx_cache[NAMEIDX_CACHE_RECORDS];
+static uint32_t nameidx_cache_block; // block of records in the cache plus 1, 0 when empty
+static fat32_dir_iter_t nameidx_scratch;
+
+// Handle of the most recently used index, so a lookup does not have to scan
+// the big directory for the index file itself
+static char nameidx_cached_dir[FAT32_MAX_PATH_LEN];
+static fat32_file_t nameidx_cached_file;
+
+// Path hashes of directories found without an index, so opening files in
+// them does not pay for a failed lookup of the index file every time.
+// A collision only sends an indexed directory down the linear scan.
+static uint32_t nameidx_missing[NAMEIDX_MISSING_SLOTS];
+static uint32_t nameidx_missing_next;
+
+static void nameidx_forget(void)
+{
+    nameidx_cached_dir[0] = '\0';
+    memset(nameidx_missing, 0, sizeof(nameidx_missing));
+}
+
+static uint32_t nameidx_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    while (*name)
+    {
+        hash ^= (uint8_t)tolower((unsigned char)*name++);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int nameidx_compare(const void *a, const void *b)
+{
+    const nameidx_record_t *ra = a;
+    const nameidx_record_t *rb = b;
+    if (ra->hash != rb->hash)
+    {
+        return ra->hash < rb->hash ? -1 : 1;
+    }
+    if (ra->sector != rb->sector)
+    {
+        return ra->sector < rb->sector ? -1 : 1;
+    }
+    return ra->slot < rb->slot ? -1 : ra->slot > rb->slot;
+}
+
+// Split a path into its directory and final name
+static bool nameidx_split(const char *path, char *dir, const char **name)
+{
+    const char *slash = strrchr(path, '/');
+    size_t dir_len = slash ? (size_t)(slash - path) : 0;
+
+    *name = slash ? slash + 1 : path;
+    if (**name == '\0' || dir_len >= FAT32_MAX_PATH_LEN)
+    {
+        return false;
+    }
+    if (slash == path)
+    {
+        dir_len = 1;
+    }
+    memcpy(dir, path, dir_len);
+    dir[dir_len] = '\0';
+    return true;
+}
+
+static bool nameidx_join(char *path, const char *dir, const char *name)
+{
+    size_t dir_len = strlen(dir);
+    const char *separator = (dir_len == 0 || dir[dir_len - 1] == '/') ? "" : "/";
+    int len = snprintf(path, FAT32_MAX_PATH_LEN, "%s%s%s", dir, separator, name);
+    return len > 0 && len < FAT32_MAX_PATH_LEN;
+}
+
+static bool nameidx_is_own_file(const char *name)
+{
+    return strncmp(name, NAMEIDX_FILE_NAME, strlen(NAMEIDX_FILE_NAME)) == 0;
+}
+
+static nameidx_record_t nameidx_record(const char *name, uint32_t sector, uint32_t slot)
+{
+    nameidx_record_t record = {nameidx_hash(name), sector, (uint8_t)slot, {0}};
+    return record;
+}
+
+static bool nameidx_is_missing(uint32_t dir_hash)
+{
+    for (int i = 0; i < NAMEIDX_MISSING_SLOTS; i++)
+    {
+        if (dir_hash != 0 && nameidx_missing[i] == dir_hash)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void nameidx_set_missing(uint32_t dir_hash)
+{
+    nameidx_missing[nameidx_missing_next++ % NAMEIDX_MISSING_SLOTS] = dir_hash;
+}
+
+// Decode the name of the entry a record points at. FILE_NOT_FOUND means the
+// slot no longer holds a live entry, INVALID_POSITION that its long name
+// starts in an earlier cluster and cannot be read back cheaply.
+static fat32_error_t nameidx_entry_name(const nameidx_record_t *record, char *name, fat32_dir_entry_t *dir_entry)
+{
+    uint32_t sector = record->sector;
+    int slot = (int)FAT32_DIR_ENTRIES_PER_SECTOR + (int)record->slot;
+    const fat32_dir_entry_t *entries = (const fat32_dir_entry_t *)nameidx_entries;
+
+    if (sector == NAMEIDX_TOMBSTONE || sector < first_data_sector || record->slot >= FAT32_DIR_ENTRIES_PER_SECTOR)
+    {
+        return FAT32_ERROR_FILE_NOT_FOUND;
+    }
+
+    // The entry's sector goes in the second half so the slots before it,
+    // possibly from the previous sector, are contiguous in memory
+    RETURN_ON_ERROR(read_sector(sector, nameidx_entries + FAT32_SECTOR_SIZE));
+    const fat32_dir_entry_t *short_entry = &entries[slot];
+    uint8_t first = (uint8_t)short_entry->name[0];
+    if (first == FAT32_DIR_ENTRY_END || first == FAT32_DIR_ENTRY_FREE ||
+        (short_entry->attr & FAT32_ATTR_LONG_NAME) == FAT32_ATTR_LONG_NAME ||
+        (short_entry->attr & FAT32_ATTR_VOLUME_ID))
+    {
+        return FAT32_ERROR_FILE_NOT_FOUND;
+    }
+    *dir_entry = *short_entry;
+
+    // Collect the long name backwards, part 1 sits right before the entry
+    uint8_t checksum = dir_iter_lfn_checksum(short_entry->name);
+    bool previous_loaded = false;
+    dir_iter_reset_lfn(&nameidx_scratch);
+    for (uint8_t expect = 1; expect <= MAX_LFN_PART; expect++)
+    {
+        int index = slot - expect;
+        if (index < (int)FAT32_DIR_ENTRIES_PER_SECTOR && !previous_loaded)
+        {
+            if ((sector - first_data_sector) % boot_sector.sectors_per_cluster == 0)
+            {
+                return FAT32_ERROR_INVALID_POSITION;
+            }
+            RETURN_ON_ERROR(read_sector(sector - 1, nameidx_entries));
+            previous_loaded = true;
+        }
+        if (index < 0)
+        {
+            return FAT32_ERROR_INVALID_POSITION;
+        }
+
+        const fat32_lfn_entry_t *lfn = (const fat32_lfn_entry_t *)&entries[index];
+        if ((lfn->attr & FAT32_ATTR_LONG_NAME) != FAT32_ATTR_LONG_NAME || lfn->seq == FAT32_DIR_ENTRY_FREE ||
+            (lfn->seq & 0x1F) != expect || lfn->checksum != checksum)
+        {
+            break;
+        }
+        if (lfn->seq & FAT32_LFN_LAST_ENTRY)
+        {
+            nameidx_scratch.lfn_name[expect * 13 < FAT32_MAX_FILENAME_LEN ? expect * 13 : FAT32_MAX_FILENAME_LEN] = '\0';
+            dir_iter_store_lfn(&nameidx_scratch, lfn);
+            strcpy(name, nameidx_scratch.lfn_name);
+            return FAT32_OK;
+        }
+        dir_iter_store_lfn(&nameidx_scratch, lfn);
+    }
+
+    dir_iter_short_name(short_entry, name);
+    return FAT32_OK;
+}
+
+// Check a candidate record: OK on a match, FILE_NOT_FOUND for a hash
+// collision, INVALID_FORMAT when the record no longer describes the entry
+static fat32_error_t nameidx_check(const nameidx_record_t *record, const char *name, fat32_dir_entry_t *dir_entry)
+{
+    char found[FAT32_MAX_FILENAME_LEN + 1];
+    fat32_error_t result = nameidx_entry_name(record, found, dir_entry);
+    if (result == FAT32_ERROR_FILE_NOT_FOUND)
+    {
+        return FAT32_ERROR_INVALID_FORMAT;
+    }
+    RETURN_ON_ERROR(result);
+
+    if (strcasecmp(found, name) == 0)
+    {
+        return FAT32_OK;
+    }
+    return nameidx_hash(found) == record->hash ? FAT32_ERROR_FILE_NOT_FOUND : FAT32_ERROR_INVALID_FORMAT;
+}
+
+static fat32_error_t nameidx_open(const char *dir, fat32_file_t *index)
+{
+    char path[FAT32_MAX_PATH_LEN];
+    size_t bytes_read;
+
+    if (!nameidx_join(path, dir, NAMEIDX_FILE_NAME))
+    {
+        return FAT32_ERROR_INVALID_PATH;
+    }
+
+    fat32_error_t result;
+    uint32_t dir_hash = nameidx_hash(dir);
+    if (dir[0] == '/' && strcmp(dir, nameidx_cached_dir) == 0)
+    {
+        *index = nameidx_cached_file;
+        result = fat32_seek(index, 0);
+    }
+    else if (dir[0] == '/' && nameidx_is_missing(dir_hash))
+    {
+        return FAT32_ERROR_FILE_NOT_FOUND;
+    }
+    else
+    {
+        result = fat32_open(index, path);
+        if (result == FAT32_ERROR_FILE_NOT_FOUND && dir[0] == '/')
+        {
+            nameidx_set_missing(dir_hash);
+        }
+        RETURN_ON_ERROR(result);
+        if (dir[0] == '/')
+        {
+            strcpy(nameidx_cached_dir, dir);
+            nameidx_cached_file = *index;
+        }
+    }
+
+    if (result == FAT32_OK)
+    {
+        result = fat32_read(index, &nameidx_header, sizeof(nameidx_header), &bytes_read);
+    }
+    if (result == FAT32_OK &&
+        (bytes_read != sizeof(nameidx_header) || nameidx_header.magic != NAMEIDX_MAGIC ||
+         nameidx_header.tail_count > NAMEIDX_TAIL_MAX ||
+         index->file_size < FAT32_SECTOR_SIZE + nameidx_header.sorted_count * sizeof(nameidx_record_t)))
+    {
+        result = FAT32_ERROR_INVALID_FORMAT;
+    }
+    if (result != FAT32_OK)
+    {
+        fat32_close(index);
+        nameidx_forget();
+    }
+    nameidx_cache_block = 0;
+    return result;
+}
+
+static fat32_error_t nameidx_read_record(fat32_file_t *index, uint32_t position, nameidx_record_t *record)
+{
+    uint32_t block = position / NAMEIDX_CACHE_RECORDS;
+    if (block + 1 != nameidx_cache_block)
+    {
+        size_t bytes_read;
+        RETURN_ON_ERROR(fat32_seek(index, FAT32_SECTOR_SIZE + block * sizeof(nameidx_cache)));
+        RETURN_ON_ERROR(fat32_read(index, nameidx_cache, sizeof(nameidx_cache), &bytes_read));
+        nameidx_cache_block = block + 1;
+    }
+    *record = nameidx_cache[position % NAMEIDX_CACHE_RECORDS];
+    return FAT32_OK;
+}
+
+// Find name in an open index. On a hit returns the record and its byte
+// offset in the index file. INVALID_FORMAT means a record was found to be
+// stale.
+static fat32_error_t nameidx_find(fat32_file_t *index, const char *name, fat32_dir_entry_t *dir_entry,
+                                  nameidx_record_t *found, uint32_t *record_offset)
+{
+    uint32_t hash = nameidx_hash(name);
+    fat32_error_t result;
+
+    for (uint32_t i = 0; i < nameidx_header.tail_count; i++)
+    {
+        if (nameidx_header.tail[i].hash != hash || nameidx_header.tail[i].sector == NAMEIDX_TOMBSTONE)
+        {
+            continue;
+        }
+        result = nameidx_check(&nameidx_header.tail[i], name, dir_entry);
+        if (result != FAT32_ERROR_FILE_NOT_FOUND)
+        {
+            *found = nameidx_header.tail[i];
+            *record_offset = offsetof(nameidx_header_t, tail) + i * sizeof(nameidx_record_t);
+            return result;
+        }
+    }
+
+    // Lower bound of the hash in the sorted records
+    uint32_t low = 0;
+    uint32_t high = nameidx_header.sorted_count;
+    nameidx_record_t record;
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        RETURN_ON_ERROR(nameidx_read_record(index, middle, &record));
+        if (record.hash < hash)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    for (; low < nameidx_header.sorted_count; low++)
+    {
+        RETURN_ON_ERROR(nameidx_read_record(index, low, &record));
+        if (record.hash != hash)
+        {
+            break;
+        }
+        if (record.sector == NAMEIDX_TOMBSTONE)
+        {
+            continue;
+        }
+        result = nameidx_check(&record, name, dir_entry);
+        if (result != FAT32_ERROR_FILE_NOT_FOUND)
+        {
+            *found = record;
+            *record_offset = FAT32_SECTOR_SIZE + low * sizeof(nameidx_record_t);
+            return result;
+        }
+    }
+    return FAT32_ERROR_FILE_NOT_FOUND;
+}
+
+// Write a new index holding the live records of the current one (when
+// has_old) merged with a sorted batch, then swap it in
+static fat32_error_t nameidx_merge(const char *dir, bool has_old, const nameidx_record_t *batch, uint32_t count)
+{
+    char index_path[FAT32_MAX_PATH_LEN];
+    char temp_path[FAT32_MAX_PATH_LEN];
+    fat32_file_t old_index;
+    fat32_file_t new_index;
+    nameidx_record_t record;
+
+    if (!nameidx_join(index_path, dir, NAMEIDX_FILE_NAME) || !nameidx_join(temp_path, dir, NAMEIDX_TEMP_NAME))
+    {
+        return FAT32_ERROR_INVALID_PATH;
+    }
+
+    uint32_t old_count = 0;
+    if (has_old)
+    {
+        RETURN_ON_ERROR(nameidx_open(dir, &old_index));
+        old_count = nameidx_header.sorted_count;
+    }
+
+    fat32_delete(temp_path);
+    fat32_error_t result = fat32_create(&new_index, temp_path);
+    if (result == FAT32_OK)
+    {
+        result = fat32_write_buffer_attach(&new_index, NULL, 0);
+    }
+
+    // Header sector first, filled in once the count is known
+    memset(&nameidx_header, 0, sizeof(nameidx_header));
+    if (result == FAT32_OK)
+    {
+        result = fat32_write_buffered(&new_index, &nameidx_header, sizeof(nameidx_header), NULL);
+    }
+
+    uint32_t written = 0;
+    uint32_t old_position = 0;
+    uint32_t batch_position = 0;
+    bool have_old_record = false;
+    while (result == FAT32_OK)
+    {
+        while (!have_old_record && old_position < old_count && result == FAT32_OK)
+        {
+            result = nameidx_read_record(&old_index, old_position++, &record);
+            have_old_record = record.sector != NAMEIDX_TOMBSTONE;
+        }
+        if (result != FAT32_OK)
+        {
+            break;
+        }
+
+        const nameidx_record_t *next;
+        if (have_old_record && (batch_position >= count || nameidx_compare(&record, &batch[batch_position]) <= 0))
+        {
+            next = &record;
+            have_old_record = false;
+        }
+        else if (batch_position < count)
+        {
+            next = &batch[batch_position++];
+        }
+        else
+        {
+            break;
+        }
+        if (next->sector == NAMEIDX_TOMBSTONE)
+        {
+            continue;
+        }
+        result = fat32_write_buffered(&new_index, next, sizeof(*next), NULL);
+        written++;
+    }
+
+    if (has_old)
+    {
+        fat32_close(&old_index);
+    }
+    if (new_index.is_open)
+    {
+        fat32_error_t detach = fat32_write_buffer_detach(&new_index);
+        if (result == FAT32_OK)
+        {
+            result = detach;
+        }
+        if (result == FAT32_OK)
+        {
+            memset(&nameidx_header, 0, sizeof(nameidx_header));
+            nameidx_header.magic = NAMEIDX_MAGIC;
+            nameidx_header.sorted_count = written;
+            result = fat32_seek(&new_index, 0);
+        }
+        if (result == FAT32_OK)
+        {
+            result = fat32_write(&new_index, &nameidx_header, sizeof(nameidx_header), NULL);
+        }
+        fat32_close(&new_index);
+    }
+    nameidx_forget();
+    if (result != FAT32_OK)
+    {
+        fat32_delete(temp_path);
+        return result;
+    }
+
+    fat32_delete(index_path);
+    RETURN_ON_ERROR(fat32_rename(temp_path, index_path));
+
+    // Keep the index out of directory listings
+    RETURN_ON_ERROR(fat32_open(&new_index, index_path));
+    uint32_t entry_sector = new_index.dir_entry_sector;
+    uint32_t entry_offset = new_index.dir_entry_offset;
+    fat32_close(&new_index);
+    RETURN_ON_ERROR(read_sector(entry_sector, sector_buffer));
+    ((fat32_dir_entry_t *)(sector_buffer + entry_offset))->attr |= FAT32_ATTR_HIDDEN | FAT32_ATTR_SYSTEM;
+    return write_meta_sector(entry_sector, sector_buffer);
+}
+
+static fat32_error_t nameidx_rebuild(const char *dir)
+{
+    fat32_dir_iter_t *iter = malloc(sizeof(fat32_dir_iter_t));
+    nameidx_record_t *batch = malloc(NAMEIDX_BATCH * sizeof(nameidx_record_t));
+    fat32_entry_t entry;
+    uint32_t count = 0;
+    bool has_old = false;
+    size_t found;
+
+    fat32_error_t result = (iter && batch) ? fat32_dir_iter_open(iter, dir) : FAT32_ERROR_INVALID_PARAMETER;
+    while (result == FAT32_OK)
+    {
+        result = fat32_dir_iter_next(iter, &entry, 1, &found);
+        if (result == FAT32_OK && found == 1 && !nameidx_is_own_file(entry.filename))
+        {
+            batch[count++] = nameidx_record(entry.filename, iter->last_sector, iter->last_entry);
+        }
+        if (result == FAT32_OK && (count == NAMEIDX_BATCH || (found == 0 && (count > 0 || !has_old))))
+        {
+            qsort(batch, count, sizeof(nameidx_record_t), nameidx_compare);
+            result = nameidx_merge(dir, has_old, batch, count);
+            has_old = true;
+            count = 0;
+        }
+        if (found == 0)
+        {
+            break;
+        }
+    }
+
+    free(batch);
+    free(iter);
+    return result;
+}
+
+// Record a newly created or renamed entry, if its directory is indexed
+static fat32_error_t nameidx_insert(const char *dir, const nameidx_record_t *record)
+{
+    fat32_file_t index;
+    fat32_error_t result = nameidx_open(dir, &index);
+    if (result == FAT32_ERROR_FILE_NOT_FOUND)
+    {
+        return FAT32_OK;
+    }
+    if (result == FAT32_ERROR_INVALID_FORMAT)
+    {
+        return nameidx_rebuild(dir);
+    }
+    RETURN_ON_ERROR(result);
+
+    if (nameidx_header.tail_count < NAMEIDX_TAIL_MAX)
+    {
+        nameidx_header.tail[nameidx_header.tail_count++] = *record;
+        result = fat32_seek(&index, 0);
+        if (result == FAT32_OK)
+        {
+            result = fat32_write(&index, &nameidx_header, sizeof(nameidx_header), NULL);
+        }
+        fat32_close(&index);
+        return result;
+    }
+    fat32_close(&index);
+
+    // Tail full: fold it into the sorted records
+    nameidx_record_t batch[NAMEIDX_TAIL_MAX + 1];
+    memcpy(batch, nameidx_header.tail, sizeof(nameidx_header.tail));
+    batch[NAMEIDX_TAIL_MAX] = *record;
+    qsort(batch, NAMEIDX_TAIL_MAX + 1, sizeof(nameidx_record_t), nameidx_compare);
+    return nameidx_merge(dir, true, batch, NAMEIDX_TAIL_MAX + 1);
+}
+
+// Build (or rebuild) the name index of a directory
+fat32_error_t fat32_index_create(const char *dir_path)
+{
+    if (!dir_path)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+    fat32_index_drop(dir_path);
+    return nameidx_rebuild(dir_path);
+}
+
+fat32_error_t fat32_index_drop(const char *dir_path)
+{
+    char path[FAT32_MAX_PATH_LEN];
+    if (!dir_path || !nameidx_join(path, dir_path, NAMEIDX_FILE_NAME))
+    {
+        return FAT32_ERROR_INVALID_PATH;
+    }
+    nameidx_forget();
+    return fat32_delete(path);
+}
+
+// Call after creating or renaming path. file is the handle from
+// fat32_create() when there is one, otherwise the entry is looked up.
+fat32_error_t fat32_index_add(const char *path, const fat32_file_t *file)
+{
+    char dir[FAT32_MAX_PATH_LEN];
+    const char *name;
+    fat32_file_t opened;
+
+    if (!path || !nameidx_split(path, dir, &name) || nameidx_is_own_file(name))
+    {
+        return FAT32_OK;
+    }
+    if (!file)
+    {
+        RETURN_ON_ERROR(fat32_open(&opened, path));
+        fat32_close(&opened);
+        file = &opened;
+    }
+    nameidx_record_t record =
+        nameidx_record(name, file->dir_entry_sector, file->dir_entry_offset / sizeof(fat32_dir_entry_t));
+    return nameidx_insert(dir, &record);
+}
+
+// Call before deleting or renaming path
+fat32_error_t fat32_index_remove(const char *path)
+{
+    char dir[FAT32_MAX_PATH_LEN];
+    const char *name;
+    fat32_file_t index;
+    fat32_dir_entry_t dir_entry;
+    nameidx_record_t found;
+    uint32_t record_offset;
+
+    if (!path || !nameidx_split(path, dir, &name))
+    {
+        return FAT32_OK;
+    }
+    fat32_error_t result = nameidx_open(dir, &index);
+    if (result != FAT32_OK)
+    {
+        return result == FAT32_ERROR_FILE_NOT_FOUND ? FAT32_OK : result;
+    }
+
+    result = nameidx_find(&index, name, &dir_entry, &found, &record_offset);
+    if (result == FAT32_OK)
+    {
+        nameidx_record_t tombstone = nameidx_record(name, NAMEIDX_TOMBSTONE, 0);
+        result = fat32_seek(&index, record_offset);
+        if (result == FAT32_OK)
+        {
+            result = fat32_write(&index, &tombstone, sizeof(tombstone), NULL);
+        }
+    }
+    fat32_close(&index);
+
+    if (result == FAT32_ERROR_FILE_NOT_FOUND || result == FAT32_ERROR_INVALID_POSITION)
+    {
+        return FAT32_OK;
+    }
+    return result == FAT32_ERROR_INVALID_FORMAT ? nameidx_rebuild(dir) : result;
+}
+
+// fat32_open() that consults the directory's name index first
+fat32_error_t fat32_open_indexed(fat32_file_t *file, const char *path)
+{
+    char dir[FAT32_MAX_PATH_LEN];
+    const char *name;
+    fat32_file_t index;
+    fat32_dir_entry_t dir_entry;
+    nameidx_record_t found;
+    uint32_t record_offset;
+
+    if (!file || !path || !nameidx_split(path, dir, &name) || nameidx_is_own_file(name) ||
+        strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    {
+        return fat32_open(file, path);
+    }
+
+    fat32_error_t result = nameidx_open(dir, &index);
+    if (result == FAT32_ERROR_INVALID_FORMAT)
+    {
+        nameidx_rebuild(dir);
+    }
+    if (result != FAT32_OK)
+    {
+        return fat32_open(file, path);
+    }
+
+    result = nameidx_find(&index, name, &dir_entry, &found, &record_offset);
+    fat32_close(&index);
+    if (result == FAT32_OK)
+    {
+        file_open_entry(file, &dir_entry, found.sector, found.slot * sizeof(fat32_dir_entry_t));
+        return FAT32_OK;
+    }
+
+    // A stale record, or an entry the index has never seen, means the
+    // directory was changed elsewhere
+    fat32_error_t open_result = fat32_open(file, path);
+    if (result == FAT32_ERROR_INVALID_FORMAT || (result == FAT32_ERROR_FILE_NOT_FOUND && open_result == FAT32_OK))
+    {
+        nameidx_rebuild(dir);
+    }
+    return open_result;
+}
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// FAT32 file system parameters
+#define FAT32_SECTOR_SIZE (512)       // only 512-byte sectors are supported
+#define FAT32_MAX_FILENAME_LEN (255)  // maximum long file name length
+#define FAT32_MAX_PATH_LEN (260)      // maximum path length including null
+#define MAX_LFN_PART (20)             // maximum LFN entries for one name
+
+// Directory entry attributes
+#define FAT32_ATTR_READ_ONLY (0x01)
+#define FAT32_ATTR_HIDDEN (0x02)
+#define FAT32_ATTR_SYSTEM (0x04)
+#define FAT32_ATTR_VOLUME_ID (0x08)
+#define FAT32_ATTR_DIRECTORY (0x10)
+#define FAT32_ATTR_ARCHIVE (0x20)
+#define FAT32_ATTR_LONG_NAME (0x0F)
+
+// FAT entry values
+#define FAT32_FAT_ENTRY_FREE (0x00000000)
+#define FAT32_FAT_ENTRY_BAD (0x0FFFFFF7)
+#define FAT32_FAT_ENTRY_EOC (0x0FFFFFF8)
+
+// Directory entry markers
+#define FAT32_DIR_ENTRY_FREE (0xE5)
+#define FAT32_DIR_ENTRY_END (0x00)
+#define FAT32_LFN_LAST_ENTRY (0x40)
+
+typedef enum
+{
+    FAT32_OK = 0,
+    FAT32_ERROR_NO_CARD,
+    FAT32_ERROR_INIT_FAILED,
+    FAT32_ERROR_READ_FAILED,
+    FAT32_ERROR_WRITE_FAILED,
+    FAT32_ERROR_INVALID_FORMAT,
+    FAT32_ERROR_NOT_MOUNTED,
+    FAT32_ERROR_FILE_NOT_FOUND,
+    FAT32_ERROR_INVALID_PATH,
+    FAT32_ERROR_NOT_A_DIRECTORY,
+    FAT32_ERROR_NOT_A_FILE,
+    FAT32_ERROR_DIR_NOT_EMPTY,
+    FAT32_ERROR_DIR_NOT_FOUND,
+    FAT32_ERROR_DISK_FULL,
+    FAT32_ERROR_FILE_EXISTS,
+    FAT32_ERROR_INVALID_POSITION,
+    FAT32_ERROR_INVALID_PARAMETER,
+    FAT32_ERROR_NO_MEMORY,
+} fat32_error_t;
+
+// On-disk structures
+
+typedef struct __attribute__((packed))
+{
+    uint8_t boot_indicator;
+    uint8_t start_chs[3];
+    uint8_t partition_type;
+    uint8_t end_chs[3];
+    uint32_t start_lba;
+    uint32_t size;
+} mbr_partition_entry_t;
+
+typedef struct __attribute__((packed))
+{
+    uint8_t jump[3];
+    char oem_name[8];
+    uint16_t bytes_per_sector;
+    uint8_t sectors_per_cluster;
+    uint16_t reserved_sectors;
+    uint8_t num_fats;
+    uint16_t root_entries;
+    uint16_t total_sectors_16;
+    uint8_t media_type;
+    uint16_t fat_size_16;
+    uint16_t sectors_per_track;
+    uint16_t num_heads;
+    uint32_t hidden_sectors;
+    uint32_t total_sectors_32;
+    uint32_t fat_size_32;
+    uint16_t ext_flags;
+    uint16_t fs_version;
+    uint32_t root_cluster;
+    uint16_t fat32_info;
+    uint16_t backup_boot_sector;
+    uint8_t reserved[12];
+    uint8_t drive_number;
+    uint8_t reserved1;
+    uint8_t boot_signature;
+    uint32_t volume_id;
+    char volume_label[11];
+    char fs_type[8];
+    uint8_t boot_code[420];
+    uint16_t boot_sector_signature;
+} fat32_boot_sector_t;
+
+typedef struct __attribute__((packed))
+{
+    uint32_t lead_sig;
+    uint8_t reserved1[480];
+    uint32_t struc_sig;
+    uint32_t free_count;
+    uint32_t next_free;
+    uint8_t reserved2[12];
+    uint32_t trail_sig;
+} fat32_fsinfo_t;
+
+typedef struct __attribute__((packed))
+{
+    char name[11];
+    uint8_t attr;
+    uint8_t nt_reserved;
+    uint8_t create_time_tenth;
+    uint16_t create_time;
+    uint16_t create_date;
+    uint16_t last_access_date;
+    uint16_t first_cluster_hi;
+    uint16_t write_time;
+    uint16_t write_date;
+    uint16_t first_cluster_lo;
+    uint32_t file_size;
+} fat32_dir_entry_t;
+
+typedef struct __attribute__((packed))
+{
+    uint8_t seq;
+    uint16_t name1[5];
+    uint8_t attr;
+    uint8_t type;
+    uint8_t checksum;
+    uint16_t name2[6];
+    uint16_t first_cluster_lo;
+    uint16_t name3[2];
+} fat32_lfn_entry_t;
+
+#define FAT32_DIR_ENTRIES_PER_SECTOR (FAT32_SECTOR_SIZE / sizeof(fat32_dir_entry_t))
+
+// Open file or directory handle
+typedef struct
+{
+    bool is_open;
+    uint32_t start_cluster;
+    uint32_t current_cluster;
+    uint32_t file_size;
+    uint32_t position;
+    uint32_t attributes;
+    uint32_t dir_entry_sector;   // volume sector holding the directory entry
+    uint32_t dir_entry_offset;   // byte offset of the entry in that sector
+    uint32_t last_entry_read;
+} fat32_file_t;
+
+// Decoded directory entry
+typedef struct
+{
+    char filename[FAT32_MAX_FILENAME_LEN + 1];
+    uint32_t size;
+    uint16_t date;
+    uint16_t time;
+    uint32_t start_cluster;
+    uint8_t attr;
+} fat32_entry_t;
+
+// Batched directory iterator
+//
+// Decodes a whole directory sector per card read and hands entries back in
+// batches. The iterator owns its sector buffer and LFN state, so FAT lookups
+// in between batches do not force the sector to be read again.
+typedef struct
+{
+    uint32_t cluster;                            // cluster being decoded
+    uint8_t sector;                              // sector within the cluster
+    uint8_t entry;                               // next entry within the sector
+    bool loaded;                                 // sector_data holds the sector
+    bool end;                                    // end of directory reached
+    uint8_t last_entry;                          // slot of the last entry returned
+    uint32_t last_sector;                        // volume sector of the last entry returned
+    uint8_t lfn_checksum;                        // checksum of pending LFN
+    uint8_t lfn_next_seq;                        // next expected LFN sequence
+    char lfn_name[FAT32_MAX_FILENAME_LEN + 1];   // pending long file name
+    uint8_t sector_data[FAT32_SECTOR_SIZE] __attribute__((aligned(4)));
+} fat32_dir_iter_t;
+
+#define FAT32_WALK_MAX_DEPTH (8) // directory levels below the walk root
+
+// Iterative tree walker
+//
+// Visits a directory tree depth first using a fixed stack of directory
+// iterators, one per level, so sibling entries come out of the sector the
+// level already holds. Directories are returned before their contents and
+// can be pruned with fat32_walk_skip() before the next call.
+typedef struct
+{
+    fat32_dir_iter_t stack[FAT32_WALK_MAX_DEPTH + 1]; // one cursor per level
+    uint16_t path_len[FAT32_WALK_MAX_DEPTH + 1];      // directory path length per level
+    uint8_t levels;                                   // cursors in use
+    uint8_t depth;                                    // level of the last entry returned
+    bool descend;                                     // last entry is a directory to enter
+    uint32_t descend_cluster;                         // first cluster of that directory
+    uint32_t skipped;                                 // entries dropped for depth or path length
+    char path[FAT32_MAX_PATH_LEN];                    // full path of the last entry returned
+} fat32_walk_t;
+
+// Card write counters, compare bytes_written with sector_writes to see how
+// well small writes are being coalesced
+typedef struct
+{
+    uint64_t bytes_written; // bytes passed to fat32_write_buffered()
+    uint32_t sector_writes; // sectors written to the card, data and metadata
+    uint32_t flushes;       // write-behind buffers written out
+} fat32_write_stats_t;
+
+// Cluster chain layout, from fat32_get_fragmentation()
+typedef struct
+{
+    uint32_t chains;     // files and directories with clusters
+    uint32_t fragmented; // chains split into more than one extent
+    uint32_t extents;    // runs of consecutive clusters over all chains
+    uint32_t clusters;   // clusters in all chains
+} fat32_frag_stats_t;
+
+// Progress callback for fat32_copy(), called after every chunk written
+typedef void (*fat32_copy_progress_t)(uint32_t bytes_done, uint32_t bytes_total, void *context);
+
+// Function prototypes
+
+// File system management
+void fat32_init(void);
+fat32_error_t fat32_mount(void);
+void fat32_unmount(void);
+bool fat32_is_mounted(void);
+bool fat32_is_ready(void);
+fat32_error_t fat32_get_status(void);
+fat32_error_t fat32_sync(void);
+fat32_error_t fat32_get_free_space(uint64_t *free_space);
+fat32_error_t fat32_get_total_space(uint64_t *total_space);
+fat32_error_t fat32_get_volume_name(char *name, size_t name_len);
+fat32_error_t fat32_get_cluster_size(uint32_t *cluster_size);
+fat32_error_t fat32_get_data_region(uint32_t *first_block, uint32_t *block_count);
+void fat32_get_write_stats(fat32_write_stats_t *stats);
+fat32_error_t fat32_get_fragmentation(const char *path, fat32_frag_stats_t *stats);
+
+// File operations
+fat32_error_t fat32_open(fat32_file_t *file, const char *path);
+fat32_error_t fat32_open_indexed(fat32_file_t *file, const char *path);
+fat32_error_t fat32_create(fat32_file_t *file, const char *path);
+fat32_error_t fat32_close(fat32_file_t *file);
+fat32_error_t fat32_read(fat32_file_t *file, void *buffer, size_t size, size_t *bytes_read);
+fat32_error_t fat32_write(fat32_file_t *file, const void *buffer, size_t size, size_t *bytes_written);
+fat32_error_t fat32_seek(fat32_file_t *file, uint32_t position);
+uint32_t fat32_tell(fat32_file_t *file);
+uint32_t fat32_size(fat32_file_t *file);
+bool fat32_eof(fat32_file_t *file);
+fat32_error_t fat32_delete(const char *path);
+fat32_error_t fat32_rename(const char *old_path, const char *new_path);
+fat32_error_t fat32_write_buffer_attach(fat32_file_t *file, void *buffer, uint32_t size);
+fat32_error_t fat32_write_buffer_detach(fat32_file_t *file);
+fat32_error_t fat32_write_buffer_reserve(fat32_file_t *file, uint32_t clusters);
+fat32_error_t fat32_write_buffered(fat32_file_t *file, const void *buffer, size_t size, size_t *bytes_written);
+fat32_error_t fat32_read_buffered(fat32_file_t *file, void *buffer, size_t size, size_t *bytes_read);
+fat32_error_t fat32_flush(fat32_file_t *file);
+fat32_error_t fat32_copy(const char *src_path, const char *dst_path, fat32_copy_progress_t progress, void *context);
+
+// Directory operations
+fat32_error_t fat32_set_current_dir(const char *path);
+fat32_error_t fat32_get_current_dir(char *path, size_t path_len);
+fat32_error_t fat32_dir_read(fat32_file_t *dir, fat32_entry_t *dir_entry);
+fat32_error_t fat32_dir_create(fat32_file_t *dir, const char *path);
+fat32_error_t fat32_dir_iter_open(fat32_dir_iter_t *iter, const char *path);
+fat32_error_t fat32_dir_iter_next(fat32_dir_iter_t *iter, fat32_entry_t *entries, size_t max_entries, size_t *count);
+fat32_error_t fat32_index_create(const char *dir_path);
+fat32_error_t fat32_index_drop(const char *dir_path);
+fat32_error_t fat32_index_add(const char *path, const fat32_file_t *file);
+fat32_error_t fat32_index_remove(const char *path);
+fat32_error_t fat32_walk_open(fat32_walk_t *walk, const char *path);
+fat32_error_t fat32_walk_next(fat32_walk_t *walk, fat32_entry_t *entry);
+void fat32_walk_skip(fat32_walk_t *walk);
+
+// Utility functions
+const char *fat32_error_string(fat32_error_t error);
@@ -0,0 +1,279 @@
+//
+//  PicoCalc FAT32 memory mapped files
+//
+//  Maps a window of a file into PSRAM and pages clusters in on demand.
+//  A software page table tracks which pages are present and which have
+//  been written so fat32_msync() only writes back what changed.
+//
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "fat32_mmap.h"
+
+#define RETURN_ON_ERROR(expr)        \
+    {                                \
+        fat32_error_t _res = (expr); \
+        if (_res != FAT32_OK)        \
+        {                            \
+            return _res;             \
+        }                            \
+    }
+
+// Bounce buffer between the card and PSRAM
+static uint8_t bounce_buffer[FAT32_SECTOR_SIZE] __attribute__((aligned(4)));
+
+// Paging moves the file position, give the caller back the one it had
+static fat32_error_t restore_position(fat32_mmap_t *map, uint32_t position, fat32_error_t result)
+{
+    fat32_error_t seek = fat32_seek(map->file, position);
+    return result != FAT32_OK ? result : seek;
+}
+
+static fat32_error_t page_fill(fat32_mmap_t *map, uint32_t page)
+{
+    uint32_t file_pos = map->file_offset + page * map->page_size;
+    uint32_t window_offset = page * map->page_size;
+    uint32_t remaining = map->page_size;
+
+    RETURN_ON_ERROR(fat32_seek(map->file, file_pos));
+    while (remaining > 0)
+    {
+        size_t bytes_read = 0;
+        size_t chunk = remaining < sizeof(bounce_buffer) ? remaining : sizeof(bounce_buffer);
+        RETURN_ON_ERROR(fat32_read(map->file, bounce_buffer, chunk, &bytes_read));
+        if (bytes_read < chunk)
+        {
+            // Past end of file, the rest of the page reads as zeros
+            memset(bounce_buffer + bytes_read, 0, chunk - bytes_read);
+        }
+        if (!psram_handle_write(map->window, window_offset, bounce_buffer, chunk))
+        {
+            return FAT32_ERROR_INVALID_PARAMETER;
+        }
+        window_offset += chunk;
+        remaining -= chunk;
+    }
+    return FAT32_OK;
+}
+
+static fat32_error_t page_in(fat32_mmap_t *map, uint32_t page)
+{
+    uint32_t position = fat32_tell(map->file);
+    RETURN_ON_ERROR(restore_position(map, position, page_fill(map, page)));
+
+    map->page_table[page] |= FAT32_MMAP_PAGE_PRESENT;
+    map->page_ins++;
+    return FAT32_OK;
+}
+
+static fat32_error_t page_flush(fat32_mmap_t *map, uint32_t page)
+{
+    uint32_t file_pos = map->file_offset + page * map->page_size;
+    uint32_t window_offset = page * map->page_size;
+    uint32_t file_size = fat32_size(map->file);
+    uint32_t remaining = map->page_size;
+
+    // Never extend the file, the window was clamped to its size when mapped
+    if (file_pos + remaining > file_size)
+    {
+        remaining = file_size - file_pos;
+    }
+
+    RETURN_ON_ERROR(fat32_seek(map->file, file_pos));
+    while (remaining > 0)
+    {
+        size_t chunk = remaining < sizeof(bounce_buffer) ? remaining : sizeof(bounce_buffer);
+        if (!psram_handle_read(map->window, window_offset, bounce_buffer, chunk))
+        {
+            return FAT32_ERROR_INVALID_PARAMETER;
+        }
+        RETURN_ON_ERROR(fat32_write(map->file, bounce_buffer, chunk, NULL));
+        window_offset += chunk;
+        remaining -= chunk;
+    }
+    return FAT32_OK;
+}
+
+static fat32_error_t page_out(fat32_mmap_t *map, uint32_t page)
+{
+    uint32_t position = fat32_tell(map->file);
+    RETURN_ON_ERROR(restore_position(map, position, page_flush(map, page)));
+
+    map->page_table[page] &= ~FAT32_MMAP_PAGE_DIRTY;
+    map->write_backs++;
+    return FAT32_OK;
+}
+
+static bool range_valid(const fat32_mmap_t *map, uint32_t offset, uint32_t length)
+{
+    return map->page_table && offset <= map->length && length <= map->length - offset;
+}
+
+//
+// Mapping management
+//
+
+// Map a window of an open file. The pages live in window, which must hold
+// fat32_mmap_psram_size() bytes; PSRAM_HANDLE_NONE lets the mapping allocate
+// its own window and free it again in fat32_munmap().
+fat32_error_t fat32_mmap(fat32_mmap_t *map, fat32_file_t *file, uint32_t offset, uint32_t length,
+                         psram_handle_t window)
+{
+    if (!map || !file || !file->is_open)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    uint32_t file_size = fat32_size(file);
+    if (offset > file_size)
+    {
+        return FAT32_ERROR_INVALID_POSITION;
+    }
+    if (length > file_size - offset)
+    {
+        length = file_size - offset;
+    }
+
+    memset(map, 0, sizeof(fat32_mmap_t));
+    RETURN_ON_ERROR(fat32_get_cluster_size(&map->page_size));
+    if (map->page_size == 0)
+    {
+        return FAT32_ERROR_NOT_MOUNTED;
+    }
+
+    map->file = file;
+    map->file_offset = offset - (offset % map->page_size);
+    map->skew = offset - map->file_offset;
+    map->length = length;
+    map->page_count = (map->skew + length + map->page_size - 1) / map->page_size;
+
+    // Only the page table is allocated, no file data is read yet
+    uint32_t window_size = fat32_mmap_psram_size(map);
+    if (window == PSRAM_HANDLE_NONE)
+    {
+        window = psram_malloc(window_size ? window_size : 1);
+        if (window == PSRAM_HANDLE_NONE)
+        {
+            return FAT32_ERROR_NO_MEMORY;
+        }
+        map->owns_window = true;
+    }
+    else if (psram_handle_size(window) < window_size)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+    map->window = window;
+
+    map->page_table = calloc(map->page_count ? map->page_count : 1, sizeof(uint8_t));
+    if (!map->page_table)
+    {
+        if (map->owns_window)
+        {
+            psram_free(map->window);
+        }
+        return FAT32_ERROR_NO_MEMORY;
+    }
+    return FAT32_OK;
+}
+
+fat32_error_t fat32_msync(fat32_mmap_t *map)
+{
+    if (!map || !map->page_table)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    for (uint32_t page = 0; page < map->page_count; page++)
+    {
+        if (map->page_table[page] & FAT32_MMAP_PAGE_DIRTY)
+        {
+            RETURN_ON_ERROR(page_out(map, page));
+        }
+    }
+    return FAT32_OK;
+}
+
+fat32_error_t fat32_munmap(fat32_mmap_t *map)
+{
+    if (!map || !map->page_table)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    fat32_error_t result = fat32_msync(map);
+    free(map->page_table);
+    map->page_table = NULL;
+    if (map->owns_window)
+    {
+        psram_free(map->window);
+    }
+    map->window = PSRAM_HANDLE_NONE;
+    return result;
+}
+
+uint32_t fat32_mmap_psram_size(const fat32_mmap_t *map)
+{
+    return map ? map->page_count * map->page_size : 0;
+}
+
+//
+// Access functions
+//
+
+fat32_error_t fat32_mmap_touch(fat32_mmap_t *map, uint32_t offset, uint32_t length)
+{
+    if (!map || !range_valid(map, offset, length))
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+    if (length == 0)
+    {
+        return FAT32_OK;
+    }
+
+    uint32_t first = (map->skew + offset) / map->page_size;
+    uint32_t last = (map->skew + offset + length - 1) / map->page_size;
+    for (uint32_t page = first; page <= last; page++)
+    {
+        if (!(map->page_table[page] & FAT32_MMAP_PAGE_PRESENT))
+        {
+            RETURN_ON_ERROR(page_in(map, page));
+        }
+    }
+    return FAT32_OK;
+}
+
+fat32_error_t fat32_mmap_read(fat32_mmap_t *map, uint32_t offset, void *buffer, uint32_t length)
+{
+    RETURN_ON_ERROR(fat32_mmap_touch(map, offset, length));
+    if (length > 0 && !psram_handle_read(map->window, map->skew + offset, buffer, length))
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+    return FAT32_OK;
+}
+
+fat32_error_t fat32_mmap_write(fat32_mmap_t *map, uint32_t offset, const void *buffer, uint32_t length)
+{
+    RETURN_ON_ERROR(fat32_mmap_touch(map, offset, length));
+    if (length == 0)
+    {
+        return FAT32_OK;
+    }
+
+    if (!psram_handle_write(map->window, map->skew + offset, buffer, length))
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    uint32_t first = (map->skew + offset) / map->page_size;
+    uint32_t last = (map->skew + offset + length - 1) / map->page_size;
+    for (uint32_t page = first; page <= last; page++)
+    {
+        map->page_table[page] |= FAT32_MMAP_PAGE_DIRTY;
+    }
+    return FAT32_OK;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "fat32.h"
+#include "psram_alloc.h"
+
+// Page table flags
+#define FAT32_MMAP_PAGE_PRESENT (0x01) // page has been read into PSRAM
+#define FAT32_MMAP_PAGE_DIRTY (0x02)   // page was written, needs fat32_msync()
+
+// Demand-paged view of a file held in PSRAM
+//
+// Pages are one cluster each and are only read from the card the first time
+// they are touched, so mapping a large asset costs nothing up front.
+typedef struct
+{
+    fat32_file_t *file;         // backing file, must stay open while mapped
+    psram_handle_t window;      // PSRAM allocation holding the pages
+    bool owns_window;           // window was allocated by fat32_mmap()
+    uint32_t file_offset;       // file offset of the first page (page aligned)
+    uint32_t skew;              // requested offset minus file_offset
+    uint32_t length;            // mapped length in bytes
+    uint32_t page_size;         // bytes per page (volume cluster size)
+    uint32_t page_count;        // number of pages in the window
+    uint8_t *page_table;        // FAT32_MMAP_PAGE_* flags, one byte per page
+    uint32_t page_ins;          // pages read from the card
+    uint32_t write_backs;       // pages written back to the card
+} fat32_mmap_t;
+
+// Function prototypes
+
+// Mapping management
+fat32_error_t fat32_mmap(fat32_mmap_t *map, fat32_file_t *file, uint32_t offset, uint32_t length,
+                         psram_handle_t window);
+fat32_error_t fat32_msync(fat32_mmap_t *map);
+fat32_error_t fat32_munmap(fat32_mmap_t *map);
+uint32_t fat32_mmap_psram_size(const fat32_mmap_t *map);
+
+// Access functions, offsets are relative to the mapped offset
+fat32_error_t fat32_mmap_touch(fat32_mmap_t *map, uint32_t offset, uint32_t length);
+fat32_error_t fat32_mmap_read(fat32_mmap_t *map, uint32_t offset, void *buffer, uint32_t length);
+fat32_error_t fat32_mmap_write(fat32_mmap_t *map, uint32_t offset, const void *buffer, uint32_t length);
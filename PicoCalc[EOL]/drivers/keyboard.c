@@ -100,11 +100,11 @@ static void process_key_events(keyboard_context_t *ctx) {
                             
                             // Update modifier state
                             switch (key) {
-                                case KEY_SHIFT: ctx->modifiers |= 0x01; break;
-                                case KEY_CTRL:  ctx->modifiers |= 0x02; break;
-                                case KEY_ALT:   ctx->modifiers |= 0x04; break;
-                                case KEY_FN:    ctx->modifiers |= 0x08; break;
-                                case KEY_SYM:   ctx->modifiers |= 0x10; break;
+                                case KEY_SHIFT: ctx->modifiers |= KB_MOD_SHIFT; break;
+                                case KEY_CTRL:  ctx->modifiers |= KB_MOD_CTRL; break;
+                                case KEY_ALT:   ctx->modifiers |= KB_MOD_ALT; break;
+                                case KEY_FN:    ctx->modifiers |= KB_MOD_FN; break;
+                                case KEY_SYM:   ctx->modifiers |= KB_MOD_SYM; break;
                             }
                         } else {
                             // Key released
@@ -112,11 +112,11 @@ static void process_key_events(keyboard_context_t *ctx) {
                             
                             // Update modifier state
                             switch (key) {
-                                case KEY_SHIFT: ctx->modifiers &= ~0x01; break;
-                                case KEY_CTRL:  ctx->modifiers &= ~0x02; break;
-                                case KEY_ALT:   ctx->modifiers &= ~0x04; break;
-                                case KEY_FN:    ctx->modifiers &= ~0x08; break;
-                                case KEY_SYM:   ctx->modifiers &= ~0x10; break;
+                                case KEY_SHIFT: ctx->modifiers &= ~KB_MOD_SHIFT; break;
+                                case KEY_CTRL:  ctx->modifiers &= ~KB_MOD_CTRL; break;
+                                case KEY_ALT:   ctx->modifiers &= ~KB_MOD_ALT; break;
+                                case KEY_FN:    ctx->modifiers &= ~KB_MOD_FN; break;
+                                case KEY_SYM:   ctx->modifiers &= ~KB_MOD_SYM; break;
                             }
                         }
                         
@@ -297,12 +297,12 @@ uint8_t keyboard_scan_to_key(uint8_t row, uint8_t col, uint8_t modifiers) {
     }
     
     // Check for Fn key first
-    if (modifiers & 0x08) {
+    if (modifiers & KB_MOD_FN) {
         return fn_keymap[row][col];
     }
     
     // Check for Shift key
-    if (modifiers & 0x01) {
+    if (modifiers & KB_MOD_SHIFT) {
         return shift_keymap[row][col];
     }
     
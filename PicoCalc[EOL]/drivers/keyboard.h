@@ -42,6 +42,13 @@
 #define KEY_FN          0x8D
 #define KEY_SYM         0x8E
 
+// Modifier bits in key_event_t.modifiers
+#define KB_MOD_SHIFT    0x01
+#define KB_MOD_CTRL     0x02
+#define KB_MOD_ALT      0x04
+#define KB_MOD_FN       0x08
+#define KB_MOD_SYM      0x10
+
 // Keyboard matrix size (PicoCalc specific)
 #define KB_MATRIX_ROWS  7
 #define KB_MATRIX_COLS  8
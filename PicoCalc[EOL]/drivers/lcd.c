@@ -201,6 +201,27 @@ void lcd_write16_buf(const uint16_t *buffer, size_t len) {
     spi_set_format_8bit();
 }
 
+void lcd_write16_fill(uint16_t colour, size_t len) {
+    static uint16_t pixels[WIDTH];
+
+    for (uint16_t i = 0; i < WIDTH; i++) {
+        pixels[i] = colour;
+    }
+
+    spi_set_format_16bit();
+
+    gpio_set_value(LCD_DCX, 1); // Data
+    gpio_set_value(LCD_CSX, 0);
+    while (len > 0) {
+        size_t chunk = len < WIDTH ? len : WIDTH;
+        spi_write16_blocking(pixels, chunk);
+        len -= chunk;
+    }
+    gpio_set_value(LCD_CSX, 1);
+
+    spi_set_format_8bit();
+}
+
 //
 // ST7789P LCD controller functions
 //
@@ -219,8 +240,8 @@ static void lcd_set_window(uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1) {
     lcd_write_cmd(LCD_CMD_RAMWR);
 }
 
-void lcd_blit(const uint16_t *pixels, uint16_t x, uint16_t y, uint16_t width, uint16_t height) {
-    lcd_disable_interrupts();
+// Open a window at screen position y, following the scroll offset
+static void lcd_open_window(uint16_t x, uint16_t y, uint16_t width, uint16_t height) {
     if (y >= lcd_scroll_top && y < HEIGHT - lcd_scroll_bottom) {
         uint16_t y_virtual = (lcd_y_offset + y) % lcd_memory_scroll_height;
         uint16_t y_end = lcd_scroll_top + y_virtual + height - 1;
@@ -231,19 +252,40 @@ void lcd_blit(const uint16_t *pixels, uint16_t x, uint16_t y, uint16_t width, ui
     } else {
         lcd_set_window(x, y, x + width - 1, y + height - 1);
     }
+}
 
+// Rows from y that fit in one window without wrapping in frame memory
+static uint16_t lcd_window_rows(uint16_t y, uint16_t height) {
+    uint16_t rows = height;
+    if (y < lcd_scroll_top) {
+        rows = lcd_scroll_top - y;
+    } else if (y < HEIGHT - lcd_scroll_bottom) {
+        uint16_t y_virtual = (lcd_y_offset + y) % lcd_memory_scroll_height;
+        rows = lcd_memory_scroll_height - y_virtual;
+        if (rows > HEIGHT - lcd_scroll_bottom - y) {
+            rows = HEIGHT - lcd_scroll_bottom - y;
+        }
+    }
+    return rows < height ? rows : height;
+}
+
+void lcd_blit(const uint16_t *pixels, uint16_t x, uint16_t y, uint16_t width, uint16_t height) {
+    lcd_disable_interrupts();
+    lcd_open_window(x, y, width, height);
     lcd_write16_buf((uint16_t *)pixels, width * height);
     lcd_enable_interrupts();
 }
 
+// One window per rectangle, split only where it wraps in frame memory
 void lcd_solid_rectangle(uint16_t colour, uint16_t x, uint16_t y, uint16_t width, uint16_t height) {
-    static uint16_t pixels[WIDTH];
-
-    for (uint16_t row = 0; row < height; row++) {
-        for (uint16_t i = 0; i < width; i++) {
-            pixels[i] = colour;
-        }
-        lcd_blit(pixels, x, y + row, width, 1);
+    while (height > 0) {
+        uint16_t rows = lcd_window_rows(y, height);
+        lcd_disable_interrupts();
+        lcd_open_window(x, y, width, rows);
+        lcd_write16_fill(colour, (size_t)width * rows);
+        lcd_enable_interrupts();
+        y += rows;
+        height -= rows;
     }
 }
 
@@ -304,7 +346,7 @@ void lcd_scroll_up(void) {
     lcd_write_data(2, UPPER8(scroll_area_start), LOWER8(scroll_area_start));
     lcd_enable_interrupts();
 
-    lcd_solid_rectangle(background, 0, HEIGHT - GLYPH_HEIGHT, WIDTH, GLYPH_HEIGHT);
+    lcd_solid_rectangle(background, 0, HEIGHT - lcd_scroll_bottom - GLYPH_HEIGHT, WIDTH, GLYPH_HEIGHT);
 }
 
 void lcd_scroll_down(void) {
@@ -90,6 +90,7 @@ void lcd_write_cmd(uint8_t cmd);
 void lcd_write_data(uint8_t len, ...);
 void lcd_write16_data(uint8_t len, ...);
 void lcd_write16_buf(const uint16_t *buffer, size_t len);
+void lcd_write16_fill(uint16_t colour, size_t len);
 
 // Display window and drawing functions
 void lcd_blit(const uint16_t *pixels, uint16_t x, uint16_t y, uint16_t width, uint16_t height);
@@ -0,0 +1,456 @@
+//
+//  PicoCalc PSRAM heap
+//
+//  Hands out PSRAM in handles so several users can share it safely. Small
+//  objects come from slabs of one size class each, larger buffers from a
+//  best-fit free list. All bookkeeping lives in SRAM, PSRAM only ever holds
+//  user data.
+//
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pico/sync.h"
+
+#include "psram_alloc.h"
+#include "psram_bus.h"
+
+#define SLAB_BITMAP_WORDS (PSRAM_ALLOC_SLAB_SIZE / PSRAM_ALLOC_MIN_CLASS / 32)
+#define NO_SLAB (-1)
+
+typedef struct
+{
+    uint32_t address;
+    uint32_t size;       // bytes reserved, 0 when the entry is free
+    uint32_t requested;  // bytes asked for
+    uint16_t generation; // bumped on every free
+    int8_t slab;         // owning slab, NO_SLAB for best-fit blocks
+} handle_entry_t;
+
+typedef struct
+{
+    uint32_t address;
+    uint32_t size;
+} free_block_t;
+
+typedef struct
+{
+    uint32_t address;
+    bool in_use;
+    uint8_t size_class;
+    uint16_t used;                         // slots taken
+    uint32_t bitmap[SLAB_BITMAP_WORDS];    // one bit per slot
+} slab_t;
+
+static psram_spi_inst_t *heap_psram;
+static critical_section_t heap_lock;
+static bool heap_ready = false;
+static uint32_t heap_total;
+
+static handle_entry_t handles[PSRAM_ALLOC_MAX_HANDLES];
+static free_block_t free_list[PSRAM_ALLOC_MAX_FREE_BLOCKS]; // sorted by address
+static uint32_t free_count;
+static slab_t slabs[PSRAM_ALLOC_MAX_SLABS];
+static uint32_t lost_bytes;
+static uint32_t failures;
+
+static inline uint32_t class_size(int size_class)
+{
+    return PSRAM_ALLOC_MIN_CLASS << size_class;
+}
+
+static inline uint32_t slab_slots(const slab_t *slab)
+{
+    return PSRAM_ALLOC_SLAB_SIZE / class_size(slab->size_class);
+}
+
+static int size_class_for(uint32_t size)
+{
+    for (int i = 0; i < PSRAM_ALLOC_CLASS_COUNT; i++)
+    {
+        if (size <= class_size(i))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//
+// Best-fit free list
+//
+
+static bool block_alloc(uint32_t size, uint32_t *address)
+{
+    int best = -1;
+    for (uint32_t i = 0; i < free_count; i++)
+    {
+        if (free_list[i].size >= size && (best < 0 || free_list[i].size < free_list[best].size))
+        {
+            best = (int)i;
+            if (free_list[i].size == size)
+            {
+                break;
+            }
+        }
+    }
+    if (best < 0)
+    {
+        return false;
+    }
+
+    *address = free_list[best].address;
+    free_list[best].address += size;
+    free_list[best].size -= size;
+    if (free_list[best].size == 0)
+    {
+        memmove(&free_list[best], &free_list[best + 1], (free_count - best - 1) * sizeof(free_block_t));
+        free_count--;
+    }
+    return true;
+}
+
+// Return a block, merging it with its neighbours
+static void block_free(uint32_t address, uint32_t size)
+{
+    uint32_t i = 0;
+    while (i < free_count && free_list[i].address < address)
+    {
+        i++;
+    }
+
+    bool merge_previous = i > 0 && free_list[i - 1].address + free_list[i - 1].size == address;
+    bool merge_next = i < free_count && address + size == free_list[i].address;
+
+    if (merge_previous && merge_next)
+    {
+        free_list[i - 1].size += size + free_list[i].size;
+        memmove(&free_list[i], &free_list[i + 1], (free_count - i - 1) * sizeof(free_block_t));
+        free_count--;
+    }
+    else if (merge_previous)
+    {
+        free_list[i - 1].size += size;
+    }
+    else if (merge_next)
+    {
+        free_list[i].address = address;
+        free_list[i].size += size;
+    }
+    else if (free_count < PSRAM_ALLOC_MAX_FREE_BLOCKS)
+    {
+        memmove(&free_list[i + 1], &free_list[i], (free_count - i) * sizeof(free_block_t));
+        free_list[i].address = address;
+        free_list[i].size = size;
+        free_count++;
+    }
+    else
+    {
+        lost_bytes += size;
+    }
+}
+
+//
+// Size class slabs
+//
+
+static bool slab_alloc(int size_class, uint32_t *address, int8_t *slab_index)
+{
+    int empty = -1;
+    for (int i = 0; i < PSRAM_ALLOC_MAX_SLABS; i++)
+    {
+        slab_t *slab = &slabs[i];
+        if (!slab->in_use)
+        {
+            if (empty < 0)
+            {
+                empty = i;
+            }
+            continue;
+        }
+        if (slab->size_class != size_class || slab->used == slab_slots(slab))
+        {
+            continue;
+        }
+
+        for (uint32_t slot = 0; slot < slab_slots(slab); slot++)
+        {
+            if (!(slab->bitmap[slot / 32] & (1u << (slot % 32))))
+            {
+                slab->bitmap[slot / 32] |= 1u << (slot % 32);
+                slab->used++;
+                *address = slab->address + slot * class_size(size_class);
+                *slab_index = (int8_t)i;
+                return true;
+            }
+        }
+    }
+
+    // Carve a new slab out of the best-fit heap
+    uint32_t slab_address;
+    if (empty < 0 || !block_alloc(PSRAM_ALLOC_SLAB_SIZE, &slab_address))
+    {
+        return false;
+    }
+    slab_t *slab = &slabs[empty];
+    memset(slab, 0, sizeof(*slab));
+    slab->address = slab_address;
+    slab->in_use = true;
+    slab->size_class = (uint8_t)size_class;
+    slab->bitmap[0] = 1;
+    slab->used = 1;
+    *address = slab_address;
+    *slab_index = (int8_t)empty;
+    return true;
+}
+
+static void slab_free(int8_t slab_index, uint32_t address)
+{
+    slab_t *slab = &slabs[slab_index];
+    uint32_t slot = (address - slab->address) / class_size(slab->size_class);
+    slab->bitmap[slot / 32] &= ~(1u << (slot % 32));
+    if (--slab->used == 0)
+    {
+        slab->in_use = false;
+        block_free(slab->address, PSRAM_ALLOC_SLAB_SIZE);
+    }
+}
+
+//
+// Handles
+//
+
+static inline psram_handle_t make_handle(uint32_t index)
+{
+    return ((psram_handle_t)handles[index].generation << 16) | (index + 1);
+}
+
+// Look up a live handle, NULL if it is stale or was never allocated
+static handle_entry_t *handle_lookup(psram_handle_t handle)
+{
+    uint32_t index = (handle & 0xFFFF) - 1;
+    if (!heap_ready || handle == PSRAM_HANDLE_NONE || index >= PSRAM_ALLOC_MAX_HANDLES)
+    {
+        return NULL;
+    }
+    handle_entry_t *entry = &handles[index];
+    if (entry->size == 0 || entry->generation != (handle >> 16))
+    {
+        return NULL;
+    }
+    return entry;
+}
+
+void psram_alloc_init(psram_spi_inst_t *psram, uint32_t base, uint32_t size)
+{
+    if (!heap_ready)
+    {
+        critical_section_init(&heap_lock);
+    }
+
+    critical_section_enter_blocking(&heap_lock);
+    heap_psram = psram;
+
+    // Keep every block aligned, including the first one
+    uint32_t aligned_base = (base + PSRAM_ALLOC_ALIGN - 1) & ~(PSRAM_ALLOC_ALIGN - 1);
+    heap_total = size > aligned_base - base ? (size - (aligned_base - base)) & ~(PSRAM_ALLOC_ALIGN - 1) : 0;
+
+    memset(handles, 0, sizeof(handles));
+    memset(slabs, 0, sizeof(slabs));
+    free_list[0].address = aligned_base;
+    free_list[0].size = heap_total;
+    free_count = heap_total ? 1 : 0;
+    lost_bytes = 0;
+    failures = 0;
+    heap_ready = true;
+    critical_section_exit(&heap_lock);
+}
+
+bool psram_alloc_ready(void)
+{
+    return heap_ready;
+}
+
+psram_handle_t psram_malloc(uint32_t size)
+{
+    if (!heap_ready || size == 0)
+    {
+        return PSRAM_HANDLE_NONE;
+    }
+
+    critical_section_enter_blocking(&heap_lock);
+
+    int index = -1;
+    for (int i = 0; i < PSRAM_ALLOC_MAX_HANDLES; i++)
+    {
+        if (handles[i].size == 0)
+        {
+            index = i;
+            break;
+        }
+    }
+
+    uint32_t address = 0;
+    uint32_t reserved = 0;
+    int8_t slab = NO_SLAB;
+    if (index >= 0)
+    {
+        int size_class = size_class_for(size);
+        if (size_class >= 0 && slab_alloc(size_class, &address, &slab))
+        {
+            reserved = class_size(size_class);
+        }
+        else
+        {
+            // Large buffers, or small ones once no slab can be carved
+            reserved = (size + PSRAM_ALLOC_ALIGN - 1) & ~(PSRAM_ALLOC_ALIGN - 1);
+            if (!block_alloc(reserved, &address))
+            {
+                reserved = 0;
+            }
+        }
+    }
+
+    psram_handle_t handle = PSRAM_HANDLE_NONE;
+    if (reserved)
+    {
+        handles[index].address = address;
+        handles[index].size = reserved;
+        handles[index].requested = size;
+        handles[index].slab = slab;
+        handle = make_handle((uint32_t)index);
+    }
+    else
+    {
+        failures++;
+    }
+
+    critical_section_exit(&heap_lock);
+    return handle;
+}
+
+void psram_free(psram_handle_t handle)
+{
+    critical_section_enter_blocking(&heap_lock);
+    handle_entry_t *entry = handle_lookup(handle);
+    if (entry)
+    {
+        if (entry->slab != NO_SLAB)
+        {
+            slab_free(entry->slab, entry->address);
+        }
+        else
+        {
+            block_free(entry->address, entry->size);
+        }
+        entry->size = 0;
+        entry->generation++;
+    }
+    critical_section_exit(&heap_lock);
+}
+
+// Copy out what an access needs under the lock, so a concurrent free or
+// allocation cannot change the entry halfway through the lookup. The
+// transfer itself runs unlocked; freeing a handle that is still in use is
+// the caller's bug either way.
+static bool handle_snapshot(psram_handle_t handle, uint32_t *address, uint32_t *requested)
+{
+    if (!heap_ready)
+    {
+        return false;
+    }
+
+    critical_section_enter_blocking(&heap_lock);
+    handle_entry_t *entry = handle_lookup(handle);
+    if (entry)
+    {
+        *address = entry->address;
+        *requested = entry->requested;
+    }
+    critical_section_exit(&heap_lock);
+    return entry != NULL;
+}
+
+bool psram_handle_valid(psram_handle_t handle)
+{
+    uint32_t address, requested;
+    return handle_snapshot(handle, &address, &requested);
+}
+
+// PSRAM address of an allocation, for the psram_read/psram_write API
+uint32_t psram_handle_address(psram_handle_t handle)
+{
+    uint32_t address, requested;
+    return handle_snapshot(handle, &address, &requested) ? address : 0;
+}
+
+uint32_t psram_handle_size(psram_handle_t handle)
+{
+    uint32_t address, requested;
+    return handle_snapshot(handle, &address, &requested) ? requested : 0;
+}
+
+// Bounds-checked access, fails rather than spill into a neighbour
+bool psram_handle_read(psram_handle_t handle, uint32_t offset, void *buffer, uint32_t length)
+{
+    uint32_t address, requested;
+    if (!handle_snapshot(handle, &address, &requested) || offset > requested || length > requested - offset)
+    {
+        return false;
+    }
+    psram_bus_read(heap_psram, address + offset, buffer, length);
+    return true;
+}
+
+bool psram_handle_write(psram_handle_t handle, uint32_t offset, const void *buffer, uint32_t length)
+{
+    uint32_t address, requested;
+    if (!handle_snapshot(handle, &address, &requested) || offset > requested || length > requested - offset)
+    {
+        return false;
+    }
+    psram_bus_write(heap_psram, address + offset, buffer, length);
+    return true;
+}
+
+void psram_alloc_get_stats(psram_alloc_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (!heap_ready)
+    {
+        return;
+    }
+
+    critical_section_enter_blocking(&heap_lock);
+    stats->total = heap_total;
+    stats->lost = lost_bytes;
+    stats->failures = failures;
+    stats->free_blocks = free_count;
+    for (uint32_t i = 0; i < free_count; i++)
+    {
+        stats->free += free_list[i].size;
+        if (free_list[i].size > stats->largest_free)
+        {
+            stats->largest_free = free_list[i].size;
+        }
+    }
+    for (int i = 0; i < PSRAM_ALLOC_MAX_HANDLES; i++)
+    {
+        if (handles[i].size)
+        {
+            stats->handles++;
+            stats->used += handles[i].size;
+            stats->requested += handles[i].requested;
+        }
+    }
+    for (int i = 0; i < PSRAM_ALLOC_MAX_SLABS; i++)
+    {
+        if (slabs[i].in_use)
+        {
+            stats->slabs++;
+            stats->slab_free += (slab_slots(&slabs[i]) - slabs[i].used) * class_size(slabs[i].size_class);
+        }
+    }
+    critical_section_exit(&heap_lock);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "psram_spi.h"
+
+// PSRAM heap parameters
+#define PSRAM_SIZE (8 * 1024 * 1024)        // PSRAM fitted to the PicoCalc
+#define PSRAM_ALLOC_ALIGN (32)              // alignment of every allocation
+#define PSRAM_ALLOC_MAX_HANDLES (256)       // live allocations at once
+#define PSRAM_ALLOC_MAX_FREE_BLOCKS (128)   // fragments the free list can track
+#define PSRAM_ALLOC_MAX_SLABS (64)          // slabs for the small size classes
+#define PSRAM_ALLOC_SLAB_SIZE (16 * 1024)   // bytes per slab
+#define PSRAM_ALLOC_MIN_CLASS (32)          // smallest size class
+#define PSRAM_ALLOC_MAX_CLASS (4096)        // largest size class, bigger goes best-fit
+#define PSRAM_ALLOC_CLASS_COUNT (8)         // 32, 64, ... 4096
+
+#define PSRAM_HANDLE_NONE (0)
+
+// Allocations are referred to by handle. A handle carries a generation so
+// one that has been freed is rejected instead of touching someone else's data.
+typedef uint32_t psram_handle_t;
+
+typedef struct
+{
+    uint32_t total;           // bytes managed
+    uint32_t used;            // bytes handed out, after rounding
+    uint32_t requested;       // bytes asked for
+    uint32_t free;            // bytes on the free list
+    uint32_t largest_free;    // largest free block
+    uint32_t free_blocks;     // fragments on the free list
+    uint32_t lost;            // freed bytes the free list had no room to track
+    uint32_t handles;         // live allocations
+    uint32_t slabs;           // slabs carved for small objects
+    uint32_t slab_free;       // unused bytes inside those slabs
+    uint32_t failures;        // allocations that could not be satisfied
+} psram_alloc_stats_t;
+
+// Function prototypes
+
+// Heap management
+void psram_alloc_init(psram_spi_inst_t *psram, uint32_t base, uint32_t size);
+bool psram_alloc_ready(void);
+void psram_alloc_get_stats(psram_alloc_stats_t *stats);
+
+// Allocation
+psram_handle_t psram_malloc(uint32_t size);
+void psram_free(psram_handle_t handle);
+
+// Handle access
+bool psram_handle_valid(psram_handle_t handle);
+uint32_t psram_handle_address(psram_handle_t handle);
+uint32_t psram_handle_size(psram_handle_t handle);
+bool psram_handle_read(psram_handle_t handle, uint32_t offset, void *buffer, uint32_t length);
+bool psram_handle_write(psram_handle_t handle, uint32_t offset, const void *buffer, uint32_t length);
@@ -0,0 +1,348 @@
+//
+//  PicoCalc PSRAM bus
+//
+//  Every PSRAM access goes through here so the chip can be switched from
+//  plain SPI to QPI at run time. In QPI mode commands, addresses and data
+//  all use four lines, and each CS low period carries a burst of up to
+//  PSRAM_QPI_MAX_BURST bytes moved by DMA instead of a short SPI frame.
+//
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pico/stdlib.h"
+#include "pico/mutex.h"
+#include "hardware/pio.h"
+#include "hardware/dma.h"
+
+#include "psram_bus.h"
+#include "psram_qpi.pio.h"
+
+static psram_spi_inst_t *bus_spi;
+static psram_mode_t bus_mode = PSRAM_MODE_SPI;
+
+// Held for every transfer and mode switch. The core 1 loader and the
+// threads on core 0 share the PIO, and a switch reads and writes through
+// the bus itself, so the lock is recursive.
+static recursive_mutex_t bus_lock;
+
+// QPI state machine, claimed the first time QPI is tried
+static bool qpi_claimed = false;
+static uint qpi_sm;
+static uint qpi_offset;
+static int qpi_tx_dma;
+static int qpi_rx_dma;
+
+//
+// QPI transfers
+//
+
+static inline PIO qpi_pio(void)
+{
+    return bus_spi->pio;
+}
+
+// Queue the transfer header, bytes go out high nibble first
+static void qpi_begin(const uint8_t *header, uint32_t header_len, uint32_t data_len, uint32_t receive_nibbles)
+{
+    PIO pio = qpi_pio();
+    pio_sm_put_blocking(pio, qpi_sm, (header_len + data_len) * 2 - 1);
+    pio_sm_put_blocking(pio, qpi_sm, receive_nibbles);
+    for (uint32_t i = 0; i < header_len; i++)
+    {
+        pio_sm_put_blocking(pio, qpi_sm, (uint32_t)header[i] << 24);
+    }
+}
+
+// Wait until the state machine is back at the top with CS released
+static void qpi_wait_idle(void)
+{
+    PIO pio = qpi_pio();
+    while (!pio_sm_is_tx_fifo_empty(pio, qpi_sm) || pio_sm_get_pc(pio, qpi_sm) != qpi_offset + psram_qpi_offset_begin)
+    {
+        tight_loop_contents();
+    }
+}
+
+static void qpi_command(uint8_t command)
+{
+    qpi_begin(&command, 1, 0, 0);
+    qpi_wait_idle();
+}
+
+static void qpi_write_burst(uint32_t address, const uint8_t *buffer, uint32_t length)
+{
+    uint8_t header[4] = {PSRAM_CMD_QUAD_WRITE, (uint8_t)(address >> 16), (uint8_t)(address >> 8), (uint8_t)address};
+    qpi_begin(header, sizeof(header), length, 0);
+
+    // 8-bit writes are replicated across the FIFO word, so each byte lands in the top lane
+    dma_channel_config c = dma_channel_get_default_config(qpi_tx_dma);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, pio_get_dreq(qpi_pio(), qpi_sm, true));
+    dma_channel_configure(qpi_tx_dma, &c, &qpi_pio()->txf[qpi_sm], buffer, length, true);
+    dma_channel_wait_for_finish_blocking(qpi_tx_dma);
+}
+
+static void qpi_read_burst(uint32_t address, uint8_t *buffer, uint32_t length)
+{
+    uint8_t header[4] = {PSRAM_CMD_QUAD_READ, (uint8_t)(address >> 16), (uint8_t)(address >> 8), (uint8_t)address};
+    qpi_begin(header, sizeof(header), 0, PSRAM_QPI_WAIT_NIBBLES + length * 2);
+
+    // The wait cycles come back as junk bytes ahead of the data
+    for (int i = 0; i < PSRAM_QPI_WAIT_NIBBLES / 2; i++)
+    {
+        pio_sm_get_blocking(qpi_pio(), qpi_sm);
+    }
+
+    dma_channel_config c = dma_channel_get_default_config(qpi_rx_dma);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_dreq(&c, pio_get_dreq(qpi_pio(), qpi_sm, false));
+    dma_channel_configure(qpi_rx_dma, &c, buffer, &qpi_pio()->rxf[qpi_sm], length, true);
+    dma_channel_wait_for_finish_blocking(qpi_rx_dma);
+}
+
+// Largest burst from address that stays inside one page and the CS low limit
+static inline uint32_t qpi_burst_length(uint32_t address, size_t length)
+{
+    uint32_t burst = PSRAM_PAGE_SIZE - (address % PSRAM_PAGE_SIZE);
+    if (burst > PSRAM_QPI_MAX_BURST)
+    {
+        burst = PSRAM_QPI_MAX_BURST;
+    }
+    return length < burst ? (uint32_t)length : burst;
+}
+
+//
+// Mode switching
+//
+
+// Claim the state machine, program space and DMA channels QPI needs. Done
+// while the chip is still in SPI mode, so a failure leaves nothing to undo.
+static bool qpi_claim(void)
+{
+    if (qpi_claimed)
+    {
+        return true;
+    }
+
+    PIO pio = qpi_pio();
+    int sm = pio_claim_unused_sm(pio, false);
+    if (sm < 0)
+    {
+        return false;
+    }
+    if (!pio_can_add_program(pio, &psram_qpi_program))
+    {
+        pio_sm_unclaim(pio, sm);
+        return false;
+    }
+    int tx_dma = dma_claim_unused_channel(false);
+    int rx_dma = tx_dma < 0 ? -1 : dma_claim_unused_channel(false);
+    if (rx_dma < 0)
+    {
+        if (tx_dma >= 0)
+        {
+            dma_channel_unclaim(tx_dma);
+        }
+        pio_sm_unclaim(pio, sm);
+        return false;
+    }
+
+    qpi_sm = (uint)sm;
+    qpi_offset = pio_add_program(pio, &psram_qpi_program);
+    qpi_tx_dma = tx_dma;
+    qpi_rx_dma = rx_dma;
+    qpi_claimed = true;
+    return true;
+}
+
+static void qpi_start(void)
+{
+    PIO pio = qpi_pio();
+
+    // Both state machines share the pins, only one runs at a time
+    pio_sm_set_enabled(pio, bus_spi->sm, false);
+    pio_sm_clear_fifos(pio, qpi_sm);
+    pio_sm_restart(pio, qpi_sm);
+    psram_qpi_program_init(pio, qpi_sm, qpi_offset, PSRAM_PIN_SIO0, PSRAM_PIN_CS, PSRAM_QPI_CLKDIV);
+}
+
+static void qpi_stop(void)
+{
+    PIO pio = qpi_pio();
+    qpi_command(PSRAM_CMD_EXIT_QPI);
+    pio_sm_set_enabled(pio, qpi_sm, false);
+
+    // Back to MOSI out, MISO in for the SPI program
+    pio_sm_set_consecutive_pindirs(pio, bus_spi->sm, PSRAM_PIN_SIO0, 1, true);
+    pio_sm_set_consecutive_pindirs(pio, bus_spi->sm, PSRAM_PIN_SIO0 + 1, 3, false);
+    pio_sm_set_enabled(pio, bus_spi->sm, true);
+}
+
+// Write a pattern, read it back and compare
+static bool bus_probe(uint32_t address)
+{
+    uint8_t pattern[PSRAM_BUS_PROBE_SIZE];
+    uint8_t check[PSRAM_BUS_PROBE_SIZE];
+    for (int i = 0; i < PSRAM_BUS_PROBE_SIZE; i++)
+    {
+        pattern[i] = (uint8_t)(0xA5 ^ (i * 37));
+    }
+    psram_bus_write(bus_spi, address, pattern, sizeof(pattern));
+    psram_bus_read(bus_spi, address, check, sizeof(check));
+    return memcmp(pattern, check, sizeof(pattern)) == 0;
+}
+
+// Switch modes, keeping the probed bytes intact. Falls back to SPI if QPI
+// cannot be set up or does not read back correctly.
+bool psram_bus_set_mode(psram_mode_t mode)
+{
+    if (!bus_spi)
+    {
+        return false;
+    }
+
+    recursive_mutex_enter_blocking(&bus_lock);
+    if (mode == bus_mode)
+    {
+        recursive_mutex_exit(&bus_lock);
+        return true;
+    }
+
+    uint8_t saved[PSRAM_BUS_PROBE_SIZE];
+    psram_bus_read(bus_spi, 0, saved, sizeof(saved));
+
+    bool switched = true;
+    if (mode == PSRAM_MODE_QPI)
+    {
+        // The chip only leaves SPI mode once the QPI side is ready to drive it
+        switched = qpi_claim();
+        if (switched)
+        {
+            uint8_t command = PSRAM_CMD_ENTER_QPI;
+            pio_spi_write_read_blocking(bus_spi, &command, 1, NULL, 0);
+            qpi_start();
+            bus_mode = PSRAM_MODE_QPI;
+            if (!bus_probe(0))
+            {
+                qpi_stop();
+                bus_mode = PSRAM_MODE_SPI;
+                switched = false;
+            }
+        }
+    }
+    else
+    {
+        qpi_stop();
+        bus_mode = PSRAM_MODE_SPI;
+    }
+
+    psram_bus_write(bus_spi, 0, saved, sizeof(saved));
+    recursive_mutex_exit(&bus_lock);
+    return switched;
+}
+
+// Try QPI and keep it only if it both works and beats SPI
+psram_mode_t psram_bus_init(psram_spi_inst_t *spi)
+{
+    if (!recursive_mutex_is_initialized(&bus_lock))
+    {
+        recursive_mutex_init(&bus_lock);
+    }
+    bus_spi = spi;
+    bus_mode = PSRAM_MODE_SPI;
+
+    uint8_t *scratch = malloc(PSRAM_BUS_BENCH_SIZE);
+    if (!scratch)
+    {
+        return bus_mode;
+    }
+
+    uint32_t spi_rate = psram_bus_measure(0, scratch, PSRAM_BUS_BENCH_SIZE);
+    if (psram_bus_set_mode(PSRAM_MODE_QPI))
+    {
+        uint32_t qpi_rate = psram_bus_measure(0, scratch, PSRAM_BUS_BENCH_SIZE);
+        if (qpi_rate < spi_rate)
+        {
+            psram_bus_set_mode(PSRAM_MODE_SPI);
+        }
+    }
+
+    free(scratch);
+    return bus_mode;
+}
+
+psram_mode_t psram_bus_mode(void)
+{
+    return bus_mode;
+}
+
+const char *psram_bus_mode_name(psram_mode_t mode)
+{
+    return mode == PSRAM_MODE_QPI ? "QPI" : "SPI";
+}
+
+// Bytes per second for writing then reading length bytes. Overwrites the
+// range, so only use it on memory nobody else owns.
+uint32_t psram_bus_measure(uint32_t address, uint8_t *scratch, uint32_t length)
+{
+    recursive_mutex_enter_blocking(&bus_lock);
+    uint64_t start = time_us_64();
+    psram_bus_write(bus_spi, address, scratch, length);
+    psram_bus_read(bus_spi, address, scratch, length);
+    uint64_t elapsed = time_us_64() - start;
+    recursive_mutex_exit(&bus_lock);
+    return elapsed ? (uint32_t)((uint64_t)length * 2 * 1000000 / elapsed) : 0;
+}
+
+//
+// Transfers
+//
+
+void psram_bus_read(psram_spi_inst_t *spi, uint32_t address, uint8_t *buffer, size_t length)
+{
+    recursive_mutex_enter_blocking(&bus_lock);
+    if (bus_mode == PSRAM_MODE_SPI)
+    {
+        psram_read(spi, address, buffer, length);
+    }
+    else
+    {
+        while (length > 0)
+        {
+            uint32_t burst = qpi_burst_length(address, length);
+            qpi_read_burst(address, buffer, burst);
+            address += burst;
+            buffer += burst;
+            length -= burst;
+        }
+    }
+    recursive_mutex_exit(&bus_lock);
+}
+
+void psram_bus_write(psram_spi_inst_t *spi, uint32_t address, const uint8_t *buffer, size_t length)
+{
+    recursive_mutex_enter_blocking(&bus_lock);
+    if (bus_mode == PSRAM_MODE_SPI)
+    {
+        psram_write(spi, address, buffer, length);
+    }
+    else
+    {
+        while (length > 0)
+        {
+            uint32_t burst = qpi_burst_length(address, length);
+            qpi_write_burst(address, buffer, burst);
+            address += burst;
+            buffer += burst;
+            length -= burst;
+        }
+    }
+    recursive_mutex_exit(&bus_lock);
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "psram_spi.h"
+
+// PSRAM wiring on the PicoCalc
+#define PSRAM_PIN_CS (20)   // chip select
+#define PSRAM_PIN_SCK (21)  // serial clock, must follow CS for the PIO side-set
+#define PSRAM_PIN_SIO0 (2)  // SIO0 (MOSI in SPI mode), SIO1-3 on the next three pins
+
+// QPI transfer parameters
+#define PSRAM_QPI_CLKDIV (1.0f)       // PIO clock divider for the QPI program
+#define PSRAM_QPI_MAX_BURST (128)     // bytes per CS low, keeps within the 8 us tCEM limit
+#define PSRAM_QPI_WAIT_NIBBLES (6)    // wait cycles of the quad fast read
+#define PSRAM_PAGE_SIZE (1024)        // bursts never cross a page
+#define PSRAM_BUS_PROBE_SIZE (32)     // bytes used to check a mode works
+#define PSRAM_BUS_BENCH_SIZE (4096)   // bytes timed when picking a mode at boot
+
+// PSRAM commands
+#define PSRAM_CMD_ENTER_QPI (0x35)
+#define PSRAM_CMD_EXIT_QPI (0xF5)
+#define PSRAM_CMD_QUAD_READ (0xEB)
+#define PSRAM_CMD_QUAD_WRITE (0x38)
+
+typedef enum
+{
+    PSRAM_MODE_SPI = 0, // one data line, through the psram_spi library
+    PSRAM_MODE_QPI,     // four data lines, through psram_qpi.pio
+} psram_mode_t;
+
+// Function prototypes
+
+// Bus management
+psram_mode_t psram_bus_init(psram_spi_inst_t *spi);
+psram_mode_t psram_bus_mode(void);
+bool psram_bus_set_mode(psram_mode_t mode);
+const char *psram_bus_mode_name(psram_mode_t mode);
+uint32_t psram_bus_measure(uint32_t address, uint8_t *scratch, uint32_t length);
+
+// Transfers in whichever mode is active
+void psram_bus_read(psram_spi_inst_t *spi, uint32_t address, uint8_t *buffer, size_t length);
+void psram_bus_write(psram_spi_inst_t *spi, uint32_t address, const uint8_t *buffer, size_t length);
@@ -0,0 +1,218 @@
+//
+//  PicoCalc SD to PSRAM loader
+//
+//  Streams a file into a fresh PSRAM allocation in cluster-sized chunks.
+//  Two SRAM buffers alternate: while core 1 pushes chunk N out to PSRAM
+//  (PIO with DMA), core 0 reads chunk N+1 from the card, so neither bus
+//  waits for the other. Core 1 is only borrowed for the length of a load:
+//  it is launched when the load starts and put back into reset at the end.
+//
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pico/stdlib.h"
+
+#include "psram_loader.h"
+#include "psram_bus.h"
+
+#if PSRAM_LOADER_CORE1
+#include "pico/multicore.h"
+#endif
+
+static psram_spi_inst_t *loader_psram;
+
+#if PSRAM_LOADER_CORE1
+// Work handed to core 1, one per buffer
+typedef struct
+{
+    uint32_t address;
+    const uint8_t *buffer;
+    uint32_t length;
+} write_job_t;
+
+static write_job_t write_jobs[2];
+
+// Core 1 writes whichever buffer it is given and hands the index back
+static void loader_core1_main(void)
+{
+    for (;;)
+    {
+        uint32_t job = multicore_fifo_pop_blocking();
+        psram_bus_write(loader_psram, write_jobs[job].address, write_jobs[job].buffer, write_jobs[job].length);
+        multicore_fifo_push_blocking(job);
+    }
+}
+#endif
+
+static void write_start(int job, uint32_t address, const uint8_t *buffer, uint32_t length)
+{
+#if PSRAM_LOADER_CORE1
+    write_jobs[job].address = address;
+    write_jobs[job].buffer = buffer;
+    write_jobs[job].length = length;
+    multicore_fifo_push_blocking((uint32_t)job);
+#else
+    psram_bus_write(loader_psram, address, buffer, length);
+#endif
+}
+
+static void write_wait(void)
+{
+#if PSRAM_LOADER_CORE1
+    multicore_fifo_pop_blocking();
+#endif
+}
+
+static void writer_start(void)
+{
+#if PSRAM_LOADER_CORE1
+    multicore_launch_core1(loader_core1_main);
+#endif
+}
+
+// Only called with no job in flight, so the FIFO is empty when core 1 stops
+static void writer_stop(void)
+{
+#if PSRAM_LOADER_CORE1
+    multicore_reset_core1();
+#endif
+}
+
+void psram_loader_init(psram_spi_inst_t *psram)
+{
+    loader_psram = psram;
+}
+
+// Read up to one chunk, short only at the end of the file
+static fat32_error_t read_chunk(fat32_file_t *file, uint8_t *buffer, uint32_t chunk, uint32_t *length)
+{
+    size_t bytes_read;
+    fat32_error_t result = fat32_read(file, buffer, chunk, &bytes_read);
+    *length = (uint32_t)bytes_read;
+    return result;
+}
+
+// Load a whole file into a new PSRAM allocation. The caller owns the handle
+// and releases it with psram_free().
+fat32_error_t psram_load_file(const char *path, psram_handle_t *handle, psram_load_stats_t *stats)
+{
+    fat32_file_t file;
+    psram_load_stats_t local_stats;
+    uint64_t start_us = time_us_64();
+
+    if (!path || !handle || !loader_psram)
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+    if (!stats)
+    {
+        stats = &local_stats;
+    }
+    memset(stats, 0, sizeof(*stats));
+    *handle = PSRAM_HANDLE_NONE;
+
+    fat32_error_t result = fat32_open_indexed(&file, path);
+    if (result != FAT32_OK)
+    {
+        return result;
+    }
+    if (file.attributes & FAT32_ATTR_DIRECTORY)
+    {
+        fat32_close(&file);
+        return FAT32_ERROR_NOT_A_FILE;
+    }
+
+    uint32_t size = file.file_size;
+    psram_handle_t allocation = psram_malloc(size ? size : 1);
+    if (allocation == PSRAM_HANDLE_NONE)
+    {
+        fat32_close(&file);
+        return FAT32_ERROR_NO_MEMORY;
+    }
+    uint32_t address = psram_handle_address(allocation);
+
+    // Cluster-sized chunks keep the card reads whole-cluster and aligned
+    uint32_t chunk = PSRAM_LOAD_MAX_CHUNK;
+    fat32_get_cluster_size(&chunk);
+    if (chunk > PSRAM_LOAD_MAX_CHUNK)
+    {
+        chunk = PSRAM_LOAD_MAX_CHUNK;
+    }
+    uint8_t *buffers = NULL;
+    while (chunk >= PSRAM_LOAD_MIN_CHUNK && (buffers = malloc(2 * chunk)) == NULL)
+    {
+        chunk /= 2;
+    }
+    if (!buffers)
+    {
+        psram_free(allocation);
+        fat32_close(&file);
+        return FAT32_ERROR_NO_MEMORY;
+    }
+    stats->chunk_size = chunk;
+    writer_start();
+
+    // Prime the pipeline, then always read chunk N+1 while chunk N is written
+    int current = 0;
+    uint32_t length = 0;
+    uint64_t t0 = time_us_64();
+    result = read_chunk(&file, buffers, chunk, &length);
+    stats->read_us += time_us_64() - t0;
+
+    while (result == FAT32_OK && length > 0 && stats->bytes < size)
+    {
+        if (length > size - stats->bytes)
+        {
+            length = size - stats->bytes;
+        }
+        write_start(current, address + stats->bytes, buffers + current * chunk, length);
+
+        uint32_t next_length = 0;
+        t0 = time_us_64();
+        if (stats->bytes + length < size)
+        {
+            result = read_chunk(&file, buffers + (current ^ 1) * chunk, chunk, &next_length);
+        }
+        uint64_t t1 = time_us_64();
+        stats->read_us += t1 - t0;
+
+        write_wait();
+        stats->write_wait_us += time_us_64() - t1;
+
+        stats->bytes += length;
+        stats->chunks++;
+        current ^= 1;
+        length = next_length;
+    }
+
+    writer_stop();
+    free(buffers);
+    fat32_close(&file);
+    stats->elapsed_us = time_us_64() - start_us;
+
+    if (result == FAT32_OK && stats->bytes < size)
+    {
+        result = FAT32_ERROR_READ_FAILED;
+    }
+    if (result != FAT32_OK)
+    {
+        psram_free(allocation);
+        return result;
+    }
+
+    *handle = allocation;
+    return FAT32_OK;
+}
+
+// Bytes per second over the whole load
+uint32_t psram_load_throughput(const psram_load_stats_t *stats)
+{
+    if (!stats || stats->elapsed_us == 0)
+    {
+        return 0;
+    }
+    return (uint32_t)((uint64_t)stats->bytes * 1000000 / stats->elapsed_us);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "fat32.h"
+#include "psram_alloc.h"
+
+// Loader parameters
+#define PSRAM_LOAD_MAX_CHUNK (32 * 1024) // upper bound on the cluster-sized chunk
+#define PSRAM_LOAD_MIN_CHUNK (4 * 1024)  // smallest chunk tried when SRAM is short
+
+// Hand PSRAM writes to core 1 so they overlap the next card read. Core 1
+// must be idle (in reset) when psram_load_file() is called; it is launched
+// for the load and reset again before the call returns. Set to 0 when core
+// 1 runs something else for good.
+#ifndef PSRAM_LOADER_CORE1
+#define PSRAM_LOADER_CORE1 1
+#endif
+
+typedef struct
+{
+    uint32_t bytes;          // bytes loaded
+    uint32_t chunk_size;     // bytes per chunk
+    uint32_t chunks;         // chunks transferred
+    uint64_t elapsed_us;     // total time
+    uint64_t read_us;        // time spent reading the card
+    uint64_t write_wait_us;  // time spent waiting for PSRAM writes to finish
+} psram_load_stats_t;
+
+// Function prototypes
+void psram_loader_init(psram_spi_inst_t *psram);
+fat32_error_t psram_load_file(const char *path, psram_handle_t *handle, psram_load_stats_t *stats);
+uint32_t psram_load_throughput(const psram_load_stats_t *stats);
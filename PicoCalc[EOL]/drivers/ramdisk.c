@@ -0,0 +1,104 @@
+//
+//  PicoCalc PSRAM RAM disk
+//
+//  A block device over a region of PSRAM with the same block interface as
+//  the SD card driver. Multi-block transfers are a single PSRAM burst, so
+//  there is no per-block command overhead and no flash wear. Contents are
+//  lost on reset.
+//
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ramdisk.h"
+
+static psram_handle_t ramdisk_handle = PSRAM_HANDLE_NONE;
+static uint32_t ramdisk_blocks = 0;
+
+sd_error_t ramdisk_init(uint32_t size)
+{
+    ramdisk_release();
+
+    uint32_t blocks = size / RAMDISK_BLOCK_SIZE;
+    if (blocks < RAMDISK_MIN_BLOCKS || !psram_alloc_ready())
+    {
+        return SD_ERROR_INIT_FAILED;
+    }
+
+    ramdisk_handle = psram_malloc(blocks * RAMDISK_BLOCK_SIZE);
+    if (ramdisk_handle == PSRAM_HANDLE_NONE)
+    {
+        return SD_ERROR_INIT_FAILED;
+    }
+    ramdisk_blocks = blocks;
+    return SD_OK;
+}
+
+void ramdisk_release(void)
+{
+    if (ramdisk_handle != PSRAM_HANDLE_NONE)
+    {
+        psram_free(ramdisk_handle);
+    }
+    ramdisk_handle = PSRAM_HANDLE_NONE;
+    ramdisk_blocks = 0;
+}
+
+bool ramdisk_present(void)
+{
+    return ramdisk_handle != PSRAM_HANDLE_NONE;
+}
+
+uint32_t ramdisk_block_count(void)
+{
+    return ramdisk_blocks;
+}
+
+//
+// Block-level read/write functions
+//
+
+sd_error_t ramdisk_read_blocks(uint32_t start_block, uint32_t num_blocks, uint8_t *buffer)
+{
+    if (!ramdisk_present())
+    {
+        return SD_ERROR_NO_CARD;
+    }
+    if (start_block > ramdisk_blocks || num_blocks > ramdisk_blocks - start_block)
+    {
+        return SD_ERROR_READ_FAILED;
+    }
+    if (!psram_handle_read(ramdisk_handle, start_block * RAMDISK_BLOCK_SIZE, buffer, num_blocks * RAMDISK_BLOCK_SIZE))
+    {
+        return SD_ERROR_READ_FAILED;
+    }
+    return SD_OK;
+}
+
+sd_error_t ramdisk_write_blocks(uint32_t start_block, uint32_t num_blocks, const uint8_t *buffer)
+{
+    if (!ramdisk_present())
+    {
+        return SD_ERROR_NO_CARD;
+    }
+    if (start_block > ramdisk_blocks || num_blocks > ramdisk_blocks - start_block)
+    {
+        return SD_ERROR_WRITE_FAILED;
+    }
+    if (!psram_handle_write(ramdisk_handle, start_block * RAMDISK_BLOCK_SIZE, buffer, num_blocks * RAMDISK_BLOCK_SIZE))
+    {
+        return SD_ERROR_WRITE_FAILED;
+    }
+    return SD_OK;
+}
+
+sd_error_t ramdisk_read_block(uint32_t block, uint8_t *buffer)
+{
+    return ramdisk_read_blocks(block, 1, buffer);
+}
+
+sd_error_t ramdisk_write_block(uint32_t block, const uint8_t *buffer)
+{
+    return ramdisk_write_blocks(block, 1, buffer);
+}
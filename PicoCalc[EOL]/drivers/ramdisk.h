@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "sdcard.h"
+#include "psram_alloc.h"
+
+// RAM disk parameters
+#define RAMDISK_BLOCK_SIZE (SD_BLOCK_SIZE) // same block size as the SD card
+#define RAMDISK_MIN_BLOCKS (64)            // smallest disk worth creating
+
+// Function prototypes
+
+// RAM disk management, the disk is carved out of the PSRAM heap
+sd_error_t ramdisk_init(uint32_t size);
+void ramdisk_release(void);
+bool ramdisk_present(void);
+uint32_t ramdisk_block_count(void);
+
+// Block-level read/write functions, drop-in for the sd_* versions
+sd_error_t ramdisk_read_block(uint32_t block, uint8_t *buffer);
+sd_error_t ramdisk_write_block(uint32_t block, const uint8_t *buffer);
+sd_error_t ramdisk_read_blocks(uint32_t start_block, uint32_t num_blocks, uint8_t *buffer);
+sd_error_t ramdisk_write_blocks(uint32_t start_block, uint32_t num_blocks, const uint8_t *buffer);
@@ -0,0 +1,567 @@
+//
+//  PicoCalc RAM disk file system
+//
+//  A flat scratch file system on top of the PSRAM RAM disk. Metadata lives
+//  in SRAM and file data is moved with whole-block transfers wherever the
+//  request is block aligned, falling back to a bounce block at the edges.
+//
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ramfs.h"
+
+#define RETURN_ON_ERROR(expr)        \
+    {                                \
+        fat32_error_t _res = (expr); \
+        if (_res != FAT32_OK)        \
+        {                            \
+            return _res;             \
+        }                            \
+    }
+
+#define RAMFS_CLUSTER_SIZE (RAMFS_CLUSTER_BLOCKS * RAMDISK_BLOCK_SIZE)
+#define RAMFS_MAX_CLUSTERS (0xFFFE)
+
+// Cluster table values
+#define RAMFS_FREE (0xFFFE)
+#define RAMFS_END (0xFFFF)
+
+typedef struct
+{
+    char name[RAMFS_MAX_NAME + 1];
+    uint32_t size;
+    uint16_t first_cluster; // RAMFS_END while the file is empty
+    bool used;
+} ramfs_entry_t;
+
+static bool ramfs_mounted = false;
+static ramfs_entry_t entries[RAMFS_MAX_FILES];
+static uint16_t *cluster_table; // next cluster in each chain
+static uint32_t cluster_count;
+static uint32_t free_clusters;
+static uint32_t next_free_hint;
+
+static uint8_t bounce_block[RAMDISK_BLOCK_SIZE] __attribute__((aligned(4)));
+
+fat32_error_t ramfs_mount(uint32_t size)
+{
+    ramfs_unmount();
+
+    if (ramdisk_init(size) != SD_OK)
+    {
+        return FAT32_ERROR_INIT_FAILED;
+    }
+
+    cluster_count = ramdisk_block_count() / RAMFS_CLUSTER_BLOCKS;
+    if (cluster_count > RAMFS_MAX_CLUSTERS)
+    {
+        cluster_count = RAMFS_MAX_CLUSTERS;
+    }
+    cluster_table = malloc(cluster_count * sizeof(uint16_t));
+    if (!cluster_table)
+    {
+        ramdisk_release();
+        return FAT32_ERROR_INIT_FAILED;
+    }
+    for (uint32_t i = 0; i < cluster_count; i++)
+    {
+        cluster_table[i] = RAMFS_FREE;
+    }
+
+    memset(entries, 0, sizeof(entries));
+    free_clusters = cluster_count;
+    next_free_hint = 0;
+    ramfs_mounted = true;
+    return FAT32_OK;
+}
+
+void ramfs_unmount(void)
+{
+    free(cluster_table);
+    cluster_table = NULL;
+    cluster_count = 0;
+    free_clusters = 0;
+    ramfs_mounted = false;
+    ramdisk_release();
+}
+
+bool ramfs_is_mounted(void)
+{
+    return ramfs_mounted;
+}
+
+// True for "/ram" and anything below it
+bool ramfs_is_path(const char *path)
+{
+    size_t len = strlen(RAMFS_MOUNT_POINT);
+    return path && strncasecmp(path, RAMFS_MOUNT_POINT, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+fat32_error_t ramfs_get_space(uint64_t *total_space, uint64_t *free_space)
+{
+    if (!ramfs_mounted)
+    {
+        return FAT32_ERROR_NOT_MOUNTED;
+    }
+    *total_space = (uint64_t)cluster_count * RAMFS_CLUSTER_SIZE;
+    *free_space = (uint64_t)free_clusters * RAMFS_CLUSTER_SIZE;
+    return FAT32_OK;
+}
+
+//
+// Names and directory slots
+//
+
+// File name below the mount point, "" for the root. NULL if the path is
+// not on the RAM disk or names something deeper than the root directory.
+static const char *ramfs_name(const char *path)
+{
+    if (!ramfs_is_path(path))
+    {
+        return NULL;
+    }
+    const char *name = path + strlen(RAMFS_MOUNT_POINT);
+    while (*name == '/')
+    {
+        name++;
+    }
+    const char *slash = strchr(name, '/');
+    if (slash && slash[strspn(slash, "/")] != '\0')
+    {
+        return NULL;
+    }
+    return name;
+}
+
+// Length of a name without trailing slashes
+static size_t ramfs_name_len(const char *name)
+{
+    size_t len = strlen(name);
+    while (len > 0 && name[len - 1] == '/')
+    {
+        len--;
+    }
+    return len;
+}
+
+static int ramfs_find(const char *name)
+{
+    size_t len = ramfs_name_len(name);
+    for (int i = 0; i < RAMFS_MAX_FILES; i++)
+    {
+        if (entries[i].used && strlen(entries[i].name) == len && strncasecmp(entries[i].name, name, len) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+//
+// Cluster chains
+//
+
+static fat32_error_t ramfs_alloc_cluster(uint16_t *cluster)
+{
+    if (free_clusters == 0)
+    {
+        return FAT32_ERROR_DISK_FULL;
+    }
+    for (uint32_t n = 0; n < cluster_count; n++)
+    {
+        uint32_t c = (next_free_hint + n) % cluster_count;
+        if (cluster_table[c] == RAMFS_FREE)
+        {
+            cluster_table[c] = RAMFS_END;
+            free_clusters--;
+            next_free_hint = c + 1;
+            *cluster = (uint16_t)c;
+            return FAT32_OK;
+        }
+    }
+    return FAT32_ERROR_DISK_FULL;
+}
+
+static void ramfs_free_chain(uint16_t cluster)
+{
+    while (cluster != RAMFS_END && cluster < cluster_count)
+    {
+        uint16_t next = cluster_table[cluster];
+        cluster_table[cluster] = RAMFS_FREE;
+        free_clusters++;
+        cluster = next;
+    }
+}
+
+// Cluster holding the given position in the chain, growing the chain if asked
+static fat32_error_t ramfs_cluster_at(fat32_file_t *file, uint32_t ordinal, bool extend, uint16_t *cluster)
+{
+    ramfs_entry_t *entry = &entries[file->start_cluster];
+
+    // Walk on from the cached cluster when it is not past the target
+    uint16_t c = entry->first_cluster;
+    uint32_t at = 0;
+    if (file->current_cluster != RAMFS_END && file->dir_entry_sector <= ordinal)
+    {
+        c = (uint16_t)file->current_cluster;
+        at = file->dir_entry_sector;
+    }
+    else if (c == RAMFS_END)
+    {
+        if (!extend)
+        {
+            return FAT32_ERROR_INVALID_POSITION;
+        }
+        RETURN_ON_ERROR(ramfs_alloc_cluster(&c));
+        entry->first_cluster = c;
+    }
+
+    while (at < ordinal)
+    {
+        uint16_t next = cluster_table[c];
+        if (next == RAMFS_END)
+        {
+            if (!extend)
+            {
+                return FAT32_ERROR_INVALID_POSITION;
+            }
+            RETURN_ON_ERROR(ramfs_alloc_cluster(&next));
+            cluster_table[c] = next;
+        }
+        c = next;
+        at++;
+    }
+
+    file->current_cluster = c;
+    file->dir_entry_sector = ordinal;
+    *cluster = c;
+    return FAT32_OK;
+}
+
+//
+// File operations
+//
+
+static void ramfs_open_slot(fat32_file_t *file, int slot)
+{
+    memset(file, 0, sizeof(*file));
+    file->is_open = true;
+    file->start_cluster = (uint32_t)slot;
+    file->current_cluster = RAMFS_END;
+    file->file_size = entries[slot].size;
+    file->attributes = FAT32_ATTR_ARCHIVE | RAMFS_ATTR_RAM;
+}
+
+fat32_error_t ramfs_open(fat32_file_t *file, const char *path)
+{
+    if (!ramfs_mounted)
+    {
+        return FAT32_ERROR_NOT_MOUNTED;
+    }
+    const char *name = ramfs_name(path);
+    if (!name)
+    {
+        return FAT32_ERROR_INVALID_PATH;
+    }
+
+    if (ramfs_name_len(name) == 0)
+    {
+        memset(file, 0, sizeof(*file));
+        file->is_open = true;
+        file->current_cluster = RAMFS_END;
+        file->attributes = FAT32_ATTR_DIRECTORY | RAMFS_ATTR_RAM;
+        return FAT32_OK;
+    }
+
+    int slot = ramfs_find(name);
+    if (slot < 0)
+    {
+        return FAT32_ERROR_FILE_NOT_FOUND;
+    }
+    ramfs_open_slot(file, slot);
+    return FAT32_OK;
+}
+
+fat32_error_t ramfs_create(fat32_file_t *file, const char *path)
+{
+    if (!ramfs_mounted)
+    {
+        return FAT32_ERROR_NOT_MOUNTED;
+    }
+    const char *name = ramfs_name(path);
+    size_t len = name ? ramfs_name_len(name) : 0;
+    if (len == 0 || len > RAMFS_MAX_NAME)
+    {
+        return FAT32_ERROR_INVALID_PATH;
+    }
+    if (ramfs_find(name) >= 0)
+    {
+        return FAT32_ERROR_FILE_EXISTS;
+    }
+
+    for (int i = 0; i < RAMFS_MAX_FILES; i++)
+    {
+        if (!entries[i].used)
+        {
+            memcpy(entries[i].name, name, len);
+            entries[i].name[len] = '\0';
+            entries[i].size = 0;
+            entries[i].first_cluster = RAMFS_END;
+            entries[i].used = true;
+            ramfs_open_slot(file, i);
+            return FAT32_OK;
+        }
+    }
+    return FAT32_ERROR_DISK_FULL;
+}
+
+fat32_error_t ramfs_close(fat32_file_t *file)
+{
+    file->is_open = false;
+    return FAT32_OK;
+}
+
+static bool ramfs_file_valid(const fat32_file_t *file)
+{
+    return ramfs_mounted && file->is_open && (file->attributes & RAMFS_ATTR_RAM) &&
+           !(file->attributes & FAT32_ATTR_DIRECTORY) && file->start_cluster < RAMFS_MAX_FILES &&
+           entries[file->start_cluster].used;
+}
+
+fat32_error_t ramfs_read(fat32_file_t *file, void *buffer, size_t size, size_t *bytes_read)
+{
+    *bytes_read = 0;
+    if (!ramfs_file_valid(file))
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    ramfs_entry_t *entry = &entries[file->start_cluster];
+    file->file_size = entry->size;
+    if (file->position >= entry->size)
+    {
+        return FAT32_OK;
+    }
+    if (size > entry->size - file->position)
+    {
+        size = entry->size - file->position;
+    }
+
+    uint8_t *dst = buffer;
+    while (*bytes_read < size)
+    {
+        uint16_t cluster;
+        uint32_t offset = file->position % RAMFS_CLUSTER_SIZE;
+        RETURN_ON_ERROR(ramfs_cluster_at(file, file->position / RAMFS_CLUSTER_SIZE, false, &cluster));
+
+        uint32_t block = cluster * RAMFS_CLUSTER_BLOCKS + offset / RAMDISK_BLOCK_SIZE;
+        uint32_t in_block = offset % RAMDISK_BLOCK_SIZE;
+        size_t remaining = size - *bytes_read;
+        size_t chunk;
+
+        if (in_block == 0 && remaining >= RAMDISK_BLOCK_SIZE)
+        {
+            // Whole blocks straight into the caller's buffer
+            uint32_t blocks = (RAMFS_CLUSTER_SIZE - offset) / RAMDISK_BLOCK_SIZE;
+            if (blocks > remaining / RAMDISK_BLOCK_SIZE)
+            {
+                blocks = remaining / RAMDISK_BLOCK_SIZE;
+            }
+            if (ramdisk_read_blocks(block, blocks, dst) != SD_OK)
+            {
+                return FAT32_ERROR_READ_FAILED;
+            }
+            chunk = blocks * RAMDISK_BLOCK_SIZE;
+        }
+        else
+        {
+            if (ramdisk_read_block(block, bounce_block) != SD_OK)
+            {
+                return FAT32_ERROR_READ_FAILED;
+            }
+            chunk = RAMDISK_BLOCK_SIZE - in_block;
+            if (chunk > remaining)
+            {
+                chunk = remaining;
+            }
+            memcpy(dst, bounce_block + in_block, chunk);
+        }
+
+        dst += chunk;
+        *bytes_read += chunk;
+        file->position += chunk;
+    }
+    return FAT32_OK;
+}
+
+fat32_error_t ramfs_write(fat32_file_t *file, const void *buffer, size_t size, size_t *bytes_written)
+{
+    *bytes_written = 0;
+    if (!ramfs_file_valid(file))
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    ramfs_entry_t *entry = &entries[file->start_cluster];
+    const uint8_t *src = buffer;
+    fat32_error_t result = FAT32_OK;
+    while (*bytes_written < size)
+    {
+        uint16_t cluster;
+        uint32_t offset = file->position % RAMFS_CLUSTER_SIZE;
+        result = ramfs_cluster_at(file, file->position / RAMFS_CLUSTER_SIZE, true, &cluster);
+        if (result != FAT32_OK)
+        {
+            break;
+        }
+
+        uint32_t block = cluster * RAMFS_CLUSTER_BLOCKS + offset / RAMDISK_BLOCK_SIZE;
+        uint32_t in_block = offset % RAMDISK_BLOCK_SIZE;
+        size_t remaining = size - *bytes_written;
+        size_t chunk;
+
+        if (in_block == 0 && remaining >= RAMDISK_BLOCK_SIZE)
+        {
+            uint32_t blocks = (RAMFS_CLUSTER_SIZE - offset) / RAMDISK_BLOCK_SIZE;
+            if (blocks > remaining / RAMDISK_BLOCK_SIZE)
+            {
+                blocks = remaining / RAMDISK_BLOCK_SIZE;
+            }
+            if (ramdisk_write_blocks(block, blocks, src) != SD_OK)
+            {
+                result = FAT32_ERROR_WRITE_FAILED;
+                break;
+            }
+            chunk = blocks * RAMDISK_BLOCK_SIZE;
+        }
+        else
+        {
+            // Partial block, merge with what is already there
+            chunk = RAMDISK_BLOCK_SIZE - in_block;
+            if (chunk > remaining)
+            {
+                chunk = remaining;
+            }
+            if (ramdisk_read_block(block, bounce_block) != SD_OK)
+            {
+                result = FAT32_ERROR_READ_FAILED;
+                break;
+            }
+            memcpy(bounce_block + in_block, src, chunk);
+            if (ramdisk_write_block(block, bounce_block) != SD_OK)
+            {
+                result = FAT32_ERROR_WRITE_FAILED;
+                break;
+            }
+        }
+
+        src += chunk;
+        *bytes_written += chunk;
+        file->position += chunk;
+        if (file->position > entry->size)
+        {
+            entry->size = file->position;
+        }
+    }
+
+    file->file_size = entry->size;
+    return result;
+}
+
+fat32_error_t ramfs_seek(fat32_file_t *file, uint32_t position)
+{
+    if (!ramfs_file_valid(file))
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+    if (position > entries[file->start_cluster].size)
+    {
+        return FAT32_ERROR_INVALID_POSITION;
+    }
+    file->position = position;
+    return FAT32_OK;
+}
+
+fat32_error_t ramfs_delete(const char *path)
+{
+    if (!ramfs_mounted)
+    {
+        return FAT32_ERROR_NOT_MOUNTED;
+    }
+    const char *name = ramfs_name(path);
+    if (!name || ramfs_name_len(name) == 0)
+    {
+        return FAT32_ERROR_INVALID_PATH;
+    }
+    int slot = ramfs_find(name);
+    if (slot < 0)
+    {
+        return FAT32_ERROR_FILE_NOT_FOUND;
+    }
+
+    ramfs_free_chain(entries[slot].first_cluster);
+    memset(&entries[slot], 0, sizeof(entries[slot]));
+    return FAT32_OK;
+}
+
+fat32_error_t ramfs_rename(const char *old_path, const char *new_path)
+{
+    if (!ramfs_mounted)
+    {
+        return FAT32_ERROR_NOT_MOUNTED;
+    }
+    const char *old_name = ramfs_name(old_path);
+    const char *new_name = ramfs_name(new_path);
+    size_t len = new_name ? ramfs_name_len(new_name) : 0;
+    if (!old_name || len == 0 || len > RAMFS_MAX_NAME)
+    {
+        return FAT32_ERROR_INVALID_PATH;
+    }
+
+    int slot = ramfs_find(old_name);
+    if (slot < 0)
+    {
+        return FAT32_ERROR_FILE_NOT_FOUND;
+    }
+    int existing = ramfs_find(new_name);
+    if (existing >= 0 && existing != slot)
+    {
+        return FAT32_ERROR_FILE_EXISTS;
+    }
+
+    memcpy(entries[slot].name, new_name, len);
+    entries[slot].name[len] = '\0';
+    return FAT32_OK;
+}
+
+//
+// Directory operations
+//
+
+// Same contract as fat32_dir_read(), an empty filename marks the end
+fat32_error_t ramfs_dir_read(fat32_file_t *dir, fat32_entry_t *dir_entry)
+{
+    memset(dir_entry, 0, sizeof(*dir_entry));
+    if (!ramfs_mounted || !dir->is_open || !(dir->attributes & FAT32_ATTR_DIRECTORY))
+    {
+        return FAT32_ERROR_INVALID_PARAMETER;
+    }
+
+    while (dir->last_entry_read < RAMFS_MAX_FILES)
+    {
+        ramfs_entry_t *entry = &entries[dir->last_entry_read++];
+        if (entry->used)
+        {
+            strcpy(dir_entry->filename, entry->name);
+            dir_entry->size = entry->size;
+            dir_entry->start_cluster = entry->first_cluster;
+            dir_entry->attr = FAT32_ATTR_ARCHIVE;
+            return FAT32_OK;
+        }
+    }
+    return FAT32_OK;
+}
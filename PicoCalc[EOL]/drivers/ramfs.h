@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "fat32.h"
+#include "ramdisk.h"
+
+// RAM file system parameters
+#define RAMFS_MOUNT_POINT "/ram"             // paths below here live on the RAM disk
+#define RAMFS_DEFAULT_SIZE (2 * 1024 * 1024) // PSRAM given to the RAM disk at boot
+#define RAMFS_MAX_FILES (64)                 // files in the (flat) root directory
+#define RAMFS_MAX_NAME (63)                  // longest file name
+#define RAMFS_CLUSTER_BLOCKS (4)             // blocks per allocation unit
+
+// Set in fat32_file_t.attributes for handles that belong to the RAM disk
+#define RAMFS_ATTR_RAM (0x100)
+
+// Light file system for scratch data on the RAM disk
+//
+// Files sit in a single directory at /ram. The directory and the cluster
+// chains are kept in SRAM, only file data goes through the block device,
+// so nothing has to be parsed at mount time. Handles and directory entries
+// reuse the FAT32 types so callers can treat both volumes alike.
+//
+// For RAM disk handles, fat32_file_t.start_cluster is the directory slot and
+// current_cluster/dir_entry_sector cache the last cluster visited and its
+// position in the chain.
+
+// Function prototypes
+
+// File system management
+fat32_error_t ramfs_mount(uint32_t size);
+void ramfs_unmount(void);
+bool ramfs_is_mounted(void);
+bool ramfs_is_path(const char *path);
+fat32_error_t ramfs_get_space(uint64_t *total_space, uint64_t *free_space);
+
+// File operations
+fat32_error_t ramfs_open(fat32_file_t *file, const char *path);
+fat32_error_t ramfs_create(fat32_file_t *file, const char *path);
+fat32_error_t ramfs_close(fat32_file_t *file);
+fat32_error_t ramfs_read(fat32_file_t *file, void *buffer, size_t size, size_t *bytes_read);
+fat32_error_t ramfs_write(fat32_file_t *file, const void *buffer, size_t size, size_t *bytes_written);
+fat32_error_t ramfs_seek(fat32_file_t *file, uint32_t position);
+fat32_error_t ramfs_delete(const char *path);
+fat32_error_t ramfs_rename(const char *old_path, const char *new_path);
+
+// Directory operations
+fat32_error_t ramfs_dir_read(fat32_file_t *dir, fat32_entry_t *dir_entry);
@@ -229,28 +229,123 @@ sd_error_t sd_write_block(uint32_t block, const uint8_t *buffer)
 
 sd_error_t sd_read_blocks(uint32_t start_block, uint32_t num_blocks, uint8_t *buffer)
 {
+    if (num_blocks == 0)
+    {
+        return SD_OK;
+    }
+    if (num_blocks == 1)
+    {
+        return sd_read_block(start_block, buffer);
+    }
+
+    // One CMD18 streams every block back to back, so the card only pays
+    // its command and access latency once for the whole run
+    uint32_t addr = is_sdhc ? start_block : start_block * SD_BLOCK_SIZE;
+    uint8_t response = sd_send_command(SD_CMD18, addr);
+    if (response != 0)
+    {
+        sd_cs_deselect();
+        return SD_ERROR_READ_FAILED;
+    }
+
+    sd_error_t result = SD_OK;
     for (uint32_t i = 0; i < num_blocks; i++)
     {
-        sd_error_t result = sd_read_block(start_block + i, buffer + (i * SD_BLOCK_SIZE));
-        if (result != SD_OK)
+        uint32_t timeout = 100000;
+        do
+        {
+            response = sd_spi_write_read(0xFF);
+            timeout--;
+        } while (response != SD_DATA_START_BLOCK && timeout > 0);
+
+        if (timeout == 0)
         {
-            return result;
+            result = SD_ERROR_READ_FAILED;
+            break;
         }
+
+        sd_spi_read_buf(buffer + (i * SD_BLOCK_SIZE), SD_BLOCK_SIZE);
+
+        sd_spi_write_read(0xFF);
+        sd_spi_write_read(0xFF);
     }
-    return SD_OK;
+
+    // CMD12 ends the stream; the byte after the command is a stuff byte
+    uint8_t packet[6] = {0x40 | SD_CMD12, 0, 0, 0, 0, 0xFF};
+    sd_spi_write_buf(packet, 6);
+    sd_spi_write_read(0xFF);
+
+    uint8_t retry = 0;
+    do
+    {
+        response = sd_spi_write_read(0xFF);
+        retry++;
+    } while ((response & 0x80) && (retry < 64));
+
+    if (response != 0)
+    {
+        result = SD_ERROR_READ_FAILED;
+    }
+
+    sd_wait_ready();
+    sd_cs_deselect();
+    return result;
 }
 
 sd_error_t sd_write_blocks(uint32_t start_block, uint32_t num_blocks, const uint8_t *buffer)
 {
+    if (num_blocks == 0)
+    {
+        return SD_OK;
+    }
+    if (num_blocks == 1)
+    {
+        return sd_write_block(start_block, buffer);
+    }
+
+    // Pre-erase hint (ACMD23) lets the card prepare the whole run before
+    // CMD25 starts streaming data tokens
+    sd_send_command(SD_CMD55, 0);
+    sd_cs_deselect();
+    sd_send_command(SD_ACMD23, num_blocks);
+    sd_cs_deselect();
+
+    uint32_t addr = is_sdhc ? start_block : start_block * SD_BLOCK_SIZE;
+    uint8_t response = sd_send_command(SD_CMD25, addr);
+    if (response != 0)
+    {
+        sd_cs_deselect();
+        return SD_ERROR_WRITE_FAILED;
+    }
+
+    sd_error_t result = SD_OK;
     for (uint32_t i = 0; i < num_blocks; i++)
     {
-        sd_error_t result = sd_write_block(start_block + i, buffer + (i * SD_BLOCK_SIZE));
-        if (result != SD_OK)
+        sd_spi_write_read(SD_DATA_START_BLOCK_MULT);
+        sd_spi_write_buf(buffer + (i * SD_BLOCK_SIZE), SD_BLOCK_SIZE);
+
+        sd_spi_write_read(0xFF);
+        sd_spi_write_read(0xFF);
+
+        response = sd_spi_write_read(0xFF) & 0x1F;
+        if (response != 0x05 || !sd_wait_ready())
         {
-            return result;
+            result = SD_ERROR_WRITE_FAILED;
+            break;
         }
     }
-    return SD_OK;
+
+    // The stop token is sent even after a rejected block so the card
+    // leaves receive mode before the next command
+    sd_spi_write_read(SD_DATA_STOP_MULT);
+    sd_spi_write_read(0xFF);
+    if (!sd_wait_ready())
+    {
+        result = SD_ERROR_WRITE_FAILED;
+    }
+
+    sd_cs_deselect();
+    return result;
 }
 
 //